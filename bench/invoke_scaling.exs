@@ -0,0 +1,214 @@
+# Throughput and latency of concurrent invokes, from 1 to N processes
+#
+#   MIX_ENV=test mix compile
+#   MIX_ENV=test mix run bench/invoke_scaling.exs [--max 64] [--duration 2000] [--workloads scalar,struct,variadic]
+#
+# Every call goes through `dlopen`/`dlsym` (the `opened_handles` and `found_symbols` maps)
+# and the signature cache, struct calls also look up their resource type in the struct
+# registry. Each workload runs for `--duration` milliseconds at 1, 2, 4, ... and `--max`
+# concurrent processes, `--max` defaults to the number of online schedulers.
+#
+# Latencies are kept in a log-linear histogram (16 buckets per power of two), so
+# percentiles are accurate to about 6%. Scaling efficiency is the throughput at N
+# processes divided by N times the throughput of one process, N being capped at the
+# number of online schedulers.
+
+defmodule OtterBench.Functions do
+  import Otter, except: [{:&, 1}]
+
+  @default_from Path.expand("../test/test.so", __DIR__)
+  @default_mode :RTLD_NOW
+
+  extern add_two_32(:u32, a :: u32, b :: u32)
+
+  cstruct(s_u8_u16(u8 :: u8, u16 :: u16))
+  extern create_s_u8_u16(s_u8_u16())
+  extern receive_s_u8_u16(:u32, s_u8_u16)
+
+  extern variadic_func_pass_by_values(:u64, n :: u32, array :: va_args)
+
+  def library, do: @default_from
+end
+
+defmodule OtterBench.Histogram do
+  @moduledoc false
+  import Bitwise
+
+  @sub_buckets 16
+
+  def new, do: %{}
+
+  def add(histogram, ns) do
+    Map.update(histogram, bucket(max(ns, 1)), 1, &(&1 + 1))
+  end
+
+  def merge(histograms) do
+    Enum.reduce(histograms, %{}, fn h, acc -> Map.merge(acc, h, fn _, a, b -> a + b end) end)
+  end
+
+  # upper bound of the bucket that holds the `p`-th percentile, in nanoseconds
+  def percentile(histogram, p) do
+    total = histogram |> Map.values() |> Enum.sum()
+    rank = max(1, ceil(total * p / 100))
+
+    histogram
+    |> Enum.sort()
+    |> Enum.reduce_while(0, fn {bucket, count}, seen ->
+      if seen + count >= rank, do: {:halt, {:found, upper_bound(bucket)}}, else: {:cont, seen + count}
+    end)
+    |> case do
+      {:found, ns} -> ns
+      _ -> 0
+    end
+  end
+
+  defp bucket(ns) when ns < @sub_buckets, do: ns
+
+  defp bucket(ns) do
+    exponent = log2(ns)
+    shift = exponent - 4
+    exponent * @sub_buckets + ((ns >>> shift) - @sub_buckets)
+  end
+
+  defp upper_bound(bucket) when bucket < @sub_buckets, do: bucket
+
+  defp upper_bound(bucket) do
+    exponent = div(bucket, @sub_buckets)
+    sub = rem(bucket, @sub_buckets)
+    (@sub_buckets + sub + 1) <<< (exponent - 4)
+  end
+
+  defp log2(n, acc \\ 0)
+  defp log2(1, acc), do: acc
+  defp log2(n, acc), do: log2(n >>> 1, acc + 1)
+end
+
+defmodule OtterBench do
+  @moduledoc false
+  alias OtterBench.{Functions, Histogram}
+
+  def main(argv) do
+    {opts, _, _} =
+      OptionParser.parse(argv, strict: [max: :integer, duration: :integer, workloads: :string])
+
+    schedulers = System.schedulers_online()
+    max_procs = Keyword.get(opts, :max, schedulers)
+    duration = Keyword.get(opts, :duration, 2000)
+
+    workloads =
+      opts
+      |> Keyword.get(:workloads, "scalar,struct,variadic")
+      |> String.split(",", trim: true)
+      |> Enum.map(&String.to_existing_atom/1)
+
+    unless File.exists?(Functions.library()) do
+      IO.puts(:stderr, "#{Functions.library()} not found, build it with `MIX_ENV=test mix compile`")
+      System.halt(1)
+    end
+
+    IO.puts("schedulers online: #{schedulers}, duration: #{duration} ms per run\n")
+
+    for workload <- workloads do
+      run_workload(workload, levels(max_procs), duration, schedulers)
+    end
+  end
+
+  defp levels(max_procs) do
+    Stream.iterate(1, &(&1 * 2))
+    |> Enum.take_while(&(&1 < max_procs))
+    |> Kernel.++([max_procs])
+  end
+
+  defp run_workload(workload, levels, duration, schedulers) do
+    IO.puts("== #{workload}")
+
+    IO.puts(
+      String.pad_trailing("procs", 8) <>
+        String.pad_leading("calls/s", 14) <>
+        String.pad_leading("p50 (us)", 12) <>
+        String.pad_leading("p99 (us)", 12) <>
+        String.pad_leading("efficiency", 12)
+    )
+
+    # warm up the symbol and signature caches
+    call = setup(workload)
+    for _ <- 1..1000, do: call.()
+
+    Enum.reduce(levels, nil, fn procs, single ->
+      {calls, histogram} = run(workload, procs, duration)
+      throughput = calls * 1000 / duration
+      single = single || throughput
+      efficiency = throughput / (single * min(procs, schedulers))
+
+      IO.puts(
+        String.pad_trailing(Integer.to_string(procs), 8) <>
+          String.pad_leading(format(throughput, 0), 14) <>
+          String.pad_leading(format(Histogram.percentile(histogram, 50) / 1000, 2), 12) <>
+          String.pad_leading(format(Histogram.percentile(histogram, 99) / 1000, 2), 12) <>
+          String.pad_leading(format(efficiency * 100, 1) <> "%", 12)
+      )
+
+      single
+    end)
+
+    IO.puts("")
+  end
+
+  defp run(workload, procs, duration) do
+    parent = self()
+    ref = make_ref()
+
+    pids =
+      for _ <- 1..procs do
+        spawn_link(fn ->
+          call = setup(workload)
+          send(parent, {ref, :ready})
+
+          receive do
+            {^ref, :go, deadline} -> send(parent, {ref, loop(call, deadline, 0, Histogram.new())})
+          end
+        end)
+      end
+
+    for _ <- pids, do: receive(do: ({^ref, :ready} -> :ok))
+    deadline = System.monotonic_time(:nanosecond) + duration * 1_000_000
+    for pid <- pids, do: send(pid, {ref, :go, deadline})
+
+    results = for _ <- pids, do: receive(do: ({^ref, result} -> result))
+    {results |> Enum.map(&elem(&1, 0)) |> Enum.sum(), results |> Enum.map(&elem(&1, 1)) |> Histogram.merge()}
+  end
+
+  defp loop(call, deadline, calls, histogram) do
+    start = System.monotonic_time(:nanosecond)
+    call.()
+    stop = System.monotonic_time(:nanosecond)
+    histogram = Histogram.add(histogram, stop - start)
+
+    if stop < deadline do
+      loop(call, deadline, calls + 1, histogram)
+    else
+      {calls + 1, histogram}
+    end
+  end
+
+  # returns a function that makes one call, values are created once per process
+  defp setup(:scalar) do
+    fn -> 3 = Functions.add_two_32!(1, 2) end
+  end
+
+  defp setup(:struct) do
+    t = Functions.create_s_u8_u16!()
+    fn -> 1 = Functions.receive_s_u8_u16!(t) end
+  end
+
+  defp setup(:variadic) do
+    args = Enum.map([1, 2, 3], &Otter.as_type!(&1, :u32))
+    fn -> 6 = Functions.variadic_func_pass_by_values!(3, args) end
+  end
+
+  defp format(value, decimals) do
+    :erlang.float_to_binary(value / 1, decimals: decimals)
+  end
+end
+
+OtterBench.main(System.argv())
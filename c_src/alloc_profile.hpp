@@ -0,0 +1,235 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <mutex>
+#include <new>
+#include <vector>
+
+/*
+ * Opt-in counting of the NIF's own heap allocations, built with `OTTER_ALLOC_PROFILE=1`
+ *
+ * The Makefile then links the NIF with `--wrap` for malloc, calloc, realloc and free, so
+ * that calls from the NIF go through the wrappers below, and this header replaces the
+ * global operator new/delete. Allocations made by the called C libraries, and memory that
+ * comes from the VM (`enif_alloc`, binaries), are not counted.
+ *
+ * Counters are per thread and per phase of an invoke. When an invoke ends, its counters
+ * are appended to a fixed-size history that `last_calls` reads. Without
+ * `OTTER_ALLOC_PROFILE`, every function here is an empty inline function.
+ */
+
+namespace otter
+{
+namespace alloc_profile
+{
+    enum Phase {
+        // parsing the symbol, return type and arguments
+        DECODE = 0,
+        // ffi_prep_cif, argument values and return storage
+        PREPARE,
+        // the foreign function itself
+        CALL,
+        // out values and the return value
+        ENCODE,
+        // releasing what the call used
+        CLEANUP,
+        NUM_PHASES,
+    };
+
+    static const char * const phase_names[NUM_PHASES] = {"decode", "prepare", "call", "encode", "cleanup"};
+
+    struct Counters {
+        // malloc and calloc
+        uint64_t mallocs;
+        uint64_t reallocs;
+        uint64_t frees;
+        uint64_t news;
+        uint64_t deletes;
+        // requested by mallocs, reallocs and news
+        uint64_t bytes;
+    };
+
+    struct CallRecord {
+        void * symbol;
+        Counters phases[NUM_PHASES];
+    };
+
+#ifdef OTTER_ALLOC_PROFILE
+    static const bool enabled = true;
+
+    // calls that are kept for `last_calls`
+    static const size_t history_capacity = 1024;
+
+    struct ThreadState {
+        // NUM_PHASES when the thread is not in an invoke
+        int phase;
+        CallRecord current;
+    };
+
+    // initial-exec, so that accessing it never allocates, which would recurse into the wrappers
+    static thread_local ThreadState thread_state __attribute__((tls_model("initial-exec"))) = {NUM_PHASES, {}};
+
+    static std::mutex history_lock;
+    static CallRecord history[history_capacity];
+    static size_t history_next = 0;
+    static size_t history_size = 0;
+
+    static inline Counters *current_counters() {
+        if (thread_state.phase >= NUM_PHASES) {
+            return nullptr;
+        }
+        return &thread_state.current.phases[thread_state.phase];
+    }
+
+    static inline void begin_call() {
+        memset(&thread_state.current, 0, sizeof(thread_state.current));
+        thread_state.phase = DECODE;
+    }
+
+    static inline void set_phase(Phase phase) {
+        if (thread_state.phase < NUM_PHASES) {
+            thread_state.phase = phase;
+        }
+    }
+
+    static inline void end_call(void *symbol) {
+        if (thread_state.phase >= NUM_PHASES) {
+            return;
+        }
+        thread_state.phase = NUM_PHASES;
+        thread_state.current.symbol = symbol;
+
+        std::lock_guard<std::mutex> g(history_lock);
+        history[history_next] = thread_state.current;
+        history_next = (history_next + 1) % history_capacity;
+        if (history_size < history_capacity) {
+            history_size++;
+        }
+    }
+
+    /// Copy the records of the last `n` calls, oldest first
+    static inline void last_calls(size_t n, std::vector<CallRecord> &records) {
+        std::lock_guard<std::mutex> g(history_lock);
+        if (n > history_size) {
+            n = history_size;
+        }
+        records.reserve(n);
+        for (size_t i = 0; i < n; ++i) {
+            records.push_back(history[(history_next + history_capacity - n + i) % history_capacity]);
+        }
+    }
+#else
+    static const bool enabled = false;
+
+    static inline void begin_call() {}
+    static inline void set_phase(Phase) {}
+    static inline void end_call(void *) {}
+    static inline void last_calls(size_t, std::vector<CallRecord> &) {}
+#endif
+} // namespace alloc_profile
+} // namespace otter
+
+#ifdef OTTER_ALLOC_PROFILE
+extern "C" {
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t nmemb, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+void __real_free(void *ptr);
+
+void *__wrap_malloc(size_t size) {
+    if (auto c = otter::alloc_profile::current_counters()) {
+        c->mallocs++;
+        c->bytes += size;
+    }
+    return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t nmemb, size_t size) {
+    if (auto c = otter::alloc_profile::current_counters()) {
+        c->mallocs++;
+        c->bytes += nmemb * size;
+    }
+    return __real_calloc(nmemb, size);
+}
+
+void *__wrap_realloc(void *ptr, size_t size) {
+    if (auto c = otter::alloc_profile::current_counters()) {
+        c->reallocs++;
+        c->bytes += size;
+    }
+    return __real_realloc(ptr, size);
+}
+
+void __wrap_free(void *ptr) {
+    auto c = otter::alloc_profile::current_counters();
+    if (c && ptr) {
+        c->frees++;
+    }
+    __real_free(ptr);
+}
+}
+
+static void *otter_profiled_new(size_t size) {
+    if (auto c = otter::alloc_profile::current_counters()) {
+        c->news++;
+        c->bytes += size;
+    }
+    // operator new(0) must return a unique pointer
+    return __real_malloc(size ? size : 1);
+}
+
+static void otter_profiled_delete(void *ptr) {
+    auto c = otter::alloc_profile::current_counters();
+    if (c && ptr) {
+        c->deletes++;
+    }
+    __real_free(ptr);
+}
+
+void *operator new(size_t size) {
+    void *ptr = otter_profiled_new(size);
+    if (ptr == nullptr) throw std::bad_alloc();
+    return ptr;
+}
+
+void *operator new[](size_t size) {
+    void *ptr = otter_profiled_new(size);
+    if (ptr == nullptr) throw std::bad_alloc();
+    return ptr;
+}
+
+void *operator new(size_t size, const std::nothrow_t &) noexcept {
+    return otter_profiled_new(size);
+}
+
+void *operator new[](size_t size, const std::nothrow_t &) noexcept {
+    return otter_profiled_new(size);
+}
+
+void operator delete(void *ptr) noexcept {
+    otter_profiled_delete(ptr);
+}
+
+void operator delete[](void *ptr) noexcept {
+    otter_profiled_delete(ptr);
+}
+
+void operator delete(void *ptr, size_t) noexcept {
+    otter_profiled_delete(ptr);
+}
+
+void operator delete[](void *ptr, size_t) noexcept {
+    otter_profiled_delete(ptr);
+}
+
+void operator delete(void *ptr, const std::nothrow_t &) noexcept {
+    otter_profiled_delete(ptr);
+}
+
+void operator delete[](void *ptr, const std::nothrow_t &) noexcept {
+    otter_profiled_delete(ptr);
+}
+#endif
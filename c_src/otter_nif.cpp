@@ -1,17 +1,39 @@
 #include <dlfcn.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
 #include <setjmp.h>
 #include <signal.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#if defined(__linux__)
+#include <sys/eventfd.h>
+#endif
 
 #include <erl_nif.h>
 #include <ffi.h>
 
+#include <atomic>
+#include <cmath>
+#include <deque>
 #include <iostream>
+#include <limits>
+#include <list>
 #include <mutex>
 #include <memory>
+#include <type_traits>
+#include <unordered_map>
 
+#include "alloc_profile.hpp"
 #include "nif_utils.hpp"
+#include "otter_ring.h"
+#include "spsc_ring.hpp"
+#include "thread_pool.hpp"
 
 #ifdef __GNUC__
 #pragma GCC diagnostic ignored "-Wunused-parameter"
@@ -34,6 +56,94 @@ template <typename R> int alloc_resource(erlang_nif_res<R> **res) {
 using OtterHandle = erlang_nif_res<void *>;
 using OtterSymbol = erlang_nif_res<void *>;
 
+struct MmapRegion {
+    // address and length returned by/passed to mmap
+    // `base` is aligned to the page size
+    void * base;
+    size_t map_length;
+    // address and length requested by the user
+    void * addr;
+    size_t length;
+    bool writable;
+    bool unmapped;
+};
+using OtterMmap = erlang_nif_res<MmapRegion>;
+
+struct PointerView {
+    uint8_t * addr;
+    ffi_type * element_type;
+    // number of elements of `element_type` that can be accessed
+    size_t count;
+    // if the view was created from a memory-mapped region,
+    // it keeps a reference to the region so that the memory stays mapped
+    OtterMmap * region;
+};
+using OtterPointer = erlang_nif_res<PointerView>;
+
+/// A call interface prepared once for a function that takes and returns basic types
+struct PreparedCall {
+    void * func;
+    ffi_cif cif;
+    ffi_type * return_type;
+    // `cif.arg_types` points to the data of this vector
+    std::vector<ffi_type *> arg_types;
+    // arguments are packed like the fields of a C struct in an input record
+    std::vector<size_t> arg_offsets;
+    size_t record_size;
+};
+using OtterPrepared = erlang_nif_res<PreparedCall *>;
+
+/// A pointer owned by C code that is released by calling `destructor` on it
+struct OwnedPointer {
+    // set to nullptr once the destructor has been called (or queued)
+    std::atomic<void *> ptr;
+    void (*destructor)(void *);
+    // call the destructor on the background finalizer thread
+    bool background;
+};
+using OtterOwnedPointer = erlang_nif_res<OwnedPointer>;
+
+/// A struct instance whose memory comes from `StructPool`
+struct PooledStruct {
+    void * data;
+    size_t size;
+    // interned by `StructPool`, never freed
+    const std::string * struct_id;
+    // accounting of `struct_id`, see `MemoryAccounting`
+    void * counters;
+};
+using OtterPooledStruct = erlang_nif_res<PooledStruct>;
+
+/// A ring buffer shared with producer threads in C code, see otter_ring.h
+struct SharedRing {
+    struct otter_ring * ring;
+    // size of the allocation at `ring`
+    size_t bytes;
+    // serialises consumers
+    std::mutex drain_lock;
+    // once the doorbell has been passed to enif_select, it is closed by the stop callback
+    bool selected;
+    bool closed;
+};
+using OtterRing = erlang_nif_res<SharedRing *>;
+
+/// A file descriptor watched with enif_select
+struct SelectedFd {
+    int fd;
+    // the fd belongs to Otter and is closed once it is no longer watched
+    bool close_on_stop;
+    // enif_select has been called at least once
+    bool selected;
+    std::atomic<bool> stopped;
+};
+using OtterSelectedFd = erlang_nif_res<SelectedFd>;
+
+// the pool is created on first use
+// 0 means one thread per online CPU
+static size_t thread_pool_size = 0;
+static std::shared_ptr<otter::WorkStealingPool> thread_pool;
+static std::mutex thread_pool_lock;
+
 // key: shared library name/path
 // value: handle returned by dlopen
 static std::map<std::string, OtterHandle *> opened_handles;
@@ -42,6 +152,8 @@ static std::map<std::string, OtterHandle *> opened_handles;
 //   key: function name
 //   value: function address
 static std::map<OtterHandle *, std::map<std::string, OtterSymbol *>> found_symbols;
+// guards `opened_handles` and `found_symbols`, `dlopen_binary` runs on a dirty scheduler
+static std::mutex opened_handles_lock;
 // key: basic type
 // value: ffi_type
 static std::map<std::string, ffi_type *> str2ffi_type = {
@@ -57,7 +169,377 @@ static std::map<std::string, ffi_type *> str2ffi_type = {
 static const void * null_ptr_g = nullptr;
 static thread_local jmp_buf jmp_buf_g;
 
-static void resource_dtor(ErlNifEnv *env, void *) {}
+/// Native memory held by Otter, by kind of allocation and by struct id
+///
+/// Every kind has a soft and a hard budget in bytes, 0 means unlimited. Allocations that
+/// would go past the hard budget are refused, while the soft budget is only reported.
+///
+/// After an upgrade, the old instance forwards every call to the instance that adopted it
+/// (see `adopt`), so that code of the old module that is still running charges, releases and
+/// creates struct counters in the same place as the destructors of the new module.
+class MemoryAccounting {
+public:
+    enum Kind {
+        // struct instances returned by C functions
+        STRUCT,
+        // struct instances backed by `StructPool`
+        POOLED_STRUCT,
+        // ffi_type element arrays of `FFIStructTypeWrapper`
+        STRUCT_TYPE,
+        // handles returned by dlopen and symbols
+        SYMBOL,
+        // memory-mapped regions
+        MMAP,
+        // out buffers until they are handed over to erlang
+        OUT_BUFFER,
+        PREPARED,
+        WORKER,
+        // shared ring buffers
+        RING,
+        NUM_KINDS,
+    };
+
+    struct Counters {
+        Counters() : bytes(0), objects(0) {}
+        std::atomic<int64_t> bytes;
+        std::atomic<int64_t> objects;
+    };
+
+    MemoryAccounting() : successor(nullptr) {
+        for (size_t i = 0; i < NUM_KINDS; ++i) {
+            soft_budget[i] = 0;
+            hard_budget[i] = 0;
+            rejected[i] = 0;
+        }
+    }
+
+    /// Account for an allocation
+    /// @param sub optional counters of a struct id
+    /// @param force account even if the hard budget is exceeded, for allocations that cannot fail
+    /// @return false if the allocation would exceed the hard budget, nothing is accounted then
+    bool charge(Kind kind, size_t bytes, Counters *sub=nullptr, bool force=false) {
+        if (auto next = successor.load(std::memory_order_acquire)) {
+            return next->charge(kind, bytes, sub, force);
+        }
+        int64_t prev = kinds[kind].bytes.fetch_add((int64_t)bytes);
+        uint64_t hard = hard_budget[kind].load(std::memory_order_relaxed);
+        if (!force && hard > 0 && clamped(prev) + bytes > hard) {
+            kinds[kind].bytes.fetch_sub((int64_t)bytes);
+            rejected[kind]++;
+            return false;
+        }
+        kinds[kind].objects++;
+        if (sub) {
+            sub->bytes += (int64_t)bytes;
+            sub->objects++;
+        }
+        return true;
+    }
+
+    /// @return true if `bytes` more would stay within the hard budget of `kind`
+    bool allows(Kind kind, size_t bytes) const {
+        if (auto next = successor.load(std::memory_order_acquire)) {
+            return next->allows(kind, bytes);
+        }
+        uint64_t hard = hard_budget[kind].load(std::memory_order_relaxed);
+        return hard == 0 || clamped(kinds[kind].bytes.load(std::memory_order_relaxed)) + bytes <= hard;
+    }
+
+    void release(Kind kind, size_t bytes, Counters *sub=nullptr) {
+        if (auto next = successor.load(std::memory_order_acquire)) {
+            return next->release(kind, bytes, sub);
+        }
+        kinds[kind].bytes -= (int64_t)bytes;
+        kinds[kind].objects--;
+        if (sub) {
+            sub->bytes -= (int64_t)bytes;
+            sub->objects--;
+        }
+    }
+
+    /// Counters of a struct id, the returned pointer stays valid forever
+    Counters * struct_counters(const std::string &struct_id) {
+        // checked under the lock, `adopt` sets `successor` while holding it
+        std::unique_lock<std::mutex> g(lock);
+        if (auto next = successor.load(std::memory_order_acquire)) {
+            g.unlock();
+            return next->struct_counters(struct_id);
+        }
+        return &structs[struct_id];
+    }
+
+    static bool kind_from_name(const std::string &name, Kind &kind) {
+        for (size_t i = 0; i < NUM_KINDS; ++i) {
+            if (name == kind_names[i]) {
+                kind = (Kind)i;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void set_budget(Kind kind, uint64_t soft, uint64_t hard) {
+        if (auto next = successor.load(std::memory_order_acquire)) {
+            return next->set_budget(kind, soft, hard);
+        }
+        soft_budget[kind] = soft;
+        hard_budget[kind] = hard;
+    }
+
+    /// Take over the totals, budgets and struct counters of an older instance
+    ///
+    /// Live resources keep pointers to their struct counters, the map nodes are moved
+    /// as they are so that those pointers stay valid. From then on, `old` forwards to this
+    /// instance, so struct counters created by old code live in this instance's map too.
+    /// A charge that old code was making while `successor` was set may be missed, the
+    /// totals can then be slightly off, and may even go negative (see `clamped`).
+    void adopt(MemoryAccounting &old) {
+        {
+            std::lock_guard<std::mutex> old_g(old.lock);
+            std::lock_guard<std::mutex> g(lock);
+            structs.swap(old.structs);
+            old.successor.store(this, std::memory_order_release);
+        }
+        for (size_t i = 0; i < NUM_KINDS; ++i) {
+            kinds[i].bytes += old.kinds[i].bytes.load();
+            kinds[i].objects += old.kinds[i].objects.load();
+            soft_budget[i] = old.soft_budget[i].load();
+            hard_budget[i] = old.hard_budget[i].load();
+            rejected[i] = old.rejected[i].load();
+        }
+    }
+
+    ERL_NIF_TERM info(ErlNifEnv *env) {
+        if (auto next = successor.load(std::memory_order_acquire)) {
+            return next->info(env);
+        }
+        ERL_NIF_TERM kind_keys[NUM_KINDS], kind_values[NUM_KINDS];
+        for (size_t i = 0; i < NUM_KINDS; ++i) {
+            int64_t bytes = kinds[i].bytes.load();
+            uint64_t soft = soft_budget[i].load();
+            ERL_NIF_TERM keys[] = {
+                enif_make_atom(env, "bytes"),
+                enif_make_atom(env, "objects"),
+                enif_make_atom(env, "soft_budget"),
+                enif_make_atom(env, "hard_budget"),
+                enif_make_atom(env, "over_soft_budget"),
+                enif_make_atom(env, "rejected"),
+            };
+            ERL_NIF_TERM values[] = {
+                enif_make_int64(env, bytes),
+                enif_make_int64(env, kinds[i].objects.load()),
+                enif_make_uint64(env, soft),
+                enif_make_uint64(env, hard_budget[i].load()),
+                enif_make_atom(env, (soft > 0 && bytes > (int64_t)soft) ? "true" : "false"),
+                enif_make_uint64(env, rejected[i].load()),
+            };
+            kind_keys[i] = enif_make_atom(env, kind_names[i]);
+            enif_make_map_from_arrays(env, keys, values, sizeof(keys) / sizeof(keys[0]), &kind_values[i]);
+        }
+
+        std::vector<ERL_NIF_TERM> struct_keys, struct_values;
+        {
+            std::lock_guard<std::mutex> g(lock);
+            for (auto &iter : structs) {
+                ERL_NIF_TERM keys[] = {enif_make_atom(env, "bytes"), enif_make_atom(env, "objects")};
+                ERL_NIF_TERM values[] = {
+                    enif_make_int64(env, iter.second.bytes.load()),
+                    enif_make_int64(env, iter.second.objects.load()),
+                };
+                ERL_NIF_TERM map;
+                enif_make_map_from_arrays(env, keys, values, 2, &map);
+                struct_keys.push_back(enif_make_atom(env, iter.first.c_str()));
+                struct_values.push_back(map);
+            }
+        }
+
+        ERL_NIF_TERM kinds_map, structs_map, map;
+        enif_make_map_from_arrays(env, kind_keys, kind_values, NUM_KINDS, &kinds_map);
+        enif_make_map_from_arrays(env, struct_keys.data(), struct_values.data(), struct_keys.size(), &structs_map);
+        ERL_NIF_TERM keys[] = {enif_make_atom(env, "kinds"), enif_make_atom(env, "structs")};
+        ERL_NIF_TERM values[] = {kinds_map, structs_map};
+        enif_make_map_from_arrays(env, keys, values, 2, &map);
+        return map;
+    }
+
+private:
+    // totals below zero count as zero against the budgets
+    static uint64_t clamped(int64_t bytes) {
+        return bytes < 0 ? 0 : (uint64_t)bytes;
+    }
+
+    static constexpr const char *kind_names[NUM_KINDS] = {
+        "struct", "pooled_struct", "struct_type", "symbol", "mmap", "out_buffer", "prepared", "worker", "ring",
+    };
+
+    Counters kinds[NUM_KINDS];
+    std::atomic<uint64_t> soft_budget[NUM_KINDS];
+    std::atomic<uint64_t> hard_budget[NUM_KINDS];
+    std::atomic<uint64_t> rejected[NUM_KINDS];
+
+    std::mutex lock;
+    // std::map nodes are stable, so pointers to the counters stay valid
+    std::map<std::string, Counters> structs;
+    // set when a newer instance adopts this one
+    std::atomic<MemoryAccounting *> successor;
+};
+
+constexpr const char *MemoryAccounting::kind_names[MemoryAccounting::NUM_KINDS];
+
+static MemoryAccounting memory_accounting;
+
+// struct resources have the counters of their struct id stored after the struct data,
+// so that the destructor knows what to release
+static size_t struct_resource_footer_offset(size_t struct_size) {
+    return (struct_size + alignof(void *) - 1) & ~(alignof(void *) - 1);
+}
+
+/// Allocate a struct resource, nullptr if it is over the hard budget or out of memory
+static void * alloc_struct_resource(ErlNifResourceType *resource_type, size_t struct_size, const std::string &struct_id) {
+    auto counters = memory_accounting.struct_counters(struct_id);
+    size_t offset = struct_resource_footer_offset(struct_size);
+    size_t total = offset + sizeof(MemoryAccounting::Counters *);
+    if (!memory_accounting.charge(MemoryAccounting::STRUCT, total, counters)) {
+        return nullptr;
+    }
+    void *obj = enif_alloc_resource(resource_type, total);
+    if (obj == nullptr) {
+        memory_accounting.release(MemoryAccounting::STRUCT, total, counters);
+        return nullptr;
+    }
+    memcpy((uint8_t *)obj + offset, &counters, sizeof(counters));
+    return obj;
+}
+
+// size of the struct data in a struct resource
+static size_t struct_resource_size(void *obj) {
+    return enif_sizeof_resource(obj) - sizeof(MemoryAccounting::Counters *);
+}
+
+static void struct_resource_dtor(ErlNifEnv *env, void *obj) {
+    size_t total = enif_sizeof_resource(obj);
+    MemoryAccounting::Counters *counters = nullptr;
+    memcpy(&counters, (uint8_t *)obj + total - sizeof(counters), sizeof(counters));
+    memory_accounting.release(MemoryAccounting::STRUCT, total, counters);
+}
+
+static void symbol_resource_dtor(ErlNifEnv *env, void *) {
+    memory_accounting.release(MemoryAccounting::SYMBOL, sizeof(OtterHandle));
+}
+
+/// Allocate a handle or symbol resource, the charge is released by `symbol_resource_dtor`
+/// @param over_budget out. true if the allocation was refused by the hard budget
+static int alloc_symbol_resource(OtterHandle **res, bool &over_budget) {
+    over_budget = !memory_accounting.charge(MemoryAccounting::SYMBOL, sizeof(OtterHandle));
+    if (over_budget) {
+        return 0;
+    }
+    if (alloc_resource(res)) {
+        return 1;
+    }
+    memory_accounting.release(MemoryAccounting::SYMBOL, sizeof(OtterHandle));
+    return 0;
+}
+
+static ERL_NIF_TERM native_memory_budget_error(ErlNifEnv *env) {
+    return enif_make_tuple2(env, enif_make_atom(env, "error"), enif_make_atom(env, "native_memory_budget"));
+}
+
+static void pointer_resource_dtor(ErlNifEnv *env, void *obj) {
+    auto res = (OtterPointer *)obj;
+    if (res && res->val.region) {
+        enif_release_resource(res->val.region);
+        res->val.region = nullptr;
+    }
+}
+
+static void prepared_resource_dtor(ErlNifEnv *env, void *obj) {
+    auto res = (OtterPrepared *)obj;
+    if (res && res->val) {
+        delete res->val;
+        res->val = nullptr;
+        memory_accounting.release(MemoryAccounting::PREPARED, sizeof(PreparedCall));
+    }
+}
+
+static void mmap_resource_dtor(ErlNifEnv *env, void *obj) {
+    auto res = (OtterMmap *)obj;
+    if (res && !res->val.unmapped && res->val.base) {
+        munmap(res->val.base, res->val.map_length);
+        res->val.unmapped = true;
+        memory_accounting.release(MemoryAccounting::MMAP, res->val.map_length);
+    }
+}
+
+/// A lazily started thread that runs slow destructors of owned pointers,
+/// so that they do not block the scheduler doing garbage collection
+class BackgroundFinalizer {
+public:
+    BackgroundFinalizer() : stopping(false) {}
+
+    ~BackgroundFinalizer() {
+        {
+            std::lock_guard<std::mutex> g(lock);
+            stopping = true;
+        }
+        wake.notify_one();
+        if (thread.joinable()) thread.join();
+    }
+
+    void submit(void (*destructor)(void *), void *ptr) {
+        std::lock_guard<std::mutex> g(lock);
+        if (!thread.joinable()) {
+            thread = std::thread([this] { this->loop(); });
+        }
+        pending.emplace_back(destructor, ptr);
+        wake.notify_one();
+    }
+
+private:
+    void loop() {
+        std::unique_lock<std::mutex> g(lock);
+        while (true) {
+            wake.wait(g, [this] { return stopping || !pending.empty(); });
+            // run everything queued before stopping
+            if (pending.empty()) {
+                return;
+            }
+            auto job = pending.front();
+            pending.pop_front();
+            g.unlock();
+            job.first(job.second);
+            g.lock();
+        }
+    }
+
+    std::mutex lock;
+    std::condition_variable wake;
+    std::deque<std::pair<void (*)(void *), void *>> pending;
+    bool stopping;
+    std::thread thread;
+};
+
+static BackgroundFinalizer background_finalizer;
+
+// call the destructor at most once
+static void release_owned_pointer(OwnedPointer &owned) {
+    void *ptr = owned.ptr.exchange(nullptr);
+    if (ptr == nullptr || owned.destructor == nullptr) {
+        return;
+    }
+    if (owned.background) {
+        background_finalizer.submit(owned.destructor, ptr);
+    } else {
+        owned.destructor(ptr);
+    }
+}
+
+static void owned_pointer_resource_dtor(ErlNifEnv *env, void *obj) {
+    auto res = (OtterOwnedPointer *)obj;
+    if (res) {
+        release_owned_pointer(res->val);
+    }
+}
 
 // Helper function for FFIResource
 template <typename T>
@@ -131,20 +613,25 @@ public:
         ffi_struct_type.alignment = 0;
         ffi_struct_type.type = FFI_TYPE_STRUCT;
         // field_size + 1: elements has to be a null-terminated array
-        ffi_struct_type.elements = (decltype(ffi_struct_type.elements))malloc(sizeof(void *) * (field_size + 1));
-        memset(ffi_struct_type.elements, 0, sizeof(void *) * (field_size + 1));
+        elements_bytes = sizeof(void *) * (field_size + 1);
+        ffi_struct_type.elements = (decltype(ffi_struct_type.elements))malloc(elements_bytes);
+        memset(ffi_struct_type.elements, 0, elements_bytes);
+        // type descriptions are needed to make any call, so they are accounted but never refused
+        memory_accounting.charge(MemoryAccounting::STRUCT_TYPE, elements_bytes, nullptr, true);
     }
 
     ~FFIStructTypeWrapper() {
         if (ffi_struct_type.elements) {
             free((void *)ffi_struct_type.elements);
             ffi_struct_type.elements = nullptr;
+            memory_accounting.release(MemoryAccounting::STRUCT_TYPE, elements_bytes);
         }
     }
 
     FFIStructTypeWrapper(FFIStructTypeWrapper &&other) {
         // take over elements from `other`
         this->ffi_struct_type = other.ffi_struct_type;
+        this->elements_bytes = other.elements_bytes;
         other.ffi_struct_type.elements = nullptr;
 
         this->resource_type = other.resource_type;
@@ -161,22 +648,41 @@ public:
 
     // NOTE: the basic idea here we register a resource type for each struct type,
     // identified by struct_id.
-    static ErlNifResourceType * register_ffi_struct_resource_type(ErlNifEnv *env, std::string &struct_id) {
+    static ErlNifResourceType * register_ffi_struct_resource_type(ErlNifEnv *env, const std::string &struct_id,
+                                                                  ErlNifResourceFlags flags=ERL_NIF_RT_CREATE) {
         auto resource_type = enif_open_resource_type(
-          env, "Elixir.Otter.Nif", ("OTTER_STRUCT_" + struct_id).data(), resource_dtor,
-          ERL_NIF_RT_CREATE, nullptr);
+          env, "Elixir.Otter.Nif", ("OTTER_STRUCT_" + struct_id).data(), struct_resource_dtor,
+          flags, nullptr);
         return resource_type;
     }
 
+    /// Take over the struct resource types registered by an older instance,
+    /// so that existing struct instances are released by this instance
+    /// @return false if a resource type cannot be taken over
+    static bool adopt_ffi_struct_resource_types(ErlNifEnv *env, std::map<std::string, ErlNifResourceType *> &old_registry,
+                                                std::mutex &old_lock) {
+        std::lock_guard<std::mutex> old_g(old_lock);
+        std::lock_guard<std::mutex> g(struct_resource_type_registry_lock);
+        for (auto &iter : old_registry) {
+            auto t = register_ffi_struct_resource_type(env, iter.first, (ErlNifResourceFlags)(ERL_NIF_RT_CREATE | ERL_NIF_RT_TAKEOVER));
+            if (!t) {
+                return false;
+            }
+            struct_resource_type_registry[iter.first] = t;
+        }
+        return true;
+    }
+
     static ERL_NIF_TERM make_ffi_struct_resource(
         ErlNifEnv *env,
         size_t return_object_size,
         ErlNifResourceType *resource_type,
+        const std::string &struct_id,
         void *result,
         ERL_NIF_TERM &ret)
     {
         if (resource_type && return_object_size && result) {
-            auto resource = enif_alloc_resource(resource_type, return_object_size);
+            auto resource = alloc_struct_resource(resource_type, return_object_size, struct_id);
             if (resource) {
                 memcpy(resource, (void *)result, return_object_size);
                 ret = enif_make_resource(env, resource);
@@ -206,1307 +712,5564 @@ public:
     ErlNifResourceType *resource_type;
     std::string struct_id;
     std::vector<std::shared_ptr<ffi_type>> field_types;
+
+private:
+    // size of `ffi_struct_type.elements`
+    size_t elements_bytes = 0;
 };
 
 std::mutex FFIStructTypeWrapper::struct_resource_type_registry_lock;
 std::map<std::string, ErlNifResourceType *> FFIStructTypeWrapper::struct_resource_type_registry;
 
-class FFIArgType {
+/// Free lists of struct memory, for struct types that have pooling enabled
+///
+/// Each thread (i.e., each scheduler) keeps its own free lists keyed by size,
+/// so acquiring and releasing memory does not take any lock.
+class StructPool {
 public:
-    enum FFIArgPassingType {
-        VALUE,
-        ADDR,
-        REF,
-    };
+    /// @return the interned struct id if pooling is enabled for `struct_id`, otherwise nullptr
+    static const std::string * pooled_id(const std::string &struct_id) {
+        std::lock_guard<std::mutex> g(lock);
+        auto it = enabled.find(struct_id);
+        if (it != enabled.end() && it->second) {
+            return &it->first;
+        }
+        return nullptr;
+    }
 
-    FFIArgType(ERL_NIF_TERM term_, ERL_NIF_TERM type_term_, const std::string type_, uint64_t size_, ERL_NIF_TERM info) :
-        term(term_), type_term(type_term_), type(type_), size(size_), extra_info(info) {
-        pass_by = VALUE;
-        is_out = false;
-        value_slot = 0;
-        value_slot_original = 0;
-        is_va_args = false;
-        is_struct_instance = false;
-        struct_data = nullptr;
+    static void set_enabled(const std::string &struct_id, bool enable) {
+        std::lock_guard<std::mutex> g(lock);
+        // entries are never erased, so that interned ids stay valid
+        enabled[struct_id] = enable;
     }
 
-    ERL_NIF_TERM term;
-    ERL_NIF_TERM type_term;
-    std::string type;
+    static void * acquire(size_t size) {
+        auto &blocks = local().free_lists[size];
+        if (!blocks.empty()) {
+            void *data = blocks.back();
+            blocks.pop_back();
+            hits++;
+            return data;
+        }
+        misses++;
+        return malloc(size);
+    }
 
-    // if size > 0,
-    // then the value is a nd-array
-    uint64_t size;
-    // erlang map
-    ERL_NIF_TERM extra_info;
+    static void release(void *data, size_t size) {
+        auto &blocks = local().free_lists[size];
+        if (blocks.size() < capacity.load(std::memory_order_relaxed)) {
+            blocks.push_back(data);
+        } else {
+            free(data);
+        }
+    }
 
-    // ffi type
-    std::shared_ptr<ffi_type> ffi_arg_type;
-    std::shared_ptr<ffi_type> ffi_arg_type_original;
+    static void set_capacity(size_t new_capacity) {
+        capacity = new_capacity;
+    }
 
-    size_t value_slot;
-    size_t value_slot_original;
+    /// Settings and counters of the pool of one instance of this library
+    struct Shared {
+        std::mutex *lock;
+        std::map<std::string, bool> *enabled;
+        std::atomic<size_t> *capacity;
+        std::atomic<uint64_t> *hits;
+        std::atomic<uint64_t> *misses;
+    };
 
-    // if pass_by == VALUE or pass_by == REF
-    //  then we have ffi_arg_type == ffi_arg_type_original
-    // if pass_by == ADDR
-    //  then ffi_arg_type_original will record the original type
-    //       and ffi_arg_type will be the corresponding pointer type
-    FFIArgPassingType pass_by;
-    bool is_out;
-    bool is_va_args;
+    static Shared shared() {
+        return Shared{&lock, &enabled, &capacity, &hits, &misses};
+    }
 
-    bool is_struct_instance;
-    // borrowed data from erlang vm
-    // do not free struct_data
-    void * struct_data;
-};
+    /// Take over the settings of an older instance
+    ///
+    /// Pooled struct instances keep pointers to the interned ids,
+    /// the map nodes are moved as they are so that those pointers stay valid.
+    /// Free blocks stay in the thread caches of the older instance.
+    static void adopt(const Shared &old) {
+        std::lock_guard<std::mutex> old_g(*old.lock);
+        std::lock_guard<std::mutex> g(lock);
+        enabled.swap(*old.enabled);
+        capacity = old.capacity->load();
+        hits = old.hits->load();
+        misses = old.misses->load();
+    }
 
-template<typename T>
-class FFIResource {
-public:
-    FFIResource(size_t default_cap=32) : invalid(false), increase_by(default_cap), cap(0), next(0) {
+    static ERL_NIF_TERM info(ErlNifEnv *env) {
+        ERL_NIF_TERM keys[] = {
+            enif_make_atom(env, "capacity"),
+            enif_make_atom(env, "hits"),
+            enif_make_atom(env, "misses"),
+        };
+        ERL_NIF_TERM values[] = {
+            enif_make_uint64(env, capacity.load()),
+            enif_make_uint64(env, hits.load()),
+            enif_make_uint64(env, misses.load()),
+        };
+        ERL_NIF_TERM map;
+        enif_make_map_from_arrays(env, keys, values, sizeof(keys) / sizeof(keys[0]), &map);
+        return map;
     }
 
-    ~FFIResource() {
-        if (resources) {
-            free((void *)resources);
-            resources = nullptr;
+private:
+    struct ThreadCache {
+        ~ThreadCache() {
+            for (auto &iter : free_lists) {
+                for (auto data : iter.second) free(data);
+            }
         }
-        invalid = true;
+
+        std::unordered_map<size_t, std::vector<void *>> free_lists;
+    };
+
+    static ThreadCache &local() {
+        static thread_local ThreadCache cache;
+        return cache;
     }
 
-    bool get(size_t slot, void *&addr) {
-        if (invalid || slot >= next) return false;
-        addr = &resources[slot];
-        return true;
+    static std::mutex lock;
+    static std::map<std::string, bool> enabled;
+    // maximum number of free blocks of each size kept by each thread
+    static std::atomic<size_t> capacity;
+    static std::atomic<uint64_t> hits;
+    static std::atomic<uint64_t> misses;
+};
+
+std::mutex StructPool::lock;
+std::map<std::string, bool> StructPool::enabled;
+std::atomic<size_t> StructPool::capacity(64);
+std::atomic<uint64_t> StructPool::hits(0);
+std::atomic<uint64_t> StructPool::misses(0);
+
+static void pooled_struct_resource_dtor(ErlNifEnv *env, void *obj) {
+    auto res = (OtterPooledStruct *)obj;
+    if (res && res->val.data) {
+        StructPool::release(res->val.data, res->val.size);
+        res->val.data = nullptr;
+        memory_accounting.release(MemoryAccounting::POOLED_STRUCT, res->val.size,
+                                  (MemoryAccounting::Counters *)res->val.counters);
     }
+}
 
-    bool get_value(size_t slot, T& value) {
-        if (invalid || slot >= next) return false;
-        value = resources[slot];
+/// Get the memory of a struct instance, either a plain struct resource or a pooled one
+/// @param resource_type resource type of plain instances of the struct
+/// @param data out. Address of the struct instance.
+/// @param size out. Size of the struct instance in bytes.
+static bool get_struct_data(ErlNifEnv *env, ERL_NIF_TERM term, ErlNifResourceType *resource_type,
+                            const std::string &struct_id, void *&data, size_t &size) {
+    if (resource_type && enif_get_resource(env, term, resource_type, &data) && data) {
+        size = struct_resource_size(data);
         return true;
     }
 
-    bool set(T val, size_t &occupy) {
-        if (invalid) return false;
-        if (next == cap) {
-            size_t new_cap = cap + increase_by;
-            T * new_res = (T *)realloc(this->resources, sizeof(T) * new_cap);
-            if (new_res != nullptr) {
-                cap = new_cap;
-                this->resources = new_res;
-            } else {
-                free((void *)resources);
-                resources = nullptr;
-                invalid = true;
-                return false;
-            }
-        }
-        this->resources[next] = val;
-        occupy = next;
-        next++;
+    OtterPooledStruct *res = nullptr;
+    if (enif_get_resource(env, term, OtterPooledStruct::type, (void **)&res) && res && res->val.data &&
+        *res->val.struct_id == struct_id) {
+        data = res->val.data;
+        size = res->val.size;
         return true;
     }
+    return false;
+}
 
-    bool invalid;
-    T * resources = nullptr;
-    size_t increase_by;
-    size_t cap;
-    size_t next;
-};
+// ffi type of a basic type name, nullptr if `type` is not a basic type
+static ffi_type * get_basic_ffi_type(const std::string &type) {
+    if (type == "c_ptr" || type == "cstring") {
+        return &ffi_type_pointer;
+    } else if (type == "void") {
+        return nullptr;
+    }
+    auto it = str2ffi_type.find(type);
+    if (it != str2ffi_type.end()) {
+        return it->second;
+    }
+    return nullptr;
+}
 
-/// Wrap everything we need to make an FFI call
-class FFICall {
-public:
-    /// Constructor
-    /// @param env Erlang Nif environment
-    /// @param symbol_term Contains the address of the symbol (function)
-    /// @param return_type_term Function return type
-    /// @param arg_types_term A list of 2-tuple {arg_value, arg_type_info}
-    ///        `arg_value` should be basic types
-    FFICall(ErlNifEnv *env, ERL_NIF_TERM symbol, ERL_NIF_TERM return_type, ERL_NIF_TERM arg_types_term) noexcept {
-        this->env_ = env;
-        this->symbol_ = symbol;
-        this->return_type_ = return_type;
-        this->arg_types_term_ = arg_types_term;
+// the basic ffi type of this instance that is of the same kind as `type`,
+// `type` may belong to libffi linked into an older instance of this library
+static ffi_type * same_basic_ffi_type(ffi_type *type) {
+    switch (type->type) {
+        case FFI_TYPE_UINT8: return &ffi_type_uint8;
+        case FFI_TYPE_SINT8: return &ffi_type_sint8;
+        case FFI_TYPE_UINT16: return &ffi_type_uint16;
+        case FFI_TYPE_SINT16: return &ffi_type_sint16;
+        case FFI_TYPE_UINT32: return &ffi_type_uint32;
+        case FFI_TYPE_SINT32: return &ffi_type_sint32;
+        case FFI_TYPE_UINT64: return &ffi_type_uint64;
+        case FFI_TYPE_SINT64: return &ffi_type_sint64;
+        case FFI_TYPE_FLOAT: return &ffi_type_float;
+        case FFI_TYPE_DOUBLE: return &ffi_type_double;
+        case FFI_TYPE_POINTER: return &ffi_type_pointer;
+        case FFI_TYPE_VOID: return &ffi_type_void;
+        default: return type;
     }
+}
 
-    ~FFICall() {
-        // clean up everything used as input arguments for ffi_call
-        for (auto &iter : ffi_res) {
-            auto p = (FFIResource<void *> *)iter.second;
-            if (p) delete p;
-        }
-        struct_wrapper.clear();
+template <typename T>
+static T read_unaligned(const uint8_t *data) {
+    T value;
+    memcpy(&value, data, sizeof(T));
+    return value;
+}
 
-        if (args) {
-            free((void *)args);
-            args = nullptr;
-        }
-        if (values) {
-            free((void *)values);
-            values = nullptr;
-        }
-        if (rc) {
-            free(rc);
-            rc = nullptr;
+// make an erlang term from a value of a basic type stored at `data`
+// `data` may be unaligned, e.g., when it points into a binary
+// returns false for NaN and infinities, which erlang floats cannot hold
+static bool make_basic_value_term(ErlNifEnv *env, ffi_type *type, const uint8_t *data, ERL_NIF_TERM &term) {
+    if (type == &ffi_type_uint8) {
+        term = enif_make_uint(env, read_unaligned<uint8_t>(data));
+    } else if (type == &ffi_type_sint8) {
+        term = enif_make_int(env, read_unaligned<int8_t>(data));
+    } else if (type == &ffi_type_uint16) {
+        term = enif_make_uint(env, read_unaligned<uint16_t>(data));
+    } else if (type == &ffi_type_sint16) {
+        term = enif_make_int(env, read_unaligned<int16_t>(data));
+    } else if (type == &ffi_type_uint32) {
+        term = enif_make_uint(env, read_unaligned<uint32_t>(data));
+    } else if (type == &ffi_type_sint32) {
+        term = enif_make_int(env, read_unaligned<int32_t>(data));
+    } else if (type == &ffi_type_uint64) {
+        term = enif_make_uint64(env, read_unaligned<uint64_t>(data));
+    } else if (type == &ffi_type_sint64) {
+        term = enif_make_int64(env, read_unaligned<int64_t>(data));
+    } else if (type == &ffi_type_float || type == &ffi_type_double) {
+        double value = type == &ffi_type_float ? read_unaligned<float>(data) : read_unaligned<double>(data);
+        // erlang floats are finite, enif_make_double raises badarg otherwise
+        if (!std::isfinite(value)) {
+            return false;
         }
+        term = enif_make_double(env, value);
+    } else {
+        term = enif_make_uint64(env, (uint64_t)read_unaligned<uintptr_t>(data));
     }
+    return true;
+}
 
-    /// Invoke function with input arguments
-    /// @param return_value out. The return value of the function invoked.
-    /// @param out_values out. New values of the arguments that are passed by reference or marked as output
+/// Memory layout of a struct declared by `cstruct`, computed once per struct_id
+class StructLayout {
+public:
+    struct Field {
+        // field name atom, atoms are valid in all environments
+        ERL_NIF_TERM name;
+        // ffi type of the field, or of each element if the field is a nd-array
+        ffi_type *element_type;
+        // number of elements if the field is a nd-array, otherwise 0
+        size_t count;
+        size_t offset;
+    };
+
+    /// Get the cached layout of a struct
+    /// @param struct_term `{:struct, struct_id, fields}`, i.e., the output of `Otter.transform_type/1`
     /// @param error_msg out. Error message if encountered error
-    /// @return true if successfully invoked the function
-    ///         Otherwise, false. And error message will be in `error_msg`.
-    bool call(ERL_NIF_TERM &return_value, ERL_NIF_TERM &out_values, std::string &error_msg) noexcept {
-        if (env_ == nullptr) {
-            error_msg = "ErlNifEnv variable is nullptr";
-            return false;
+    static std::shared_ptr<StructLayout> get(ErlNifEnv *env, ERL_NIF_TERM struct_term, std::string &error_msg) {
+        int arity;
+        const ERL_NIF_TERM *array;
+        std::string struct_atom, struct_id;
+        if (!(enif_get_tuple(env, struct_term, &arity, &array) && arity == 3 &&
+              erlang::nif::get_atom(env, array[0], struct_atom) && struct_atom == "struct" &&
+              erlang::nif::get_atom(env, array[1], struct_id))) {
+            error_msg = "expecting a struct type: {:struct, struct_id, fields}";
+            return nullptr;
         }
 
-        // get the symbol
-        OtterSymbol *symbol_res = nullptr;
-        if (!enif_get_resource(env_, symbol_, OtterSymbol::type, (void **)&symbol_res) && symbol_res && symbol_res->val) {
-            error_msg = "invalid symbol";
-            return false;
+        {
+            std::lock_guard<std::mutex> g(registry_lock);
+            auto it = registry.find(struct_id);
+            if (it != registry.end()) {
+                return it->second;
+            }
         }
 
-        // get return type
-        if (!prepare_ffi_return_type(error_msg)) {
-            return false;
+        auto layout = std::make_shared<StructLayout>();
+        layout->struct_id = struct_id;
+        if (!layout->compute(env, array[2], error_msg)) {
+            return nullptr;
         }
 
-        // first pass of parsing the arg_types_term_
-        if (!_get_args_with_type(arg_types_term_, 0, args_with_type_, error_msg)) {
-            error_msg = "failed to parse the args_with_type list";
-            return false;
+        std::lock_guard<std::mutex> g(registry_lock);
+        auto it = registry.find(struct_id);
+        if (it != registry.end()) {
+            return it->second;
         }
+        registry[struct_id] = layout;
+        return layout;
+    }
 
-        // allocate memory for args
-        // args will be used in `_process_args_with_type`
-        if (args_with_type_.size() > 0) {
-            size_t args_size = sizeof(ffi_type *) * args_with_type_.size();
-            void * new_args = (ffi_type **)realloc(args, args_size);
-            if (new_args == nullptr) {
-                error_msg = "fail to allocate memory for ffi args";
+    /// Decode one struct at `data` into a map (field name => value) or a tuple (in field order)
+    /// @param decoded out. The map or the tuple.
+    /// @param error_msg out. Error message if a field cannot be decoded
+    bool decode(ErlNifEnv *env, const uint8_t *data, bool as_map, std::vector<ERL_NIF_TERM> &values,
+                ERL_NIF_TERM &decoded, std::string &error_msg) const {
+        values.resize(fields.size());
+        for (size_t i = 0; i < fields.size(); ++i) {
+            auto &field = fields[i];
+            const uint8_t *field_data = data + field.offset;
+            bool ok = true;
+            if (field.count == 0) {
+                ok = make_basic_value_term(env, field.element_type, field_data, values[i]);
+            } else {
+                ERL_NIF_TERM list = enif_make_list(env, 0);
+                for (size_t j = field.count; ok && j > 0; --j) {
+                    ERL_NIF_TERM elem;
+                    ok = make_basic_value_term(env, field.element_type, field_data + (j - 1) * field.element_type->size, elem);
+                    list = enif_make_list_cell(env, elem, list);
+                }
+                values[i] = list;
+            }
+            if (!ok) {
+                error_msg = "field is NaN or infinity in struct " + struct_id;
                 return false;
             }
-            args = (ffi_type **)new_args;
-            memset((void *)args, 0, args_size);
         }
 
-        // process parsed args_with_type_ array
-        // va_args will be processed in `_process_args_with_type`
-        if (!_process_args_with_type(num_fixed_args, 0, error_msg, true)) {
-            return false;
+        if (as_map) {
+            if (!enif_make_map_from_arrays(env, (ERL_NIF_TERM *)keys.data(), values.data(), fields.size(), &decoded)) {
+                error_msg = "duplicate field names in struct " + struct_id;
+                return false;
+            }
+        } else {
+            decoded = enif_make_tuple_from_array(env, values.data(), (unsigned)values.size());
         }
+        return true;
+    }
 
-        // args_with_type_ will now be a "flatten" list of arguments
-        // get number of variadic arguments
-        num_variadic_args = args_with_type_.size() - num_fixed_args;
-
-        // verify ffi type info for args
-        bool ready = true;
-        for (size_t i = 0; i < num_fixed_args + num_variadic_args; i++) {
-            if (args == nullptr || args[i] == nullptr) {
-                ready = 0;
-                error_msg = "input argument type missing for arg at index " + std::to_string(i);
-                break;
+    /// Copy the layouts computed by an older instance into the registry
+    ///
+    /// The layouts are copied rather than shared, the control blocks of the old
+    /// shared_ptrs belong to the older instance.
+    static void adopt(std::map<std::string, std::shared_ptr<StructLayout>> &old_registry, std::mutex &old_lock) {
+        std::lock_guard<std::mutex> old_g(old_lock);
+        std::lock_guard<std::mutex> g(registry_lock);
+        for (auto &iter : old_registry) {
+            auto layout = std::make_shared<StructLayout>(*iter.second);
+            for (auto &field : layout->fields) {
+                field.element_type = same_basic_ffi_type(field.element_type);
             }
+            registry[iter.first] = layout;
         }
+    }
 
-        // prepare ffi call
-        ffi_status prep_status;
-        if (ready) {
-            if (num_variadic_args > 0) {
-                prep_status = ffi_prep_cif_var(&cif, FFI_DEFAULT_ABI, num_fixed_args,
-                                               num_fixed_args + num_variadic_args, ffi_return_type, args);
-            } else {
-                prep_status = ffi_prep_cif(&cif, FFI_DEFAULT_ABI, num_fixed_args, ffi_return_type, args);
-            }
+    static std::map<std::string, std::shared_ptr<StructLayout>> registry;
+    static std::mutex registry_lock;
 
-            if (prep_status != FFI_OK) {
-                ready = false;
-                error_msg = "ffi_prep_cif failed";
+    std::string struct_id;
+    std::vector<Field> fields;
+    // field name atoms, in the same order as `fields`
+    std::vector<ERL_NIF_TERM> keys;
+    size_t size = 0;
+    size_t alignment = 0;
+
+private:
+    // same rules as libffi uses for FFI_TYPE_STRUCT:
+    //   each field is aligned to its own alignment,
+    //   the struct is aligned to the largest field alignment and padded to a multiple of it
+    bool compute(ErlNifEnv *env, ERL_NIF_TERM fields_term, std::string &error_msg) {
+        ERL_NIF_TERM head, tail;
+        size_t offset = 0;
+        alignment = 1;
+        while (enif_get_list_cell(env, fields_term, &head, &tail)) {
+            int arity;
+            const ERL_NIF_TERM *array;
+            ERL_NIF_TERM type_term;
+            std::string type;
+            if (!(enif_get_tuple(env, head, &arity, &array) && arity == 2 && enif_is_atom(env, array[0]) &&
+                  enif_get_map_value(env, array[1], enif_make_atom(env, "type"), &type_term) &&
+                  (erlang::nif::get_atom(env, type_term, type) || erlang::nif::get(env, type_term, type)))) {
+                error_msg = "each field should be a 2-tuple: {field_name, %{type: type}}";
+                return false;
             }
-        }
 
-        // fill values after ffi_prep_cif succeeded
-        if (ready) {
-            ready = fill_values(error_msg);
+            Field field;
+            field.name = array[0];
+            field.element_type = get_basic_ffi_type(type);
+            if (field.element_type == nullptr) {
+                error_msg = "unsupported field type in struct " + struct_id + ": " + type;
+                return false;
+            }
 
-            // verify ffi type info for values
-            for (size_t i = 0; ready && i < (num_fixed_args + num_variadic_args); i++) {
-                if (values == nullptr || values[i] == nullptr) {
-                    ready = false;
-                    error_msg = "input argument value missing for arg at index " + std::to_string(i);
-                    break;
-                }
+            uint64_t count = 0;
+            ERL_NIF_TERM size_term;
+            if (enif_get_map_value(env, array[1], enif_make_atom(env, "size"), &size_term)) {
+                erlang::nif::get_uint64(env, size_term, &count);
+            }
+            field.count = (size_t)count;
+
+            size_t field_alignment = field.element_type->alignment;
+            size_t field_size = field.element_type->size * (field.count > 0 ? field.count : 1);
+            offset = (offset + field_alignment - 1) / field_alignment * field_alignment;
+            field.offset = offset;
+            offset += field_size;
+            if (field_alignment > alignment) {
+                alignment = field_alignment;
             }
-        }
 
-        if (!ready) {
-            return ready;
+            fields.push_back(field);
+            keys.push_back(field.name);
+            fields_term = tail;
         }
+        size = (offset + alignment - 1) / alignment * alignment;
+        return true;
+    }
+};
 
-        // size here gets updated by ffi_prep_cif
-        size_t return_object_size = ffi_return_type->size;
-        if (return_object_size > 0) {
-            // based on libffi docs
-            // rc should be at least as large as sizeof(ffi_arg *)
-            size_t rc_size = return_object_size;
-            if (rc_size < sizeof(ffi_arg *)) {
-                rc_size = sizeof(ffi_arg *);
-            }
-            void * new_rc = realloc(rc, rc_size);
-            if (new_rc == nullptr) {
-                ready = false;
-                error_msg = "cannot allocate memory for ffi return value";
-            } else {
-                rc = new_rc;
+std::mutex StructLayout::registry_lock;
+std::map<std::string, std::shared_ptr<StructLayout>> StructLayout::registry;
+
+/// A per-thread buffer for large struct arrays passed to C functions
+///
+/// Large arrays would otherwise go through malloc and free (i.e., mmap and munmap)
+/// on every call. One array per thread can use the arena at a time.
+class StructArrayArena {
+public:
+    // arrays smaller than this are allocated with malloc
+    static const size_t threshold = 64 * 1024;
+    // the arena is freed after use if it grew larger than this
+    static const size_t max_retained = 16 * 1024 * 1024;
+
+    /// @return nullptr if the arena is in use or out of memory
+    static void * acquire(size_t size) {
+        auto &arena = local();
+        if (arena.busy) {
+            return nullptr;
+        }
+        if (arena.capacity < size) {
+            free(arena.data);
+            arena.data = malloc(size);
+            arena.capacity = arena.data ? size : 0;
+            if (arena.data == nullptr) {
+                return nullptr;
             }
         }
+        arena.busy = true;
+        return arena.data;
+    }
 
-        if (ready) {
-            ffi_call(&cif, (void (*)())symbol_res->val, rc, values);
+    static void release() {
+        auto &arena = local();
+        arena.busy = false;
+        if (arena.capacity > max_retained) {
+            free(arena.data);
+            arena.data = nullptr;
+            arena.capacity = 0;
         }
+    }
 
-        // has out values, copy them to erlang
-        if (out_value_indexes.size() > 0) {
-            std::vector<ERL_NIF_TERM> out_terms;
-            for (auto &index : out_value_indexes) {
-                auto &p = args_with_type_[index];
-                ERL_NIF_TERM out;
-                std::string out_error;
-                if (!handle_out_values(p, out, out_error)) {
-                    out = erlang::nif::error(env_, out_error.c_str());
-                }
-                out_terms.push_back(out);
-            }
-            out_values = enif_make_list_from_array(env_, (const ERL_NIF_TERM *)out_terms.data(), (unsigned)out_value_indexes.size());
+private:
+    struct Arena {
+        ~Arena() {
+            free(data);
         }
 
-        if (return_object_size && rc) {
-            if (struct_return_type) {
-                if (!FFIStructTypeWrapper::make_ffi_struct_resource(env_, return_object_size, struct_return_type->resource_type, rc, return_value)) {
-                    struct_return_type.reset();
-                    ready = false;
-                    error_msg = "cannot make_ffi_struct_resource";
-                }
-            } else if (return_type == "void") {
-                return_value = erlang::nif::ok(env_);
-            } else if (return_type == "u8") {
-                return_value = enif_make_uint(env_, *(uint8_t *)rc);
-            } else if (return_type == "s8") {
-                return_value = enif_make_int(env_, *(int8_t *)rc);
-            } else if (return_type == "u16") {
-                return_value = enif_make_uint(env_, *(uint16_t *)rc);
-            } else if (return_type == "s16") {
-                return_value = enif_make_int(env_, *(int16_t *)rc);
-            } else if (return_type == "u32") {
-                return_value = enif_make_uint(env_, *(uint32_t *)rc);
-            } else if (return_type == "s32") {
-                return_value = enif_make_int(env_, *(int32_t *)rc);
-            } else if (return_type == "u64") {
-                return_value = enif_make_uint64(env_, *(uint64_t *)rc);
-            } else if (return_type == "s64") {
-                return_value = enif_make_int64(env_, *(int64_t *)rc);
-            } else if (return_type == "f32") {
-                return_value = enif_make_double(env_, *(float *)rc);
-            } else if (return_type == "f64") {
-                return_value = enif_make_double(env_, *(double *)rc);
-            } else if (return_type == "c_ptr") {
-                return_value = enif_make_uint64(env_, (uint64_t)(*(uint64_t *)rc));
-            } else {
-                printf("[debug] todo: return_type: %s\r\n", return_type.c_str());
-                error_msg = "return_type " + return_type + " is not implemented yet";
-                ready = false;
-            }
-        } else {
-            return_value = erlang::nif::ok(env_);
-        }
+        void * data = nullptr;
+        size_t capacity = 0;
+        bool busy = false;
+    };
 
-        return ready;
+    static Arena &local() {
+        static thread_local Arena arena;
+        return arena;
     }
+};
 
-    bool prepare_ffi_return_type(std::string &error_msg) {
-        if (erlang::nif::get_atom(env_, return_type_, return_type) && !return_type.empty()) {
-            // Do nothing
-        } else {
-            struct_return_type = create_from_tuple(return_type_, error_msg);
-            if (struct_return_type == nullptr) {
-                error_msg = "fail to create struct wrapper";
-                return false;
-            }
-            struct_wrapper.push_back(struct_return_type);
-        }
+/// Bump allocator for the temporary memory of one call, e.g., NUL-terminated copies of strings
+///
+/// Small allocations come from an inline buffer, so most calls do not allocate at all.
+/// Everything is freed when the arena is destroyed.
+class ScratchArena {
+public:
+    ScratchArena() = default;
+    ScratchArena(const ScratchArena &) = delete;
+    ScratchArena &operator=(const ScratchArena &) = delete;
 
-        if (struct_return_type) {
-            ffi_return_type = &struct_return_type->ffi_struct_type;
-        } else if (str2ffi_type.find(return_type) != str2ffi_type.end()) {
-            ffi_return_type = str2ffi_type[return_type];
-        } else {
-            error_msg = "failed to create return type for ffi_call";
-            return false;
-        }
+    ~ScratchArena() {
+        for (auto block : blocks) free(block);
+    }
 
-        if (ffi_return_type == nullptr) {
-            error_msg = "ffi return type is not initialised properly";
-            return false;
+    /// @return nullptr if out of memory
+    void * allocate(size_t size) {
+        if (size <= sizeof(inline_buffer) - used) {
+            void *data = inline_buffer + used;
+            used += size;
+            return data;
         }
-
-        return true;
+        void *data = malloc(size);
+        if (data) {
+            blocks.push_back(data);
+        }
+        return data;
     }
 
-    bool fill_values(std::string &error_msg) {
-        bool ok = true;
+private:
+    char inline_buffer[256];
+    size_t used = 0;
+    std::vector<void *> blocks;
+};
 
-        void * new_values = realloc(values, sizeof(void *) * (num_fixed_args + num_variadic_args));
-        if (new_values == nullptr) {
-            error_msg = "fail to allocate memory for ffi values";
-            return false;
+class FFIArgType {
+public:
+    enum FFIArgPassingType {
+        VALUE,
+        ADDR,
+        REF,
+    };
+
+    FFIArgType(ERL_NIF_TERM term_, ERL_NIF_TERM type_term_, const std::string type_, uint64_t size_, ERL_NIF_TERM info) :
+        term(term_), type_term(type_term_), type(type_), size(size_), extra_info(info) {
+        pass_by = VALUE;
+        is_out = false;
+        value_slot = 0;
+        value_slot_original = 0;
+        is_va_args = false;
+        is_struct_instance = false;
+        struct_data = nullptr;
+        is_out_buffer = false;
+        out_buffer_owned = false;
+        out_buffer_length_from = BUFFER_SIZE;
+        out_buffer_length_arg = 0;
+        array_data = nullptr;
+        array_in_arena = false;
+    }
+
+    ~FFIArgType() {
+        if (array_in_arena) {
+            StructArrayArena::release();
+        } else if (array_data) {
+            free(array_data);
         }
-        values = (void **)new_values;
-        memset((void *)values, 0, sizeof(void *) * (num_fixed_args + num_variadic_args));
+        array_data = nullptr;
+        if (out_buffer_owned) {
+            enif_release_binary(&out_buffer);
+            out_buffer_owned = false;
+            memory_accounting.release(MemoryAccounting::OUT_BUFFER, out_buffer.size);
+        }
+    }
 
-        for (size_t i = 0; ok && i < (num_fixed_args + num_variadic_args); i++) {
-            if (args == nullptr) {
-                ok = 0;
-                error_msg = "input argument type info missing for arg at index " + std::to_string(i);
-                break;
-            }
+    FFIArgType(const FFIArgType &) = delete;
+    FFIArgType &operator=(const FFIArgType &) = delete;
 
-            if (type_index_resindex.find((uint64_t)(uint64_t *)args[i]) != type_index_resindex.end()) {
-                auto &index_resindex = type_index_resindex[(uint64_t)(uint64_t *)args[i]];
-                auto slot = index_resindex[i];
-                if (args[i] == &ffi_type_pointer) {
-                    auto ffi_arg_res = get_ffi_res<void *>();
-                    if (!(ok = (ffi_arg_res && ffi_arg_res->get(slot, values[i])))) {
-                        error_msg = "invalid ffi resource for a void * arg";
-                        break;
-                    }
-                } else if (args[i] == &ffi_type_uint8) {
-                    auto ffi_arg_res = get_ffi_res<uint8_t>();
-                    if (!(ok = (ffi_arg_res && ffi_arg_res->get(slot, values[i])))) {
-                        error_msg = "invalid ffi resource for a uint8_t arg";
-                        break;
-                    }
-                } else if (args[i] == &ffi_type_uint16) {
-                    auto ffi_arg_res = get_ffi_res<uint16_t>();
-                    if (!(ok = (ffi_arg_res && ffi_arg_res->get(slot, values[i])))) {
-                        error_msg = "invalid ffi resource for a uint16_t arg";
-                        break;
-                    }
-                } else if (args[i] == &ffi_type_uint32) {
-                    auto ffi_arg_res = get_ffi_res<uint32_t>();
-                    if (!(ok = (ffi_arg_res && ffi_arg_res->get(slot, values[i])))) {
-                        error_msg = "invalid ffi resource for a uint32_t arg";
-                        break;
-                    }
-                } else if (args[i] == &ffi_type_uint64) {
-                    auto ffi_arg_res = get_ffi_res<uint64_t>();
-                    if (!(ok = (ffi_arg_res && ffi_arg_res->get(slot, values[i])))) {
-                        error_msg = "invalid ffi resource for a uint64_t arg";
-                        break;
-                    }
-                } else if (args[i] == &ffi_type_sint8) {
-                    auto ffi_arg_res = get_ffi_res<int8_t>();
-                    if (!(ok = (ffi_arg_res && ffi_arg_res->get(slot, values[i])))) {
-                        error_msg = "invalid ffi resource for an int8_t arg";
-                        break;
-                    }
-                } else if (args[i] == &ffi_type_sint16) {
-                    auto ffi_arg_res = get_ffi_res<int16_t>();
-                    if (!(ok = (ffi_arg_res && ffi_arg_res->get(slot, values[i])))) {
-                        error_msg = "invalid ffi resource for an int16_t arg";
-                        break;
-                    }
-                } else if (args[i] == &ffi_type_sint32) {
-                    auto ffi_arg_res = get_ffi_res<int32_t>();
-                    if (!(ok = (ffi_arg_res && ffi_arg_res->get(slot, values[i])))) {
-                        error_msg = "invalid ffi resource for an int32_t arg";
-                        break;
-                    }
-                } else if (args[i] == &ffi_type_sint64) {
-                    auto ffi_arg_res = get_ffi_res<int64_t>();
-                    if (!(ok = (ffi_arg_res && ffi_arg_res->get(slot, values[i])))) {
-                        error_msg = "invalid ffi resource for an int64_t arg";
-                        break;
-                    }
-                } else if (args[i] == &ffi_type_float) {
-                    auto ffi_arg_res = get_ffi_res<float>();
-                    if (!(ok = (ffi_arg_res && ffi_arg_res->get(slot, values[i])))) {
-                        error_msg = "invalid ffi resource for a float arg";
-                        break;
-                    }
-                } else if (args[i] == &ffi_type_double) {
-                    auto ffi_arg_res = get_ffi_res<double>();
-                    if (!(ok = (ffi_arg_res && ffi_arg_res->get(slot, values[i])))) {
-                        error_msg = "invalid ffi resource for a double arg";
-                        break;
-                    }
-                }
+    enum OutBufferLengthFrom {
+        // the whole buffer
+        BUFFER_SIZE,
+        // the return value of the function
+        RETURN_VALUE,
+        // the value of another (integer) argument after the call
+        ARG_VALUE,
+    };
+
+    ERL_NIF_TERM term;
+    ERL_NIF_TERM type_term;
+    std::string type;
+
+    // if size > 0,
+    // then the value is a nd-array
+    uint64_t size;
+    // erlang map
+    ERL_NIF_TERM extra_info;
+
+    // ffi type
+    std::shared_ptr<ffi_type> ffi_arg_type;
+    std::shared_ptr<ffi_type> ffi_arg_type_original;
+
+    size_t value_slot;
+    size_t value_slot_original;
+
+    // if pass_by == VALUE or pass_by == REF
+    //  then we have ffi_arg_type == ffi_arg_type_original
+    // if pass_by == ADDR
+    //  then ffi_arg_type_original will record the original type
+    //       and ffi_arg_type will be the corresponding pointer type
+    FFIArgPassingType pass_by;
+    bool is_out;
+    bool is_va_args;
+
+    bool is_struct_instance;
+    // borrowed data from erlang vm
+    // do not free struct_data
+    void * struct_data;
+
+    // `{:out_buffer, size}` or `{:out_buffer, size, length_from}` passed as a c_ptr
+    // the C function writes into `out_buffer.data` and the binary is returned as an out value
+    bool is_out_buffer;
+    // true until the binary is handed over to erlang by enif_make_binary
+    bool out_buffer_owned;
+    ErlNifBinary out_buffer;
+    OutBufferLengthFrom out_buffer_length_from;
+    size_t out_buffer_length_arg;
+
+    // struct arrays gathered from a list, or copied from a misaligned binary
+    // allocated with malloc, or the `StructArrayArena` of this thread if `array_in_arena`
+    void * array_data;
+    bool array_in_arena;
+};
+
+template<typename T>
+class FFIResource {
+public:
+    FFIResource(size_t default_cap=32) : invalid(false), increase_by(default_cap), cap(0), next(0) {
+    }
+
+    ~FFIResource() {
+        if (resources) {
+            free((void *)resources);
+            resources = nullptr;
+        }
+        invalid = true;
+    }
+
+    bool get(size_t slot, void *&addr) {
+        if (invalid || slot >= next) return false;
+        addr = &resources[slot];
+        return true;
+    }
+
+    bool get_value(size_t slot, T& value) {
+        if (invalid || slot >= next) return false;
+        value = resources[slot];
+        return true;
+    }
+
+    bool set(T val, size_t &occupy) {
+        if (invalid) return false;
+        if (next == cap) {
+            size_t new_cap = cap + increase_by;
+            T * new_res = (T *)realloc(this->resources, sizeof(T) * new_cap);
+            if (new_res != nullptr) {
+                cap = new_cap;
+                this->resources = new_res;
             } else {
-                auto &p = args_with_type_[i];
-                if (p->is_struct_instance) {
-                    if (p->struct_data) {
-                        values[i] = p->struct_data;
-                    } else {
-                        ok = 0;
-                        error_msg = "struct data is nullptr";
-                        break;
-                    }
-                }
+                free((void *)resources);
+                resources = nullptr;
+                invalid = true;
+                return false;
             }
         }
-        return ok;
+        this->resources[next] = val;
+        occupy = next;
+        next++;
+        return true;
     }
 
-    static void copy_ffi_type(std::shared_ptr<ffi_type> &shared_ffi_type, ffi_type &copy_from) {
-        shared_ffi_type->size = copy_from.size;
-        shared_ffi_type->alignment = copy_from.alignment;
-        shared_ffi_type->type = copy_from.type;
-        shared_ffi_type->elements = nullptr;
+    bool invalid;
+    T * resources = nullptr;
+    size_t increase_by;
+    size_t cap;
+    size_t next;
+};
+
+/// Bounded LRU cache of prepared call interfaces for variadic functions
+///
+/// Only signatures that consist entirely of the basic ffi types are cached, because
+/// those ffi_type objects are statically allocated by libffi and outlive every entry.
+///
+/// Each thread keeps a small direct-mapped front of the entries it used last, so that a hit
+/// neither builds a key nor takes the lock. Hits in the front do not refresh the LRU order.
+class VariadicCIFCache {
+public:
+    struct Entry {
+        ffi_cif cif;
+        size_t num_fixed_args;
+        // `cif.arg_types` points to the data of this vector
+        std::vector<ffi_type *> arg_types;
+
+        bool matches(ffi_type *rtype, size_t num_fixed_args_, ffi_type **args, size_t num_args) const {
+            return cif.rtype == rtype && num_fixed_args == num_fixed_args_ && arg_types.size() == num_args &&
+                memcmp(arg_types.data(), args, sizeof(ffi_type *) * num_args) == 0;
+        }
+    };
+
+    VariadicCIFCache(size_t capacity_=64) : capacity(capacity_), hits(0), misses(0), generation(0) {
     }
 
-    /// Transform the args_with_type list to vector<arg_type>
-    /// @param arg_types_term The `args_with_type` list (in Elixir). [{arg_value, type_info}, ...]
-    /// @param prev_size Number of processed arguments in `args_with_type` array (C++).
-    /// @param args_with_type out. The `args_with_type` array that stores transformed function input arguments.
-    /// @param error_msg out. Error message if encountered error
-    bool _get_args_with_type(ERL_NIF_TERM arg_types_term, size_t prev_size, std::vector<std::shared_ptr<FFIArgType>> &args_with_type, std::string &error_msg) noexcept {
-        // `arg_types_term` shoud be a list in all cases
-        // including for C function that takes no input arguments (i.e., will be [])
-        if (!enif_is_list(env_, arg_types_term)) {
-            // this is unlikely to happen unless the user directly
-            // calls functions in Otter.Nif instead of using the
-            // wrappers provided by Otter
-            error_msg = "args_with_type is expected to be a list";
-            return false;
+    /// @return true if the signature consists of basic ffi types only
+    static bool cacheable(ffi_type *rtype, ffi_type **args, size_t num_args) {
+        if (!is_static_ffi_type(rtype)) return false;
+        for (size_t i = 0; i < num_args; ++i) {
+            if (!is_static_ffi_type(args[i])) return false;
         }
+        return true;
+    }
 
-        // we should have no issues getting the length of a list
-        unsigned int length;
-        if (!enif_get_list_length(env_, arg_types_term, &length)) {
-            error_msg = "enif_get_list_length: cannot get the length of args_with_type";
-            return false;
+    /// Build the cache key for a variadic signature
+    /// @param rtype ffi return type
+    /// @param num_fixed_args number of fixed arguments
+    /// @param args ffi types of all arguments, fixed ones first
+    /// @param num_args total number of arguments
+    /// @param key out. The cache key.
+    /// @return true if this signature can be cached
+    static bool make_key(ffi_type *rtype, size_t num_fixed_args, ffi_type **args, size_t num_args, std::string &key) {
+        if (!cacheable(rtype, args, num_args)) return false;
+
+        key.reserve(sizeof(ffi_type *) * (num_args + 1) + sizeof(size_t));
+        key.append((const char *)&rtype, sizeof(ffi_type *));
+        key.append((const char *)&num_fixed_args, sizeof(size_t));
+        key.append((const char *)args, sizeof(ffi_type *) * num_args);
+        return true;
+    }
+
+    static bool is_static_ffi_type(ffi_type *t) {
+        return t == &ffi_type_pointer ||
+            t == &ffi_type_uint8 || t == &ffi_type_uint16 || t == &ffi_type_uint32 || t == &ffi_type_uint64 ||
+            t == &ffi_type_sint8 || t == &ffi_type_sint16 || t == &ffi_type_sint32 || t == &ffi_type_sint64 ||
+            t == &ffi_type_float || t == &ffi_type_double || t == &ffi_type_void;
+    }
+
+    /// Get a prepared cif from the front of this thread, or from the shared cache
+    /// @note the signature has to be `cacheable`
+    /// @return nullptr if ffi_prep_cif_var failed
+    std::shared_ptr<Entry> get(ffi_type *rtype, size_t num_fixed_args, ffi_type **args, size_t num_args) {
+        uint64_t current = generation.load(std::memory_order_acquire);
+        auto &slot = local().slots[front_index(rtype, num_fixed_args, args, num_args)];
+        if (slot.entry && slot.generation == current && slot.entry->matches(rtype, num_fixed_args, args, num_args)) {
+            hits.fetch_add(1, std::memory_order_relaxed);
+            return slot.entry;
         }
 
-        // note that we might be inside a _get_args_with_type call
-        // because we need to process va_args
-        // if we were in a recursive call, then
-        //   prev_size indicates the number of arguments we have already processed
-        //     and we just need to reserve some more space for the ones in va_args
-        // otherwise
-        //   prev_size should be zero
-        args_with_type.reserve(prev_size + length);
+        std::string key;
+        make_key(rtype, num_fixed_args, args, num_args, key);
+        auto entry = get_or_prepare(key, rtype, num_fixed_args, args, num_args);
+        if (entry && capacity.load(std::memory_order_relaxed) > 0) {
+            slot.entry = entry;
+            slot.generation = current;
+        }
+        return entry;
+    }
 
-        // iterate through the list, arg_types_term
-        ERL_NIF_TERM head, tail;
-        while (enif_get_list_cell(env_, arg_types_term, &head, &tail)) {
-            // each element in this list should be a 2-tuple
-            int arity;
-            const ERL_NIF_TERM *array;
-            if (enif_is_tuple(env_, head) && enif_get_tuple(env_, head, &arity, &array) && arity == 2) {
-                ERL_NIF_TERM arg_value = array[0];
-                ERL_NIF_TERM type_info = array[1];
+    /// Get a prepared cif, preparing and inserting it on a cache miss
+    /// @return nullptr if ffi_prep_cif_var failed
+    std::shared_ptr<Entry> get_or_prepare(const std::string &key, ffi_type *rtype, size_t num_fixed_args, ffi_type **args, size_t num_args) {
+        {
+            std::lock_guard<std::mutex> g(lock);
+            auto it = index.find(key);
+            if (it != index.end()) {
+                hits++;
+                // move to the front, most recently used
+                lru.splice(lru.begin(), lru, it->second);
+                return it->second->second;
+            }
+            misses++;
+        }
 
-                // for all data types, type_info should be a map
-                //   and a `type` key must be set in type_info.
-                ERL_NIF_TERM type_term;
-                enif_get_map_value(env_, type_info, enif_make_atom(env_, "type"), &type_term);
+        // prepare outside of the lock, the same signature may get prepared twice
+        // by concurrent callers, and the later one simply replaces the former one
+        auto entry = std::make_shared<Entry>();
+        entry->num_fixed_args = num_fixed_args;
+        entry->arg_types.assign(args, args + num_args);
+        if (ffi_prep_cif_var(&entry->cif, FFI_DEFAULT_ABI, (unsigned)num_fixed_args, (unsigned)num_args,
+                             rtype, entry->arg_types.data()) != FFI_OK) {
+            return nullptr;
+        }
 
-                std::string arg_type_str;
-                if (erlang::nif::get_atom(env_, type_term, arg_type_str)
-                    || erlang::nif::get(env_, type_term, arg_type_str)) {
-                    // when `type_term` is either a binary (i.e., String.t()) or an atom
-                    // for example,
-                    //   most basic types:
-                    //     {arg_value, %{type: type_term}}
-                    //   nd-array types:
-                    //     {arg_value, %{type: type_term, size: size_term}}
+        std::lock_guard<std::mutex> g(lock);
+        auto it = index.find(key);
+        if (it != index.end()) {
+            lru.erase(it->second);
+            index.erase(it);
+        }
+        if (capacity == 0) {
+            return entry;
+        }
+        lru.emplace_front(key, entry);
+        index[key] = lru.begin();
+        evict();
+        return entry;
+    }
 
-                    // ignore error as `size` will stay 0
-                    // if key `size` is not in the map type_info
-                    // (which means this arg_value is not a nd-array)
-                    uint64_t size = 0;
-                    ERL_NIF_TERM size_term;
-                    if (enif_get_map_value(env_, type_info, enif_make_atom(env_, "size"), &size_term)) {
-                        erlang::nif::get_uint64(env_, size_term, &size);
-                    }
+    void set_capacity(size_t new_capacity) {
+        std::lock_guard<std::mutex> g(lock);
+        capacity = new_capacity;
+        evict();
+        // drop the fronts, so that a capacity of 0 disables the cache right away
+        generation.fetch_add(1, std::memory_order_release);
+    }
 
-                    // minimum type info is obtained
-                    // append it to the array
-                    args_with_type.emplace_back(std::make_shared<FFIArgType>(arg_value, type_term, arg_type_str, size, type_info));
-                    auto &arg_with_type = args_with_type[args_with_type.size() - 1];
+    /// Prepare the signatures cached by an older instance again, keeping their LRU order
+    void adopt(VariadicCIFCache &old) {
+        std::vector<std::pair<std::string, std::shared_ptr<Entry>>> entries;
+        uint64_t old_hits, old_misses;
+        {
+            std::lock_guard<std::mutex> old_g(old.lock);
+            // least recently used first, so that it ends up at the back again
+            entries.assign(old.lru.rbegin(), old.lru.rend());
+            old_hits = old.hits.load();
+            old_misses = old.misses.load();
+            std::lock_guard<std::mutex> g(lock);
+            capacity = old.capacity.load();
+        }
 
-                    // check if we need to pass it by address
-                    //   for exmaple,
-                    //     {arg_value, %{type: type_term, addr: true}}
-                    // by default, the implementation in Otter.Nif will remove the `addr` entry
-                    //   if an argument is set to passing by ref or by value.
-                    //   therefore, if the `addr` entry appeared in the type_info map
-                    //     the value must be `true`.
-                    bool pass_by_addr = false;
-                    ERL_NIF_TERM addr_term;
-                    if (enif_get_map_value(env_, type_info, enif_make_atom(env_, "addr"), &addr_term)) {
-                        arg_with_type->pass_by = FFIArgType::ADDR;
-                    }
+        std::vector<ffi_type *> args;
+        std::string key;
+        for (auto &iter : entries) {
+            size_t num_fixed_args = iter.second->num_fixed_args;
+            ffi_type *rtype = same_basic_ffi_type(iter.second->cif.rtype);
+            args.clear();
+            for (auto arg : iter.second->arg_types) {
+                args.push_back(same_basic_ffi_type(arg));
+            }
+            key.clear();
+            if (make_key(rtype, num_fixed_args, args.data(), args.size(), key)) {
+                get_or_prepare(key, rtype, num_fixed_args, args.data(), args.size());
+            }
+        }
+
+        std::lock_guard<std::mutex> g(lock);
+        hits = old_hits;
+        misses = old_misses;
+        generation.fetch_add(1, std::memory_order_release);
+    }
+
+    ERL_NIF_TERM info(ErlNifEnv *env) {
+        std::lock_guard<std::mutex> g(lock);
+        ERL_NIF_TERM keys[] = {
+            enif_make_atom(env, "capacity"),
+            enif_make_atom(env, "size"),
+            enif_make_atom(env, "hits"),
+            enif_make_atom(env, "misses"),
+        };
+        ERL_NIF_TERM values[] = {
+            enif_make_uint64(env, capacity.load()),
+            enif_make_uint64(env, lru.size()),
+            enif_make_uint64(env, hits.load()),
+            enif_make_uint64(env, misses.load()),
+        };
+        ERL_NIF_TERM map;
+        enif_make_map_from_arrays(env, keys, values, sizeof(keys) / sizeof(keys[0]), &map);
+        return map;
+    }
+
+private:
+    // caller should hold the lock
+    void evict() {
+        while (lru.size() > capacity) {
+            index.erase(lru.back().first);
+            lru.pop_back();
+        }
+    }
+
+    // entries per thread front, a power of two
+    static const size_t front_size = 16;
+
+    struct ThreadFront {
+        struct Slot {
+            // `generation` of the cache when the entry was stored
+            uint64_t generation = 0;
+            std::shared_ptr<Entry> entry;
+        };
+        Slot slots[front_size];
+    };
+
+    static ThreadFront &local() {
+        static thread_local ThreadFront front;
+        return front;
+    }
+
+    static size_t front_index(ffi_type *rtype, size_t num_fixed_args, ffi_type **args, size_t num_args) {
+        uint64_t h = 0xcbf29ce484222325ULL;
+        h = (h ^ (uint64_t)(uintptr_t)rtype) * 0x100000001b3ULL;
+        h = (h ^ num_fixed_args) * 0x100000001b3ULL;
+        for (size_t i = 0; i < num_args; ++i) {
+            h = (h ^ (uint64_t)(uintptr_t)args[i]) * 0x100000001b3ULL;
+        }
+        return (size_t)(h ^ (h >> 32)) & (front_size - 1);
+    }
+
+    std::mutex lock;
+    std::atomic<size_t> capacity;
+    std::atomic<uint64_t> hits;
+    std::atomic<uint64_t> misses;
+    // bumped when entries in the thread fronts must no longer be used
+    std::atomic<uint64_t> generation;
+    std::list<std::pair<std::string, std::shared_ptr<Entry>>> lru;
+    std::map<std::string, std::list<std::pair<std::string, std::shared_ptr<Entry>>>::iterator> index;
+};
+
+static VariadicCIFCache variadic_cif_cache;
+
+/// A function signature decoded from the compact descriptor generated by the `extern` macro
+///
+/// Descriptor layout, integers are little-endian:
+///   "OTS" version:u8 return:entry num_args:u8 entry*
+///   entry: tag:u8 flags:u8 count:u32 [name_len:u8 name:bytes, only if tag == STRUCT]
+///
+/// `count` is the number of elements of an nd-array argument, 0 for scalars. A return
+/// entry with a non-zero `count` is a pointer to an array of that many elements, or with
+/// the COUNT_ARG flag, a pointer to an array whose length is in the argument at index `count`.
+class CallSignature {
+public:
+    enum Tag : uint8_t {
+        VOID = 0,
+        U8, U16, U32, U64,
+        S8, S16, S32, S64,
+        F32, F64,
+        C_PTR,
+        VA_ARGS,
+        STRUCT,
+        // pointer to a contiguous array of structs
+        STRUCT_ARRAY,
+        // NUL-terminated string, a binary in erlang
+        CSTRING,
+    };
+
+    enum Flag : uint8_t {
+        ADDR = 1,
+        OUT = 2,
+        REF = 4,
+        // only for the return type, see above
+        COUNT_ARG = 8,
+    };
+
+    struct Entry {
+        Tag tag;
+        uint8_t flags;
+        uint32_t count;
+        // basic type name, or the struct id (also of struct arrays)
+        std::string type;
+        // atom of the basic type, or the `{:struct, id, fields}` tuple in `env`
+        ERL_NIF_TERM type_term;
+    };
+
+    static constexpr uint8_t version = 1;
+
+    CallSignature() : env(enif_alloc_env()), num_structs(0) {}
+
+    ~CallSignature() {
+        if (env) {
+            enif_free_env(env);
+            env = nullptr;
+        }
+    }
+
+    CallSignature(const CallSignature &) = delete;
+    CallSignature &operator=(const CallSignature &) = delete;
+
+    /// Decode a descriptor
+    /// @return nullptr if the descriptor is malformed
+    static std::shared_ptr<CallSignature> decode(const uint8_t *data, size_t size, std::string &error_msg) {
+        auto sig = std::make_shared<CallSignature>();
+        size_t pos = 0;
+        if (size < 4 || memcmp(data, "OTS", 3) != 0 || data[3] != version) {
+            error_msg = "invalid signature descriptor";
+            return nullptr;
+        }
+        pos = 4;
+        if (!sig->decode_entry(data, size, pos, sig->return_entry, error_msg)) {
+            return nullptr;
+        }
+        auto &ret = sig->return_entry;
+        bool is_array = ret.count != 0 || ret.flags == COUNT_ARG;
+        if ((ret.flags != 0 && ret.flags != COUNT_ARG) || ret.tag == VA_ARGS || ret.tag == STRUCT_ARRAY ||
+            (is_array && !(ret.tag >= U8 && ret.tag <= F64))) {
+            error_msg = "invalid return type in signature descriptor";
+            return nullptr;
+        }
+        if (pos >= size) {
+            error_msg = "truncated signature descriptor";
+            return nullptr;
+        }
+        size_t num_args = data[pos++];
+        sig->args.resize(num_args);
+        for (size_t i = 0; i < num_args; ++i) {
+            if (!sig->decode_entry(data, size, pos, sig->args[i], error_msg)) {
+                return nullptr;
+            }
+            if (sig->args[i].tag == VOID || (sig->args[i].tag == VA_ARGS && i + 1 != num_args)) {
+                error_msg = "invalid argument type in signature descriptor";
+                return nullptr;
+            }
+        }
+        if (pos != size) {
+            error_msg = "trailing bytes in signature descriptor";
+            return nullptr;
+        }
+        if (ret.flags == COUNT_ARG && ret.count >= num_args) {
+            error_msg = "invalid return type in signature descriptor";
+            return nullptr;
+        }
+        if (is_array) {
+            ret.type_term = enif_make_tuple3(sig->env, enif_make_atom(sig->env, ret.flags == COUNT_ARG ? "ptr_array" : "array"),
+                                             ret.type_term, enif_make_uint(sig->env, ret.count));
+        }
+        return sig;
+    }
+
+    /// Attach struct types, in the order they appear in the descriptor (return type first)
+    /// @param struct_types a list of `{:struct, id, fields}` tuples
+    bool set_struct_types(ErlNifEnv *caller_env, ERL_NIF_TERM struct_types, std::string &error_msg) {
+        unsigned int length = 0;
+        if (!enif_get_list_length(caller_env, struct_types, &length) || length != num_structs) {
+            error_msg = "expected " + std::to_string(num_structs) + " struct types";
+            return false;
+        }
+
+        ERL_NIF_TERM head, tail = struct_types;
+        auto attach = [&](Entry &entry) -> bool {
+            if (entry.tag != STRUCT && entry.tag != STRUCT_ARRAY) return true;
+            enif_get_list_cell(caller_env, tail, &head, &tail);
+            int arity;
+            const ERL_NIF_TERM *array;
+            std::string id;
+            if (!(enif_get_tuple(caller_env, head, &arity, &array) && arity == 3 &&
+                  erlang::nif::get_atom(caller_env, array[1], id) && id == entry.type)) {
+                error_msg = "struct type does not match the descriptor: " + entry.type;
+                return false;
+            }
+            entry.type_term = enif_make_copy(env, head);
+            return true;
+        };
+
+        if (!attach(return_entry)) return false;
+        for (auto &entry : args) {
+            if (!attach(entry)) return false;
+        }
+        return true;
+    }
+
+    ErlNifEnv *env;
+    Entry return_entry;
+    std::vector<Entry> args;
+    size_t num_structs;
+
+private:
+    bool decode_entry(const uint8_t *data, size_t size, size_t &pos, Entry &entry, std::string &error_msg) {
+        // struct types carry their own name
+        static const char *names[] = {
+            "void", "u8", "u16", "u32", "u64", "s8", "s16", "s32", "s64", "f32", "f64", "c_ptr", "va_args",
+            nullptr, nullptr, "cstring",
+        };
+
+        if (pos + 6 > size) {
+            error_msg = "truncated signature descriptor";
+            return false;
+        }
+        uint8_t tag = data[pos];
+        if (tag > CSTRING) {
+            error_msg = "unknown type tag in signature descriptor";
+            return false;
+        }
+        entry.tag = (Tag)tag;
+        entry.flags = data[pos + 1];
+        entry.count = (uint32_t)data[pos + 2] | ((uint32_t)data[pos + 3] << 8) |
+            ((uint32_t)data[pos + 4] << 16) | ((uint32_t)data[pos + 5] << 24);
+        pos += 6;
+
+        if (entry.tag == STRUCT || entry.tag == STRUCT_ARRAY) {
+            if (pos >= size || pos + 1 + data[pos] > size) {
+                error_msg = "truncated signature descriptor";
+                return false;
+            }
+            size_t name_len = data[pos];
+            entry.type.assign((const char *)data + pos + 1, name_len);
+            pos += 1 + name_len;
+            // set by `set_struct_types`
+            entry.type_term = enif_make_atom(env, "nil");
+            num_structs++;
+        } else {
+            entry.type = names[tag];
+            entry.type_term = enif_make_atom(env, names[tag]);
+        }
+        return true;
+    }
+};
+
+/// Decoded signatures keyed by the descriptor bytes
+///
+/// Descriptors are compile-time constants, so the number of entries is bounded by the
+/// number of distinct `extern` signatures in the loaded code.
+class SignatureCache {
+public:
+    /// Find the decoded signature of a descriptor, decoding it on the first use
+    /// @param signature out. nullptr if the descriptor has struct types and has not been registered yet.
+    /// @return false if the descriptor is malformed
+    bool lookup(const ErlNifBinary &descriptor, std::shared_ptr<CallSignature> &signature, std::string &error_msg) {
+        std::string key((const char *)descriptor.data, descriptor.size);
+        {
+            std::lock_guard<std::mutex> g(lock);
+            auto it = signatures.find(key);
+            if (it != signatures.end()) {
+                signature = it->second;
+                return true;
+            }
+        }
+
+        auto decoded = CallSignature::decode(descriptor.data, descriptor.size, error_msg);
+        if (!decoded) {
+            return false;
+        }
+        if (decoded->num_structs > 0) {
+            signature = nullptr;
+            return true;
+        }
+
+        std::lock_guard<std::mutex> g(lock);
+        signature = signatures.emplace(key, decoded).first->second;
+        return true;
+    }
+
+    /// Decode a descriptor that has struct types and attach them
+    bool register_signature(ErlNifEnv *env, const ErlNifBinary &descriptor, ERL_NIF_TERM struct_types, std::string &error_msg) {
+        auto decoded = CallSignature::decode(descriptor.data, descriptor.size, error_msg);
+        if (!decoded || !decoded->set_struct_types(env, struct_types, error_msg)) {
+            return false;
+        }
+
+        std::string key((const char *)descriptor.data, descriptor.size);
+        std::lock_guard<std::mutex> g(lock);
+        signatures[key] = decoded;
+        return true;
+    }
+
+    /// Decode the descriptors cached by an older instance again
+    ///
+    /// Descriptors of an older format are skipped and decoded on their next use.
+    void adopt(ErlNifEnv *env, SignatureCache &old) {
+        std::lock_guard<std::mutex> old_g(old.lock);
+        std::string error_msg;
+        for (auto &iter : old.signatures) {
+            auto &key = iter.first;
+            auto decoded = CallSignature::decode((const uint8_t *)key.data(), key.size(), error_msg);
+            if (!decoded) continue;
+
+            if (decoded->num_structs > 0) {
+                auto &old_sig = *iter.second;
+                std::vector<ERL_NIF_TERM> struct_types;
+                auto collect = [&](const CallSignature::Entry &entry) {
+                    if (entry.tag == CallSignature::STRUCT || entry.tag == CallSignature::STRUCT_ARRAY) {
+                        struct_types.push_back(enif_make_copy(env, entry.type_term));
+                    }
+                };
+                collect(old_sig.return_entry);
+                for (auto &entry : old_sig.args) {
+                    collect(entry);
+                }
+                ERL_NIF_TERM list = enif_make_list_from_array(env, struct_types.data(), (unsigned)struct_types.size());
+                if (!decoded->set_struct_types(env, list, error_msg)) continue;
+            }
+
+            std::lock_guard<std::mutex> g(lock);
+            signatures[key] = decoded;
+        }
+    }
+
+private:
+    std::mutex lock;
+    std::unordered_map<std::string, std::shared_ptr<CallSignature>> signatures;
+};
+
+static SignatureCache signature_cache;
+
+static uint64_t monotonic_ns() {
+    struct timespec ts;
+#ifdef CLOCK_MONOTONIC_RAW
+    clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+#else
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+#endif
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+/// A function that returns a pointer to an array of basic values
+///
+/// The elements are returned as one binary: a copy of the array, or the array itself
+/// when its ownership is transferred to us, then `destructor` is called once the binary
+/// is garbage collected.
+struct ArrayReturn {
+    std::string element_type;
+    size_t element_size = 0;
+    // number of elements, or the index of the argument that holds it after the call
+    size_t count = 0;
+    bool count_from_arg = false;
+    void (*destructor)(void *) = nullptr;
+    bool background = false;
+};
+
+/// Wrap everything we need to make an FFI call
+class FFICall {
+public:
+    /// Constructor
+    /// @param env Erlang Nif environment
+    /// @param symbol_term Contains the address of the symbol (function)
+    /// @param return_type_term Function return type
+    /// @param arg_types_term A list of 2-tuple {arg_value, arg_type_info}
+    ///        `arg_value` should be basic types
+    FFICall(ErlNifEnv *env, ERL_NIF_TERM symbol, ERL_NIF_TERM return_type, ERL_NIF_TERM arg_types_term) noexcept {
+        this->env_ = env;
+        this->symbol_ = symbol;
+        this->return_type_ = return_type;
+        this->arg_types_term_ = arg_types_term;
+    }
+
+    /// Constructor for calls described by a signature descriptor
+    /// @param signature Decoded signature, its struct types must have been registered
+    /// @param args_term A tuple of argument values, one for each argument in the signature
+    FFICall(ErlNifEnv *env, ERL_NIF_TERM symbol, std::shared_ptr<CallSignature> signature, ERL_NIF_TERM args_term) noexcept
+        : FFICall(env, symbol, enif_make_copy(env, signature->return_entry.type_term), args_term) {
+        this->signature_ = signature;
+    }
+
+    ~FFICall() {
+        // clean up everything used as input arguments for ffi_call
+        for (auto &iter : ffi_res) {
+            auto p = (FFIResource<void *> *)iter.second;
+            if (p) delete p;
+        }
+        struct_wrapper.clear();
+
+        if (args) {
+            free((void *)args);
+            args = nullptr;
+        }
+        if (values) {
+            free((void *)values);
+            values = nullptr;
+        }
+        if (return_resource) {
+            enif_release_resource(return_resource);
+            return_resource = nullptr;
+        }
+        if (pooled_return) {
+            StructPool::release(pooled_return, ffi_return_type->size);
+            pooled_return = nullptr;
+            memory_accounting.release(MemoryAccounting::POOLED_STRUCT, ffi_return_type->size, return_counters);
+        }
+    }
+
+    /// Invoke function with input arguments
+    /// @param return_value out. The return value of the function invoked.
+    /// @param out_values out. New values of the arguments that are passed by reference or marked as output
+    /// @param error_msg out. Error message if encountered error
+    /// @return true if successfully invoked the function
+    ///         Otherwise, false. And error message will be in `error_msg`.
+    bool call(ERL_NIF_TERM &return_value, ERL_NIF_TERM &out_values, std::string &error_msg) noexcept {
+        if (env_ == nullptr) {
+            error_msg = "ErlNifEnv variable is nullptr";
+            return false;
+        }
+
+        // get the symbol
+        OtterSymbol *symbol_res = nullptr;
+        if (!enif_get_resource(env_, symbol_, OtterSymbol::type, (void **)&symbol_res) && symbol_res && symbol_res->val) {
+            error_msg = "invalid symbol";
+            return false;
+        }
+
+        // get return type
+        if (!prepare_ffi_return_type(error_msg)) {
+            return false;
+        }
+
+        // first pass of parsing the arg_types_term_
+        if (signature_) {
+            if (!_get_args_from_signature(arg_types_term_, error_msg)) {
+                return false;
+            }
+        } else if (!_get_args_with_type(arg_types_term_, 0, args_with_type_, error_msg)) {
+            error_msg = "failed to parse the args_with_type list";
+            return false;
+        }
+
+        // allocate memory for args
+        // args will be used in `_process_args_with_type`
+        if (args_with_type_.size() > 0) {
+            size_t args_size = sizeof(ffi_type *) * args_with_type_.size();
+            void * new_args = (ffi_type **)realloc(args, args_size);
+            if (new_args == nullptr) {
+                error_msg = "fail to allocate memory for ffi args";
+                return false;
+            }
+            args = (ffi_type **)new_args;
+            memset((void *)args, 0, args_size);
+        }
+
+        // process parsed args_with_type_ array
+        // va_args will be processed in `_process_args_with_type`
+        if (!_process_args_with_type(num_fixed_args, 0, error_msg, true)) {
+            return false;
+        }
+
+        // args_with_type_ will now be a "flatten" list of arguments
+        // get number of variadic arguments
+        num_variadic_args = args_with_type_.size() - num_fixed_args;
+
+        otter::alloc_profile::set_phase(otter::alloc_profile::PREPARE);
+
+        // verify ffi type info for args
+        bool ready = true;
+        for (size_t i = 0; i < num_fixed_args + num_variadic_args; i++) {
+            if (args == nullptr || args[i] == nullptr) {
+                ready = 0;
+                error_msg = "input argument type missing for arg at index " + std::to_string(i);
+                break;
+            }
+        }
+
+        // prepare ffi call
+        ffi_status prep_status;
+        if (ready) {
+            if (num_variadic_args > 0 &&
+                VariadicCIFCache::cacheable(ffi_return_type, args, num_fixed_args + num_variadic_args)) {
+                // keep a reference to the cached entry, `cif.arg_types` points to its data
+                prepared_cif = variadic_cif_cache.get(ffi_return_type, num_fixed_args,
+                                                      args, num_fixed_args + num_variadic_args);
+                if (prepared_cif) {
+                    cif = prepared_cif->cif;
+                    prep_status = FFI_OK;
+                } else {
+                    prep_status = FFI_BAD_TYPEDEF;
+                }
+            } else if (num_variadic_args > 0) {
+                prep_status = ffi_prep_cif_var(&cif, FFI_DEFAULT_ABI, num_fixed_args,
+                                               num_fixed_args + num_variadic_args, ffi_return_type, args);
+            } else {
+                prep_status = ffi_prep_cif(&cif, FFI_DEFAULT_ABI, num_fixed_args, ffi_return_type, args);
+            }
+
+            if (prep_status != FFI_OK) {
+                ready = false;
+                error_msg = "ffi_prep_cif failed";
+            }
+        }
+
+        // fill values after ffi_prep_cif succeeded
+        if (ready) {
+            ready = fill_values(error_msg);
+
+            // verify ffi type info for values
+            for (size_t i = 0; ready && i < (num_fixed_args + num_variadic_args); i++) {
+                if (values == nullptr || values[i] == nullptr) {
+                    ready = false;
+                    error_msg = "input argument value missing for arg at index " + std::to_string(i);
+                    break;
+                }
+            }
+        }
+
+        if (!ready) {
+            return ready;
+        }
+
+        // size here gets updated by ffi_prep_cif
+        size_t return_object_size = ffi_return_type->size;
+        if (struct_return_type && (return_pool_id = StructPool::pooled_id(struct_return_type->struct_id))) {
+            return_counters = memory_accounting.struct_counters(*return_pool_id);
+            if (!memory_accounting.charge(MemoryAccounting::POOLED_STRUCT, return_object_size, return_counters)) {
+                ready = false;
+                budget_exceeded = true;
+                error_msg = "native memory budget exceeded";
+                return ready;
+            }
+            pooled_return = StructPool::acquire(return_object_size);
+            if (pooled_return == nullptr) {
+                memory_accounting.release(MemoryAccounting::POOLED_STRUCT, return_object_size, return_counters);
+                ready = false;
+                error_msg = "cannot allocate memory for ffi return value";
+            }
+            // small structs may be returned in registers, see below
+            rc = return_object_size > sizeof(rc_inline) ? pooled_return : rc_inline;
+        } else if (return_object_size > sizeof(rc_inline) && struct_return_type) {
+            // large structs are returned through a hidden pointer (sret),
+            // so the callee constructs the value directly in the resource
+            return_resource = alloc_struct_resource(struct_return_type->resource_type, return_object_size,
+                                                    struct_return_type->struct_id);
+            if (return_resource == nullptr) {
+                ready = false;
+                budget_exceeded = !memory_accounting.allows(MemoryAccounting::STRUCT,
+                                                            struct_resource_footer_offset(return_object_size) + sizeof(void *));
+                error_msg = budget_exceeded ? "native memory budget exceeded" : "cannot allocate memory for ffi return value";
+            }
+            rc = return_resource;
+        } else if (struct_return_type &&
+                   !memory_accounting.allows(MemoryAccounting::STRUCT,
+                                             struct_resource_footer_offset(return_object_size) + sizeof(void *))) {
+            // check before the call, so that the function is not called for a result that would be dropped
+            ready = false;
+            budget_exceeded = true;
+            error_msg = "native memory budget exceeded";
+            return ready;
+        } else if (return_object_size > sizeof(rc_inline)) {
+            ready = false;
+            error_msg = "return type is too large";
+        } else if (return_object_size > 0) {
+            // based on libffi docs
+            // rc should be at least as large as sizeof(ffi_arg)
+            rc = rc_inline;
+        }
+
+        if (ready) {
+            otter::alloc_profile::set_phase(otter::alloc_profile::CALL);
+            uint64_t start = measure_native ? monotonic_ns() : 0;
+            ffi_call(&cif, (void (*)())symbol_res->val, rc, values);
+            if (measure_native) {
+                native_ns = (int64_t)(monotonic_ns() - start);
+            }
+        }
+        otter::alloc_profile::set_phase(otter::alloc_profile::ENCODE);
+
+        // has out values, copy them to erlang
+        if (out_value_indexes.size() > 0) {
+            std::vector<ERL_NIF_TERM> out_terms;
+            for (auto &index : out_value_indexes) {
+                auto &p = args_with_type_[index];
+                ERL_NIF_TERM out;
+                std::string out_error;
+                if (!handle_out_values(p, out, out_error)) {
+                    out = erlang::nif::error(env_, out_error.c_str());
+                }
+                out_terms.push_back(out);
+            }
+            out_values = enif_make_list_from_array(env_, (const ERL_NIF_TERM *)out_terms.data(), (unsigned)out_value_indexes.size());
+        }
+
+        if (return_object_size && rc) {
+            if (struct_return_type && pooled_return) {
+                OtterPooledStruct *res = nullptr;
+                if (alloc_resource(&res)) {
+                    if (rc != pooled_return) {
+                        memcpy(pooled_return, rc, return_object_size);
+                    }
+                    res->val.data = pooled_return;
+                    res->val.size = return_object_size;
+                    res->val.struct_id = return_pool_id;
+                    res->val.counters = return_counters;
+                    pooled_return = nullptr;
+                    return_value = enif_make_resource(env_, res);
+                    enif_release_resource(res);
+                } else {
+                    ready = false;
+                    error_msg = "cannot allocate memory for resource";
+                }
+            } else if (struct_return_type && return_resource) {
+                return_value = enif_make_resource(env_, return_resource);
+                enif_release_resource(return_resource);
+                return_resource = nullptr;
+            } else if (struct_return_type) {
+                if (!FFIStructTypeWrapper::make_ffi_struct_resource(env_, return_object_size, struct_return_type->resource_type,
+                                                                struct_return_type->struct_id, rc, return_value)) {
+                    struct_return_type.reset();
+                    ready = false;
+                    error_msg = "cannot make_ffi_struct_resource";
+                }
+            } else if (array_return_type) {
+                ready = ready && make_array_return_value(*(void **)rc, return_value, error_msg);
+            } else if (return_type == "void") {
+                return_value = erlang::nif::ok(env_);
+            } else if (return_type == "u8") {
+                return_value = enif_make_uint(env_, *(uint8_t *)rc);
+            } else if (return_type == "s8") {
+                return_value = enif_make_int(env_, *(int8_t *)rc);
+            } else if (return_type == "u16") {
+                return_value = enif_make_uint(env_, *(uint16_t *)rc);
+            } else if (return_type == "s16") {
+                return_value = enif_make_int(env_, *(int16_t *)rc);
+            } else if (return_type == "u32") {
+                return_value = enif_make_uint(env_, *(uint32_t *)rc);
+            } else if (return_type == "s32") {
+                return_value = enif_make_int(env_, *(int32_t *)rc);
+            } else if (return_type == "u64") {
+                return_value = enif_make_uint64(env_, *(uint64_t *)rc);
+            } else if (return_type == "s64") {
+                return_value = enif_make_int64(env_, *(int64_t *)rc);
+            } else if (return_type == "f32") {
+                return_value = enif_make_double(env_, *(float *)rc);
+            } else if (return_type == "f64") {
+                return_value = enif_make_double(env_, *(double *)rc);
+            } else if (return_type == "c_ptr") {
+                return_value = enif_make_uint64(env_, (uint64_t)(*(uint64_t *)rc));
+            } else if (return_type == "cstring") {
+                const char *str = *(const char **)rc;
+                if (str == nullptr) {
+                    return_value = enif_make_atom(env_, "nil");
+                } else {
+                    size_t length = strnlen(str, max_cstring_length);
+                    unsigned char *data = enif_make_new_binary(env_, length, &return_value);
+                    if (data) {
+                        memcpy(data, str, length);
+                    } else {
+                        ready = false;
+                        error_msg = "cannot allocate binary for cstring";
+                    }
+                }
+            } else {
+                printf("[debug] todo: return_type: %s\r\n", return_type.c_str());
+                error_msg = "return_type " + return_type + " is not implemented yet";
+                ready = false;
+            }
+        } else {
+            return_value = erlang::nif::ok(env_);
+        }
+
+        return ready;
+    }
+
+    bool prepare_ffi_return_type(std::string &error_msg) {
+        if (erlang::nif::get_atom(env_, return_type_, return_type) && !return_type.empty()) {
+            // Do nothing
+        } else if (enif_is_tuple(env_, return_type_) && is_array_return_type(return_type_)) {
+            array_return_type = create_array_return_type(return_type_, error_msg);
+            if (array_return_type == nullptr) {
+                return false;
+            }
+        } else {
+            struct_return_type = create_from_tuple(return_type_, error_msg);
+            if (struct_return_type == nullptr) {
+                error_msg = "fail to create struct wrapper";
+                return false;
+            }
+            struct_wrapper.push_back(struct_return_type);
+        }
+
+        if (struct_return_type) {
+            ffi_return_type = &struct_return_type->ffi_struct_type;
+        } else if (array_return_type || return_type == "c_ptr" || return_type == "cstring") {
+            ffi_return_type = &ffi_type_pointer;
+        } else if (str2ffi_type.find(return_type) != str2ffi_type.end()) {
+            ffi_return_type = str2ffi_type[return_type];
+        } else {
+            error_msg = "failed to create return type for ffi_call";
+            return false;
+        }
+
+        if (ffi_return_type == nullptr) {
+            error_msg = "ffi return type is not initialised properly";
+            return false;
+        }
+
+        return true;
+    }
+
+    bool is_array_return_type(ERL_NIF_TERM term) {
+        int arity = -1;
+        const ERL_NIF_TERM *array;
+        std::string kind;
+        return enif_get_tuple(env_, term, &arity, &array) && arity >= 1 &&
+            erlang::nif::get_atom(env_, array[0], kind) && (kind == "array" || kind == "ptr_array");
+    }
+
+    /// Parse an array return type
+    ///
+    ///   {:array, type, count}
+    ///   {:ptr_array, type, arg_index}
+    ///
+    /// Both can be followed by a destructor symbol and a boolean (call it in the background)
+    /// when the caller takes ownership of the array.
+    std::shared_ptr<ArrayReturn> create_array_return_type(ERL_NIF_TERM term, std::string &error_msg) {
+        int arity = -1;
+        const ERL_NIF_TERM *array;
+        std::string kind;
+        uint64_t count = 0;
+        auto ret = std::make_shared<ArrayReturn>();
+        if (!(enif_get_tuple(env_, term, &arity, &array) && (arity == 3 || arity == 5) &&
+              erlang::nif::get_atom(env_, array[0], kind) &&
+              erlang::nif::get_atom(env_, array[1], ret->element_type) &&
+              erlang::nif::get_uint64(env_, array[2], &count))) {
+            error_msg = "invalid array return type";
+            return nullptr;
+        }
+
+        auto type_it = str2ffi_type.find(ret->element_type);
+        if (type_it == str2ffi_type.end() || ret->element_type == "void") {
+            error_msg = "array return type has invalid element type: " + ret->element_type;
+            return nullptr;
+        }
+        ret->element_size = type_it->second->size;
+        ret->count = (size_t)count;
+        ret->count_from_arg = (kind == "ptr_array");
+
+        if (arity == 5) {
+            OtterSymbol *symbol_res = nullptr;
+            std::string background;
+            if (!(enif_get_resource(env_, array[3], OtterSymbol::type, (void **)&symbol_res) && symbol_res && symbol_res->val)) {
+                error_msg = "cannot get destructor symbol of array return type";
+                return nullptr;
+            }
+            if (!(erlang::nif::get_atom(env_, array[4], background) && (background == "true" || background == "false"))) {
+                error_msg = "expecting a boolean in array return type";
+                return nullptr;
+            }
+            ret->destructor = (void (*)(void *))symbol_res->val;
+            ret->background = (background == "true");
+        }
+        return ret;
+    }
+
+    // copy the returned array into a binary, or hand it over to erlang if we own it
+    bool make_array_return_value(void *data, ERL_NIF_TERM &return_value, std::string &error_msg) {
+        auto &ret = *array_return_type;
+        if (data == nullptr) {
+            return_value = enif_make_atom(env_, "nil");
+            return true;
+        }
+
+        int64_t count = (int64_t)ret.count;
+        bool ok = true;
+        if (ret.count_from_arg && !get_integer_arg_value((size_t)ret.count, count)) {
+            error_msg = "cannot get array length from argument at index " + std::to_string(ret.count);
+            ok = false;
+        }
+        // negative values are usually errors
+        if (count < 0) {
+            count = 0;
+        }
+        if (ok && (uint64_t)count > SIZE_MAX / ret.element_size) {
+            error_msg = "returned array is too large";
+            ok = false;
+        }
+        size_t bytes = (size_t)count * ret.element_size;
+
+        if (ret.destructor) {
+            OtterOwnedPointer *res = nullptr;
+            if (ok && alloc_resource(&res)) {
+                new (&res->val.ptr) std::atomic<void *>(data);
+                res->val.destructor = ret.destructor;
+                res->val.background = ret.background;
+                // the binary keeps the resource alive, the destructor runs once it is garbage collected
+                return_value = enif_make_resource_binary(env_, res, data, bytes);
+                enif_release_resource(res);
+                return true;
+            }
+            if (ok) {
+                error_msg = "cannot allocate memory for resource";
+            }
+            // nobody else will free it
+            ret.destructor(data);
+            return false;
+        }
+
+        if (!ok) {
+            return false;
+        }
+        unsigned char *copy = enif_make_new_binary(env_, bytes, &return_value);
+        if (copy == nullptr) {
+            error_msg = "cannot allocate binary for returned array";
+            return false;
+        }
+        memcpy(copy, data, bytes);
+        return true;
+    }
+
+    bool fill_values(std::string &error_msg) {
+        bool ok = true;
+
+        void * new_values = realloc(values, sizeof(void *) * (num_fixed_args + num_variadic_args));
+        if (new_values == nullptr) {
+            error_msg = "fail to allocate memory for ffi values";
+            return false;
+        }
+        values = (void **)new_values;
+        memset((void *)values, 0, sizeof(void *) * (num_fixed_args + num_variadic_args));
+
+        for (size_t i = 0; ok && i < (num_fixed_args + num_variadic_args); i++) {
+            if (args == nullptr) {
+                ok = 0;
+                error_msg = "input argument type info missing for arg at index " + std::to_string(i);
+                break;
+            }
+
+            if (type_index_resindex.find((uint64_t)(uint64_t *)args[i]) != type_index_resindex.end()) {
+                auto &index_resindex = type_index_resindex[(uint64_t)(uint64_t *)args[i]];
+                auto slot = index_resindex[i];
+                if (args[i] == &ffi_type_pointer) {
+                    auto ffi_arg_res = get_ffi_res<void *>();
+                    if (!(ok = (ffi_arg_res && ffi_arg_res->get(slot, values[i])))) {
+                        error_msg = "invalid ffi resource for a void * arg";
+                        break;
+                    }
+                } else if (args[i] == &ffi_type_uint8) {
+                    auto ffi_arg_res = get_ffi_res<uint8_t>();
+                    if (!(ok = (ffi_arg_res && ffi_arg_res->get(slot, values[i])))) {
+                        error_msg = "invalid ffi resource for a uint8_t arg";
+                        break;
+                    }
+                } else if (args[i] == &ffi_type_uint16) {
+                    auto ffi_arg_res = get_ffi_res<uint16_t>();
+                    if (!(ok = (ffi_arg_res && ffi_arg_res->get(slot, values[i])))) {
+                        error_msg = "invalid ffi resource for a uint16_t arg";
+                        break;
+                    }
+                } else if (args[i] == &ffi_type_uint32) {
+                    auto ffi_arg_res = get_ffi_res<uint32_t>();
+                    if (!(ok = (ffi_arg_res && ffi_arg_res->get(slot, values[i])))) {
+                        error_msg = "invalid ffi resource for a uint32_t arg";
+                        break;
+                    }
+                } else if (args[i] == &ffi_type_uint64) {
+                    auto ffi_arg_res = get_ffi_res<uint64_t>();
+                    if (!(ok = (ffi_arg_res && ffi_arg_res->get(slot, values[i])))) {
+                        error_msg = "invalid ffi resource for a uint64_t arg";
+                        break;
+                    }
+                } else if (args[i] == &ffi_type_sint8) {
+                    auto ffi_arg_res = get_ffi_res<int8_t>();
+                    if (!(ok = (ffi_arg_res && ffi_arg_res->get(slot, values[i])))) {
+                        error_msg = "invalid ffi resource for an int8_t arg";
+                        break;
+                    }
+                } else if (args[i] == &ffi_type_sint16) {
+                    auto ffi_arg_res = get_ffi_res<int16_t>();
+                    if (!(ok = (ffi_arg_res && ffi_arg_res->get(slot, values[i])))) {
+                        error_msg = "invalid ffi resource for an int16_t arg";
+                        break;
+                    }
+                } else if (args[i] == &ffi_type_sint32) {
+                    auto ffi_arg_res = get_ffi_res<int32_t>();
+                    if (!(ok = (ffi_arg_res && ffi_arg_res->get(slot, values[i])))) {
+                        error_msg = "invalid ffi resource for an int32_t arg";
+                        break;
+                    }
+                } else if (args[i] == &ffi_type_sint64) {
+                    auto ffi_arg_res = get_ffi_res<int64_t>();
+                    if (!(ok = (ffi_arg_res && ffi_arg_res->get(slot, values[i])))) {
+                        error_msg = "invalid ffi resource for an int64_t arg";
+                        break;
+                    }
+                } else if (args[i] == &ffi_type_float) {
+                    auto ffi_arg_res = get_ffi_res<float>();
+                    if (!(ok = (ffi_arg_res && ffi_arg_res->get(slot, values[i])))) {
+                        error_msg = "invalid ffi resource for a float arg";
+                        break;
+                    }
+                } else if (args[i] == &ffi_type_double) {
+                    auto ffi_arg_res = get_ffi_res<double>();
+                    if (!(ok = (ffi_arg_res && ffi_arg_res->get(slot, values[i])))) {
+                        error_msg = "invalid ffi resource for a double arg";
+                        break;
+                    }
+                }
+            } else {
+                auto &p = args_with_type_[i];
+                if (p && p->is_struct_instance) {
+                    if (p->struct_data) {
+                        values[i] = p->struct_data;
+                    } else {
+                        ok = 0;
+                        error_msg = "struct data is nullptr";
+                        break;
+                    }
+                }
+            }
+        }
+        return ok;
+    }
+
+    static void copy_ffi_type(std::shared_ptr<ffi_type> &shared_ffi_type, ffi_type &copy_from) {
+        shared_ffi_type->size = copy_from.size;
+        shared_ffi_type->alignment = copy_from.alignment;
+        shared_ffi_type->type = copy_from.type;
+        shared_ffi_type->elements = nullptr;
+    }
+
+    /// Set `ffi_arg_type` of an argument of a basic type (or an nd-array of it), or mark it as va_args
+    static void set_basic_ffi_arg_type(std::shared_ptr<FFIArgType> &arg_with_type) {
+        // copy ffi_type to arg_with_type.ffi_arg_type
+        arg_with_type->ffi_arg_type = std::make_shared<ffi_type>();
+        ffi_type *basic_type = get_basic_ffi_type(arg_with_type->type);
+        if (basic_type) {
+            FFICall::copy_ffi_type(arg_with_type->ffi_arg_type, *basic_type);
+        } else if (arg_with_type->type == "va_args") {
+            arg_with_type->is_va_args = true;
+        }
+
+        // nd-array
+        if (arg_with_type->size > 0) {
+            // note that nd-array uses a continous (virtual) memory region
+            // therefore, we can pretend it is a struct
+            ffi_type ffi_type_array;
+            // ffi_type_array.size = sizeof(T) * count, where
+            //   sizeof(T): arg_with_type->ffi_arg_type->size
+            //   count: arg_with_type->size
+            ffi_type_array.size = arg_with_type->ffi_arg_type->size * arg_with_type->size;
+            ffi_type_array.alignment = arg_with_type->ffi_arg_type->alignment;
+            ffi_type_array.type = FFI_TYPE_STRUCT;
+
+            FFICall::copy_ffi_type(arg_with_type->ffi_arg_type, ffi_type_array);
+            arg_with_type->ffi_arg_type->elements = (ffi_type **)&null_ptr_g;
+        }
+    }
+
+    /// Build the args_with_type vector from a decoded signature and a tuple of argument values
+    /// @param args_term A tuple with one value per argument in the signature
+    /// @param error_msg out. Error message if encountered error
+    bool _get_args_from_signature(ERL_NIF_TERM args_term, std::string &error_msg) noexcept {
+        int arity;
+        const ERL_NIF_TERM *values_array;
+        if (!enif_get_tuple(env_, args_term, &arity, &values_array) || (size_t)arity != signature_->args.size()) {
+            error_msg = "expected a tuple of " + std::to_string(signature_->args.size()) + " arguments";
+            return false;
+        }
+
+        args_with_type_.reserve(signature_->args.size());
+        ERL_NIF_TERM nil = enif_make_atom(env_, "nil");
+        for (size_t i = 0; i < signature_->args.size(); ++i) {
+            auto &entry = signature_->args[i];
+            if (entry.tag == CallSignature::STRUCT) {
+                ERL_NIF_TERM type_term = enif_make_copy(env_, entry.type_term);
+                auto struct_type = create_from_tuple(type_term, error_msg);
+                if (!struct_type) {
+                    error_msg = "cannot parse type";
+                    return false;
+                }
+                args_with_type_.emplace_back(std::make_shared<FFIArgType>(values_array[i], type_term, struct_type->struct_id, 0, nil));
+                struct_wrapper.push_back(struct_type);
+                continue;
+            } else if (entry.tag == CallSignature::STRUCT_ARRAY) {
+                args_with_type_.emplace_back(std::make_shared<FFIArgType>(values_array[i], enif_make_copy(env_, entry.type_term), "struct_array", 0, nil));
+                args_with_type_.back()->is_out = (entry.flags & CallSignature::OUT) != 0;
+                continue;
+            }
+
+            // atoms are valid in every environment
+            args_with_type_.emplace_back(std::make_shared<FFIArgType>(values_array[i], entry.type_term, entry.type, entry.count, nil));
+            auto &arg_with_type = args_with_type_[args_with_type_.size() - 1];
+            if (entry.flags & CallSignature::ADDR) {
+                arg_with_type->pass_by = FFIArgType::ADDR;
+            }
+            if (entry.flags & CallSignature::OUT) {
+                arg_with_type->is_out = true;
+            }
+            set_basic_ffi_arg_type(arg_with_type);
+        }
+        return true;
+    }
+
+    /// Transform the args_with_type list to vector<arg_type>
+    /// @param arg_types_term The `args_with_type` list (in Elixir). [{arg_value, type_info}, ...]
+    /// @param prev_size Number of processed arguments in `args_with_type` array (C++).
+    /// @param args_with_type out. The `args_with_type` array that stores transformed function input arguments.
+    /// @param error_msg out. Error message if encountered error
+    bool _get_args_with_type(ERL_NIF_TERM arg_types_term, size_t prev_size, std::vector<std::shared_ptr<FFIArgType>> &args_with_type, std::string &error_msg) noexcept {
+        // `arg_types_term` shoud be a list in all cases
+        // including for C function that takes no input arguments (i.e., will be [])
+        if (!enif_is_list(env_, arg_types_term)) {
+            // this is unlikely to happen unless the user directly
+            // calls functions in Otter.Nif instead of using the
+            // wrappers provided by Otter
+            error_msg = "args_with_type is expected to be a list";
+            return false;
+        }
+
+        // we should have no issues getting the length of a list
+        unsigned int length;
+        if (!enif_get_list_length(env_, arg_types_term, &length)) {
+            error_msg = "enif_get_list_length: cannot get the length of args_with_type";
+            return false;
+        }
+
+        // note that we might be inside a _get_args_with_type call
+        // because we need to process va_args
+        // if we were in a recursive call, then
+        //   prev_size indicates the number of arguments we have already processed
+        //     and we just need to reserve some more space for the ones in va_args
+        // otherwise
+        //   prev_size should be zero
+        args_with_type.reserve(prev_size + length);
+
+        // iterate through the list, arg_types_term
+        ERL_NIF_TERM head, tail;
+        while (enif_get_list_cell(env_, arg_types_term, &head, &tail)) {
+            // each element in this list should be a 2-tuple
+            int arity;
+            const ERL_NIF_TERM *array;
+            if (enif_is_tuple(env_, head) && enif_get_tuple(env_, head, &arity, &array) && arity == 2) {
+                ERL_NIF_TERM arg_value = array[0];
+                ERL_NIF_TERM type_info = array[1];
+
+                // for all data types, type_info should be a map
+                //   and a `type` key must be set in type_info.
+                ERL_NIF_TERM type_term;
+                enif_get_map_value(env_, type_info, enif_make_atom(env_, "type"), &type_term);
+
+                std::string arg_type_str;
+                if (erlang::nif::get_atom(env_, type_term, arg_type_str)
+                    || erlang::nif::get(env_, type_term, arg_type_str)) {
+                    // when `type_term` is either a binary (i.e., String.t()) or an atom
+                    // for example,
+                    //   most basic types:
+                    //     {arg_value, %{type: type_term}}
+                    //   nd-array types:
+                    //     {arg_value, %{type: type_term, size: size_term}}
+
+                    // ignore error as `size` will stay 0
+                    // if key `size` is not in the map type_info
+                    // (which means this arg_value is not a nd-array)
+                    uint64_t size = 0;
+                    ERL_NIF_TERM size_term;
+                    if (enif_get_map_value(env_, type_info, enif_make_atom(env_, "size"), &size_term)) {
+                        erlang::nif::get_uint64(env_, size_term, &size);
+                    }
+
+                    // minimum type info is obtained
+                    // append it to the array
+                    args_with_type.emplace_back(std::make_shared<FFIArgType>(arg_value, type_term, arg_type_str, size, type_info));
+                    auto &arg_with_type = args_with_type[args_with_type.size() - 1];
+
+                    // check if we need to pass it by address
+                    //   for exmaple,
+                    //     {arg_value, %{type: type_term, addr: true}}
+                    // by default, the implementation in Otter.Nif will remove the `addr` entry
+                    //   if an argument is set to passing by ref or by value.
+                    //   therefore, if the `addr` entry appeared in the type_info map
+                    //     the value must be `true`.
+                    bool pass_by_addr = false;
+                    ERL_NIF_TERM addr_term;
+                    if (enif_get_map_value(env_, type_info, enif_make_atom(env_, "addr"), &addr_term)) {
+                        arg_with_type->pass_by = FFIArgType::ADDR;
+                    }
+
+                    // check if we should fetch the new value of the current argument
+                    //   for exmaple,
+                    //     {arg_value, %{type: type_term, addr: true, out: true}}
+                    //     {arg_value, %{type: type_term, ref: true, out: true}}
+                    // same as the `addr` above, if `out` was presented in the map
+                    // it must be `true`
+                    bool is_out = false;
+                    ERL_NIF_TERM out_term;
+                    if (enif_get_map_value(env_, type_info, enif_make_atom(env_, "out"), &out_term)) {
+                        arg_with_type->is_out = true;
+                    }
+
+                    set_basic_ffi_arg_type(arg_with_type);
+                    arg_types_term = tail;
+                } else if (is_struct_array_type(type_term)) {
+                    // {arg_value, %{type: {:struct_array, {:struct, id, fields}}}}
+                    const ERL_NIF_TERM *struct_array_type;
+                    enif_get_tuple(env_, type_term, &arity, &struct_array_type);
+                    args_with_type.emplace_back(std::make_shared<FFIArgType>(arg_value, struct_array_type[1], "struct_array", 0, type_info));
+                    ERL_NIF_TERM out_term;
+                    if (enif_get_map_value(env_, type_info, enif_make_atom(env_, "out"), &out_term)) {
+                        args_with_type.back()->is_out = true;
+                    }
+                    arg_types_term = tail;
+                } else if (enif_is_tuple(env_, type_term)) {
+                    auto struct_type = create_from_tuple(type_term, error_msg);
+                    if (struct_type) {
+                        args_with_type.emplace_back(std::make_shared<FFIArgType>(arg_value, type_term, struct_type->struct_id, 0, enif_make_atom(env_, "nil")));
+                        struct_wrapper.push_back(struct_type);
+                        arg_types_term = tail;
+                    } else {
+                        error_msg = "cannot parse type";
+                        return false;
+                    }
+                } else {
+                    auto struct_type = create_from_tuple(type_info, error_msg);
+                    if (struct_type) {
+                        args_with_type.emplace_back(std::make_shared<FFIArgType>(arg_value, type_info, struct_type->struct_id, 0, enif_make_atom(env_, "nil")));
+                        struct_wrapper.push_back(struct_type);
+                        arg_types_term = tail;
+                    } else {
+                        error_msg = "cannot parse type";
+                        return false;
+                    }
+                }
+            } else {
+                error_msg = "each element in args_with_type should be a tuple: {arg_value, type_info}";
+                return false;
+            }
+        }
+
+        // verify that we do have `length` new arguments parsed
+        if ((args_with_type.size() - prev_size) == length) {
+            return true;
+        } else {
+            error_msg = std::string(__PRETTY_FUNCTION__) + ": expected " + std::to_string(length) + " arguments to be parsed, however, only " + std::to_string(args_with_type.size() - prev_size) + " arguments were successfully parsed";
+            return false;
+        }
+    }
+
+    /// libffi type of a type tag that `_process_plain_va_args` handles, or nullptr
+    /// `cstring` is reported as `ffi_type_void`, which is never the type of an argument
+    static ffi_type * plain_va_arg_type(ErlNifEnv *env, ERL_NIF_TERM type_term) {
+        static const struct {
+            const char *name;
+            ffi_type *type;
+        } plain_types[] = {
+            {"u8", &ffi_type_uint8},   {"u16", &ffi_type_uint16},
+            {"u32", &ffi_type_uint32}, {"u64", &ffi_type_uint64},
+            {"s8", &ffi_type_sint8},   {"s16", &ffi_type_sint16},
+            {"s32", &ffi_type_sint32}, {"s64", &ffi_type_sint64},
+            {"f32", &ffi_type_float},  {"f64", &ffi_type_double},
+            {"c_ptr", &ffi_type_pointer}, {"cstring", &ffi_type_void},
+        };
+
+        // the type is an atom, or a string when it comes from `as_type/2` with a string
+        char name[8];
+        ErlNifBinary binary;
+        if (enif_get_atom(env, type_term, name, sizeof(name), ERL_NIF_LATIN1) <= 0) {
+            if (!(enif_inspect_binary(env, type_term, &binary) && binary.size < sizeof(name))) {
+                return nullptr;
+            }
+            memcpy(name, binary.data, binary.size);
+            name[binary.size] = '\0';
+        }
+        for (auto &plain_type : plain_types) {
+            if (strcmp(name, plain_type.name) == 0) return plain_type.type;
+        }
+        return nullptr;
+    }
+
+    /// Direct path for va_args where every element has the shape generated by `as_type/2`,
+    /// i.e., `{arg_value, %{type: type_term}}` with a basic type and nothing else in the map.
+    /// `c_ptr` values should be integers or binaries.
+    ///
+    /// The values are stored and `args` is set to the static libffi types without creating
+    /// an FFIArgType for each argument, so their entries in `args_with_type_` stay empty.
+    /// @param va_args_term The va_args list
+    /// @param va_arg_index Index of the first variadic argument
+    /// @return false if the general parser `_get_args_with_type` should be used instead
+    bool _process_plain_va_args(ERL_NIF_TERM va_args_term, size_t va_arg_index, std::string &error_msg) {
+        unsigned int length;
+        if (!enif_get_list_length(env_, va_args_term, &length) || length == 0) {
+            return false;
+        }
+
+        size_t total_args = va_arg_index + length;
+        void * new_args = realloc((void *)args, sizeof(ffi_type *) * total_args);
+        if (new_args == nullptr) {
+            return false;
+        }
+        args = (ffi_type **)new_args;
+
+        // check every element before storing any value
+        ERL_NIF_TERM type_key = enif_make_atom(env_, "type");
+        ERL_NIF_TERM list = va_args_term, head, tail;
+        for (size_t i = va_arg_index; enif_get_list_cell(env_, list, &head, &tail); ++i, list = tail) {
+            int arity;
+            const ERL_NIF_TERM *array;
+            size_t map_size = 0;
+            ERL_NIF_TERM type_term;
+            uint64_t ptr;
+            if (!(enif_get_tuple(env_, head, &arity, &array) && arity == 2 &&
+                  enif_get_map_size(env_, array[1], &map_size) && map_size == 1 &&
+                  enif_get_map_value(env_, array[1], type_key, &type_term) &&
+                  (args[i] = plain_va_arg_type(env_, type_term)) != nullptr)) {
+                return false;
+            }
+            if (args[i] == &ffi_type_pointer &&
+                !(enif_is_binary(env_, array[0]) || erlang::nif::get_uint64(env_, array[0], &ptr))) {
+                return false;
+            }
+        }
+
+        list = va_args_term;
+        for (size_t i = va_arg_index; enif_get_list_cell(env_, list, &head, &tail); ++i, list = tail) {
+            int arity;
+            const ERL_NIF_TERM *array;
+            enif_get_tuple(env_, head, &arity, &array);
+            ffi_type *type = args[i];
+            ERL_NIF_TERM value = array[0];
+            bool ok = false;
+            if (type == &ffi_type_void) ok = handle_cstring_arg(value, i, error_msg);
+            else if (type == &ffi_type_pointer) ok = set_plain_c_ptr(value, i);
+            else if (type == &ffi_type_uint8) ok = set_plain_arg<uint8_t, unsigned int>(erlang::nif::get_uint, value, i);
+            else if (type == &ffi_type_uint16) ok = set_plain_arg<uint16_t, unsigned int>(erlang::nif::get_uint, value, i);
+            else if (type == &ffi_type_uint32) ok = set_plain_arg<uint32_t, unsigned int>(erlang::nif::get_uint, value, i);
+            else if (type == &ffi_type_uint64) ok = set_plain_arg<uint64_t, uint64_t>(erlang::nif::get_uint64, value, i);
+            else if (type == &ffi_type_sint8) ok = set_plain_arg<int8_t, int>(erlang::nif::get_sint, value, i);
+            else if (type == &ffi_type_sint16) ok = set_plain_arg<int16_t, int>(erlang::nif::get_sint, value, i);
+            else if (type == &ffi_type_sint32) ok = set_plain_arg<int32_t, int>(erlang::nif::get_sint, value, i);
+            else if (type == &ffi_type_sint64) ok = set_plain_arg<int64_t, int64_t>(erlang::nif::get_sint64, value, i);
+            else if (type == &ffi_type_float) ok = set_plain_arg<float, double>(erlang::nif::get_f64, value, i);
+            else if (type == &ffi_type_double) ok = set_plain_arg<double, double>(erlang::nif::get_f64, value, i);
+            if (!ok) {
+                // the general path reports the error
+                error_msg.clear();
+                return false;
+            }
+        }
+
+        args_with_type_.resize(total_args);
+        return true;
+    }
+
+    /// Store the value of a plain va_args `c_ptr`, an address or a binary
+    bool set_plain_c_ptr(ERL_NIF_TERM term, size_t arg_index) {
+        ErlNifBinary binary;
+        uint64_t ptr;
+        void *value = nullptr;
+        if (enif_inspect_binary(env_, term, &binary)) {
+            value = binary.data;
+        } else if (erlang::nif::get_uint64(env_, term, &ptr)) {
+            value = (void *)(uintptr_t)ptr;
+        } else {
+            return false;
+        }
+
+        auto ffi_arg_res = get_ffi_res<void *>();
+        size_t value_slot = 0;
+        if (ffi_arg_res == nullptr || !ffi_arg_res->set(value, value_slot)) {
+            return false;
+        }
+        type_index_resindex[(uint64_t)(uint64_t *)args[arg_index]][arg_index] = value_slot;
+        return true;
+    }
+
+    /// Store the value of a plain va_args argument of a basic type
+    template <typename T, typename ERL_API_T>
+    bool set_plain_arg(int(*get_nif_term_value)(ErlNifEnv *, ERL_NIF_TERM, ERL_API_T *), ERL_NIF_TERM term, size_t arg_index) {
+        ERL_API_T value;
+        auto ffi_arg_res = get_ffi_res<T>();
+        size_t value_slot = 0;
+        if (!(get_nif_term_value(env_, term, &value) && ffi_arg_res && ffi_arg_res->set((T)value, value_slot))) {
+            return false;
+        }
+        type_index_resindex[(uint64_t)(uint64_t *)args[arg_index]][arg_index] = value_slot;
+        return true;
+    }
+
+    bool _process_args_with_type(size_t &num_args_processed, size_t arg_offset, std::string &error_msg, bool allow_va_args) {
+        // `va_args` can only appear once in the last position
+        // note that `va_args` is a pseudo-type in Otter
+        //   where `va_list` is the real underlying type defined in stdarg.h
+        //   and `va_list` is the one you can pass around in C
+        bool ok = true;
+        bool last_is_va_args = false;
+        size_t arg_failed = 0;
+
+        size_t total_size = args_with_type_.size();
+        for (size_t i = arg_offset; i < total_size; ++i) {
+            if (last_is_va_args) {
+                error_msg = "va_args can only appear at the end of the input argument list";
+                ok = false;
+                break;
+            }
+
+            num_args_processed += 1;
+            arg_failed = i;
+            auto &p = args_with_type_[i];
+            if (p->is_out) {
+                out_value_indexes.push_back(i);
+            }
+
+            if (p->type == "c_ptr") {
+                if (!handle_c_ptr_arg(erlang::nif::get_sint64, p, i)) {
+                    ok = false;
+                    break;
+                }
+            } else if (p->type == "cstring") {
+                if (!handle_cstring_arg(p->term, i, error_msg)) {
+                    ok = false;
+                    break;
+                }
+            } else if (p->type == "s8") {
+                if (!handle_arg<int8_t, int>(erlang::nif::get_sint, p, i)) {
+                    ok = false;
+                    break;
+                }
+            } else if (p->type == "s16") {
+                if (!handle_arg<int16_t, int>(erlang::nif::get_sint, p, i)) {
+                    ok = false;
+                    break;
+                }
+            } else if (p->type == "s32") {
+                if (!handle_arg<int32_t, int>(erlang::nif::get_sint, p, i)) {
+                    ok = false;
+                    break;
+                }
+            } else if (p->type == "s64") {
+                if (!handle_arg<int64_t, int64_t>(erlang::nif::get_sint64, p, i)) {
+                    ok = false;
+                    break;
+                }
+            } else if (p->type == "u8") {
+                if (!handle_arg<uint8_t, unsigned int>(erlang::nif::get_uint, p, i)) {
+                    ok = false;
+                    break;
+                }
+            } else if (p->type == "u16") {
+                if (!handle_arg<uint16_t, unsigned int>(erlang::nif::get_uint, p, i)) {
+                    ok = false;
+                    break;
+                }
+            } else if (p->type == "u32") {
+                if (!handle_arg<uint32_t, unsigned int>(erlang::nif::get_uint, p, i)) {
+                    ok = false;
+                    break;
+                }
+            } else if (p->type == "u64") {
+                if (!handle_arg<uint64_t, uint64_t>(erlang::nif::get_uint64, p, i)) {
+                    ok = false;
+                    break;
+                }
+            } else if (p->type == "f32") {
+                if (!handle_arg<float, double>(erlang::nif::get_f64, p, i)) {
+                    ok = false;
+                    break;
+                }
+            } else if (p->type == "f64") {
+                if (!handle_arg<double, double>(erlang::nif::get_f64, p, i)) {
+                    ok = false;
+                    break;
+                }
+            } else if (p->type == "struct_array") {
+                if (!handle_struct_array_arg(p, i, error_msg)) {
+                    ok = false;
+                    break;
+                }
+            } else if (p->type == "va_args") {
+                if (allow_va_args) {
+                    // notes:
+                    //  - `error_msg` will be set in handle_va_args
+                    //  - `args` will be realloc'ed in handle_va_args
+                    if (!handle_va_args(p, i, error_msg)) {
+                        ok = false;
+                        break;
+                    } else {
+                        last_is_va_args = true;
+                        num_args_processed -= 1;
+                    }
+                } else {
+                    error_msg = "type :va_args only allow to appear once as the type of the last argument";
+                    ok = false;
+                    break;
+                }
+            } else {
+                auto wrapper_it = create_from_tuple(p->type_term, error_msg);
+                if (wrapper_it != nullptr) {
+                    args[i] = &wrapper_it->ffi_struct_type;
+                    // https://www.erlang.org/doc/man/erl_nif.html#enif_get_resource
+                    // enif_get_resource does not add a reference to the resource object.
+                    // However, the pointer received in *objp is guaranteed to be valid
+                    // at least as long as the resource handle term is valid.
+                    void *resource_obj_ptr = nullptr;
+                    size_t resource_size = 0;
+                    if (!get_struct_data(env_, p->term, wrapper_it->resource_type, wrapper_it->struct_id, resource_obj_ptr, resource_size)) {
+                        error_msg = "failed to get resource for struct: " + wrapper_it->struct_id;
+                        ok = false;
+                        break;
+                    }
+                    p->is_struct_instance = true;
+                    p->struct_data = resource_obj_ptr;
+
+                    struct_wrapper.push_back(wrapper_it);
+                } else {
+                    // todo: other types
+                    error_msg = std::string(__PRETTY_FUNCTION__) + ": not implemented for type: " + p->type;
+                    ok = false;
+                    break;
+                }
+            }
+        }
+
+        if (!ok) {
+            if (error_msg.empty()) {
+                error_msg = "failed to process argument at index " + std::to_string(arg_failed);
+            }
+        }
+        return ok;
+    }
+
+    /// Pass a binary as a NUL-terminated string
+    ///
+    /// A binary that already ends with NUL is passed as it is, otherwise it is copied
+    /// into the scratch arena of this call with a NUL appended. `nil` and `:NULL` are passed as NULL.
+    bool handle_cstring_arg(ERL_NIF_TERM term, size_t arg_index, std::string &error_msg) {
+        ErlNifBinary binary;
+        std::string null_str;
+        const char *str = nullptr;
+        if (enif_inspect_binary(env_, term, &binary)) {
+            if (binary.size > 0 && binary.data[binary.size - 1] == '\0') {
+                str = (const char *)binary.data;
+            } else {
+                char *copy = (char *)scratch.allocate(binary.size + 1);
+                if (copy == nullptr) {
+                    error_msg = "cannot allocate memory for cstring";
+                    return false;
+                }
+                memcpy(copy, binary.data, binary.size);
+                copy[binary.size] = '\0';
+                str = copy;
+            }
+        } else if (!(erlang::nif::get_atom(env_, term, null_str) && (null_str == "NULL" || null_str == "nil"))) {
+            error_msg = "expecting a binary or nil for cstring argument at index " + std::to_string(arg_index);
+            return false;
+        }
+
+        auto ffi_arg_res = get_ffi_res<void *>();
+        size_t value_slot = 0;
+        args[arg_index] = &ffi_type_pointer;
+        if (ffi_arg_res == nullptr || !ffi_arg_res->set((void *)str, value_slot)) {
+            return false;
+        }
+        type_index_resindex[(uint64_t)(uint64_t *)args[arg_index]][arg_index] = value_slot;
+        return true;
+    }
+
+    bool is_struct_array_type(ERL_NIF_TERM type_term) {
+        int arity;
+        const ERL_NIF_TERM *array;
+        std::string tag;
+        return enif_get_tuple(env_, type_term, &arity, &array) && arity == 2 &&
+            erlang::nif::get_atom(env_, array[0], tag) && tag == "struct_array";
+    }
+
+    /// Pass a list of struct instances, or a binary of packed structs, as a pointer to a contiguous array
+    ///
+    /// Out arrays are built in a binary that is returned as the out value.
+    bool handle_struct_array_arg(std::shared_ptr<FFIArgType> &p, size_t arg_index, std::string &error_msg) {
+        auto layout = StructLayout::get(env_, p->type_term, error_msg);
+        if (layout == nullptr) {
+            return false;
+        }
+        if (layout->size == 0) {
+            error_msg = "cannot pass an array of empty structs: " + layout->struct_id;
+            return false;
+        }
+
+        ErlNifBinary packed;
+        bool is_packed = enif_inspect_binary(env_, p->term, &packed);
+        unsigned int list_length = 0;
+        size_t count = 0;
+        if (is_packed) {
+            if (packed.size % layout->size != 0) {
+                error_msg = "binary size is not a multiple of the size of struct " + layout->struct_id;
+                return false;
+            }
+            count = packed.size / layout->size;
+        } else if (enif_get_list_length(env_, p->term, &list_length)) {
+            count = list_length;
+        } else {
+            error_msg = "expecting a list of struct instances or a binary of packed structs";
+            return false;
+        }
+        size_t bytes = count * layout->size;
+
+        void *data = nullptr;
+        if (is_packed && !p->is_out && (uintptr_t)packed.data % layout->alignment == 0) {
+            // pass the binary as it is
+            data = packed.data;
+        } else if (p->is_out) {
+            if (!memory_accounting.charge(MemoryAccounting::OUT_BUFFER, bytes)) {
+                budget_exceeded = true;
+                error_msg = "native memory budget exceeded";
+                return false;
+            }
+            if (!enif_alloc_binary(bytes, &p->out_buffer)) {
+                memory_accounting.release(MemoryAccounting::OUT_BUFFER, bytes);
+                error_msg = "cannot allocate memory for struct array";
+                return false;
+            }
+            p->out_buffer_owned = true;
+            p->is_out_buffer = true;
+            data = p->out_buffer.data;
+        } else {
+            if (bytes >= StructArrayArena::threshold && (data = StructArrayArena::acquire(bytes)) != nullptr) {
+                p->array_in_arena = true;
+            } else if (bytes > 0 && (data = malloc(bytes)) == nullptr) {
+                error_msg = "cannot allocate memory for struct array";
+                return false;
+            }
+            p->array_data = p->array_in_arena ? nullptr : data;
+        }
+
+        if (is_packed && data != packed.data) {
+            memcpy(data, packed.data, bytes);
+        } else if (!is_packed) {
+            auto resource_type = FFIStructTypeWrapper::get_ffi_struct_resource_type(env_, layout->struct_id);
+            ERL_NIF_TERM head, tail = p->term;
+            uint8_t *dst = (uint8_t *)data;
+            while (enif_get_list_cell(env_, tail, &head, &tail)) {
+                void *instance = nullptr;
+                size_t instance_size = 0;
+                if (!get_struct_data(env_, head, resource_type, layout->struct_id, instance, instance_size) ||
+                    instance_size < layout->size) {
+                    error_msg = "failed to get resource for struct: " + layout->struct_id;
+                    return false;
+                }
+                memcpy(dst, instance, layout->size);
+                dst += layout->size;
+            }
+        }
+
+        auto ffi_arg_res = get_ffi_res<void *>();
+        size_t value_slot = 0;
+        args[arg_index] = &ffi_type_pointer;
+        if (ffi_arg_res == nullptr || !ffi_arg_res->set(data, value_slot)) {
+            return false;
+        }
+        type_index_resindex[(uint64_t)(uint64_t *)args[arg_index]][arg_index] = value_slot;
+        return true;
+    }
+
+    bool handle_c_ptr_arg(int(*get_nif_term_value)(ErlNifEnv *, ERL_NIF_TERM, int64_t *), std::shared_ptr<FFIArgType> &p, size_t arg_index) {
+        auto ffi_arg_res = get_ffi_res<void *>();
+        // if enif_inspect_binary succeeded,
+        // `binary.data` will live until we return to erlang
+        ErlNifBinary binary;
+        uint64_t ptr;
+        size_t value_slot = 0;
+        std::string null_c_ptr;
+
+        // it could be a function pointer
+        OtterSymbol * symbol_res = nullptr;
+        OtterMmap * mmap_res = nullptr;
+        OtterPointer * pointer_res = nullptr;
+        OtterOwnedPointer * owned_res = nullptr;
+        OtterRing * ring_res = nullptr;
+        if (enif_get_resource(env_, p->term, OtterSymbol::type, (void **)&symbol_res) && symbol_res) {
+            // do not check if the symbol is a nullptr
+            // because it might be intended value for the function to be called
+            void * func_ptr = symbol_res->val;
+            args[arg_index] = &ffi_type_pointer;
+            if (ffi_arg_res == nullptr || !ffi_arg_res->set(func_ptr, value_slot)) {
+                return false;
+            }
+            type_index_resindex[(uint64_t)(uint64_t *)args[arg_index]][arg_index] = value_slot;
+        } else if (enif_get_resource(env_, p->term, OtterMmap::type, (void **)&mmap_res) && mmap_res) {
+            // memory-mapped file region, pass its address without copying
+            if (mmap_res->val.unmapped) {
+                return false;
+            }
+            args[arg_index] = &ffi_type_pointer;
+            if (ffi_arg_res == nullptr || !ffi_arg_res->set(mmap_res->val.addr, value_slot)) {
+                return false;
+            }
+            type_index_resindex[(uint64_t)(uint64_t *)args[arg_index]][arg_index] = value_slot;
+        } else if (enif_get_resource(env_, p->term, OtterPointer::type, (void **)&pointer_res) && pointer_res) {
+            if (pointer_res->val.region && pointer_res->val.region->val.unmapped) {
+                return false;
+            }
+            args[arg_index] = &ffi_type_pointer;
+            if (ffi_arg_res == nullptr || !ffi_arg_res->set(pointer_res->val.addr, value_slot)) {
+                return false;
+            }
+            type_index_resindex[(uint64_t)(uint64_t *)args[arg_index]][arg_index] = value_slot;
+        } else if (enif_get_resource(env_, p->term, OtterOwnedPointer::type, (void **)&owned_res) && owned_res) {
+            void *owned_ptr = owned_res->val.ptr.load();
+            if (owned_ptr == nullptr) {
+                // already released
+                return false;
+            }
+            args[arg_index] = &ffi_type_pointer;
+            if (ffi_arg_res == nullptr || !ffi_arg_res->set(owned_ptr, value_slot)) {
+                return false;
+            }
+            type_index_resindex[(uint64_t)(uint64_t *)args[arg_index]][arg_index] = value_slot;
+        } else if (enif_get_resource(env_, p->term, OtterRing::type, (void **)&ring_res) && ring_res) {
+            if (ring_res->val == nullptr || ring_res->val->closed) {
+                return false;
+            }
+            args[arg_index] = &ffi_type_pointer;
+            if (ffi_arg_res == nullptr || !ffi_arg_res->set(ring_res->val->ring, value_slot)) {
+                return false;
+            }
+            type_index_resindex[(uint64_t)(uint64_t *)args[arg_index]][arg_index] = value_slot;
+        } else if (enif_is_tuple(env_, p->term)) {
+            if (!prepare_out_buffer(p, arg_index)) {
+                return false;
+            }
+            args[arg_index] = &ffi_type_pointer;
+            if (ffi_arg_res == nullptr || !ffi_arg_res->set(p->out_buffer.data, value_slot)) {
+                return false;
+            }
+            type_index_resindex[(uint64_t)(uint64_t *)args[arg_index]][arg_index] = value_slot;
+        } else if (enif_inspect_binary(env_, p->term, &binary)) {
+            args[arg_index] = &ffi_type_pointer;
+            if (ffi_arg_res == nullptr || !ffi_arg_res->set(binary.data, value_slot)) {
+                return false;
+            }
+            type_index_resindex[(uint64_t)(uint64_t *)args[arg_index]][arg_index] = value_slot;
+        } else if (erlang::nif::get_atom(env_, p->term, null_c_ptr) &&
+                   (null_c_ptr == "NULL" || null_c_ptr == "nil")) {
+            args[arg_index] = &ffi_type_pointer;
+            if (ffi_arg_res == nullptr || !ffi_arg_res->set(nullptr, value_slot)) {
+                return false;
+            }
+            type_index_resindex[(uint64_t)(uint64_t *)args[arg_index]][arg_index] = value_slot;
+        } else if (erlang::nif::get_uint64(env_, p->term, &ptr)) {
+            args[arg_index] = &ffi_type_pointer;
+            if (ffi_arg_res == nullptr || !ffi_arg_res->set((void *)(uint64_t *)(ptr), value_slot)) {
+                return false;
+            }
+            type_index_resindex[(uint64_t)(uint64_t *)args[arg_index]][arg_index] = value_slot;
+        } else {
+            return false;
+        }
+        return handle_pass_by_addr<void *>(ffi_arg_res, value_slot, p, arg_index);
+    }
+
+    /// Allocate the binary for an out buffer argument
+    ///   {:out_buffer, size}
+    ///   {:out_buffer, size, :return_value}
+    ///   {:out_buffer, size, {:arg, index}}
+    bool prepare_out_buffer(std::shared_ptr<FFIArgType> &p, size_t arg_index) {
+        int arity;
+        const ERL_NIF_TERM *array;
+        std::string tag;
+        uint64_t size;
+        if (!(enif_get_tuple(env_, p->term, &arity, &array) && (arity == 2 || arity == 3) &&
+              erlang::nif::get_atom(env_, array[0], tag) && tag == "out_buffer" &&
+              erlang::nif::get_uint64(env_, array[1], &size))) {
+            return false;
+        }
+
+        if (arity == 3) {
+            std::string length_from;
+            int length_arg_arity;
+            const ERL_NIF_TERM *length_arg;
+            uint64_t length_arg_index;
+            if (erlang::nif::get_atom(env_, array[2], length_from) && length_from == "return_value") {
+                p->out_buffer_length_from = FFIArgType::RETURN_VALUE;
+            } else if (enif_get_tuple(env_, array[2], &length_arg_arity, &length_arg) && length_arg_arity == 2 &&
+                       erlang::nif::get_atom(env_, length_arg[0], length_from) && length_from == "arg" &&
+                       erlang::nif::get_uint64(env_, length_arg[1], &length_arg_index) &&
+                       length_arg_index != arg_index) {
+                p->out_buffer_length_from = FFIArgType::ARG_VALUE;
+                p->out_buffer_length_arg = (size_t)length_arg_index;
+            } else {
+                return false;
+            }
+        }
+
+        if (!memory_accounting.charge(MemoryAccounting::OUT_BUFFER, (size_t)size)) {
+            budget_exceeded = true;
+            return false;
+        }
+        if (!enif_alloc_binary((size_t)size, &p->out_buffer)) {
+            memory_accounting.release(MemoryAccounting::OUT_BUFFER, (size_t)size);
+            return false;
+        }
+        p->out_buffer_owned = true;
+        p->is_out_buffer = true;
+        if (!p->is_out) {
+            p->is_out = true;
+            out_value_indexes.push_back(arg_index);
+        }
+        return true;
+    }
+
+    template <
+        typename T,
+        typename ERL_API_T=T,
+        typename get_nif_term_func = int(*)(ErlNifEnv *, ERL_NIF_TERM, ERL_API_T*)>
+    bool handle_arg(
+        get_nif_term_func get_nif_term_value,
+        std::shared_ptr<FFIArgType> &p,
+        size_t arg_index,
+        T _unused=0) {
+        ERL_API_T value;
+        if (args != nullptr && get_nif_term_value(env_, p->term, &value)) {
+            args[arg_index] = get_default_ffi_type<T>();
+            auto ffi_arg_res = get_ffi_res<T>();
+            size_t value_slot = 0;
+            if (ffi_arg_res && ffi_arg_res->set((T)value, value_slot)) {
+                type_index_resindex[(uint64_t)(uint64_t *)args[arg_index]][arg_index] = value_slot;
+                return handle_pass_by_addr<T>(ffi_arg_res, value_slot, p, arg_index);
+            } else {
+                printf("[debug] cannot save value for %s to ffi_arg_res\r\n", p->type.c_str());
+                return false;
+            }
+        } else {
+            printf("[debug] cannot get value for %s\r\n", p->type.c_str());
+            return false;
+        }
+    }
+
+    bool handle_va_args(std::shared_ptr<FFIArgType> &va_args, size_t va_arg_index, std::string &error_msg) {
+        // va_args.term should be a list of 2-tuples like
+        //   {value, %{type: TYPE, extra: EXTRA}}
+
+        // call pop_back because the last one is :va_args
+        std::shared_ptr<FFIArgType> this_va_args = va_args;
+        args_with_type_.pop_back();
+        if (_process_plain_va_args(this_va_args->term, va_arg_index, error_msg)) {
+            return true;
+        }
+        if (_get_args_with_type(this_va_args->term, va_arg_index, args_with_type_, error_msg)) {
+            size_t total_args = args_with_type_.size();
+            void * new_args = realloc((void *)args, sizeof(ffi_type *) * total_args);
+            if (new_args == nullptr) {
+                error_msg = "cannot allocate enough memory for function arguments";
+                return false;
+            }
+            args = (ffi_type **)new_args;
+
+            size_t num_var_args = 0;
+
+            return _process_args_with_type(num_var_args, va_arg_index, error_msg, false);
+        } else {
+            error_msg = "failed to parse argument types in va_args";
+            return false;
+        }
+    }
+
+    template <typename T>
+    bool handle_pass_by_addr(
+        FFIResource<T> * ffi_arg_res,
+        size_t value_slot,
+        std::shared_ptr<FFIArgType> &p,
+        size_t arg_index)
+    {
+        p->ffi_arg_type_original = p->ffi_arg_type;
+        p->value_slot_original = value_slot;
+
+        if (p->pass_by == FFIArgType::ADDR) {
+            args[arg_index] = get_default_ffi_type<void *>();
+            auto ffi_arg_by_addr_res = get_ffi_res<void *>();
+            void * res_address = nullptr;
+            if (ffi_arg_res && ffi_arg_by_addr_res &&
+                ffi_arg_res->get(value_slot, res_address) &&
+                ffi_arg_by_addr_res->set(res_address, value_slot)) {
+
+                p->ffi_arg_type = std::make_shared<ffi_type>();
+                copy_ffi_type(p->ffi_arg_type, ffi_type_pointer);
+                p->value_slot = value_slot;
+
+                type_index_resindex[(uint64_t)(uint64_t *)args[arg_index]][arg_index] = value_slot;
+                return true;
+            } else {
+                return false;
+            }
+        } else {
+            p->value_slot = value_slot;
+        }
+        return true;
+    }
+
+    bool handle_out_values(std::shared_ptr<FFIArgType> &p, ERL_NIF_TERM &out_term, std::string &out_error) {
+        bool ok = false;
+        out_error = "not implemented for type " + p->type;
+        if (p->type == "c_ptr" || p->type == "struct_array") {
+            if (p->is_out_buffer) {
+                ok = handle_out_buffer(p, out_term, out_error);
+            } else {
+                // need to handle pointers with care
+                // copy data, but how many bytes should we copy?
+            }
+        } else if (p->type == "s8") {
+            ok = handle_out_values<int8_t, int32_t>(enif_make_int, p, out_term, out_error);
+        } else if (p->type == "s16") {
+            ok = handle_out_values<int16_t, int32_t>(enif_make_int, p, out_term, out_error);
+        } else if (p->type == "s32") {
+            ok = handle_out_values<int32_t, int32_t>(enif_make_int, p, out_term, out_error);
+        } else if (p->type == "s64") {
+            ok = handle_out_values<int64_t, int64_t>(enif_make_long, p, out_term, out_error);
+        } else if (p->type == "u8") {
+            ok = handle_out_values<uint8_t, uint32_t>(enif_make_uint, p, out_term, out_error);
+        } else if (p->type == "u16") {
+            ok = handle_out_values<uint16_t, uint32_t>(enif_make_uint, p, out_term, out_error);
+        } else if (p->type == "u32") {
+            ok = handle_out_values<uint32_t, uint32_t>(enif_make_uint, p, out_term, out_error);
+        } else if (p->type == "u64") {
+            ok = handle_out_values<uint64_t, uint64_t>(enif_make_ulong, p, out_term, out_error);
+        } else if (p->type == "f32") {
+            ok = handle_out_values<float, double>(enif_make_double, p, out_term, out_error);
+        } else if (p->type == "f64") {
+            ok = handle_out_values<double, double>(enif_make_double, p, out_term, out_error);
+        } else {
+            bool is_struct = false;
+            if (is_struct) {
+                // todo: struct
+            } else {
+                // todo: other types
+                printf("[debug] type: %s\r\n", p->type.c_str());
+            }
+            ok = false;
+        }
+        return ok;
+    }
+
+    template <typename T, typename ERL_API_T=T, typename make_nif_term_func = ERL_NIF_TERM(*)(ErlNifEnv *, ERL_API_T)>
+    bool handle_out_values(
+        make_nif_term_func make_term,
+        std::shared_ptr<FFIArgType> &p,
+        ERL_NIF_TERM &out_term,
+        std::string &out_error)
+    {
+        auto ffi_arg_res = get_ffi_res<T>();
+        T value;
+        if (ffi_arg_res && ffi_arg_res->get_value(p->value_slot_original, value)) {
+            out_term = make_term(env_, value);
+            return true;
+        } else {
+            out_error = "cannot get original argument storage";
+            return false;
+        }
+    }
+
+    bool handle_out_buffer(std::shared_ptr<FFIArgType> &p, ERL_NIF_TERM &out_term, std::string &out_error) {
+        if (!p->out_buffer_owned) {
+            out_error = "out buffer has been released";
+            return false;
+        }
+
+        int64_t length = (int64_t)p->out_buffer.size;
+        if (p->out_buffer_length_from == FFIArgType::RETURN_VALUE) {
+            if (!get_integer_return_value(length)) {
+                out_error = "cannot get buffer length from the return value";
+                return false;
+            }
+        } else if (p->out_buffer_length_from == FFIArgType::ARG_VALUE) {
+            if (!get_integer_arg_value(p->out_buffer_length_arg, length)) {
+                out_error = "cannot get buffer length from argument at index " + std::to_string(p->out_buffer_length_arg);
+                return false;
+            }
+        }
+
+        // negative values are usually errors, e.g., read(2) returns -1
+        if (length < 0) {
+            length = 0;
+        }
+        size_t charged = p->out_buffer.size;
+        if ((uint64_t)length < p->out_buffer.size && !enif_realloc_binary(&p->out_buffer, (size_t)length)) {
+            out_error = "cannot shrink out buffer";
+            return false;
+        }
+
+        // ownership of the binary goes to erlang
+        out_term = enif_make_binary(env_, &p->out_buffer);
+        p->out_buffer_owned = false;
+        memory_accounting.release(MemoryAccounting::OUT_BUFFER, charged);
+        return true;
+    }
+
+    bool get_integer_return_value(int64_t &value) {
+        if (rc == nullptr || struct_return_type) return false;
+        if (return_type == "u8") {
+            value = *(uint8_t *)rc;
+        } else if (return_type == "s8") {
+            value = *(int8_t *)rc;
+        } else if (return_type == "u16") {
+            value = *(uint16_t *)rc;
+        } else if (return_type == "s16") {
+            value = *(int16_t *)rc;
+        } else if (return_type == "u32") {
+            value = *(uint32_t *)rc;
+        } else if (return_type == "s32") {
+            value = *(int32_t *)rc;
+        } else if (return_type == "u64") {
+            value = (int64_t)*(uint64_t *)rc;
+        } else if (return_type == "s64") {
+            value = *(int64_t *)rc;
+        } else {
+            return false;
+        }
+        return true;
+    }
+
+    /// Value of the integer argument at `index` after the call
+    bool get_integer_arg_value(size_t index, int64_t &value) {
+        if (index >= args_with_type_.size()) {
+            return false;
+        }
+        if (args_with_type_[index]) {
+            return get_integer_arg_value(args_with_type_[index], value);
+        }
+
+        // plain va_args, see `_process_plain_va_args`
+        auto type = args[index];
+        auto it = type_index_resindex.find((uint64_t)(uint64_t *)type);
+        if (it == type_index_resindex.end() || it->second.find(index) == it->second.end()) {
+            return false;
+        }
+        size_t slot = it->second[index];
+        if (type == &ffi_type_uint8) return get_integer_slot_value<uint8_t>(slot, value);
+        if (type == &ffi_type_sint8) return get_integer_slot_value<int8_t>(slot, value);
+        if (type == &ffi_type_uint16) return get_integer_slot_value<uint16_t>(slot, value);
+        if (type == &ffi_type_sint16) return get_integer_slot_value<int16_t>(slot, value);
+        if (type == &ffi_type_uint32) return get_integer_slot_value<uint32_t>(slot, value);
+        if (type == &ffi_type_sint32) return get_integer_slot_value<int32_t>(slot, value);
+        if (type == &ffi_type_uint64) return get_integer_slot_value<uint64_t>(slot, value);
+        if (type == &ffi_type_sint64) return get_integer_slot_value<int64_t>(slot, value);
+        return false;
+    }
+
+    bool get_integer_arg_value(std::shared_ptr<FFIArgType> &p, int64_t &value) {
+        if (p->type == "u8") {
+            return get_integer_arg_value<uint8_t>(p, value);
+        } else if (p->type == "s8") {
+            return get_integer_arg_value<int8_t>(p, value);
+        } else if (p->type == "u16") {
+            return get_integer_arg_value<uint16_t>(p, value);
+        } else if (p->type == "s16") {
+            return get_integer_arg_value<int16_t>(p, value);
+        } else if (p->type == "u32") {
+            return get_integer_arg_value<uint32_t>(p, value);
+        } else if (p->type == "s32") {
+            return get_integer_arg_value<int32_t>(p, value);
+        } else if (p->type == "u64") {
+            return get_integer_arg_value<uint64_t>(p, value);
+        } else if (p->type == "s64") {
+            return get_integer_arg_value<int64_t>(p, value);
+        }
+        return false;
+    }
+
+    template <typename T>
+    bool get_integer_arg_value(std::shared_ptr<FFIArgType> &p, int64_t &value) {
+        return get_integer_slot_value<T>(p->value_slot_original, value);
+    }
+
+    template <typename T>
+    bool get_integer_slot_value(size_t slot, int64_t &value) {
+        auto ffi_arg_res = get_ffi_res<T>();
+        T arg_value;
+        if (ffi_arg_res && ffi_arg_res->get_value(slot, arg_value)) {
+            value = (int64_t)arg_value;
+            return true;
+        }
+        return false;
+    }
+
+    std::shared_ptr<FFIStructTypeWrapper> create_from_tuple(
+        ERL_NIF_TERM struct_return_type_term,
+        std::string &error_msg)
+    {
+        int arity = -1;
+        const ERL_NIF_TERM *array;
+        std::vector<std::shared_ptr<FFIArgType>> args_with_type;
+        bool is_size_correct_tuple =
+                enif_get_tuple(env_, struct_return_type_term, &arity, &array) &&
+                arity == 3;
+        std::string struct_atom;
+        std::string struct_id;
+        erlang::nif::get_atom(env_, array[0], struct_atom);
+        erlang::nif::get_atom(env_, array[1], struct_id);
+        if (!is_size_correct_tuple) {
+            return nullptr;
+        }
+
+        if (struct_atom != "struct") {
+            return nullptr;
+        }
+
+        if (_get_args_with_type(array[2], 0, args_with_type, error_msg)) {
+            auto wrapper = std::make_shared<FFIStructTypeWrapper>(args_with_type.size() + 1);
+
+            wrapper->struct_id = struct_id;
+            wrapper->resource_type = FFIStructTypeWrapper::get_ffi_struct_resource_type(env_, struct_id);
+
+            // note: wrapper will be added to `wrappers` after it is returned from this function
+            if (wrapper->resource_type) {
+                for (size_t i = 0; i < args_with_type.size(); ++i) {
+                    auto &p = args_with_type[i];
+                    wrapper->field_types.push_back(p->ffi_arg_type);
+                    wrapper->ffi_struct_type.elements[i] = wrapper->field_types[i].get();
+                }
+                wrapper->ffi_struct_type.elements[args_with_type.size()] = nullptr;
+                return wrapper;
+            } else {
+                wrapper.reset();
+                return nullptr;
+            }
+        }
+        return nullptr;
+    }
+
+    template <typename T>
+    auto get_ffi_res() -> FFIResource<T> * {
+        auto u64_type = (uint64_t)(uint64_t *)get_default_ffi_type<T>();
+        if (ffi_res.find(u64_type) != ffi_res.end()) {
+            return (FFIResource<T> *)ffi_res[u64_type];
+        } else {
+            ffi_res[u64_type] = new FFIResource<T>();
+            return (FFIResource<T> *)ffi_res[u64_type];
+        }
+    }
+
+    ErlNifEnv * env_;
+    ERL_NIF_TERM symbol_;
+    ERL_NIF_TERM return_type_;
+    ERL_NIF_TERM arg_types_term_;
+    // set if the arguments are described by a signature descriptor
+    std::shared_ptr<CallSignature> signature_;
+
+    std::vector<std::shared_ptr<FFIArgType>> args_with_type_;
+    std::vector<std::shared_ptr<FFIStructTypeWrapper>> struct_wrapper;
+
+    std::string return_type;
+    std::shared_ptr<FFIStructTypeWrapper> struct_return_type = nullptr;
+    std::shared_ptr<ArrayReturn> array_return_type = nullptr;
+    size_t num_fixed_args = 0;
+    size_t num_variadic_args = 0;
+
+    // type_index_resindex (resource pool)
+    //   key: type
+    //   value:
+    //     key: index in the above variable values
+    //     value: index in ffi_resources
+    std::map<uint64_t, std::map<size_t, size_t>> type_index_resindex;
+    std::map<uint64_t, void *> ffi_res;
+    std::vector<size_t> out_value_indexes;
+
+    ffi_cif cif;
+    std::shared_ptr<VariadicCIFCache::Entry> prepared_cif;
+    ffi_type ** args = nullptr;
+    void ** values = nullptr;
+    ffi_type * ffi_return_type = nullptr;
+    // points to `rc_inline`, or to `return_resource` for large struct returns
+    void * rc = nullptr;
+    // scalars and small structs, at least sizeof(ffi_arg)
+    uint64_t rc_inline[2];
+    // allocated before ffi_call, released by us if it is not handed over to erlang
+    void * return_resource = nullptr;
+    // same as `return_resource`, for struct types that have pooling enabled
+    void * pooled_return = nullptr;
+    MemoryAccounting::Counters * return_counters = nullptr;
+    // set when an allocation was refused by `memory_accounting`
+    bool budget_exceeded = false;
+    const std::string * return_pool_id = nullptr;
+    // NUL-terminated copies of cstring arguments
+    ScratchArena scratch;
+    // time spent in the function itself, set by `call` if `measure_native` is set
+    // and the function has been called, otherwise -1
+    bool measure_native = false;
+    int64_t native_ns = -1;
+
+    // returned strings longer than this are truncated
+    static const size_t max_cstring_length = 1 << 30;
+};
+
+// wrap a handle returned by dlopen in a resource and remember it as `key` in `opened_handles`
+static ERL_NIF_TERM make_opened_handle(ErlNifEnv *env, const std::string &key, void *handle_dl) {
+    OtterHandle *handle = nullptr;
+    bool over_budget = false;
+    if (!alloc_symbol_resource(&handle, over_budget)) {
+        dlclose(handle_dl);
+        if (over_budget) {
+            return native_memory_budget_error(env);
+        }
+        return erlang::nif::error(env, "cannot allocate memory for resource");
+    }
+    opened_handles[key] = handle;
+    handle->val = handle_dl;
+    return erlang::nif::ok(env, enif_make_resource(env, handle));
+}
+
+static ERL_NIF_TERM otter_dlopen(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[]) {
+    if (argc != 2) {
+        return enif_make_badarg(env);
+    }
+    ERL_NIF_TERM path_term = argv[0];
+    ERL_NIF_TERM mode_term = argv[1];
+
+    int mode = 0;
+    if (erlang::nif::get(env, mode_term, &mode)) {
+        std::string path;
+        const char *c_path = nullptr;
+        if (erlang::nif::get(env, path_term, path) && !path.empty()) {
+            if (path == "RTLD_SELF") {
+                c_path = nullptr;
+            } else {
+                c_path = path.c_str();
+            }
+        } else {
+            return enif_make_badarg(env);
+        }
+
+        std::lock_guard<std::mutex> g(opened_handles_lock);
+        if (opened_handles.find(path) != opened_handles.end()) {
+            ERL_NIF_TERM ret = enif_make_resource(env, opened_handles[path]);
+            return erlang::nif::ok(env, ret);
+        } else {
+            void *handle_dl = dlopen(c_path, mode);
+            if (handle_dl != nullptr) {
+                return make_opened_handle(env, path, handle_dl);
+            } else {
+                return erlang::nif::error(env, dlerror());
+            }
+        }
+    } else {
+        return erlang::nif::error(env, "cannot get dlopen mode");
+    }
+}
+
+// SHA-256 of `data` in hex, FIPS 180-4
+static std::string content_digest(const uint8_t *data, size_t size) {
+    static const uint32_t k[64] = {
+        0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+        0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+        0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+        0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+        0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+        0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+        0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+        0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+    };
+    uint32_t h[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+    };
+    auto rotr = [](uint32_t x, int n) { return (x >> n) | (x << (32 - n)); };
+    auto compress = [&](const uint8_t *block) {
+        uint32_t w[64];
+        for (int i = 0; i < 16; ++i) {
+            w[i] = ((uint32_t)block[i * 4] << 24) | ((uint32_t)block[i * 4 + 1] << 16) |
+                ((uint32_t)block[i * 4 + 2] << 8) | (uint32_t)block[i * 4 + 3];
+        }
+        for (int i = 16; i < 64; ++i) {
+            uint32_t s0 = rotr(w[i - 15], 7) ^ rotr(w[i - 15], 18) ^ (w[i - 15] >> 3);
+            uint32_t s1 = rotr(w[i - 2], 17) ^ rotr(w[i - 2], 19) ^ (w[i - 2] >> 10);
+            w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+        }
+        uint32_t a = h[0], b = h[1], c = h[2], d = h[3], e = h[4], f = h[5], g = h[6], hh = h[7];
+        for (int i = 0; i < 64; ++i) {
+            uint32_t t1 = hh + (rotr(e, 6) ^ rotr(e, 11) ^ rotr(e, 25)) + ((e & f) ^ (~e & g)) + k[i] + w[i];
+            uint32_t t2 = (rotr(a, 2) ^ rotr(a, 13) ^ rotr(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+            hh = g; g = f; f = e; e = d + t1;
+            d = c; c = b; b = a; a = t1 + t2;
+        }
+        h[0] += a; h[1] += b; h[2] += c; h[3] += d;
+        h[4] += e; h[5] += f; h[6] += g; h[7] += hh;
+    };
+
+    size_t full = size - size % 64;
+    for (size_t i = 0; i < full; i += 64) {
+        compress(data + i);
+    }
+    // padding: 0x80, zeros, then the length in bits as a big-endian u64
+    uint8_t tail[128] = {0};
+    size_t rest = size - full;
+    memcpy(tail, data + full, rest);
+    tail[rest] = 0x80;
+    size_t tail_size = rest + 9 > 64 ? 128 : 64;
+    uint64_t bits = (uint64_t)size * 8;
+    for (int i = 0; i < 8; ++i) {
+        tail[tail_size - 1 - i] = (uint8_t)(bits >> (i * 8));
+    }
+    compress(tail);
+    if (tail_size == 128) {
+        compress(tail + 64);
+    }
+
+    char hex[65];
+    for (int i = 0; i < 8; ++i) {
+        snprintf(hex + i * 8, 9, "%08x", h[i]);
+    }
+    return std::string(hex, 64);
+}
+
+static ERL_NIF_TERM otter_dlopen_binary(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[]) {
+    if (argc != 2) {
+        return enif_make_badarg(env);
+    }
+
+    ErlNifBinary bytes;
+    int mode = 0;
+    if (!enif_inspect_binary(env, argv[0], &bytes) || bytes.size == 0) {
+        return erlang::nif::error(env, "cannot get shared object binary");
+    }
+    if (!erlang::nif::get(env, argv[1], &mode)) {
+        return erlang::nif::error(env, "cannot get dlopen mode");
+    }
+
+#if defined(__linux__)
+    // the same bytes are only loaded once, a collision of the digest is not a concern
+    std::string key = "memfd:" + content_digest(bytes.data, bytes.size);
+    {
+        std::lock_guard<std::mutex> g(opened_handles_lock);
+        auto it = opened_handles.find(key);
+        if (it != opened_handles.end()) {
+            return erlang::nif::ok(env, enif_make_resource(env, it->second));
+        }
+    }
+
+    int fd = memfd_create(key.c_str(), MFD_CLOEXEC);
+    if (fd < 0) {
+        return erlang::nif::error(env, strerror(errno));
+    }
+    size_t written = 0;
+    while (written < bytes.size) {
+        ssize_t n = write(fd, bytes.data + written, bytes.size - written);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            int err = errno;
+            close(fd);
+            return erlang::nif::error(env, strerror(err));
+        }
+        written += (size_t)n;
+    }
+
+    // the mappings made by dlopen keep the memfd alive after it is closed
+    std::string path = "/proc/self/fd/" + std::to_string(fd);
+    void *handle_dl = dlopen(path.c_str(), mode);
+    close(fd);
+    if (handle_dl == nullptr) {
+        return erlang::nif::error(env, dlerror());
+    }
+
+    // the lock is not held while writing and loading, which can be slow
+    std::lock_guard<std::mutex> g(opened_handles_lock);
+    auto it = opened_handles.find(key);
+    if (it != opened_handles.end()) {
+        // loaded by another caller in the meantime
+        dlclose(handle_dl);
+        return erlang::nif::ok(env, enif_make_resource(env, it->second));
+    }
+    return make_opened_handle(env, key, handle_dl);
+#else
+    return erlang::nif::error(env, "dlopen_binary is only supported on Linux");
+#endif
+}
+
+static ERL_NIF_TERM otter_dlclose(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[]) {
+    if (argc != 1) {
+        return enif_make_badarg(env);
+    }
+
+    OtterHandle *res = nullptr;
+    if (enif_get_resource(env, argv[0], OtterHandle::type, (void **)&res) && res) {
+        void *handle = res->val;
+        if (handle != nullptr) {
+            std::lock_guard<std::mutex> g(opened_handles_lock);
+            int ret = dlclose(handle);
+            auto entry = opened_handles.end();
+            for (auto it = opened_handles.begin(); it != opened_handles.end(); ++it) {
+                if (it->second->val == handle) {
+                    entry = it;
+                    break;
+                }
+            }
+
+            if (entry != opened_handles.end()) {
+                OtterHandle *opened = entry->second;
+                opened_handles.erase(entry);
+
+                // release all symbols
+                auto &symbols = found_symbols[opened];
+                for (auto &s : symbols) {
+                    enif_release_resource(s.second);
+                }
+                // remove image entry in found_symbols
+                found_symbols.erase(opened);
+                enif_release_resource(opened);
+            }
+
+            if (ret == 0) {
+                return erlang::nif::ok(env);
+            } else {
+                return erlang::nif::error(env, dlerror());
+            }
+        } else {
+            return erlang::nif::error(env, "resource has an invalid handle");
+        }
+    } else {
+        return erlang::nif::error(env, "cannot get mode");
+    }
+}
+
+static ERL_NIF_TERM otter_dlsym(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[]) {
+    if (argc != 2) {
+        return enif_make_badarg(env);
+    }
+
+    OtterHandle *res = nullptr;
+    std::string func_name;
+    if (enif_get_resource(env, argv[0], OtterHandle::type, (void **)&res) &&
+        erlang::nif::get(env, argv[1], func_name) && res && !func_name.empty()) {
+        void *handle = res->val;
+        if (handle != nullptr) {
+            std::lock_guard<std::mutex> g(opened_handles_lock);
+            OtterHandle *opened_res = nullptr;
+            for (auto it = opened_handles.begin(); it != opened_handles.end(); ++it) {
+                if (it->second->val == handle) {
+                    opened_res = it->second;
+                    break;
+                }
+            }
+
+            if (opened_res == nullptr) {
+                opened_res = res;
+            }
+
+            OtterSymbol *symbol = nullptr;
+            if (found_symbols.find(opened_res) != found_symbols.end()) {
+                auto &symbols = found_symbols[opened_res];
+                if (symbols.find(func_name) != symbols.end()) {
+                    symbol = symbols[func_name];
+                }
+            }
+
+            if (symbol == nullptr) {
+                bool over_budget = false;
+                if (alloc_symbol_resource(&symbol, over_budget)) {
+                    void *symbol_dl = dlsym(handle, func_name.c_str());
+                    if (symbol_dl == nullptr) {
+                        // the destructor releases the charge of the resource
+                        enif_release_resource(symbol);
+                        return erlang::nif::error(env, dlerror());
+                    }
+                    symbol->val = symbol_dl;
+                } else if (over_budget) {
+                    return native_memory_budget_error(env);
+                } else {
+                    return erlang::nif::error(env, "cannot allocate memory for resource");
+                }
+            }
+
+            found_symbols[opened_res][func_name] = symbol;
+            ERL_NIF_TERM ret = enif_make_resource(env, symbol);
+
+            return erlang::nif::ok(env, ret);
+        } else {
+            return erlang::nif::error(env, "resource has an invalid image handle");
+        }
+    } else {
+      return erlang::nif::error(env, "cannot get image handle");
+    }
+}
+
+static ERL_NIF_TERM otter_symbol_to_address(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[]) {
+    if (argc != 1) return enif_make_badarg(env);
+
+    OtterSymbol *symbol_res = nullptr;
+    if (enif_get_resource(env, argv[0], OtterSymbol::type, (void **)&symbol_res)) {
+        void *symbol = symbol_res->val;
+        // if it is nullptr, then the return value will be 0
+        // which I'd like to keep it the same as what would have expected to be
+        // if (symbol != nullptr)
+        return erlang::nif::ok(env, enif_make_uint64(env, (uint64_t)((uint64_t *)symbol)));
+    } else {
+        return erlang::nif::error(env, "cannot get symbol resource");
+    }
+}
+
+static ERL_NIF_TERM otter_address_to_symbol(ErlNifEnv *env, int argc,
+                                            const ERL_NIF_TERM argv[]) {
+    if (argc != 1) return enif_make_badarg(env);
+
+    OtterSymbol *symbol_res = nullptr;
+    uint64_t address;
+    if (erlang::nif::get_uint64(env, argv[0], &address)) {
+        bool over_budget = false;
+        if (alloc_symbol_resource(&symbol_res, over_budget)) {
+            symbol_res->val = (void *)(uint64_t *)address;
+            ERL_NIF_TERM res = enif_make_resource(env, symbol_res);
+            enif_release_resource(symbol_res);
+            return erlang::nif::ok(env, res);
+        } else if (over_budget) {
+            return native_memory_budget_error(env);
+        } else {
+            return erlang::nif::error(env, "cannot allocate memory for resource");
+        }
+    } else {
+        return erlang::nif::error(env, "cannot get address");
+    }
+}
+
+static ERL_NIF_TERM otter_erl_nif_env(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[]) {
+    return erlang::nif::ok(env, enif_make_uint64(env, (uint64_t)((uint64_t *)env)));
+}
+
+static ERL_NIF_TERM otter_stdin(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[]) {
+    return erlang::nif::ok(env, enif_make_uint64(env, (uint64_t)((uint64_t *)stdin)));
+}
+
+static ERL_NIF_TERM otter_stdout(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[]) {
+    return erlang::nif::ok(env, enif_make_uint64(env, (uint64_t)((uint64_t *)stdout)));
+}
+
+static ERL_NIF_TERM otter_stderr(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[]) {
+    return erlang::nif::ok(env, enif_make_uint64(env, (uint64_t)((uint64_t *)stderr)));
+}
+
+static ERL_NIF_TERM otter_mmap(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[]) {
+    if (argc != 4) return enif_make_badarg(env);
+
+    std::string path, mode;
+    uint64_t offset, length;
+    if (!(erlang::nif::get(env, argv[0], path) && !path.empty())) {
+        return erlang::nif::error(env, "cannot get path");
+    }
+    if (!erlang::nif::get_atom(env, argv[1], mode)) {
+        return erlang::nif::error(env, "cannot get mmap mode");
+    }
+    if (!erlang::nif::get_uint64(env, argv[2], &offset) || !erlang::nif::get_uint64(env, argv[3], &length)) {
+        return erlang::nif::error(env, "cannot get offset or length");
+    }
+
+    // :read       - read-only shared mapping
+    // :read_write - changes are written back to the file
+    // :private    - copy-on-write, changes are not visible to other mappings
+    int open_flags, prot, flags;
+    if (mode == "read") {
+        open_flags = O_RDONLY;
+        prot = PROT_READ;
+        flags = MAP_SHARED;
+    } else if (mode == "read_write") {
+        open_flags = O_RDWR;
+        prot = PROT_READ | PROT_WRITE;
+        flags = MAP_SHARED;
+    } else if (mode == "private") {
+        open_flags = O_RDONLY;
+        prot = PROT_READ | PROT_WRITE;
+        flags = MAP_PRIVATE;
+    } else {
+        return erlang::nif::error(env, "unknown mmap mode");
+    }
+
+    int fd = open(path.c_str(), open_flags);
+    if (fd < 0) {
+        return erlang::nif::error(env, strerror(errno));
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        int err = errno;
+        close(fd);
+        return erlang::nif::error(env, strerror(err));
+    }
+
+    // length 0 maps the file from `offset` to the end
+    uint64_t file_size = (uint64_t)st.st_size;
+    if (offset > file_size || (length == 0 && offset == file_size)) {
+        close(fd);
+        return erlang::nif::error(env, "offset is beyond the end of file");
+    }
+    if (length == 0) {
+        length = file_size - offset;
+    }
+    // pages past the end of file raise SIGBUS when they are touched
+    if (length > file_size - offset) {
+        close(fd);
+        return erlang::nif::error(env, "region is beyond the end of file");
+    }
+
+    // mmap requires the offset to be a multiple of the page size
+    uint64_t page_size = (uint64_t)sysconf(_SC_PAGESIZE);
+    uint64_t aligned_offset = offset - (offset % page_size);
+    size_t map_length = (size_t)(length + (offset - aligned_offset));
+    if (!memory_accounting.charge(MemoryAccounting::MMAP, map_length)) {
+        close(fd);
+        return native_memory_budget_error(env);
+    }
+
+    void *base = mmap(nullptr, map_length, prot, flags, fd, (off_t)aligned_offset);
+    int err = errno;
+    // the mapping holds its own reference to the file
+    close(fd);
+    if (base == MAP_FAILED) {
+        memory_accounting.release(MemoryAccounting::MMAP, map_length);
+        return erlang::nif::error(env, strerror(err));
+    }
+
+    OtterMmap *res = nullptr;
+    if (!alloc_resource(&res)) {
+        munmap(base, map_length);
+        memory_accounting.release(MemoryAccounting::MMAP, map_length);
+        return erlang::nif::error(env, "cannot allocate memory for resource");
+    }
+    res->val.base = base;
+    res->val.map_length = map_length;
+    res->val.addr = (uint8_t *)base + (offset - aligned_offset);
+    res->val.length = (size_t)length;
+    res->val.writable = (prot & PROT_WRITE) != 0;
+    res->val.unmapped = false;
+
+    ERL_NIF_TERM ret = enif_make_resource(env, res);
+    enif_release_resource(res);
+    return erlang::nif::ok(env, ret);
+}
+
+static ERL_NIF_TERM otter_munmap(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[]) {
+    if (argc != 1) return enif_make_badarg(env);
+
+    OtterMmap *res = nullptr;
+    if (enif_get_resource(env, argv[0], OtterMmap::type, (void **)&res) && res) {
+        if (res->val.unmapped) {
+            return erlang::nif::error(env, "region has been unmapped");
+        }
+        if (munmap(res->val.base, res->val.map_length) != 0) {
+            return erlang::nif::error(env, strerror(errno));
+        }
+        res->val.unmapped = true;
+        memory_accounting.release(MemoryAccounting::MMAP, res->val.map_length);
+        return erlang::nif::ok(env);
+    } else {
+        return erlang::nif::error(env, "cannot get mmap resource");
+    }
+}
+
+static ERL_NIF_TERM otter_madvise(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[]) {
+    if (argc != 2) return enif_make_badarg(env);
+
+    OtterMmap *res = nullptr;
+    std::string advice_str;
+    if (!(enif_get_resource(env, argv[0], OtterMmap::type, (void **)&res) && res)) {
+        return erlang::nif::error(env, "cannot get mmap resource");
+    }
+    if (!erlang::nif::get_atom(env, argv[1], advice_str)) {
+        return erlang::nif::error(env, "cannot get advice");
+    }
+    if (res->val.unmapped) {
+        return erlang::nif::error(env, "region has been unmapped");
+    }
+
+    int advice;
+    if (advice_str == "normal") {
+        advice = MADV_NORMAL;
+    } else if (advice_str == "sequential") {
+        advice = MADV_SEQUENTIAL;
+    } else if (advice_str == "random") {
+        advice = MADV_RANDOM;
+    } else if (advice_str == "willneed") {
+        advice = MADV_WILLNEED;
+    } else if (advice_str == "dontneed") {
+        advice = MADV_DONTNEED;
+    } else {
+        return erlang::nif::error(env, "unknown advice");
+    }
+
+    // madvise applies to whole pages, use the page-aligned base
+    if (madvise(res->val.base, res->val.map_length, advice) != 0) {
+        return erlang::nif::error(env, strerror(errno));
+    }
+    return erlang::nif::ok(env);
+}
+
+static ERL_NIF_TERM otter_msync(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[]) {
+    if (argc != 2) return enif_make_badarg(env);
+
+    OtterMmap *res = nullptr;
+    std::string sync_mode;
+    if (!(enif_get_resource(env, argv[0], OtterMmap::type, (void **)&res) && res)) {
+        return erlang::nif::error(env, "cannot get mmap resource");
+    }
+    if (!erlang::nif::get_atom(env, argv[1], sync_mode)) {
+        return erlang::nif::error(env, "cannot get msync mode");
+    }
+    if (res->val.unmapped) {
+        return erlang::nif::error(env, "region has been unmapped");
+    }
+
+    int flags;
+    if (sync_mode == "sync") {
+        flags = MS_SYNC;
+    } else if (sync_mode == "async") {
+        flags = MS_ASYNC;
+    } else {
+        return erlang::nif::error(env, "unknown msync mode");
+    }
+
+    if (msync(res->val.base, res->val.map_length, flags) != 0) {
+        return erlang::nif::error(env, strerror(errno));
+    }
+    return erlang::nif::ok(env);
+}
+
+/// Per-symbol latency statistics
+///
+/// Latencies are recorded into a log2 histogram. Every `window` samples, the p99 of the
+/// window is estimated from the histogram and the histogram starts over, so that the
+/// routing decision follows symbols that become slow or fast again.
+class SymbolStats {
+public:
+    SymbolStats() : window_count(0), calls(0), last_p99_ns(0), dirty(false) {
+        for (auto &b : buckets) b.store(0, std::memory_order_relaxed);
+    }
+
+    /// @param ns latency of one call
+    /// @param threshold_ns route to dirty schedulers if p99 is above this, and back if p99 drops below half of it
+    void record(uint64_t ns, uint64_t threshold_ns, uint64_t window) {
+        calls.fetch_add(1, std::memory_order_relaxed);
+        buckets[bucket_of(ns)].fetch_add(1, std::memory_order_relaxed);
+        uint64_t count = window_count.fetch_add(1, std::memory_order_acq_rel) + 1;
+        if (count < window) {
+            return;
+        }
+
+        // only the caller that resets the count evaluates the window,
+        // samples recorded concurrently may land in either window
+        if (!window_count.compare_exchange_strong(count, 0, std::memory_order_acq_rel)) {
+            return;
+        }
+        uint64_t counts[64];
+        uint64_t total = 0;
+        for (size_t i = 0; i < 64; ++i) {
+            counts[i] = buckets[i].exchange(0, std::memory_order_relaxed);
+            total += counts[i];
+        }
+        if (total == 0) return;
+
+        uint64_t rank = total - total / 100;
+        uint64_t seen = 0;
+        uint64_t p99 = 0;
+        for (size_t i = 0; i < 64; ++i) {
+            seen += counts[i];
+            if (seen >= rank) {
+                // upper bound of the bucket
+                p99 = i >= 63 ? UINT64_MAX : ((uint64_t)2 << i) - 1;
+                break;
+            }
+        }
+        last_p99_ns.store(p99, std::memory_order_relaxed);
+
+        if (p99 > threshold_ns) {
+            dirty.store(true, std::memory_order_relaxed);
+        } else if (p99 < threshold_ns / 2) {
+            dirty.store(false, std::memory_order_relaxed);
+        }
+    }
+
+    bool is_dirty() const {
+        return dirty.load(std::memory_order_relaxed);
+    }
+
+    /// Start from the routing decision of `other`, the latency histogram starts empty
+    void seed(const SymbolStats &other) {
+        calls.store(other.calls.load(std::memory_order_relaxed), std::memory_order_relaxed);
+        last_p99_ns.store(other.last_p99_ns.load(std::memory_order_relaxed), std::memory_order_relaxed);
+        dirty.store(other.is_dirty(), std::memory_order_relaxed);
+    }
+
+    ERL_NIF_TERM info(ErlNifEnv *env) const {
+        ERL_NIF_TERM keys[] = {
+            enif_make_atom(env, "route"),
+            enif_make_atom(env, "p99_ns"),
+            enif_make_atom(env, "calls"),
+        };
+        ERL_NIF_TERM values[] = {
+            enif_make_atom(env, is_dirty() ? "dirty" : "normal"),
+            enif_make_uint64(env, last_p99_ns.load(std::memory_order_relaxed)),
+            enif_make_uint64(env, calls.load(std::memory_order_relaxed)),
+        };
+        ERL_NIF_TERM map;
+        enif_make_map_from_arrays(env, keys, values, sizeof(keys) / sizeof(keys[0]), &map);
+        return map;
+    }
+
+private:
+    static size_t bucket_of(uint64_t ns) {
+        return 63 - __builtin_clzll(ns | 1);
+    }
+
+    std::atomic<uint64_t> buckets[64];
+    std::atomic<uint64_t> window_count;
+    std::atomic<uint64_t> calls;
+    std::atomic<uint64_t> last_p99_ns;
+    std::atomic<bool> dirty;
+};
+
+/// Route symbols whose p99 latency is above a threshold to dirty schedulers
+class AdaptiveRouter {
+public:
+    // disabled until `set_adaptive_routing` is called, it costs a lookup and two clock reads per call
+    AdaptiveRouter() : enabled(false), threshold_ns(1000000), window(256), dirty_io(false) {}
+
+    /// @return nullptr if routing is disabled or `symbol_term` is not a symbol
+    std::shared_ptr<SymbolStats> stats_for(ErlNifEnv *env, ERL_NIF_TERM symbol_term, bool create=true) {
+        if (!enabled.load(std::memory_order_relaxed)) return nullptr;
+
+        OtterSymbol *symbol_res = nullptr;
+        if (!(enif_get_resource(env, symbol_term, OtterSymbol::type, (void **)&symbol_res) && symbol_res && symbol_res->val)) {
+            return nullptr;
+        }
+
+        auto &shard = shards[((uintptr_t)symbol_res->val >> 4) % num_shards];
+        std::lock_guard<std::mutex> g(shard.lock);
+        auto it = shard.stats.find(symbol_res->val);
+        if (it != shard.stats.end()) {
+            return it->second;
+        }
+        if (!create) return nullptr;
+        auto stats = std::make_shared<SymbolStats>();
+        shard.stats[symbol_res->val] = stats;
+        return stats;
+    }
+
+    void record(const std::shared_ptr<SymbolStats> &stats, uint64_t ns) {
+        stats->record(ns, threshold_ns.load(std::memory_order_relaxed), window.load(std::memory_order_relaxed));
+    }
+
+    int dirty_flags() const {
+        return dirty_io.load(std::memory_order_relaxed) ? ERL_NIF_DIRTY_JOB_IO_BOUND : ERL_NIF_DIRTY_JOB_CPU_BOUND;
+    }
+
+    void configure(bool enabled_, uint64_t threshold_ns_, uint64_t window_, bool dirty_io_) {
+        enabled = enabled_;
+        threshold_ns = threshold_ns_;
+        window = window_ == 0 ? 1 : window_;
+        dirty_io = dirty_io_;
+    }
+
+    /// Take over the configuration and the routing decisions of the router of an older instance
+    void adopt(AdaptiveRouter &old) {
+        configure(old.enabled.load(), old.threshold_ns.load(), old.window.load(), old.dirty_io.load());
+        for (size_t i = 0; i < num_shards; ++i) {
+            std::lock_guard<std::mutex> old_g(old.shards[i].lock);
+            std::lock_guard<std::mutex> g(shards[i].lock);
+            for (auto &iter : old.shards[i].stats) {
+                auto stats = std::make_shared<SymbolStats>();
+                stats->seed(*iter.second);
+                shards[i].stats[iter.first] = stats;
+            }
+        }
+    }
+
+private:
+    static const size_t num_shards = 16;
+    struct Shard {
+        std::mutex lock;
+        std::unordered_map<void *, std::shared_ptr<SymbolStats>> stats;
+    };
+
+    Shard shards[num_shards];
+    std::atomic<bool> enabled;
+    std::atomic<uint64_t> threshold_ns;
+    std::atomic<uint64_t> window;
+    std::atomic<bool> dirty_io;
+};
+
+static AdaptiveRouter adaptive_router;
+
+/// One native call recorded by `TraceRecorder`
+struct TraceEvent {
+    void * symbol;
+    uint64_t start_ns;
+    uint64_t end_ns;
+    uint32_t thread;
+    uint16_t argc;
+    // 1 if the call returned {:ok, _}
+    uint8_t ok;
+};
+
+/// Opt-in recorder of native calls
+///
+/// Each thread writes into its own SPSC ring, so recording takes no lock. The rings are
+/// read by `drain`, which is serialised by `lock`. When a ring is full, new events are
+/// dropped and counted. With tracing disabled, the cost is one relaxed atomic load per call.
+class TraceRecorder {
+public:
+    static const size_t ring_capacity = 4096;
+
+    TraceRecorder() : enabled(false), dropped(0) {}
+
+    bool is_enabled() const {
+        return enabled.load(std::memory_order_relaxed);
+    }
+
+    void set_enabled(bool enable) {
+        enabled = enable;
+    }
+
+    void record(void *symbol, uint64_t start_ns, uint64_t end_ns, unsigned argc, bool ok) {
+        ThreadRing *ring = local_ring();
+        if (ring == nullptr) return;
+        TraceEvent event{symbol, start_ns, end_ns, ring->thread, (uint16_t)(argc > UINT16_MAX ? UINT16_MAX : argc), (uint8_t)ok};
+        if (!ring->events.push(event)) {
+            dropped.fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+
+    /// Move all recorded events out of the rings, ordered by thread
+    /// @param dropped_events out. Number of events dropped since the last drain.
+    void drain(std::vector<TraceEvent> &events, uint64_t &dropped_events) {
+        std::lock_guard<std::mutex> g(lock);
+        for (auto &ring : rings) {
+            TraceEvent event;
+            while (ring->events.pop(event)) {
+                events.push_back(event);
+            }
+        }
+        dropped_events = dropped.exchange(0);
+    }
+
+private:
+    struct ThreadRing {
+        ThreadRing(uint32_t thread_) : thread(thread_), events(ring_capacity) {}
+        uint32_t thread;
+        otter::SPSCRing<TraceEvent> events;
+    };
+
+    // rings are never freed, a thread that exits leaves its ring for the next drain
+    ThreadRing * local_ring() {
+        static thread_local ThreadRing *ring = nullptr;
+        if (ring == nullptr) {
+            std::lock_guard<std::mutex> g(lock);
+            rings.emplace_back(new ThreadRing((uint32_t)rings.size() + 1));
+            ring = rings.back().get();
+        }
+        return ring;
+    }
+
+    std::atomic<bool> enabled;
+    std::atomic<uint64_t> dropped;
+    std::mutex lock;
+    std::vector<std::unique_ptr<ThreadRing>> rings;
+};
+
+static TraceRecorder trace_recorder;
+
+// name of the symbol at `address` for trace output, or its address in hex
+static std::string trace_symbol_name(void *address) {
+    Dl_info info;
+    if (dladdr(address, &info) && info.dli_sname && info.dli_saddr == address) {
+        return info.dli_sname;
+    }
+    char buf[32];
+    snprintf(buf, sizeof(buf), "0x%" PRIxPTR, (uintptr_t)address);
+    return buf;
+}
+
+// https://docs.google.com/document/d/1CvAClvFfyA5R-PhYUmn5OOQtYMH4h6I0nSsKchNAySU
+static std::string trace_to_chrome_json(const std::vector<TraceEvent> &events, uint64_t dropped_events) {
+    std::map<void *, std::string> names;
+    std::string json = "{\"traceEvents\":[";
+    char buf[192];
+    for (size_t i = 0; i < events.size(); ++i) {
+        auto &e = events[i];
+        auto it = names.find(e.symbol);
+        if (it == names.end()) {
+            it = names.emplace(e.symbol, trace_symbol_name(e.symbol)).first;
+        }
+        json += i == 0 ? "{\"name\":\"" : ",{\"name\":\"";
+        json += it->second;
+        // timestamps are in microseconds
+        snprintf(buf, sizeof(buf),
+                 "\",\"cat\":\"otter\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,"
+                 "\"pid\":1,\"tid\":%u,\"args\":{\"argc\":%u,\"ok\":%s}}",
+                 e.start_ns / 1000.0, (e.end_ns - e.start_ns) / 1000.0,
+                 e.thread, (unsigned)e.argc, e.ok ? "true" : "false");
+        json += buf;
+    }
+    snprintf(buf, sizeof(buf), "],\"otherData\":{\"dropped\":%" PRIu64 "}}", dropped_events);
+    json += buf;
+    return json;
+}
+
+// each event is 32 bytes in native byte order:
+//   symbol:u64 start_ns:u64 end_ns:u64 thread:u32 argc:u16 ok:u8 reserved:u8
+static void trace_to_binary(const std::vector<TraceEvent> &events, uint8_t *out) {
+    for (auto &e : events) {
+        uint64_t symbol = (uint64_t)(uintptr_t)e.symbol;
+        memcpy(out, &symbol, 8);
+        memcpy(out + 8, &e.start_ns, 8);
+        memcpy(out + 16, &e.end_ns, 8);
+        memcpy(out + 24, &e.thread, 4);
+        memcpy(out + 28, &e.argc, 2);
+        out[30] = e.ok;
+        out[31] = 0;
+        out += 32;
+    }
+}
+
+static void otter_segfault_catcher(int sig) {
+    switch(sig) {
+        case SIGSEGV:
+            longjmp(jmp_buf_g, 1);
+            break;
+    }
+}
+
+/// @param native_ns out. If not nullptr, the time spent in the function, -1 if it was not called
+static ERL_NIF_TERM invoke(ErlNifEnv *env, std::shared_ptr<FFICall> ffi_call_wrapper, int64_t *native_ns=nullptr) {
+    std::string error_msg;
+    ffi_call_wrapper->measure_native = (native_ns != nullptr);
+    ERL_NIF_TERM return_value, out_values;
+    ERL_NIF_TERM ret;
+
+    struct sigaction oldact;
+    sigaction(SIGSEGV, NULL, &oldact);
+
+    signal(SIGSEGV, otter_segfault_catcher);
+    if (!setjmp(jmp_buf_g)) {
+        if (ffi_call_wrapper->call(return_value, out_values, error_msg)) {
+            if (ffi_call_wrapper->out_value_indexes.size() > 0) {
+                ret = erlang::nif::ok(env, enif_make_tuple2(env, return_value, out_values));
+            } else {
+                ret =  erlang::nif::ok(env, return_value);
+            }
+        } else if (ffi_call_wrapper->budget_exceeded) {
+            ret = native_memory_budget_error(env);
+        } else {
+            ret =  erlang::nif::error(env, error_msg.c_str());
+        }
+    } else {
+        ret =  erlang::nif::error(env, "segmentation fault");
+    }
+
+    signal(SIGSEGV, oldact.sa_handler);
+    if (native_ns) {
+        *native_ns = ffi_call_wrapper->native_ns;
+    }
+    // `ffi_call_wrapper` is released by the caller
+    otter::alloc_profile::set_phase(otter::alloc_profile::CLEANUP);
+    return ret;
+}
+
+static ERL_NIF_TERM invoke(ErlNifEnv *env, ERL_NIF_TERM symbol_term, ERL_NIF_TERM return_type_term,
+                           ERL_NIF_TERM args_with_type_term, int64_t *native_ns=nullptr) {
+    return invoke(env, std::make_shared<FFICall>(env, symbol_term, return_type_term, args_with_type_term), native_ns);
+}
+
+static ERL_NIF_TERM invoke_signature(ErlNifEnv *env, const ERL_NIF_TERM argv[], int64_t *native_ns=nullptr) {
+    ErlNifBinary descriptor;
+    if (!enif_inspect_binary(env, argv[1], &descriptor)) {
+        return erlang::nif::error(env, "expecting a signature descriptor");
+    }
+
+    std::string error_msg;
+    std::shared_ptr<CallSignature> signature;
+    if (!signature_cache.lookup(descriptor, signature, error_msg)) {
+        return erlang::nif::error(env, error_msg.c_str());
+    }
+    if (!signature) {
+        // struct types are not part of the descriptor, see `register_signature`
+        return enif_make_tuple2(env, enif_make_atom(env, "error"), enif_make_atom(env, "unregistered_signature"));
+    }
+    return invoke(env, std::make_shared<FFICall>(env, argv[0], signature, argv[2]), native_ns);
+}
+
+// invoke, record the time spent in the function for adaptive routing,
+// and the whole call including term conversions for tracing
+static ERL_NIF_TERM measured_invoke(ErlNifEnv *env, const ERL_NIF_TERM argv[], bool with_signature,
+                                    const std::shared_ptr<SymbolStats> &stats) {
+    bool tracing = trace_recorder.is_enabled();
+    uint64_t start = tracing ? monotonic_ns() : 0;
+    int64_t native_ns = -1;
+    int64_t *measure = stats ? &native_ns : nullptr;
+    otter::alloc_profile::begin_call();
+    ERL_NIF_TERM ret = with_signature ? invoke_signature(env, argv, measure) : invoke(env, argv[0], argv[1], argv[2], measure);
+    if (otter::alloc_profile::enabled) {
+        OtterSymbol *symbol_res = nullptr;
+        enif_get_resource(env, argv[0], OtterSymbol::type, (void **)&symbol_res);
+        otter::alloc_profile::end_call(symbol_res ? symbol_res->val : nullptr);
+    }
+    if (!(stats || tracing)) {
+        return ret;
+    }
+
+    if (stats && native_ns >= 0) {
+        adaptive_router.record(stats, (uint64_t)native_ns);
+    }
+
+    uint64_t end = tracing ? monotonic_ns() : 0;
+    OtterSymbol *symbol_res = nullptr;
+    if (tracing && enif_get_resource(env, argv[0], OtterSymbol::type, (void **)&symbol_res) && symbol_res) {
+        unsigned argc = 0;
+        int arity = 0;
+        const ERL_NIF_TERM *array;
+        if (with_signature && enif_get_tuple(env, argv[2], &arity, &array)) {
+            argc = (unsigned)arity;
+        } else if (!with_signature) {
+            enif_get_list_length(env, argv[2], &argc);
+        }
+        bool ok = enif_get_tuple(env, ret, &arity, &array) && arity == 2 &&
+            enif_is_identical(array[0], enif_make_atom(env, "ok"));
+        trace_recorder.record(symbol_res->val, start, end, argc, ok);
+    }
+    return ret;
+}
+
+static ERL_NIF_TERM otter_invoke_dirty(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[]) {
+    return measured_invoke(env, argv, false, adaptive_router.stats_for(env, argv[0]));
+}
+
+static ERL_NIF_TERM otter_invoke(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[]) {
+    if (argc != 3) {
+        return enif_make_badarg(env);
+    }
+    auto stats = adaptive_router.stats_for(env, argv[0]);
+    if (stats && stats->is_dirty()) {
+        return enif_schedule_nif(env, "invoke", adaptive_router.dirty_flags(), otter_invoke_dirty, argc, argv);
+    }
+    return measured_invoke(env, argv, false, stats);
+}
+
+static ERL_NIF_TERM otter_invoke_signature_dirty(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[]) {
+    return measured_invoke(env, argv, true, adaptive_router.stats_for(env, argv[0]));
+}
+
+static ERL_NIF_TERM otter_invoke_signature(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[]) {
+    if (argc != 3) {
+        return enif_make_badarg(env);
+    }
+    auto stats = adaptive_router.stats_for(env, argv[0]);
+    if (stats && stats->is_dirty()) {
+        return enif_schedule_nif(env, "invoke_signature", adaptive_router.dirty_flags(), otter_invoke_signature_dirty, argc, argv);
+    }
+    return measured_invoke(env, argv, true, stats);
+}
+
+static ERL_NIF_TERM otter_set_tracing(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[]) {
+    if (argc != 1) return enif_make_badarg(env);
+
+    std::string enabled;
+    if (!(erlang::nif::get_atom(env, argv[0], enabled) && (enabled == "true" || enabled == "false"))) {
+        return erlang::nif::error(env, "expecting a boolean");
+    }
+    trace_recorder.set_enabled(enabled == "true");
+    return erlang::nif::ok(env);
+}
+
+static ERL_NIF_TERM otter_drain_trace(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[]) {
+    if (argc != 1) return enif_make_badarg(env);
+
+    std::string format;
+    if (!(erlang::nif::get_atom(env, argv[0], format) && (format == "chrome" || format == "binary"))) {
+        return erlang::nif::error(env, "format should be either :chrome or :binary");
+    }
+
+    std::vector<TraceEvent> events;
+    uint64_t dropped_events = 0;
+    trace_recorder.drain(events, dropped_events);
+
+    ERL_NIF_TERM ret;
+    if (format == "chrome") {
+        std::string json = trace_to_chrome_json(events, dropped_events);
+        uint8_t *out = enif_make_new_binary(env, json.size(), &ret);
+        if (out == nullptr) {
+            return erlang::nif::error(env, "cannot allocate binary");
+        }
+        memcpy(out, json.data(), json.size());
+    } else {
+        uint8_t *out = enif_make_new_binary(env, events.size() * 32, &ret);
+        if (out == nullptr) {
+            return erlang::nif::error(env, "cannot allocate binary");
+        }
+        trace_to_binary(events, out);
+    }
+    return erlang::nif::ok(env, enif_make_tuple2(env, ret, enif_make_uint64(env, dropped_events)));
+}
+
+static ERL_NIF_TERM otter_routing_info(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[]) {
+    if (argc != 1) return enif_make_badarg(env);
+
+    OtterSymbol *symbol_res = nullptr;
+    if (!(enif_get_resource(env, argv[0], OtterSymbol::type, (void **)&symbol_res) && symbol_res)) {
+        return erlang::nif::error(env, "invalid symbol");
+    }
+    auto stats = adaptive_router.stats_for(env, argv[0], false);
+    if (!stats) {
+        // not called yet, or routing is disabled
+        SymbolStats empty;
+        return erlang::nif::ok(env, empty.info(env));
+    }
+    return erlang::nif::ok(env, stats->info(env));
+}
+
+static ERL_NIF_TERM otter_set_adaptive_routing(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[]) {
+    if (argc != 4) return enif_make_badarg(env);
+
+    std::string enabled, dirty;
+    uint64_t threshold_ns, window;
+    if (!(erlang::nif::get_atom(env, argv[0], enabled) && (enabled == "true" || enabled == "false"))) {
+        return erlang::nif::error(env, "expecting a boolean");
+    }
+    if (!erlang::nif::get_uint64(env, argv[1], &threshold_ns)) {
+        return erlang::nif::error(env, "cannot get threshold");
+    }
+    if (!erlang::nif::get_uint64(env, argv[2], &window)) {
+        return erlang::nif::error(env, "cannot get window");
+    }
+    if (!(erlang::nif::get_atom(env, argv[3], dirty) && (dirty == "cpu" || dirty == "io"))) {
+        return erlang::nif::error(env, "dirty should be either :cpu or :io");
+    }
+    adaptive_router.configure(enabled == "true", threshold_ns, window, dirty == "io");
+    return erlang::nif::ok(env);
+}
+
+static ERL_NIF_TERM otter_register_signature(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[]) {
+    if (argc != 2) {
+        return enif_make_badarg(env);
+    }
+
+    ErlNifBinary descriptor;
+    if (!enif_inspect_binary(env, argv[0], &descriptor)) {
+        return erlang::nif::error(env, "expecting a signature descriptor");
+    }
+
+    std::string error_msg;
+    if (!signature_cache.register_signature(env, descriptor, argv[1], error_msg)) {
+        return erlang::nif::error(env, error_msg.c_str());
+    }
+    return erlang::nif::ok(env);
+}
+
+struct WorkerRequest;
+
+/// A native thread that runs every request sent to it
+///
+/// Some libraries keep thread-local state or require all calls to be made on the
+/// thread that initialised them. Requests are passed through a lock-free MPSC ring,
+/// `wake_lock` is only taken when the worker is about to sleep or has to be woken up.
+class NativeWorker {
+public:
+    explicit NativeWorker(size_t queue_size) : ring(queue_size), stopping(false), sleeping(false), producers(0) {
+    }
+
+    ~NativeWorker() {
+        stop();
+    }
+
+    NativeWorker(const NativeWorker &) = delete;
+    NativeWorker &operator=(const NativeWorker &) = delete;
+
+    /// Start the worker thread and pin it to a CPU before it runs any request
+    /// @param cpu CPU to pin the thread to, no affinity if negative
+    /// @return false if the affinity cannot be set, the thread is stopped then
+    bool start(int cpu) {
+        otter::Latch ready(1);
+        bool pinned = true;
+        thread = std::thread([this, cpu, &ready, &pinned] {
+            if (cpu >= 0) {
+                pinned = set_affinity(cpu);
+            }
+            ready.count_down();
+            if (pinned) {
+                this->loop();
+            }
+        });
+        ready.wait();
+        if (!pinned) {
+            stopping.store(true);
+            std::lock_guard<std::mutex> g(join_lock);
+            thread.join();
+        }
+        return pinned;
+    }
+
+    bool submit(WorkerRequest *request) {
+        // pairs with the load of `producers` in `loop` after it has seen `stopping`
+        producers.fetch_add(1);
+        bool pushed = !stopping.load() && ring.push(request);
+        producers.fetch_sub(1);
+        if (!pushed) {
+            return false;
+        }
+
+        // pairs with the fence in `loop` before it checks the ring and sleeps
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (sleeping.load(std::memory_order_relaxed)) {
+            {
+                std::lock_guard<std::mutex> g(wake_lock);
+            }
+            wake.notify_one();
+        }
+        return true;
+    }
+
+    void stop() {
+        stopping.store(true);
+        {
+            std::lock_guard<std::mutex> g(wake_lock);
+        }
+        wake.notify_one();
+
+        std::lock_guard<std::mutex> g(join_lock);
+        if (thread.joinable() && thread.get_id() != std::this_thread::get_id()) {
+            thread.join();
+        }
+    }
+
+    bool is_stopping() {
+        return stopping.load();
+    }
+
+    /// Native memory used by the worker and its queue
+    size_t footprint() const {
+        return sizeof(NativeWorker) + ring.capacity() * sizeof(WorkerRequest *);
+    }
+
+private:
+    void loop();
+
+    /// Pin the calling thread to a CPU
+    static bool set_affinity(int cpu) {
+#if defined(__linux__)
+        cpu_set_t cpuset;
+        CPU_ZERO(&cpuset);
+        CPU_SET(cpu, &cpuset);
+        return pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &cpuset) == 0;
+#else
+        // not supported on this platform
+        return false;
+#endif
+    }
+
+    otter::MPSCRing<WorkerRequest *> ring;
+    std::atomic<bool> stopping;
+    // set by the worker while it waits on `wake`
+    std::atomic<bool> sleeping;
+    // number of producers between their check of `stopping` and their push
+    std::atomic<size_t> producers;
+    std::mutex wake_lock;
+    std::condition_variable wake;
+    std::mutex join_lock;
+    std::thread thread;
+};
+using OtterWorker = erlang_nif_res<NativeWorker *>;
+
+struct WorkerRequest {
+    // process independent environment that holds copies of the input terms and the result
+    ErlNifEnv *env;
+    ERL_NIF_TERM symbol;
+    ERL_NIF_TERM return_type;
+    ERL_NIF_TERM args_with_type;
+    ERL_NIF_TERM result;
+
+    // synchronous requests: the caller waits on `done`
+    otter::Latch *done;
+    // asynchronous requests: the result is sent to `pid` as `{ref, result}`
+    ErlNifPid pid;
+    ERL_NIF_TERM ref;
+    // keeps the worker alive until the request completes
+    OtterWorker *worker;
+};
+
+static void release_worker_resource(void *res) {
+    enif_release_resource(res);
+}
+
+static void complete_worker_request(WorkerRequest *request, ERL_NIF_TERM result) {
+    request->result = result;
+    if (request->done) {
+        // the caller copies the result and frees the request
+        request->done->count_down();
+    } else {
+        enif_send(nullptr, &request->pid, request->env, enif_make_tuple2(request->env, request->ref, request->result));
+        // this may be the last reference to the worker, whose destructor joins this thread,
+        // so it is dropped on the background finalizer thread
+        background_finalizer.submit(release_worker_resource, request->worker);
+        enif_free_env(request->env);
+        delete request;
+    }
+}
+
+void NativeWorker::loop() {
+    while (true) {
+        WorkerRequest *request = nullptr;
+        if (ring.pop(request)) {
+            complete_worker_request(request, invoke(request->env, request->symbol, request->return_type, request->args_with_type));
+            continue;
+        }
+        if (stopping.load()) {
+            break;
+        }
+
+        std::unique_lock<std::mutex> g(wake_lock);
+        sleeping.store(true, std::memory_order_relaxed);
+        // pairs with the fence in `submit` after the push
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        wake.wait(g, [this] { return stopping.load() || !ring.empty(); });
+        sleeping.store(false, std::memory_order_relaxed);
+    }
+
+    // a producer that has not seen `stopping` may still be pushing
+    while (producers.load() != 0) {
+        std::this_thread::yield();
+    }
+
+    // fail requests that were queued before `stop`
+    WorkerRequest *request = nullptr;
+    while (ring.pop(request)) {
+        complete_worker_request(request, erlang::nif::error(request->env, "worker has been stopped"));
+    }
+}
+
+static void worker_resource_dtor(ErlNifEnv *env, void *obj) {
+    auto res = (OtterWorker *)obj;
+    if (res && res->val) {
+        // no request can be pending because each of them holds a reference to the resource
+        memory_accounting.release(MemoryAccounting::WORKER, res->val->footprint());
+        delete res->val;
+        res->val = nullptr;
+    }
+}
+
+static ERL_NIF_TERM otter_worker_start(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[]) {
+    if (argc != 2) return enif_make_badarg(env);
+
+    int cpu;
+    uint64_t queue_size;
+    if (!erlang::nif::get(env, argv[0], &cpu)) {
+        return erlang::nif::error(env, "cannot get cpu");
+    }
+    if (!erlang::nif::get_uint64(env, argv[1], &queue_size) || queue_size == 0) {
+        return erlang::nif::error(env, "cannot get queue size");
+    }
+
+    std::unique_ptr<NativeWorker> worker(new NativeWorker((size_t)queue_size));
+    if (!memory_accounting.charge(MemoryAccounting::WORKER, worker->footprint())) {
+        return native_memory_budget_error(env);
+    }
+
+    OtterWorker *res = nullptr;
+    if (!alloc_resource(&res)) {
+        memory_accounting.release(MemoryAccounting::WORKER, worker->footprint());
+        return erlang::nif::error(env, "cannot allocate memory for resource");
+    }
+    res->val = worker.release();
+
+    // cpu < 0: no affinity
+    if (!res->val->start(cpu)) {
+        // the destructor releases the charge of the worker
+        enif_release_resource(res);
+        return erlang::nif::error(env, "cannot set cpu affinity");
+    }
+
+    ERL_NIF_TERM ret = enif_make_resource(env, res);
+    enif_release_resource(res);
+    return erlang::nif::ok(env, ret);
+}
+
+static WorkerRequest * make_worker_request(ErlNifEnv *env, OtterWorker *worker, const ERL_NIF_TERM argv[]) {
+    auto request = new WorkerRequest();
+    request->env = enif_alloc_env();
+    request->symbol = enif_make_copy(request->env, argv[1]);
+    request->return_type = enif_make_copy(request->env, argv[2]);
+    request->args_with_type = enif_make_copy(request->env, argv[3]);
+    request->done = nullptr;
+    request->worker = worker;
+    enif_keep_resource(worker);
+    return request;
+}
+
+static void free_worker_request(WorkerRequest *request) {
+    enif_release_resource(request->worker);
+    enif_free_env(request->env);
+    delete request;
+}
+
+static ERL_NIF_TERM otter_worker_invoke(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[]) {
+    if (argc != 4) return enif_make_badarg(env);
+
+    OtterWorker *res = nullptr;
+    if (!(enif_get_resource(env, argv[0], OtterWorker::type, (void **)&res) && res && res->val)) {
+        return erlang::nif::error(env, "cannot get worker");
+    }
+
+    otter::Latch done(1);
+    WorkerRequest *request = make_worker_request(env, res, argv);
+    request->done = &done;
+    if (!res->val->submit(request)) {
+        free_worker_request(request);
+        return erlang::nif::error(env, "worker is stopped or its queue is full");
+    }
+
+    done.wait();
+    ERL_NIF_TERM ret = enif_make_copy(env, request->result);
+    free_worker_request(request);
+    return ret;
+}
+
+static ERL_NIF_TERM otter_worker_invoke_async(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[]) {
+    if (argc != 4) return enif_make_badarg(env);
+
+    OtterWorker *res = nullptr;
+    if (!(enif_get_resource(env, argv[0], OtterWorker::type, (void **)&res) && res && res->val)) {
+        return erlang::nif::error(env, "cannot get worker");
+    }
+
+    WorkerRequest *request = make_worker_request(env, res, argv);
+    ERL_NIF_TERM ref = enif_make_ref(env);
+    request->ref = enif_make_copy(request->env, ref);
+    enif_self(env, &request->pid);
+    if (!res->val->submit(request)) {
+        free_worker_request(request);
+        return erlang::nif::error(env, "worker is stopped or its queue is full");
+    }
+    return erlang::nif::ok(env, ref);
+}
+
+static ERL_NIF_TERM otter_worker_stop(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[]) {
+    if (argc != 1) return enif_make_badarg(env);
+
+    OtterWorker *res = nullptr;
+    if (!(enif_get_resource(env, argv[0], OtterWorker::type, (void **)&res) && res && res->val)) {
+        return erlang::nif::error(env, "cannot get worker");
+    }
+    if (res->val->is_stopping()) {
+        return erlang::nif::error(env, "worker has been stopped");
+    }
+    res->val->stop();
+    return erlang::nif::ok(env);
+}
+
+// copy from/to memory that Otter does not own
+// returns false instead of crashing the VM if the address is not accessible
+static bool guarded_memcpy(void *dst, const void *src, size_t n) {
+    volatile bool ok = false;
+    struct sigaction oldact;
+    sigaction(SIGSEGV, NULL, &oldact);
+
+    signal(SIGSEGV, otter_segfault_catcher);
+    if (!setjmp(jmp_buf_g)) {
+        memcpy(dst, src, n);
+        ok = true;
+    }
+    signal(SIGSEGV, oldact.sa_handler);
+    return ok;
+}
+
+static bool get_basic_type_param(ErlNifEnv *env, ERL_NIF_TERM type_term, ffi_type *&type) {
+    std::string type_str;
+    if (erlang::nif::get_atom(env, type_term, type_str) || erlang::nif::get(env, type_term, type_str)) {
+        type = get_basic_ffi_type(type_str);
+        return type != nullptr;
+    }
+    return false;
+}
+
+// get the pointer view and check that it is still accessible
+static bool get_pointer_view(ErlNifEnv *env, ERL_NIF_TERM term, OtterPointer *&res, std::string &error_msg) {
+    if (!(enif_get_resource(env, term, OtterPointer::type, (void **)&res) && res)) {
+        error_msg = "cannot get pointer resource";
+        return false;
+    }
+    if (res->val.region && res->val.region->val.unmapped) {
+        error_msg = "region has been unmapped";
+        return false;
+    }
+    return true;
+}
+
+static ERL_NIF_TERM otter_pointer_new(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[]) {
+    if (argc != 3) return enif_make_badarg(env);
+
+    ffi_type *element_type = nullptr;
+    uint64_t count;
+    if (!get_basic_type_param(env, argv[1], element_type)) {
+        return erlang::nif::error(env, "element type should be a basic type");
+    }
+    if (!erlang::nif::get_uint64(env, argv[2], &count)) {
+        return erlang::nif::error(env, "cannot get count");
+    }
+
+    uint8_t *addr = nullptr;
+    OtterMmap *region = nullptr;
+    uint64_t address;
+    if (enif_get_resource(env, argv[0], OtterMmap::type, (void **)&region) && region) {
+        if (region->val.unmapped) {
+            return erlang::nif::error(env, "region has been unmapped");
+        }
+        // count 0 covers the whole region
+        size_t max_count = region->val.length / element_type->size;
+        if (count == 0) {
+            count = max_count;
+        } else if (count > max_count) {
+            return erlang::nif::error(env, "count exceeds the size of the region");
+        }
+        addr = (uint8_t *)region->val.addr;
+    } else if (erlang::nif::get_uint64(env, argv[0], &address)) {
+        addr = (uint8_t *)(uintptr_t)address;
+        region = nullptr;
+    } else {
+        return erlang::nif::error(env, "expecting an address or a memory-mapped region");
+    }
+
+    OtterPointer *res = nullptr;
+    if (!alloc_resource(&res)) {
+        return erlang::nif::error(env, "cannot allocate memory for resource");
+    }
+    res->val.addr = addr;
+    res->val.element_type = element_type;
+    res->val.count = (size_t)count;
+    res->val.region = region;
+    if (region) {
+        enif_keep_resource(region);
+    }
+
+    ERL_NIF_TERM ret = enif_make_resource(env, res);
+    enif_release_resource(res);
+    return erlang::nif::ok(env, ret);
+}
+
+static ERL_NIF_TERM otter_pointer_read(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[]) {
+    if (argc != 5) return enif_make_badarg(env);
+
+    OtterPointer *res = nullptr;
+    ffi_type *type = nullptr;
+    uint64_t offset, count;
+    std::string format, error_msg;
+    if (!get_pointer_view(env, argv[0], res, error_msg)) {
+        return erlang::nif::error(env, error_msg.c_str());
+    }
+    if (!get_basic_type_param(env, argv[1], type)) {
+        return erlang::nif::error(env, "type should be a basic type");
+    }
+    if (!erlang::nif::get_uint64(env, argv[2], &offset) || !erlang::nif::get_uint64(env, argv[3], &count)) {
+        return erlang::nif::error(env, "cannot get offset or count");
+    }
+    if (!(erlang::nif::get_atom(env, argv[4], format) && (format == "binary" || format == "list"))) {
+        return erlang::nif::error(env, "format should be either :binary or :list");
+    }
+
+    // offset and count are in elements of `type`
+    // the extent of the view is in elements of the view's element type
+    size_t extent = res->val.count * res->val.element_type->size;
+    size_t elem_size = type->size;
+    if (offset > extent / elem_size || count > extent / elem_size - offset) {
+        return erlang::nif::error(env, "out of bounds");
+    }
+    size_t nbytes = (size_t)count * elem_size;
+    const uint8_t *src = res->val.addr + offset * elem_size;
+
+    ERL_NIF_TERM binary_term;
+    unsigned char *data = enif_make_new_binary(env, nbytes, &binary_term);
+    if (data == nullptr) {
+        return erlang::nif::error(env, "cannot allocate memory for binary");
+    }
+    if (!guarded_memcpy(data, src, nbytes)) {
+        return erlang::nif::error(env, "segmentation fault");
+    }
+    if (format == "binary") {
+        return erlang::nif::ok(env, binary_term);
+    }
+
+    ERL_NIF_TERM list = enif_make_list(env, 0);
+    for (size_t i = (size_t)count; i > 0; --i) {
+        ERL_NIF_TERM elem;
+        if (!make_basic_value_term(env, type, data + (i - 1) * elem_size, elem)) {
+            return erlang::nif::error(env, "value is NaN or infinity");
+        }
+        list = enif_make_list_cell(env, elem, list);
+    }
+    return erlang::nif::ok(env, list);
+}
+
+static ERL_NIF_TERM otter_pointer_write(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[]) {
+    if (argc != 3) return enif_make_badarg(env);
+
+    OtterPointer *res = nullptr;
+    uint64_t offset;
+    ErlNifBinary binary;
+    std::string error_msg;
+    if (!get_pointer_view(env, argv[0], res, error_msg)) {
+        return erlang::nif::error(env, error_msg.c_str());
+    }
+    if (!erlang::nif::get_uint64(env, argv[1], &offset)) {
+        return erlang::nif::error(env, "cannot get offset");
+    }
+    if (!enif_inspect_binary(env, argv[2], &binary)) {
+        return erlang::nif::error(env, "cannot get binary");
+    }
+    if (res->val.region && !res->val.region->val.writable) {
+        return erlang::nif::error(env, "region is read-only");
+    }
+
+    // offset is in elements of the view's element type
+    size_t elem_size = res->val.element_type->size;
+    size_t extent = res->val.count * elem_size;
+    if (offset > res->val.count || binary.size > extent - offset * elem_size) {
+        return erlang::nif::error(env, "out of bounds");
+    }
+    if (!guarded_memcpy(res->val.addr + offset * elem_size, binary.data, binary.size)) {
+        return erlang::nif::error(env, "segmentation fault");
+    }
+    return erlang::nif::ok(env);
+}
+
+static ERL_NIF_TERM otter_pointer_address(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[]) {
+    if (argc != 1) return enif_make_badarg(env);
+
+    OtterPointer *res = nullptr;
+    std::string error_msg;
+    if (!get_pointer_view(env, argv[0], res, error_msg)) {
+        return erlang::nif::error(env, error_msg.c_str());
+    }
+    return erlang::nif::ok(env, enif_make_uint64(env, (uint64_t)(uintptr_t)res->val.addr));
+}
+
+// lists, or binaries, of more elements than this are converted on a dirty CPU scheduler
+static const size_t pack_dirty_threshold = 64 * 1024;
+
+// read a list element as int64 (or uint64 for u64 and c_ptr) or as double for floats
+template <typename Wide>
+static bool get_wide_number(ErlNifEnv *env, ERL_NIF_TERM term, Wide &value);
+
+template <>
+bool get_wide_number<int64_t>(ErlNifEnv *env, ERL_NIF_TERM term, int64_t &value) {
+    ErlNifSInt64 v;
+    if (!enif_get_int64(env, term, &v)) return false;
+    value = v;
+    return true;
+}
+
+template <>
+bool get_wide_number<uint64_t>(ErlNifEnv *env, ERL_NIF_TERM term, uint64_t &value) {
+    ErlNifUInt64 v;
+    if (!enif_get_uint64(env, term, &v)) return false;
+    value = v;
+    return true;
+}
+
+template <>
+bool get_wide_number<double>(ErlNifEnv *env, ERL_NIF_TERM term, double &value) {
+    ErlNifSInt64 i64;
+    if (enif_get_double(env, term, &value)) {
+        return true;
+    } else if (enif_get_int64(env, term, &i64)) {
+        value = (double)i64;
+        return true;
+    }
+    return false;
+}
+
+// read, range check and narrow every element in a single pass over the list
+template <typename T, typename Wide>
+static ERL_NIF_TERM pack_numbers(ErlNifEnv *env, ERL_NIF_TERM list, unsigned int length) {
+    const Wide lo = std::is_floating_point<T>::value ? (Wide)-std::numeric_limits<T>::max() : (Wide)std::numeric_limits<T>::min();
+    const Wide hi = (Wide)std::numeric_limits<T>::max();
+
+    ERL_NIF_TERM ret;
+    uint8_t *out = enif_make_new_binary(env, sizeof(T) * length, &ret);
+    if (out == nullptr) {
+        return erlang::nif::error(env, "cannot allocate binary");
+    }
+
+    ERL_NIF_TERM head;
+    for (unsigned int i = 0; i < length && enif_get_list_cell(env, list, &head, &list); ++i) {
+        Wide value;
+        if (!get_wide_number<Wide>(env, head, value)) {
+            return erlang::nif::error(env, "list contains a value that is not a number of the requested type");
+        }
+        if (!(value >= lo && value <= hi)) {
+            return erlang::nif::error(env, "list contains a value that is out of range for the requested type");
+        }
+        T narrowed = (T)value;
+        memcpy(out + (size_t)i * sizeof(T), &narrowed, sizeof(T));
+    }
+    return erlang::nif::ok(env, ret);
+}
+
+static ERL_NIF_TERM pack(ErlNifEnv *env, const ERL_NIF_TERM argv[]) {
+    unsigned int length;
+    ffi_type *type = nullptr;
+    if (!enif_get_list_length(env, argv[0], &length)) {
+        return erlang::nif::error(env, "expecting a list");
+    }
+    if (!get_basic_type_param(env, argv[1], type)) {
+        return erlang::nif::error(env, "type should be a basic type");
+    }
+
+    if (type == &ffi_type_uint8) return pack_numbers<uint8_t, int64_t>(env, argv[0], length);
+    if (type == &ffi_type_uint16) return pack_numbers<uint16_t, int64_t>(env, argv[0], length);
+    if (type == &ffi_type_uint32) return pack_numbers<uint32_t, int64_t>(env, argv[0], length);
+    if (type == &ffi_type_uint64 || type == &ffi_type_pointer) return pack_numbers<uint64_t, uint64_t>(env, argv[0], length);
+    if (type == &ffi_type_sint8) return pack_numbers<int8_t, int64_t>(env, argv[0], length);
+    if (type == &ffi_type_sint16) return pack_numbers<int16_t, int64_t>(env, argv[0], length);
+    if (type == &ffi_type_sint32) return pack_numbers<int32_t, int64_t>(env, argv[0], length);
+    if (type == &ffi_type_sint64) return pack_numbers<int64_t, int64_t>(env, argv[0], length);
+    if (type == &ffi_type_float) return pack_numbers<float, double>(env, argv[0], length);
+    if (type == &ffi_type_double) return pack_numbers<double, double>(env, argv[0], length);
+    return erlang::nif::error(env, "type should be a basic type");
+}
+
+static ERL_NIF_TERM otter_pack_dirty(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[]) {
+    return pack(env, argv);
+}
+
+static ERL_NIF_TERM otter_pack(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[]) {
+    if (argc != 2) return enif_make_badarg(env);
+
+    // count no further than the threshold, walking a long list here would block the scheduler
+    ERL_NIF_TERM list = argv[0], head;
+    size_t cells = 0;
+    while (cells <= pack_dirty_threshold && enif_get_list_cell(env, list, &head, &list)) {
+        cells++;
+    }
+    if (cells > pack_dirty_threshold) {
+        return enif_schedule_nif(env, "pack", ERL_NIF_DIRTY_JOB_CPU_BOUND, otter_pack_dirty, argc, argv);
+    }
+    return pack(env, argv);
+}
+
+template <typename T, typename MakeTerm>
+static void unpack_numbers(ErlNifEnv *env, const uint8_t *data, size_t count, ERL_NIF_TERM *terms, MakeTerm make_term) {
+    for (size_t i = 0; i < count; ++i) {
+        terms[i] = make_term(env, read_unaligned<T>(data + i * sizeof(T)));
+    }
+}
+
+// erlang floats are finite, enif_make_double raises badarg for NaN and infinities
+template <typename T>
+static bool unpack_floats(ErlNifEnv *env, const uint8_t *data, size_t count, ERL_NIF_TERM *terms) {
+    for (size_t i = 0; i < count; ++i) {
+        double value = read_unaligned<T>(data + i * sizeof(T));
+        if (!std::isfinite(value)) {
+            return false;
+        }
+        terms[i] = enif_make_double(env, value);
+    }
+    return true;
+}
+
+static ERL_NIF_TERM unpack(ErlNifEnv *env, const ERL_NIF_TERM argv[]) {
+    ErlNifBinary binary;
+    ffi_type *type = nullptr;
+    if (!enif_inspect_binary(env, argv[0], &binary)) {
+        return erlang::nif::error(env, "cannot get binary");
+    }
+    if (!get_basic_type_param(env, argv[1], type)) {
+        return erlang::nif::error(env, "type should be a basic type");
+    }
+    if (binary.size % type->size != 0) {
+        return erlang::nif::error(env, "binary size is not a multiple of the size of the type");
+    }
 
-                    // check if we should fetch the new value of the current argument
-                    //   for exmaple,
-                    //     {arg_value, %{type: type_term, addr: true, out: true}}
-                    //     {arg_value, %{type: type_term, ref: true, out: true}}
-                    // same as the `addr` above, if `out` was presented in the map
-                    // it must be `true`
-                    bool is_out = false;
-                    ERL_NIF_TERM out_term;
-                    if (enif_get_map_value(env_, type_info, enif_make_atom(env_, "out"), &out_term)) {
-                        arg_with_type->is_out = true;
-                    }
+    size_t count = binary.size / type->size;
+    std::vector<ERL_NIF_TERM> terms(count);
+    const uint8_t *data = binary.data;
+    auto make_uint = [](ErlNifEnv *e, unsigned int v) { return enif_make_uint(e, v); };
+    auto make_int = [](ErlNifEnv *e, int v) { return enif_make_int(e, v); };
+    auto make_uint64 = [](ErlNifEnv *e, uint64_t v) { return enif_make_uint64(e, v); };
+    auto make_int64 = [](ErlNifEnv *e, int64_t v) { return enif_make_int64(e, v); };
+    bool finite = true;
+
+    if (type == &ffi_type_uint8) unpack_numbers<uint8_t>(env, data, count, terms.data(), make_uint);
+    else if (type == &ffi_type_uint16) unpack_numbers<uint16_t>(env, data, count, terms.data(), make_uint);
+    else if (type == &ffi_type_uint32) unpack_numbers<uint32_t>(env, data, count, terms.data(), make_uint);
+    else if (type == &ffi_type_uint64 || type == &ffi_type_pointer) unpack_numbers<uint64_t>(env, data, count, terms.data(), make_uint64);
+    else if (type == &ffi_type_sint8) unpack_numbers<int8_t>(env, data, count, terms.data(), make_int);
+    else if (type == &ffi_type_sint16) unpack_numbers<int16_t>(env, data, count, terms.data(), make_int);
+    else if (type == &ffi_type_sint32) unpack_numbers<int32_t>(env, data, count, terms.data(), make_int);
+    else if (type == &ffi_type_sint64) unpack_numbers<int64_t>(env, data, count, terms.data(), make_int64);
+    else if (type == &ffi_type_float) finite = unpack_floats<float>(env, data, count, terms.data());
+    else if (type == &ffi_type_double) finite = unpack_floats<double>(env, data, count, terms.data());
+
+    if (!finite) {
+        return erlang::nif::error(env, "binary contains NaN or infinity");
+    }
+    return erlang::nif::ok(env, enif_make_list_from_array(env, terms.data(), (unsigned)count));
+}
 
-                    // copy ffi_type to arg_with_type.ffi_arg_type
-                    arg_with_type->ffi_arg_type = std::make_shared<ffi_type>();
-                    if (arg_with_type->type == "c_ptr") {
-                        FFICall::copy_ffi_type(arg_with_type->ffi_arg_type, ffi_type_pointer);
-                    } else if (arg_with_type->type == "s8") {
-                        FFICall::copy_ffi_type(arg_with_type->ffi_arg_type, ffi_type_sint8);
-                    } else if (arg_with_type->type == "s16") {
-                        FFICall::copy_ffi_type(arg_with_type->ffi_arg_type, ffi_type_sint16);
-                    } else if (arg_with_type->type == "s32") {
-                        FFICall::copy_ffi_type(arg_with_type->ffi_arg_type, ffi_type_sint32);
-                    } else if (arg_with_type->type == "s64") {
-                        FFICall::copy_ffi_type(arg_with_type->ffi_arg_type, ffi_type_sint64);
-                    } else if (arg_with_type->type == "u8") {
-                        FFICall::copy_ffi_type(arg_with_type->ffi_arg_type, ffi_type_uint8);
-                    } else if (arg_with_type->type == "u16") {
-                        FFICall::copy_ffi_type(arg_with_type->ffi_arg_type, ffi_type_uint16);
-                    } else if (arg_with_type->type == "u32") {
-                        FFICall::copy_ffi_type(arg_with_type->ffi_arg_type, ffi_type_uint32);
-                    } else if (arg_with_type->type == "u64") {
-                        FFICall::copy_ffi_type(arg_with_type->ffi_arg_type, ffi_type_uint64);
-                    } else if (arg_with_type->type == "f32") {
-                        FFICall::copy_ffi_type(arg_with_type->ffi_arg_type, ffi_type_float);
-                    } else if (arg_with_type->type == "f64") {
-                        FFICall::copy_ffi_type(arg_with_type->ffi_arg_type, ffi_type_double);
-                    } else if (arg_with_type->type == "va_args") {
-                        arg_with_type->is_va_args = true;
-                    }
+static ERL_NIF_TERM otter_unpack_dirty(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[]) {
+    return unpack(env, argv);
+}
 
-                    // nd-array
-                    if (arg_with_type->size > 0) {
-                        // note that nd-array uses a continous (virtual) memory region
-                        // therefore, we can pretend it is a struct
-                        ffi_type ffi_type_array;
-                        // ffi_type_array.size = sizeof(T) * count, where
-                        //   sizeof(T): arg_with_type->ffi_arg_type->size
-                        //   count: arg_with_type->size
-                        ffi_type_array.size = arg_with_type->ffi_arg_type->size * arg_with_type->size;
-                        ffi_type_array.alignment = arg_with_type->ffi_arg_type->alignment;
-                        ffi_type_array.type = FFI_TYPE_STRUCT;
-
-                        FFICall::copy_ffi_type(arg_with_type->ffi_arg_type, ffi_type_array);
-                        arg_with_type->ffi_arg_type->elements = (ffi_type **)&null_ptr_g;
-                    }
+static ERL_NIF_TERM otter_unpack(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[]) {
+    if (argc != 2) return enif_make_badarg(env);
 
-                    arg_types_term = tail;
-                } else if (enif_is_tuple(env_, type_term)) {
-                    auto struct_type = create_from_tuple(type_term, error_msg);
-                    if (struct_type) {
-                        args_with_type.emplace_back(std::make_shared<FFIArgType>(arg_value, type_term, struct_type->struct_id, 0, enif_make_atom(env_, "nil")));
-                        struct_wrapper.push_back(struct_type);
-                        arg_types_term = tail;
-                    } else {
-                        error_msg = "cannot parse type";
-                        return false;
-                    }
-                } else {
-                    auto struct_type = create_from_tuple(type_info, error_msg);
-                    if (struct_type) {
-                        args_with_type.emplace_back(std::make_shared<FFIArgType>(arg_value, type_info, struct_type->struct_id, 0, enif_make_atom(env_, "nil")));
-                        struct_wrapper.push_back(struct_type);
-                        arg_types_term = tail;
-                    } else {
-                        error_msg = "cannot parse type";
-                        return false;
-                    }
-                }
-            } else {
-                error_msg = "each element in args_with_type should be a tuple: {arg_value, type_info}";
-                return false;
-            }
+    // compare the number of elements, as `pack` does, not the number of bytes
+    ErlNifBinary binary;
+    ffi_type *type = nullptr;
+    if (enif_inspect_binary(env, argv[0], &binary) && get_basic_type_param(env, argv[1], type) &&
+        type->size > 0 && binary.size / type->size > pack_dirty_threshold) {
+        return enif_schedule_nif(env, "unpack", ERL_NIF_DIRTY_JOB_CPU_BOUND, otter_unpack_dirty, argc, argv);
+    }
+    return unpack(env, argv);
+}
+
+static ERL_NIF_TERM otter_prepare(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[]) {
+    if (argc != 3) return enif_make_badarg(env);
+
+    OtterSymbol *symbol_res = nullptr;
+    if (!(enif_get_resource(env, argv[0], OtterSymbol::type, (void **)&symbol_res) && symbol_res && symbol_res->val)) {
+        return erlang::nif::error(env, "invalid symbol");
+    }
+
+    std::string return_type_str;
+    ffi_type *return_type = nullptr;
+    if (!(erlang::nif::get_atom(env, argv[1], return_type_str) || erlang::nif::get(env, argv[1], return_type_str))) {
+        return erlang::nif::error(env, "cannot get return type");
+    }
+    if (return_type_str == "void") {
+        return_type = &ffi_type_void;
+    } else if ((return_type = get_basic_ffi_type(return_type_str)) == nullptr) {
+        return erlang::nif::error(env, "return type should be a basic type or :void");
+    }
+
+    std::unique_ptr<PreparedCall> prepared(new PreparedCall());
+    prepared->func = symbol_res->val;
+    prepared->return_type = return_type;
+
+    size_t offset = 0;
+    size_t alignment = 1;
+    ERL_NIF_TERM head, tail, list = argv[2];
+    while (enif_get_list_cell(env, list, &head, &tail)) {
+        ffi_type *arg_type = nullptr;
+        if (!get_basic_type_param(env, head, arg_type)) {
+            return erlang::nif::error(env, "argument types should be basic types");
+        }
+        offset = (offset + arg_type->alignment - 1) / arg_type->alignment * arg_type->alignment;
+        prepared->arg_types.push_back(arg_type);
+        prepared->arg_offsets.push_back(offset);
+        offset += arg_type->size;
+        if (arg_type->alignment > alignment) {
+            alignment = arg_type->alignment;
         }
+        list = tail;
+    }
+    prepared->record_size = (offset + alignment - 1) / alignment * alignment;
 
-        // verify that we do have `length` new arguments parsed
-        if ((args_with_type.size() - prev_size) == length) {
-            return true;
-        } else {
-            error_msg = std::string(__PRETTY_FUNCTION__) + ": expected " + std::to_string(length) + " arguments to be parsed, however, only " + std::to_string(args_with_type.size() - prev_size) + " arguments were successfully parsed";
-            return false;
+    if (ffi_prep_cif(&prepared->cif, FFI_DEFAULT_ABI, (unsigned)prepared->arg_types.size(),
+                     prepared->return_type, prepared->arg_types.data()) != FFI_OK) {
+        return erlang::nif::error(env, "ffi_prep_cif failed");
+    }
+
+    if (!memory_accounting.charge(MemoryAccounting::PREPARED, sizeof(PreparedCall))) {
+        return native_memory_budget_error(env);
+    }
+    OtterPrepared *res = nullptr;
+    if (!alloc_resource(&res)) {
+        memory_accounting.release(MemoryAccounting::PREPARED, sizeof(PreparedCall));
+        return erlang::nif::error(env, "cannot allocate memory for resource");
+    }
+    res->val = prepared.release();
+    ERL_NIF_TERM ret = enif_make_resource(env, res);
+    enif_release_resource(res);
+    return erlang::nif::ok(env, ret);
+}
+
+static std::shared_ptr<otter::WorkStealingPool> get_thread_pool() {
+    std::lock_guard<std::mutex> g(thread_pool_lock);
+    if (!thread_pool) {
+        size_t num_threads = thread_pool_size;
+        if (num_threads == 0) {
+            num_threads = std::thread::hardware_concurrency();
         }
+        thread_pool = std::make_shared<otter::WorkStealingPool>(num_threads);
     }
+    return thread_pool;
+}
 
-    bool _process_args_with_type(size_t &num_args_processed, size_t arg_offset, std::string &error_msg, bool allow_va_args) {
-        // `va_args` can only appear once in the last position
-        // note that `va_args` is a pseudo-type in Otter
-        //   where `va_list` is the real underlying type defined in stdarg.h
-        //   and `va_list` is the one you can pass around in C
-        bool ok = true;
-        bool last_is_va_args = false;
-        size_t arg_failed = 0;
+// size of one return value in the output of parallel_map
+// ffi_type_void has a size of 1, but a void function returns nothing
+static size_t return_value_size(ffi_type *type) {
+    return type == &ffi_type_void ? 0 : type->size;
+}
 
-        size_t total_size = args_with_type_.size();
-        for (size_t i = arg_offset; i < total_size; ++i) {
-            if (last_is_va_args) {
-                error_msg = "va_args can only appear at the end of the input argument list";
-                ok = false;
-                break;
-            }
+// store the return value of ffi_call
+// integral return values smaller than ffi_arg are widened by libffi
+static void store_return_value(ffi_type *type, const ffi_arg &rvalue, uint8_t *dst) {
+    if (return_value_size(type) == 0) {
+        return;
+    }
+    if (type == &ffi_type_float || type == &ffi_type_double || type->size >= sizeof(ffi_arg)) {
+        memcpy(dst, &rvalue, type->size);
+    } else if (type->size == 1) {
+        uint8_t v = (uint8_t)rvalue;
+        memcpy(dst, &v, 1);
+    } else if (type->size == 2) {
+        uint16_t v = (uint16_t)rvalue;
+        memcpy(dst, &v, 2);
+    } else if (type->size == 4) {
+        uint32_t v = (uint32_t)rvalue;
+        memcpy(dst, &v, 4);
+    }
+}
 
-            num_args_processed += 1;
-            arg_failed = i;
-            auto &p = args_with_type_[i];
-            if (p->is_out) {
-                out_value_indexes.push_back(i);
-            }
+static ERL_NIF_TERM otter_parallel_map(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[]) {
+    if (argc != 4) return enif_make_badarg(env);
 
-            if (p->type == "c_ptr") {
-                if (!handle_c_ptr_arg(erlang::nif::get_sint64, p, i)) {
-                    ok = false;
-                    break;
-                }
-            } else if (p->type == "s8") {
-                if (!handle_arg<int8_t, int>(erlang::nif::get_sint, p, i)) {
-                    ok = false;
-                    break;
-                }
-            } else if (p->type == "s16") {
-                if (!handle_arg<int16_t, int>(erlang::nif::get_sint, p, i)) {
-                    ok = false;
-                    break;
-                }
-            } else if (p->type == "s32") {
-                if (!handle_arg<int32_t, int>(erlang::nif::get_sint, p, i)) {
-                    ok = false;
-                    break;
-                }
-            } else if (p->type == "s64") {
-                if (!handle_arg<int64_t, int64_t>(erlang::nif::get_sint64, p, i)) {
-                    ok = false;
-                    break;
-                }
-            } else if (p->type == "u8") {
-                if (!handle_arg<uint8_t, unsigned int>(erlang::nif::get_uint, p, i)) {
-                    ok = false;
-                    break;
-                }
-            } else if (p->type == "u16") {
-                if (!handle_arg<uint16_t, unsigned int>(erlang::nif::get_uint, p, i)) {
-                    ok = false;
-                    break;
-                }
-            } else if (p->type == "u32") {
-                if (!handle_arg<uint32_t, unsigned int>(erlang::nif::get_uint, p, i)) {
-                    ok = false;
-                    break;
-                }
-            } else if (p->type == "u64") {
-                if (!handle_arg<uint64_t, uint64_t>(erlang::nif::get_uint64, p, i)) {
-                    ok = false;
-                    break;
-                }
-            } else if (p->type == "f32") {
-                if (!handle_arg<float, double>(erlang::nif::get_f64, p, i)) {
-                    ok = false;
-                    break;
-                }
-            } else if (p->type == "f64") {
-                if (!handle_arg<double, double>(erlang::nif::get_f64, p, i)) {
-                    ok = false;
-                    break;
-                }
-            } else if (p->type == "va_args") {
-                if (allow_va_args) {
-                    // notes:
-                    //  - `error_msg` will be set in handle_va_args
-                    //  - `args` will be realloc'ed in handle_va_args
-                    if (!handle_va_args(p, i, error_msg)) {
-                        ok = false;
-                        break;
-                    } else {
-                        last_is_va_args = true;
-                        num_args_processed -= 1;
-                    }
-                } else {
-                    error_msg = "type :va_args only allow to appear once as the type of the last argument";
-                    ok = false;
-                    break;
-                }
-            } else {
-                auto wrapper_it = create_from_tuple(p->type_term, error_msg);
-                if (wrapper_it != nullptr) {
-                    args[i] = &wrapper_it->ffi_struct_type;
-                    // https://www.erlang.org/doc/man/erl_nif.html#enif_get_resource
-                    // enif_get_resource does not add a reference to the resource object.
-                    // However, the pointer received in *objp is guaranteed to be valid
-                    // at least as long as the resource handle term is valid.
-                    void *resource_obj_ptr = nullptr;
-                    if (!enif_get_resource(env_, p->term, wrapper_it->resource_type, &resource_obj_ptr)) {
-                        error_msg = "failed to get resource for struct: " + wrapper_it->struct_id;
-                        ok = false;
-                        break;
-                    }
-                    p->is_struct_instance = true;
-                    p->struct_data = resource_obj_ptr;
+    OtterPrepared *res = nullptr;
+    ErlNifBinary inputs;
+    uint64_t max_threads, chunk_size;
+    if (!(enif_get_resource(env, argv[0], OtterPrepared::type, (void **)&res) && res && res->val)) {
+        return erlang::nif::error(env, "cannot get prepared function");
+    }
+    if (!enif_inspect_binary(env, argv[1], &inputs)) {
+        return erlang::nif::error(env, "inputs should be a binary");
+    }
+    if (!erlang::nif::get_uint64(env, argv[2], &max_threads) || !erlang::nif::get_uint64(env, argv[3], &chunk_size)) {
+        return erlang::nif::error(env, "cannot get max_threads or chunk_size");
+    }
 
-                    struct_wrapper.push_back(wrapper_it);
-                } else {
-                    // todo: other types
-                    error_msg = std::string(__PRETTY_FUNCTION__) + ": not implemented for type: " + p->type;
-                    ok = false;
-                    break;
+    PreparedCall *prepared = res->val;
+    if (prepared->record_size == 0) {
+        return erlang::nif::error(env, "the prepared function takes no arguments");
+    }
+    if (inputs.size % prepared->record_size != 0) {
+        return erlang::nif::error(env, "inputs size is not a multiple of the input record size");
+    }
+
+    size_t num_records = inputs.size / prepared->record_size;
+    size_t return_size = return_value_size(prepared->return_type);
+    ErlNifBinary outputs;
+    if (!enif_alloc_binary(num_records * return_size, &outputs)) {
+        return erlang::nif::error(env, "cannot allocate memory for outputs");
+    }
+    if (num_records == 0) {
+        return erlang::nif::ok(env, enif_make_binary(env, &outputs));
+    }
+
+    auto pool = get_thread_pool();
+    size_t num_workers = pool->size();
+    if (max_threads > 0 && max_threads < num_workers) {
+        num_workers = (size_t)max_threads;
+    }
+    // by default, a few chunks per worker so that faster workers can steal the rest
+    if (chunk_size == 0) {
+        chunk_size = (num_records + num_workers * 4 - 1) / (num_workers * 4);
+    }
+    size_t num_chunks = (num_records + chunk_size - 1) / chunk_size;
+
+    const uint8_t *in = inputs.data;
+    uint8_t *out = outputs.data;
+    otter::Latch latch(num_chunks);
+    std::vector<std::function<void()>> tasks;
+    tasks.reserve(num_chunks);
+    for (size_t c = 0; c < num_chunks; ++c) {
+        size_t begin = c * chunk_size;
+        size_t end = begin + chunk_size;
+        if (end > num_records) end = num_records;
+        tasks.emplace_back([prepared, in, out, begin, end, &latch]() {
+            size_t num_args = prepared->arg_types.size();
+            std::vector<void *> values(num_args);
+            size_t return_size = return_value_size(prepared->return_type);
+            ffi_arg rvalue;
+            for (size_t i = begin; i < end; ++i) {
+                const uint8_t *record = in + i * prepared->record_size;
+                for (size_t a = 0; a < num_args; ++a) {
+                    values[a] = (void *)(record + prepared->arg_offsets[a]);
                 }
+                ffi_call(&prepared->cif, (void (*)())prepared->func, &rvalue, values.data());
+                store_return_value(prepared->return_type, rvalue, out + i * return_size);
             }
-        }
+            latch.count_down();
+        });
+    }
+    pool->submit(tasks, num_workers);
+    latch.wait();
 
-        if (!ok) {
-            if (error_msg.empty()) {
-                error_msg = "failed to process argument at index " + std::to_string(arg_failed);
-            }
-        }
-        return ok;
+    return erlang::nif::ok(env, enif_make_binary(env, &outputs));
+}
+
+static ERL_NIF_TERM otter_set_thread_pool_size(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[]) {
+    if (argc != 1) return enif_make_badarg(env);
+
+    uint64_t size;
+    if (!erlang::nif::get_uint64(env, argv[0], &size)) {
+        return erlang::nif::error(env, "cannot get thread pool size");
     }
 
-    bool handle_c_ptr_arg(int(*get_nif_term_value)(ErlNifEnv *, ERL_NIF_TERM, int64_t *), std::shared_ptr<FFIArgType> &p, size_t arg_index) {
-        auto ffi_arg_res = get_ffi_res<void *>();
-        // if enif_inspect_binary succeeded,
-        // `binary.data` will live until we return to erlang
-        ErlNifBinary binary;
-        uint64_t ptr;
-        size_t value_slot = 0;
-        std::string null_c_ptr;
+    // the current pool is destroyed once all calls running on it return
+    std::lock_guard<std::mutex> g(thread_pool_lock);
+    thread_pool_size = (size_t)size;
+    thread_pool.reset();
+    return erlang::nif::ok(env);
+}
 
-        // it could be a function pointer
-        OtterSymbol * symbol_res = nullptr;
-        if (enif_get_resource(env_, p->term, OtterSymbol::type, (void **)&symbol_res) && symbol_res) {
-            // do not check if the symbol is a nullptr
-            // because it might be intended value for the function to be called
-            void * func_ptr = symbol_res->val;
-            args[arg_index] = &ffi_type_pointer;
-            if (ffi_arg_res == nullptr || !ffi_arg_res->set(func_ptr, value_slot)) {
-                return false;
-            }
-            type_index_resindex[(uint64_t)(uint64_t *)args[arg_index]][arg_index] = value_slot;
-        } else if (enif_inspect_binary(env_, p->term, &binary)) {
-            args[arg_index] = &ffi_type_pointer;
-            if (ffi_arg_res == nullptr || !ffi_arg_res->set(binary.data, value_slot)) {
-                return false;
-            }
-            type_index_resindex[(uint64_t)(uint64_t *)args[arg_index]][arg_index] = value_slot;
-        } else if (erlang::nif::get_atom(env_, p->term, null_c_ptr) &&
-                   (null_c_ptr == "NULL" || null_c_ptr == "nil")) {
-            args[arg_index] = &ffi_type_pointer;
-            if (ffi_arg_res == nullptr || !ffi_arg_res->set(nullptr, value_slot)) {
-                return false;
-            }
-            type_index_resindex[(uint64_t)(uint64_t *)args[arg_index]][arg_index] = value_slot;
-        } else if (erlang::nif::get_uint64(env_, p->term, &ptr)) {
-            args[arg_index] = &ffi_type_pointer;
-            if (ffi_arg_res == nullptr || !ffi_arg_res->set((void *)(uint64_t *)(ptr), value_slot)) {
-                return false;
-            }
-            type_index_resindex[(uint64_t)(uint64_t *)args[arg_index]][arg_index] = value_slot;
-        } else {
-            return false;
-        }
-        return handle_pass_by_addr<void *>(ffi_arg_res, value_slot, p, arg_index);
+static bool get_decode_format(ErlNifEnv *env, ERL_NIF_TERM format_term, bool &as_map) {
+    std::string format;
+    if (erlang::nif::get_atom(env, format_term, format) && (format == "map" || format == "tuple")) {
+        as_map = (format == "map");
+        return true;
     }
+    return false;
+}
 
-    template <
-        typename T,
-        typename ERL_API_T=T,
-        typename get_nif_term_func = int(*)(ErlNifEnv *, ERL_NIF_TERM, ERL_API_T*)>
-    bool handle_arg(
-        get_nif_term_func get_nif_term_value,
-        std::shared_ptr<FFIArgType> &p,
-        size_t arg_index,
-        T _unused=0) {
-        ERL_API_T value;
-        if (args != nullptr && get_nif_term_value(env_, p->term, &value)) {
-            args[arg_index] = get_default_ffi_type<T>();
-            auto ffi_arg_res = get_ffi_res<T>();
-            size_t value_slot = 0;
-            if (ffi_arg_res && ffi_arg_res->set((T)value, value_slot)) {
-                type_index_resindex[(uint64_t)(uint64_t *)args[arg_index]][arg_index] = value_slot;
-                return handle_pass_by_addr<T>(ffi_arg_res, value_slot, p, arg_index);
-            } else {
-                printf("[debug] cannot save value for %s to ffi_arg_res\r\n", p->type.c_str());
-                return false;
-            }
-        } else {
-            printf("[debug] cannot get value for %s\r\n", p->type.c_str());
-            return false;
-        }
+static ERL_NIF_TERM otter_decode_struct(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[]) {
+    if (argc != 3) return enif_make_badarg(env);
+
+    std::string error_msg;
+    bool as_map = true;
+    auto layout = StructLayout::get(env, argv[0], error_msg);
+    if (layout == nullptr) {
+        return erlang::nif::error(env, error_msg.c_str());
+    }
+    if (!get_decode_format(env, argv[2], as_map)) {
+        return erlang::nif::error(env, "format should be either :map or :tuple");
     }
 
-    bool handle_va_args(std::shared_ptr<FFIArgType> &va_args, size_t va_arg_index, std::string &error_msg) {
-        // va_args.term should be a list of 2-tuples like
-        //   {value, %{type: TYPE, extra: EXTRA}}
+    auto resource_type = FFIStructTypeWrapper::get_ffi_struct_resource_type(env, layout->struct_id);
+    void *data = nullptr;
+    size_t size = 0;
+    if (!get_struct_data(env, argv[1], resource_type, layout->struct_id, data, size)) {
+        return erlang::nif::error(env, ("failed to get resource for struct: " + layout->struct_id).c_str());
+    }
+    if (size < layout->size) {
+        return erlang::nif::error(env, "struct resource is smaller than the struct layout");
+    }
 
-        // call pop_back because the last one is :va_args
-        std::shared_ptr<FFIArgType> this_va_args = va_args;
-        args_with_type_.pop_back();
-        if (_get_args_with_type(va_args->term, va_arg_index, args_with_type_, error_msg)) {
-            size_t total_args = args_with_type_.size();
-            void * new_args = realloc((void *)args, sizeof(ffi_type *) * total_args);
-            if (new_args == nullptr) {
-                error_msg = "cannot allocate enough memory for function arguments";
-                return false;
-            }
-            args = (ffi_type **)new_args;
+    std::vector<ERL_NIF_TERM> values;
+    ERL_NIF_TERM decoded;
+    if (!layout->decode(env, (const uint8_t *)data, as_map, values, decoded, error_msg)) {
+        return erlang::nif::error(env, error_msg.c_str());
+    }
+    return erlang::nif::ok(env, decoded);
+}
 
-            size_t num_var_args = 0;
+static ERL_NIF_TERM otter_decode_struct_array(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[]) {
+    if (argc != 3) return enif_make_badarg(env);
 
-            return _process_args_with_type(num_var_args, va_arg_index, error_msg, false);
-        } else {
-            error_msg = "failed to parse argument types in va_args";
-            return false;
+    std::string error_msg;
+    bool as_map = true;
+    ErlNifBinary binary;
+    auto layout = StructLayout::get(env, argv[0], error_msg);
+    if (layout == nullptr) {
+        return erlang::nif::error(env, error_msg.c_str());
+    }
+    if (!enif_inspect_binary(env, argv[1], &binary)) {
+        return erlang::nif::error(env, "cannot get binary");
+    }
+    if (!get_decode_format(env, argv[2], as_map)) {
+        return erlang::nif::error(env, "format should be either :map or :tuple");
+    }
+    if (layout->size == 0 || binary.size % layout->size != 0) {
+        return erlang::nif::error(env, ("binary size is not a multiple of the size of struct " + layout->struct_id).c_str());
+    }
+
+    // build the list backwards so that no reverse is needed
+    size_t num_structs = binary.size / layout->size;
+    std::vector<ERL_NIF_TERM> values;
+    ERL_NIF_TERM list = enif_make_list(env, 0);
+    for (size_t i = num_structs; i > 0; --i) {
+        ERL_NIF_TERM decoded;
+        if (!layout->decode(env, binary.data + (i - 1) * layout->size, as_map, values, decoded, error_msg)) {
+            return erlang::nif::error(env, error_msg.c_str());
         }
+        list = enif_make_list_cell(env, decoded, list);
     }
+    return erlang::nif::ok(env, list);
+}
 
-    template <typename T>
-    bool handle_pass_by_addr(
-        FFIResource<T> * ffi_arg_res,
-        size_t value_slot,
-        std::shared_ptr<FFIArgType> &p,
-        size_t arg_index)
-    {
-        p->ffi_arg_type_original = p->ffi_arg_type;
-        p->value_slot_original = value_slot;
+static ERL_NIF_TERM otter_variadic_cif_cache_info(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[]) {
+    return erlang::nif::ok(env, variadic_cif_cache.info(env));
+}
 
-        if (p->pass_by == FFIArgType::ADDR) {
-            args[arg_index] = get_default_ffi_type<void *>();
-            auto ffi_arg_by_addr_res = get_ffi_res<void *>();
-            void * res_address = nullptr;
-            if (ffi_arg_res && ffi_arg_by_addr_res &&
-                ffi_arg_res->get(value_slot, res_address) &&
-                ffi_arg_by_addr_res->set(res_address, value_slot)) {
+static ERL_NIF_TERM otter_set_variadic_cif_cache_capacity(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[]) {
+    if (argc != 1) return enif_make_badarg(env);
 
-                p->ffi_arg_type = std::make_shared<ffi_type>();
-                copy_ffi_type(p->ffi_arg_type, ffi_type_pointer);
-                p->value_slot = value_slot;
+    uint64_t capacity;
+    if (erlang::nif::get_uint64(env, argv[0], &capacity)) {
+        variadic_cif_cache.set_capacity(capacity);
+        return erlang::nif::ok(env);
+    } else {
+        return erlang::nif::error(env, "cannot get capacity");
+    }
+}
 
-                type_index_resindex[(uint64_t)(uint64_t *)args[arg_index]][arg_index] = value_slot;
-                return true;
-            } else {
-                return false;
-            }
-        } else {
-            p->value_slot = value_slot;
-        }
-        return true;
+static ERL_NIF_TERM otter_owned_pointer(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[]) {
+    if (argc != 3) return enif_make_badarg(env);
+
+    uint64_t address;
+    OtterSymbol *symbol_res = nullptr;
+    std::string background;
+    if (!erlang::nif::get_uint64(env, argv[0], &address)) {
+        return erlang::nif::error(env, "cannot get address");
+    }
+    if (!(enif_get_resource(env, argv[1], OtterSymbol::type, (void **)&symbol_res) && symbol_res && symbol_res->val)) {
+        return erlang::nif::error(env, "cannot get destructor symbol");
+    }
+    if (!(erlang::nif::get_atom(env, argv[2], background) && (background == "true" || background == "false"))) {
+        return erlang::nif::error(env, "expecting a boolean");
     }
 
-    bool handle_out_values(std::shared_ptr<FFIArgType> &p, ERL_NIF_TERM &out_term, std::string &out_error) {
-        bool ok = false;
-        out_error = "not implemented for type " + p->type;
-        if (p->type == "c_ptr") {
-            // need to handle pointers with care
-            // copy data, but how many bytes should we copy?
-        } else if (p->type == "s8") {
-            ok = handle_out_values<int8_t, int32_t>(enif_make_int, p, out_term, out_error);
-        } else if (p->type == "s16") {
-            ok = handle_out_values<int16_t, int32_t>(enif_make_int, p, out_term, out_error);
-        } else if (p->type == "s32") {
-            ok = handle_out_values<int32_t, int32_t>(enif_make_int, p, out_term, out_error);
-        } else if (p->type == "s64") {
-            ok = handle_out_values<int64_t, int64_t>(enif_make_long, p, out_term, out_error);
-        } else if (p->type == "u8") {
-            ok = handle_out_values<uint8_t, uint32_t>(enif_make_uint, p, out_term, out_error);
-        } else if (p->type == "u16") {
-            ok = handle_out_values<uint16_t, uint32_t>(enif_make_uint, p, out_term, out_error);
-        } else if (p->type == "u32") {
-            ok = handle_out_values<uint32_t, uint32_t>(enif_make_uint, p, out_term, out_error);
-        } else if (p->type == "u64") {
-            ok = handle_out_values<uint64_t, uint64_t>(enif_make_ulong, p, out_term, out_error);
-        } else if (p->type == "f32") {
-            ok = handle_out_values<float, double>(enif_make_double, p, out_term, out_error);
-        } else if (p->type == "f64") {
-            ok = handle_out_values<double, double>(enif_make_double, p, out_term, out_error);
-        } else {
-            bool is_struct = false;
-            if (is_struct) {
-                // todo: struct
-            } else {
-                // todo: other types
-                printf("[debug] type: %s\r\n", p->type.c_str());
-            }
-            ok = false;
-        }
-        return ok;
+    OtterOwnedPointer *res = nullptr;
+    if (!alloc_resource(&res)) {
+        return erlang::nif::error(env, "cannot allocate memory for resource");
     }
+    new (&res->val.ptr) std::atomic<void *>((void *)address);
+    res->val.destructor = (void (*)(void *))symbol_res->val;
+    res->val.background = (background == "true");
 
-    template <typename T, typename ERL_API_T=T, typename make_nif_term_func = ERL_NIF_TERM(*)(ErlNifEnv *, ERL_API_T)>
-    bool handle_out_values(
-        make_nif_term_func make_term,
-        std::shared_ptr<FFIArgType> &p,
-        ERL_NIF_TERM &out_term,
-        std::string &out_error)
-    {
-        auto ffi_arg_res = get_ffi_res<T>();
-        T value;
-        if (ffi_arg_res && ffi_arg_res->get_value(p->value_slot_original, value)) {
-            out_term = make_term(env_, value);
-            return true;
-        } else {
-            out_error = "cannot get original argument storage";
-            return false;
-        }
+    ERL_NIF_TERM ret = enif_make_resource(env, res);
+    enif_release_resource(res);
+    return erlang::nif::ok(env, ret);
+}
+
+static ERL_NIF_TERM otter_owned_pointer_release(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[]) {
+    if (argc != 1) return enif_make_badarg(env);
+
+    OtterOwnedPointer *res = nullptr;
+    if (!(enif_get_resource(env, argv[0], OtterOwnedPointer::type, (void **)&res) && res)) {
+        return erlang::nif::error(env, "cannot get owned pointer");
     }
+    release_owned_pointer(res->val);
+    return erlang::nif::ok(env);
+}
 
-    std::shared_ptr<FFIStructTypeWrapper> create_from_tuple(
-        ERL_NIF_TERM struct_return_type_term,
-        std::string &error_msg)
-    {
-        int arity = -1;
-        const ERL_NIF_TERM *array;
-        std::vector<std::shared_ptr<FFIArgType>> args_with_type;
-        bool is_size_correct_tuple =
-                enif_get_tuple(env_, struct_return_type_term, &arity, &array) &&
-                arity == 3;
-        std::string struct_atom;
-        std::string struct_id;
-        erlang::nif::get_atom(env_, array[0], struct_atom);
-        erlang::nif::get_atom(env_, array[1], struct_id);
-        if (!is_size_correct_tuple) {
-            return nullptr;
-        }
+static ERL_NIF_TERM otter_owned_pointer_address(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[]) {
+    if (argc != 1) return enif_make_badarg(env);
 
-        if (struct_atom != "struct") {
-            return nullptr;
-        }
+    OtterOwnedPointer *res = nullptr;
+    if (!(enif_get_resource(env, argv[0], OtterOwnedPointer::type, (void **)&res) && res)) {
+        return erlang::nif::error(env, "cannot get owned pointer");
+    }
+    return erlang::nif::ok(env, enif_make_uint64(env, (uint64_t)res->val.ptr.load()));
+}
 
-        if (_get_args_with_type(array[2], 0, args_with_type, error_msg)) {
-            auto wrapper = std::make_shared<FFIStructTypeWrapper>(args_with_type.size() + 1);
+static ERL_NIF_TERM otter_struct_pool_info(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[]) {
+    return erlang::nif::ok(env, StructPool::info(env));
+}
 
-            wrapper->struct_id = struct_id;
-            wrapper->resource_type = FFIStructTypeWrapper::get_ffi_struct_resource_type(env_, struct_id);
+static ERL_NIF_TERM otter_set_struct_pool_capacity(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[]) {
+    if (argc != 1) return enif_make_badarg(env);
 
-            // note: wrapper will be added to `wrappers` after it is returned from this function
-            if (wrapper->resource_type) {
-                for (size_t i = 0; i < args_with_type.size(); ++i) {
-                    auto &p = args_with_type[i];
-                    wrapper->field_types.push_back(p->ffi_arg_type);
-                    wrapper->ffi_struct_type.elements[i] = wrapper->field_types[i].get();
-                }
-                wrapper->ffi_struct_type.elements[args_with_type.size()] = nullptr;
-                return wrapper;
-            } else {
-                wrapper.reset();
-                return nullptr;
-            }
-        }
-        return nullptr;
+    uint64_t capacity;
+    if (erlang::nif::get_uint64(env, argv[0], &capacity)) {
+        StructPool::set_capacity(capacity);
+        return erlang::nif::ok(env);
+    } else {
+        return erlang::nif::error(env, "cannot get capacity");
     }
+}
 
-    template <typename T>
-    auto get_ffi_res() -> FFIResource<T> * {
-        auto u64_type = (uint64_t)(uint64_t *)get_default_ffi_type<T>();
-        if (ffi_res.find(u64_type) != ffi_res.end()) {
-            return (FFIResource<T> *)ffi_res[u64_type];
-        } else {
-            ffi_res[u64_type] = new FFIResource<T>();
-            return (FFIResource<T> *)ffi_res[u64_type];
+static ERL_NIF_TERM otter_set_struct_pooling(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[]) {
+    if (argc != 2) return enif_make_badarg(env);
+
+    int arity;
+    const ERL_NIF_TERM *array;
+    std::string struct_atom, struct_id, enable;
+    if (!(enif_get_tuple(env, argv[0], &arity, &array) && arity == 3 &&
+          erlang::nif::get_atom(env, array[0], struct_atom) && struct_atom == "struct" &&
+          erlang::nif::get_atom(env, array[1], struct_id))) {
+        return erlang::nif::error(env, "expecting a struct type");
+    }
+    if (!(erlang::nif::get_atom(env, argv[1], enable) && (enable == "true" || enable == "false"))) {
+        return erlang::nif::error(env, "expecting a boolean");
+    }
+
+    StructPool::set_enabled(struct_id, enable == "true");
+    return erlang::nif::ok(env);
+}
+
+static void ring_resource_dtor(ErlNifEnv *env, void *obj) {
+    auto res = (OtterRing *)obj;
+    if (res && res->val) {
+        // a selected doorbell keeps a reference to the resource until it is stopped,
+        // so it has been closed by `ring_resource_stop` if it was ever selected
+        if (!res->val->selected && res->val->ring->doorbell_fd >= 0) {
+            close(res->val->ring->doorbell_fd);
         }
+        memory_accounting.release(MemoryAccounting::RING, res->val->bytes);
+        free(res->val->ring);
+        delete res->val;
+        res->val = nullptr;
     }
+}
 
-    ErlNifEnv * env_;
-    ERL_NIF_TERM symbol_;
-    ERL_NIF_TERM return_type_;
-    ERL_NIF_TERM arg_types_term_;
+static void ring_resource_stop(ErlNifEnv *env, void *obj, ErlNifEvent event, int is_direct_call) {
+    close((int)event);
+}
 
-    std::vector<std::shared_ptr<FFIArgType>> args_with_type_;
-    std::vector<std::shared_ptr<FFIStructTypeWrapper>> struct_wrapper;
+// true if the slot `offset` records after `head` has been written
+static bool ring_has_record(struct otter_ring *ring, uint64_t offset = 0) {
+    uint64_t pos = __atomic_load_n(&ring->head, __ATOMIC_RELAXED) + offset;
+    return __atomic_load_n((uint64_t *)otter_ring_slot(ring, pos), __ATOMIC_ACQUIRE) == pos + 1;
+}
 
-    std::string return_type;
-    std::shared_ptr<FFIStructTypeWrapper> struct_return_type = nullptr;
-    size_t num_fixed_args = 0;
-    size_t num_variadic_args = 0;
+static bool get_ring(ErlNifEnv *env, ERL_NIF_TERM term, OtterRing *&res) {
+    return enif_get_resource(env, term, OtterRing::type, (void **)&res) && res && res->val && !res->val->closed;
+}
 
-    // type_index_resindex (resource pool)
-    //   key: type
-    //   value:
-    //     key: index in the above variable values
-    //     value: index in ffi_resources
-    std::map<uint64_t, std::map<size_t, size_t>> type_index_resindex;
-    std::map<uint64_t, void *> ffi_res;
-    std::vector<size_t> out_value_indexes;
+static ERL_NIF_TERM otter_ring_new(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[]) {
+    if (argc != 3) return enif_make_badarg(env);
 
-    ffi_cif cif;
-    ffi_type ** args = nullptr;
-    void ** values = nullptr;
-    ffi_type * ffi_return_type = nullptr;
-    void * rc = nullptr;
-};
+#if defined(__linux__)
+    uint64_t record_size, capacity;
+    std::string mode;
+    if (!erlang::nif::get_uint64(env, argv[0], &record_size) || record_size == 0 ||
+        record_size > std::numeric_limits<uint32_t>::max() / 2) {
+        return erlang::nif::error(env, "cannot get record size");
+    }
+    if (!erlang::nif::get_uint64(env, argv[1], &capacity) || capacity == 0 || capacity > (1u << 30)) {
+        return erlang::nif::error(env, "cannot get capacity");
+    }
+    if (!(erlang::nif::get_atom(env, argv[2], mode) && (mode == "spsc" || mode == "mpsc"))) {
+        return erlang::nif::error(env, "mode should be either :spsc or :mpsc");
+    }
+
+    uint64_t num_slots = 1;
+    while (num_slots < capacity) num_slots <<= 1;
+    uint32_t slot_size = (uint32_t)(8 + (record_size + 7) / 8 * 8);
+    size_t bytes = sizeof(struct otter_ring) + (size_t)num_slots * slot_size;
+    if (!memory_accounting.charge(MemoryAccounting::RING, bytes)) {
+        return native_memory_budget_error(env);
+    }
+
+    void *memory = nullptr;
+    if (posix_memalign(&memory, OTTER_RING_CACHE_LINE, bytes) != 0) {
+        memory_accounting.release(MemoryAccounting::RING, bytes);
+        return erlang::nif::error(env, "cannot allocate memory for ring");
+    }
+    memset(memory, 0, bytes);
+    auto ring = (struct otter_ring *)memory;
+    ring->magic = OTTER_RING_MAGIC;
+    ring->version = OTTER_RING_VERSION;
+    ring->mode = mode == "spsc" ? OTTER_RING_SPSC : OTTER_RING_MPSC;
+    ring->record_size = (uint32_t)record_size;
+    ring->slot_size = slot_size;
+    ring->capacity = (uint32_t)num_slots;
+    for (uint64_t i = 0; i < num_slots; ++i) {
+        memcpy(otter_ring_slot(ring, i), &i, sizeof(i));
+    }
+    ring->doorbell_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (ring->doorbell_fd < 0) {
+        int err = errno;
+        free(memory);
+        memory_accounting.release(MemoryAccounting::RING, bytes);
+        return erlang::nif::error(env, strerror(err));
+    }
+
+    OtterRing *res = nullptr;
+    if (!alloc_resource(&res)) {
+        close(ring->doorbell_fd);
+        free(memory);
+        memory_accounting.release(MemoryAccounting::RING, bytes);
+        return erlang::nif::error(env, "cannot allocate memory for resource");
+    }
+    res->val = new SharedRing();
+    res->val->ring = ring;
+    res->val->bytes = bytes;
+    res->val->selected = false;
+    res->val->closed = false;
+
+    ERL_NIF_TERM ret = enif_make_resource(env, res);
+    enif_release_resource(res);
+    return erlang::nif::ok(env, ret);
+#else
+    return erlang::nif::error(env, "shared rings are only supported on Linux");
+#endif
+}
+
+static ERL_NIF_TERM otter_ring_arm(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[]) {
+    if (argc != 2) return enif_make_badarg(env);
+
+    OtterRing *res = nullptr;
+    if (!get_ring(env, argv[0], res)) {
+        return erlang::nif::error(env, "cannot get ring resource");
+    }
 
-static ERL_NIF_TERM otter_dlopen(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[]) {
-    if (argc != 2) {
-        return enif_make_badarg(env);
+    std::lock_guard<std::mutex> g(res->val->drain_lock);
+    auto ring = res->val->ring;
+    __atomic_store_n(&ring->armed, 1, __ATOMIC_SEQ_CST);
+    // a record pushed before `armed` was set did not ring the doorbell
+    if (ring_has_record(ring)) {
+        __atomic_store_n(&ring->armed, 0, __ATOMIC_SEQ_CST);
+        return erlang::nif::ok(env, enif_make_atom(env, "ready"));
     }
-    ERL_NIF_TERM path_term = argv[0];
-    ERL_NIF_TERM mode_term = argv[1];
 
-    int mode = 0;
-    if (erlang::nif::get(env, mode_term, &mode)) {
-        std::string path;
-        const char *c_path = nullptr;
-        if (erlang::nif::get(env, path_term, path) && !path.empty()) {
-            if (path == "RTLD_SELF") {
-                c_path = nullptr;
-            } else {
-                c_path = path.c_str();
-            }
-        } else {
-            return enif_make_badarg(env);
-        }
+    // the calling process receives {:select, ring, ref, :ready_input} when the doorbell rings
+    if (enif_select(env, ring->doorbell_fd, ERL_NIF_SELECT_READ, res, nullptr, argv[1]) < 0) {
+        __atomic_store_n(&ring->armed, 0, __ATOMIC_SEQ_CST);
+        return erlang::nif::error(env, "enif_select failed");
+    }
+    res->val->selected = true;
+    return erlang::nif::ok(env);
+}
 
-        OtterHandle *handle = nullptr;
-        if (opened_handles.find(path) != opened_handles.end()) {
-            handle = opened_handles[path];
-        } else {
-            void *handle_dl = dlopen(c_path, mode);
-            if (handle_dl != nullptr) {
-                if (alloc_resource(&handle)) {
-                    opened_handles[path] = handle;
-                    handle->val = handle_dl;
-                } else {
-                    dlclose(handle_dl);
-                    return erlang::nif::error(env, "cannot allocate memory for resource");
-                }
-            } else {
-                return erlang::nif::error(env, dlerror());
-            }
-        }
+static ERL_NIF_TERM otter_ring_disarm(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[]) {
+    if (argc != 1) return enif_make_badarg(env);
 
-        ERL_NIF_TERM ret = enif_make_resource(env, handle);
-        return erlang::nif::ok(env, ret);
-    } else {
-        return erlang::nif::error(env, "cannot get dlopen mode");
+    OtterRing *res = nullptr;
+    if (!get_ring(env, argv[0], res)) {
+        return erlang::nif::error(env, "cannot get ring resource");
+    }
+
+    std::lock_guard<std::mutex> g(res->val->drain_lock);
+    auto ring = res->val->ring;
+    // producers stop ringing the doorbell, a message that is already sent can still arrive
+    __atomic_store_n(&ring->armed, 0, __ATOMIC_SEQ_CST);
+    if (res->val->selected) {
+        // the doorbell stays registered with erts until `ring_close` stops it
+        enif_select(env, ring->doorbell_fd, (enum ErlNifSelectFlags)(ERL_NIF_SELECT_READ | ERL_NIF_SELECT_CANCEL),
+                    res, nullptr, enif_make_atom(env, "undefined"));
     }
+    return erlang::nif::ok(env);
 }
 
-static ERL_NIF_TERM otter_dlclose(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[]) {
-    if (argc != 1) {
-        return enif_make_badarg(env);
+// drains that copy more than this many bytes run on a dirty CPU scheduler
+static const size_t ring_dirty_drain_bytes = 64 * 1024;
+
+static ERL_NIF_TERM ring_drain(ErlNifEnv *env, const ERL_NIF_TERM argv[]) {
+    OtterRing *res = nullptr;
+    uint64_t max_records;
+    if (!get_ring(env, argv[0], res)) {
+        return erlang::nif::error(env, "cannot get ring resource");
+    }
+    if (!erlang::nif::get_uint64(env, argv[1], &max_records)) {
+        return erlang::nif::error(env, "cannot get max records");
     }
 
-    OtterHandle *res = nullptr;
-    if (enif_get_resource(env, argv[0], OtterHandle::type, (void **)&res) && res) {
-        void *handle = res->val;
-        if (handle != nullptr) {
-            int ret = dlclose(handle);
-            auto entry = opened_handles.end();
-            for (auto it = opened_handles.begin(); it != opened_handles.end(); ++it) {
-                if (it->second->val == handle) {
-                    entry = it;
-                    break;
-                }
-            }
+    std::lock_guard<std::mutex> g(res->val->drain_lock);
+    auto ring = res->val->ring;
+    // reset the doorbell, the records it announced are read below
+    uint64_t rings;
+    ssize_t bytes_read = read(ring->doorbell_fd, &rings, sizeof(rings));
+    (void)bytes_read;
+
+    uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+    uint64_t available = 0;
+    while (available < max_records && available < ring->capacity &&
+           __atomic_load_n((uint64_t *)otter_ring_slot(ring, head + available), __ATOMIC_ACQUIRE) == head + available + 1) {
+        available++;
+    }
 
-            if (entry != opened_handles.end()) {
-                opened_handles.erase(entry);
-            }
+    ErlNifBinary records;
+    if (!enif_alloc_binary((size_t)available * ring->record_size, &records)) {
+        return erlang::nif::error(env, "cannot allocate memory for records");
+    }
+    for (uint64_t i = 0; i < available; ++i) {
+        uint8_t *slot = otter_ring_slot(ring, head + i);
+        memcpy(records.data + i * ring->record_size, slot + 8, ring->record_size);
+        // the slot can be written again when the producers wrap around
+        __atomic_store_n((uint64_t *)slot, head + i + ring->capacity, __ATOMIC_RELEASE);
+    }
+    __atomic_store_n(&ring->head, head + available, __ATOMIC_RELAXED);
+    return erlang::nif::ok(env, enif_make_binary(env, &records));
+}
 
-            // release all symbols
-            auto &symbols = found_symbols[entry->second];
-            for (auto &s : symbols) {
-                enif_release_resource(s.second);
-            }
-            // remove image entry in found_symbols
-            found_symbols[entry->second].clear();
-            found_symbols.erase(entry->second);
-            enif_release_resource(entry->second);
+static ERL_NIF_TERM otter_ring_drain_dirty(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[]) {
+    return ring_drain(env, argv);
+}
 
-            if (ret == 0) {
-                return erlang::nif::ok(env);
-            } else {
-                return erlang::nif::error(env, dlerror());
-            }
-        } else {
-            return erlang::nif::error(env, "resource has an invalid handle");
+static ERL_NIF_TERM otter_ring_drain(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[]) {
+    if (argc != 2) return enif_make_badarg(env);
+
+    OtterRing *res = nullptr;
+    uint64_t max_records;
+    if (get_ring(env, argv[0], res) && erlang::nif::get_uint64(env, argv[1], &max_records)) {
+        auto ring = res->val->ring;
+        uint64_t limit = std::max<uint64_t>(1, ring_dirty_drain_bytes / ring->record_size);
+        // more than `limit` records are available if the slot after them has been written,
+        // with concurrent producers it may be written first, then the dirty drain copies less
+        if (max_records > limit && limit < ring->capacity && ring_has_record(ring, limit)) {
+            return enif_schedule_nif(env, "ring_drain", ERL_NIF_DIRTY_JOB_CPU_BOUND, otter_ring_drain_dirty, argc, argv);
         }
-    } else {
-        return erlang::nif::error(env, "cannot get mode");
     }
+    return ring_drain(env, argv);
 }
 
-static ERL_NIF_TERM otter_dlsym(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[]) {
-    if (argc != 2) {
-        return enif_make_badarg(env);
+static ERL_NIF_TERM otter_ring_close(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[]) {
+    if (argc != 1) return enif_make_badarg(env);
+
+    OtterRing *res = nullptr;
+    if (!get_ring(env, argv[0], res)) {
+        return erlang::nif::error(env, "cannot get ring resource");
     }
 
-    OtterHandle *res = nullptr;
-    std::string func_name;
-    if (enif_get_resource(env, argv[0], OtterHandle::type, (void **)&res) &&
-        erlang::nif::get(env, argv[1], func_name) && res && !func_name.empty()) {
-        void *handle = res->val;
-        if (handle != nullptr) {
-            OtterHandle *opened_res = nullptr;
-            for (auto it = opened_handles.begin(); it != opened_handles.end(); ++it) {
-                if (it->second->val == handle) {
-                    opened_res = it->second;
-                    break;
-                }
-            }
+    std::lock_guard<std::mutex> g(res->val->drain_lock);
+    auto ring = res->val->ring;
+    res->val->closed = true;
+    __atomic_store_n(&ring->armed, 0, __ATOMIC_SEQ_CST);
+    // producers must not write to the fd once it is closed and possibly reused
+    int doorbell_fd = ring->doorbell_fd;
+    __atomic_store_n(&ring->doorbell_fd, -1, __ATOMIC_SEQ_CST);
+    while (__atomic_load_n(&ring->ringing, __ATOMIC_SEQ_CST) != 0) {
+        std::this_thread::yield();
+    }
+    if (res->val->selected) {
+        // the doorbell is closed by `ring_resource_stop` once erts no longer watches it
+        enif_select(env, doorbell_fd, ERL_NIF_SELECT_STOP, res, nullptr, enif_make_atom(env, "undefined"));
+    } else {
+        close(doorbell_fd);
+    }
+    return erlang::nif::ok(env);
+}
 
-            if (opened_res == nullptr) {
-                opened_res = res;
-            }
+static void selected_fd_resource_dtor(ErlNifEnv *env, void *obj) {
+    auto res = (OtterSelectedFd *)obj;
+    // a selected fd keeps a reference to the resource until it is stopped,
+    // so here the fd is either stopped or was never selected
+    if (res && !res->val.stopped.exchange(true) && res->val.close_on_stop) {
+        close(res->val.fd);
+    }
+}
 
-            OtterSymbol *symbol = nullptr;
-            if (found_symbols.find(opened_res) != found_symbols.end()) {
-                auto &symbols = found_symbols[opened_res];
-                if (symbols.find(func_name) != symbols.end()) {
-                    symbol = symbols[func_name];
-                }
-            }
+static void selected_fd_resource_stop(ErlNifEnv *env, void *obj, ErlNifEvent event, int is_direct_call) {
+    auto res = (OtterSelectedFd *)obj;
+    if (!res->val.stopped.exchange(true) && res->val.close_on_stop) {
+        close((int)event);
+    }
+}
 
-            if (symbol == nullptr) {
-                if (alloc_resource(&symbol)) {
-                    void *symbol_dl = dlsym(handle, func_name.c_str());
-                    if (symbol_dl == nullptr) {
-                        return erlang::nif::error(env, dlerror());
-                    }
-                    symbol->val = symbol_dl;
-                } else {
-                    return erlang::nif::error(env, "cannot allocate memory for resource");
-                }
-            }
+static ERL_NIF_TERM otter_select_fd(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[]) {
+    if (argc != 2) return enif_make_badarg(env);
 
-            found_symbols[opened_res][func_name] = symbol;
-            ERL_NIF_TERM ret = enif_make_resource(env, symbol);
+    int fd;
+    std::string close_on_stop;
+    if (!erlang::nif::get(env, argv[0], &fd) || fd < 0) {
+        return erlang::nif::error(env, "cannot get fd");
+    }
+    if (!(erlang::nif::get_atom(env, argv[1], close_on_stop) && (close_on_stop == "true" || close_on_stop == "false"))) {
+        return erlang::nif::error(env, "expecting a boolean");
+    }
 
-            return erlang::nif::ok(env, ret);
-        } else {
-            return erlang::nif::error(env, "resource has an invalid image handle");
-        }
-    } else {
-      return erlang::nif::error(env, "cannot get image handle");
+    OtterSelectedFd *res = nullptr;
+    if (!alloc_resource(&res)) {
+        return erlang::nif::error(env, "cannot allocate memory for resource");
     }
+    res->val.fd = fd;
+    res->val.close_on_stop = close_on_stop == "true";
+    res->val.selected = false;
+    res->val.stopped = false;
+
+    ERL_NIF_TERM ret = enif_make_resource(env, res);
+    enif_release_resource(res);
+    return erlang::nif::ok(env, ret);
 }
 
-static ERL_NIF_TERM otter_symbol_to_address(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[]) {
-    if (argc != 1) return enif_make_badarg(env);
+static ERL_NIF_TERM otter_select(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[]) {
+    if (argc != 2) return enif_make_badarg(env);
 
-    OtterSymbol *symbol_res = nullptr;
-    if (enif_get_resource(env, argv[0], OtterSymbol::type, (void **)&symbol_res)) {
-        void *symbol = symbol_res->val;
-        // if it is nullptr, then the return value will be 0
-        // which I'd like to keep it the same as what would have expected to be
-        // if (symbol != nullptr)
-        return erlang::nif::ok(env, enif_make_uint64(env, (uint64_t)((uint64_t *)symbol)));
-    } else {
-        return erlang::nif::error(env, "cannot get symbol resource");
+    OtterSelectedFd *res = nullptr;
+    std::string mode;
+    if (!(enif_get_resource(env, argv[0], OtterSelectedFd::type, (void **)&res) && res)) {
+        return erlang::nif::error(env, "cannot get selected fd resource");
+    }
+    if (!(erlang::nif::get_atom(env, argv[1], mode) && (mode == "read" || mode == "write"))) {
+        return erlang::nif::error(env, "mode should be either :read or :write");
+    }
+    if (res->val.stopped) {
+        return erlang::nif::error(env, "fd has been deselected");
     }
+
+    // one-shot: the calling process receives
+    // {:select, resource, :undefined, :ready_input | :ready_output} once, then the fd has to be selected again
+    auto flags = mode == "read" ? ERL_NIF_SELECT_READ : ERL_NIF_SELECT_WRITE;
+    int ret = enif_select(env, (ErlNifEvent)res->val.fd, flags, res, nullptr, enif_make_atom(env, "undefined"));
+    if (ret < 0) {
+        return erlang::nif::error(env, "enif_select failed");
+    }
+    res->val.selected = true;
+    return erlang::nif::ok(env);
 }
 
-static ERL_NIF_TERM otter_address_to_symbol(ErlNifEnv *env, int argc,
-                                            const ERL_NIF_TERM argv[]) {
+static ERL_NIF_TERM otter_deselect(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[]) {
     if (argc != 1) return enif_make_badarg(env);
 
-    OtterSymbol *symbol_res = nullptr;
-    uint64_t address;
-    if (erlang::nif::get_uint64(env, argv[0], &address)) {
-        if (alloc_resource(&symbol_res)) {
-            symbol_res->val = (void *)(uint64_t *)address;
-            ERL_NIF_TERM res = enif_make_resource(env, symbol_res);
-            enif_release_resource(symbol_res);
-            return erlang::nif::ok(env, res);
-        } else {
-            return erlang::nif::error(env, "cannot allocate memory for resource");
+    OtterSelectedFd *res = nullptr;
+    if (!(enif_get_resource(env, argv[0], OtterSelectedFd::type, (void **)&res) && res)) {
+        return erlang::nif::error(env, "cannot get selected fd resource");
+    }
+    if (res->val.stopped) {
+        return erlang::nif::ok(env);
+    }
+
+    if (res->val.selected) {
+        // `selected_fd_resource_stop` is called once erts no longer watches the fd,
+        // possibly after this returns
+        if (enif_select(env, (ErlNifEvent)res->val.fd, ERL_NIF_SELECT_STOP, res, nullptr, enif_make_atom(env, "undefined")) < 0) {
+            return erlang::nif::error(env, "enif_select failed");
         }
     } else {
-        return erlang::nif::error(env, "cannot get address");
+        selected_fd_resource_stop(env, res, (ErlNifEvent)res->val.fd, 1);
     }
+    return erlang::nif::ok(env);
 }
 
-static ERL_NIF_TERM otter_erl_nif_env(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[]) {
-    return erlang::nif::ok(env, enif_make_uint64(env, (uint64_t)((uint64_t *)env)));
+static ERL_NIF_TERM otter_memory_info(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[]) {
+    return erlang::nif::ok(env, memory_accounting.info(env));
 }
 
-static ERL_NIF_TERM otter_stdin(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[]) {
-    return erlang::nif::ok(env, enif_make_uint64(env, (uint64_t)((uint64_t *)stdin)));
-}
+static ERL_NIF_TERM otter_alloc_profile(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[]) {
+    if (argc != 1) return enif_make_badarg(env);
 
-static ERL_NIF_TERM otter_stdout(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[]) {
-    return erlang::nif::ok(env, enif_make_uint64(env, (uint64_t)((uint64_t *)stdout)));
-}
+    using namespace otter::alloc_profile;
+    if (!enabled) {
+        return erlang::nif::error(env, "not built with OTTER_ALLOC_PROFILE=1");
+    }
+    uint64_t n;
+    if (!erlang::nif::get_uint64(env, argv[0], &n)) {
+        return erlang::nif::error(env, "cannot get the number of calls");
+    }
 
-static ERL_NIF_TERM otter_stderr(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[]) {
-    return erlang::nif::ok(env, enif_make_uint64(env, (uint64_t)((uint64_t *)stderr)));
+    std::vector<CallRecord> records;
+    last_calls((size_t)n, records);
+
+    std::vector<ERL_NIF_TERM> calls;
+    for (auto &record : records) {
+        ERL_NIF_TERM keys[NUM_PHASES + 1], values[NUM_PHASES + 1];
+        for (size_t i = 0; i < NUM_PHASES; ++i) {
+            auto &c = record.phases[i];
+            ERL_NIF_TERM counter_keys[] = {
+                enif_make_atom(env, "mallocs"),
+                enif_make_atom(env, "reallocs"),
+                enif_make_atom(env, "frees"),
+                enif_make_atom(env, "news"),
+                enif_make_atom(env, "deletes"),
+                enif_make_atom(env, "bytes"),
+            };
+            ERL_NIF_TERM counter_values[] = {
+                enif_make_uint64(env, c.mallocs),
+                enif_make_uint64(env, c.reallocs),
+                enif_make_uint64(env, c.frees),
+                enif_make_uint64(env, c.news),
+                enif_make_uint64(env, c.deletes),
+                enif_make_uint64(env, c.bytes),
+            };
+            keys[i] = enif_make_atom(env, phase_names[i]);
+            enif_make_map_from_arrays(env, counter_keys, counter_values,
+                                      sizeof(counter_keys) / sizeof(counter_keys[0]), &values[i]);
+        }
+        keys[NUM_PHASES] = enif_make_atom(env, "symbol");
+        values[NUM_PHASES] = enif_make_uint64(env, (uint64_t)(uintptr_t)record.symbol);
+
+        ERL_NIF_TERM map;
+        enif_make_map_from_arrays(env, keys, values, NUM_PHASES + 1, &map);
+        calls.push_back(map);
+    }
+    return erlang::nif::ok(env, enif_make_list_from_array(env, calls.data(), (unsigned)calls.size()));
 }
 
-static void otter_segfault_catcher(int sig) {
-    switch(sig) {
-        case SIGSEGV:
-            longjmp(jmp_buf_g, 1);
-            break;
+static ERL_NIF_TERM otter_set_memory_budget(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[]) {
+    if (argc != 3) return enif_make_badarg(env);
+
+    std::string kind_name;
+    MemoryAccounting::Kind kind;
+    if (!(erlang::nif::get_atom(env, argv[0], kind_name) && MemoryAccounting::kind_from_name(kind_name, kind))) {
+        return erlang::nif::error(env, "unknown memory kind");
+    }
+    uint64_t soft, hard;
+    if (!(erlang::nif::get_uint64(env, argv[1], &soft) && erlang::nif::get_uint64(env, argv[2], &hard))) {
+        return erlang::nif::error(env, "cannot get budget");
     }
+
+    memory_accounting.set_budget(kind, soft, hard);
+    return erlang::nif::ok(env);
 }
 
-static ERL_NIF_TERM otter_invoke(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[]) {
-    if (argc != 3) {
-        return enif_make_badarg(env);
+// open the resource types of this instance,
+// `ERL_NIF_RT_TAKEOVER` in `flags` lets it release resources created by an older instance
+static int open_resource_types(ErlNifEnv *env, ErlNifResourceFlags flags) {
+    ErlNifResourceType *rt;
+    rt = enif_open_resource_type(env, "Elixir.Otter.Nif", "OtterHandle", symbol_resource_dtor, flags, nullptr);
+    if (!rt) {
+        return -1;
     }
-    ERL_NIF_TERM symbol_term = argv[0];
-    ERL_NIF_TERM return_type_term = argv[1];
-    ERL_NIF_TERM args_with_type_term = argv[2];
+    erlang_nif_res<void *>::type = rt;
 
-    std::string error_msg;
-    ERL_NIF_TERM return_value, out_values;
-    ERL_NIF_TERM ret;
+    rt = enif_open_resource_type(env, "Elixir.Otter.Nif", "OtterMmap", mmap_resource_dtor, flags, nullptr);
+    if (!rt) {
+        return -1;
+    }
+    OtterMmap::type = rt;
 
-    struct sigaction oldact;
-    sigaction(SIGSEGV, NULL, &oldact);
+    rt = enif_open_resource_type(env, "Elixir.Otter.Nif", "OtterPointer", pointer_resource_dtor, flags, nullptr);
+    if (!rt) {
+        return -1;
+    }
+    OtterPointer::type = rt;
 
-    signal(SIGSEGV, otter_segfault_catcher);
-    if (!setjmp(jmp_buf_g)) {
-        auto ffi_call_wrapper = std::make_shared<FFICall>(env, symbol_term, return_type_term, args_with_type_term);
-        if (ffi_call_wrapper->call(return_value, out_values, error_msg)) {
-            if (ffi_call_wrapper->out_value_indexes.size() > 0) {
-                ret = erlang::nif::ok(env, enif_make_tuple2(env, return_value, out_values));
-            } else {
-                ret =  erlang::nif::ok(env, return_value);
-            }
-        } else {
-            ret =  erlang::nif::error(env, error_msg.c_str());
-        }
-    } else {
-        ret =  erlang::nif::error(env, "segmentation fault");
+    rt = enif_open_resource_type(env, "Elixir.Otter.Nif", "OtterPrepared", prepared_resource_dtor, flags, nullptr);
+    if (!rt) {
+        return -1;
     }
+    OtterPrepared::type = rt;
 
-    signal(SIGSEGV, oldact.sa_handler);
-    return ret;
-}
+    rt = enif_open_resource_type(env, "Elixir.Otter.Nif", "OtterWorker", worker_resource_dtor, flags, nullptr);
+    if (!rt) {
+        return -1;
+    }
+    OtterWorker::type = rt;
+    rt = enif_open_resource_type(env, "Elixir.Otter.Nif", "OtterPooledStruct", pooled_struct_resource_dtor, flags, nullptr);
+    if (!rt) {
+        return -1;
+    }
+    OtterPooledStruct::type = rt;
+    rt = enif_open_resource_type(env, "Elixir.Otter.Nif", "OtterOwnedPointer", owned_pointer_resource_dtor, flags, nullptr);
+    if (!rt) {
+        return -1;
+    }
+    OtterOwnedPointer::type = rt;
 
-static int on_load(ErlNifEnv *env, void **, ERL_NIF_TERM) {
-    ErlNifResourceType *rt;
-    rt = enif_open_resource_type(env, "Elixir.Otter.Nif", "OtterHandle", resource_dtor, ERL_NIF_RT_CREATE, nullptr);
+    // the doorbell of a ring is watched with enif_select, which needs a stop callback
+    ErlNifResourceTypeInit ring_init = {};
+    ring_init.dtor = ring_resource_dtor;
+    ring_init.stop = ring_resource_stop;
+    rt = enif_open_resource_type_x(env, "OtterRing", &ring_init, flags, nullptr);
     if (!rt) {
         return -1;
     }
-    erlang_nif_res<void *>::type = rt;
+    OtterRing::type = rt;
+
+    ErlNifResourceTypeInit selected_fd_init = {};
+    selected_fd_init.dtor = selected_fd_resource_dtor;
+    selected_fd_init.stop = selected_fd_resource_stop;
+    rt = enif_open_resource_type_x(env, "OtterSelectedFd", &selected_fd_init, flags, nullptr);
+    if (!rt) {
+        return -1;
+    }
+    OtterSelectedFd::type = rt;
     return 0;
 }
 
+/// Handed over in priv_data from a loaded instance of this library to the instance that upgrades it
+///
+/// It only points to the singletons of the instance that created it. `on_upgrade` takes over
+/// plain containers from the older instance and rebuilds objects that have vtables or shared_ptr
+/// control blocks, because those would call into the older library after it is purged.
+///
+/// Threads of the older instance (workers, the thread pool, the background finalizer) keep running
+/// its code, so workers and prepared calls should be released before the old code is purged.
+struct OtterPrivData {
+    // bump when the layout of anything reachable from here changes,
+    // an instance of another version cannot be upgraded to this one (see `on_upgrade`)
+    static constexpr uint32_t current_version = 3;
+
+    uint32_t version;
+    uint32_t size;
+    std::map<std::string, OtterHandle *> *opened_handles;
+    std::map<OtterHandle *, std::map<std::string, OtterSymbol *>> *found_symbols;
+    std::mutex *opened_handles_lock;
+    std::map<std::string, ErlNifResourceType *> *struct_resource_types;
+    std::mutex *struct_resource_types_lock;
+    std::map<std::string, std::shared_ptr<StructLayout>> *struct_layouts;
+    std::mutex *struct_layouts_lock;
+    StructPool::Shared struct_pool;
+    SignatureCache *signature_cache;
+    VariadicCIFCache *variadic_cif_cache;
+    MemoryAccounting *memory_accounting;
+    AdaptiveRouter *adaptive_router;
+
+    static OtterPrivData * create() {
+        auto priv = new (std::nothrow) OtterPrivData();
+        if (priv) {
+            priv->version = current_version;
+            priv->size = sizeof(OtterPrivData);
+            priv->opened_handles = &::opened_handles;
+            priv->found_symbols = &::found_symbols;
+            priv->opened_handles_lock = &::opened_handles_lock;
+            priv->struct_resource_types = &FFIStructTypeWrapper::struct_resource_type_registry;
+            priv->struct_resource_types_lock = &FFIStructTypeWrapper::struct_resource_type_registry_lock;
+            priv->struct_layouts = &StructLayout::registry;
+            priv->struct_layouts_lock = &StructLayout::registry_lock;
+            priv->struct_pool = StructPool::shared();
+            priv->signature_cache = &::signature_cache;
+            priv->variadic_cif_cache = &::variadic_cif_cache;
+            priv->memory_accounting = &::memory_accounting;
+            priv->adaptive_router = &::adaptive_router;
+        }
+        return priv;
+    }
+
+    bool compatible() const {
+        return version == current_version && size == sizeof(OtterPrivData);
+    }
+};
+
+static int on_load(ErlNifEnv *env, void **priv_data, ERL_NIF_TERM) {
+    if (open_resource_types(env, ERL_NIF_RT_CREATE) != 0) {
+        return -1;
+    }
+    *priv_data = OtterPrivData::create();
+    return *priv_data ? 0 : -1;
+}
+
 static int on_reload(ErlNifEnv *, void **, ERL_NIF_TERM) { return 0; }
 
-static int on_upgrade(ErlNifEnv *, void **, void **, ERL_NIF_TERM) { return 0; }
+static int on_upgrade(ErlNifEnv *env, void **priv_data, void **old_priv_data, ERL_NIF_TERM) {
+    // taking over the resource types makes this instance release the old instance's resources,
+    // which is only safe when everything they point to can be adopted below;
+    // otherwise the upgrade fails and the old module has to be purged before loading this one
+    auto old = (OtterPrivData *)*old_priv_data;
+    if (!(old && old->compatible())) {
+        return -1;
+    }
+    if (open_resource_types(env, (ErlNifResourceFlags)(ERL_NIF_RT_CREATE | ERL_NIF_RT_TAKEOVER)) != 0) {
+        return -1;
+    }
+
+    if (!FFIStructTypeWrapper::adopt_ffi_struct_resource_types(env, *old->struct_resource_types,
+                                                               *old->struct_resource_types_lock)) {
+        return -1;
+    }
+    {
+        // old code may still be calling dlopen and dlsym until the old module is purged
+        std::lock_guard<std::mutex> old_g(*old->opened_handles_lock);
+        std::lock_guard<std::mutex> g(opened_handles_lock);
+        opened_handles.swap(*old->opened_handles);
+        found_symbols.swap(*old->found_symbols);
+    }
+    StructPool::adopt(old->struct_pool);
+    memory_accounting.adopt(*old->memory_accounting);
+
+    // caches, only to avoid the cold start
+    StructLayout::adopt(*old->struct_layouts, *old->struct_layouts_lock);
+    signature_cache.adopt(env, *old->signature_cache);
+    variadic_cif_cache.adopt(*old->variadic_cif_cache);
+    adaptive_router.adopt(*old->adaptive_router);
+
+    *priv_data = OtterPrivData::create();
+    return *priv_data ? 0 : -1;
+}
+
+static void on_unload(ErlNifEnv *, void *priv_data) {
+    delete (OtterPrivData *)priv_data;
+}
 
 static ErlNifFunc nif_functions[] = {
     {"dlopen", 2, otter_dlopen, 0},
+    {"dlopen_binary", 2, otter_dlopen_binary, ERL_NIF_DIRTY_JOB_IO_BOUND},
     {"dlclose", 1, otter_dlclose, 0},
     {"dlsym", 2, otter_dlsym, 0},
     {"symbol_to_address", 1, otter_symbol_to_address, 0},
@@ -1516,9 +6279,53 @@ static ErlNifFunc nif_functions[] = {
     {"stdout", 0, otter_stdout, 0},
     {"stderr", 0, otter_stderr, 0},
     {"invoke", 3, otter_invoke, 0},
+    {"invoke_signature", 3, otter_invoke_signature, 0},
+    {"register_signature", 2, otter_register_signature, 0},
+    {"routing_info", 1, otter_routing_info, 0},
+    {"set_tracing", 1, otter_set_tracing, 0},
+    {"drain_trace", 1, otter_drain_trace, ERL_NIF_DIRTY_JOB_CPU_BOUND},
+    {"set_adaptive_routing", 4, otter_set_adaptive_routing, 0},
+    {"mmap", 4, otter_mmap, ERL_NIF_DIRTY_JOB_IO_BOUND},
+    {"munmap", 1, otter_munmap, ERL_NIF_DIRTY_JOB_IO_BOUND},
+    {"madvise", 2, otter_madvise, 0},
+    {"msync", 2, otter_msync, ERL_NIF_DIRTY_JOB_IO_BOUND},
+    {"pointer_new", 3, otter_pointer_new, 0},
+    {"pointer_read", 5, otter_pointer_read, 0},
+    {"pointer_write", 3, otter_pointer_write, 0},
+    {"pointer_address", 1, otter_pointer_address, 0},
+    {"worker_start", 2, otter_worker_start, 0},
+    {"worker_invoke", 4, otter_worker_invoke, ERL_NIF_DIRTY_JOB_IO_BOUND},
+    {"worker_invoke_async", 4, otter_worker_invoke_async, 0},
+    {"worker_stop", 1, otter_worker_stop, ERL_NIF_DIRTY_JOB_IO_BOUND},
+    {"prepare", 3, otter_prepare, 0},
+    {"parallel_map", 4, otter_parallel_map, ERL_NIF_DIRTY_JOB_CPU_BOUND},
+    {"set_thread_pool_size", 1, otter_set_thread_pool_size, ERL_NIF_DIRTY_JOB_CPU_BOUND},
+    {"decode_struct", 3, otter_decode_struct, 0},
+    {"decode_struct_array", 3, otter_decode_struct_array, ERL_NIF_DIRTY_JOB_CPU_BOUND},
+    {"variadic_cif_cache_info", 0, otter_variadic_cif_cache_info, 0},
+    {"set_variadic_cif_cache_capacity", 1, otter_set_variadic_cif_cache_capacity, 0},
+    {"pack", 2, otter_pack, 0},
+    {"unpack", 2, otter_unpack, 0},
+    {"owned_pointer", 3, otter_owned_pointer, 0},
+    {"owned_pointer_release", 1, otter_owned_pointer_release, 0},
+    {"owned_pointer_address", 1, otter_owned_pointer_address, 0},
+    {"struct_pool_info", 0, otter_struct_pool_info, 0},
+    {"set_struct_pool_capacity", 1, otter_set_struct_pool_capacity, 0},
+    {"set_struct_pooling", 2, otter_set_struct_pooling, 0},
+    {"ring_new", 3, otter_ring_new, 0},
+    {"ring_arm", 2, otter_ring_arm, 0},
+    {"ring_disarm", 1, otter_ring_disarm, 0},
+    {"ring_drain", 2, otter_ring_drain, 0},
+    {"ring_close", 1, otter_ring_close, 0},
+    {"select_fd", 2, otter_select_fd, 0},
+    {"select", 2, otter_select, 0},
+    {"deselect", 1, otter_deselect, 0},
+    {"memory_info", 0, otter_memory_info, 0},
+    {"set_memory_budget", 3, otter_set_memory_budget, 0},
+    {"alloc_profile", 1, otter_alloc_profile, 0},
 };
 
-ERL_NIF_INIT(Elixir.Otter.Nif, nif_functions, on_load, on_reload, on_upgrade, NULL)
+ERL_NIF_INIT(Elixir.Otter.Nif, nif_functions, on_load, on_reload, on_upgrade, on_unload)
 
 #if defined(__GNUC__)
 #pragma GCC visibility push(default)
@@ -0,0 +1,127 @@
+#ifndef OTTER_RING_H
+#define OTTER_RING_H
+
+/*
+ * Producer side of the shared ring buffers created by `Otter.Ring.new/3`.
+ *
+ * The ring is passed to C code as a `c_ptr`. C code includes this header and calls
+ * `otter_ring_push` from its own threads. Each push copies one fixed-size record into
+ * the ring and rings the doorbell if the consumer is waiting for data.
+ *
+ * This header has no dependencies other than libc and can be used from C and C++.
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define OTTER_RING_MAGIC 0x4f52424eu
+#define OTTER_RING_VERSION 1u
+
+/* only one producer thread may push at a time */
+#define OTTER_RING_SPSC 0u
+/* any number of producer threads may push concurrently */
+#define OTTER_RING_MPSC 1u
+
+#define OTTER_RING_CACHE_LINE 64
+
+struct otter_ring {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t mode;
+    /* size of each record in bytes */
+    uint32_t record_size;
+    /* distance between two slots: an 8-byte sequence number followed by the record, padded to 8 bytes */
+    uint32_t slot_size;
+    /* number of slots, a power of two */
+    uint32_t capacity;
+    /* written with a uint64_t 1 to wake up the consumer */
+    int32_t doorbell_fd;
+    /* number of producers that are ringing the doorbell, the consumer waits for them before closing it */
+    uint32_t ringing;
+    /* set by the consumer before it waits, cleared by the producer that rings the doorbell */
+    uint64_t armed;
+    char padding0[OTTER_RING_CACHE_LINE - 40];
+    /* next slot to be read, only written by the consumer */
+    uint64_t head;
+    char padding1[OTTER_RING_CACHE_LINE - 8];
+    /* next slot to be written */
+    uint64_t tail;
+    char padding2[OTTER_RING_CACHE_LINE - 8];
+    /* slots follow */
+};
+
+static inline uint8_t *otter_ring_slot(struct otter_ring *ring, uint64_t pos) {
+    return (uint8_t *)(ring + 1) + (size_t)(pos & (ring->capacity - 1)) * ring->slot_size;
+}
+
+/*
+ * Copy a record into the ring
+ *
+ * `size` may be smaller than `record_size`, the rest of the record is zero-filled.
+ * Returns 0 on success, -1 if the ring is full or `size` is larger than `record_size`.
+ */
+static inline int otter_ring_push(struct otter_ring *ring, const void *record, uint32_t size) {
+    uint64_t pos, seq;
+    int64_t diff;
+    uint8_t *slot;
+
+    if (size > ring->record_size) {
+        return -1;
+    }
+
+    /* each slot has a sequence number:
+     *   seq == pos:     free, can be written by the producer that reserves pos
+     *   seq == pos + 1: written, can be read by the consumer
+     */
+    pos = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+    for (;;) {
+        slot = otter_ring_slot(ring, pos);
+        seq = __atomic_load_n((uint64_t *)slot, __ATOMIC_ACQUIRE);
+        diff = (int64_t)(seq - pos);
+        if (diff < 0) {
+            /* full */
+            return -1;
+        } else if (diff > 0) {
+            /* another producer took this slot */
+            pos = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+        } else if (ring->mode == OTTER_RING_SPSC) {
+            __atomic_store_n(&ring->tail, pos + 1, __ATOMIC_RELAXED);
+            break;
+        } else if (__atomic_compare_exchange_n(&ring->tail, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+            break;
+        }
+    }
+
+    memcpy(slot + 8, record, size);
+    memset(slot + 8 + size, 0, ring->record_size - size);
+    __atomic_store_n((uint64_t *)slot, pos + 1, __ATOMIC_RELEASE);
+
+    /* the consumer re-checks the ring after arming, so either it sees this record
+     * or we see `armed` and wake it up */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&ring->armed, __ATOMIC_RELAXED) &&
+        __atomic_exchange_n(&ring->armed, 0, __ATOMIC_SEQ_CST)) {
+        int32_t fd;
+        __atomic_fetch_add(&ring->ringing, 1, __ATOMIC_SEQ_CST);
+        /* -1 once the ring is closed */
+        fd = __atomic_load_n(&ring->doorbell_fd, __ATOMIC_SEQ_CST);
+        if (fd >= 0) {
+            uint64_t one = 1;
+            ssize_t written = write(fd, &one, sizeof(one));
+            (void)written;
+        }
+        __atomic_fetch_sub(&ring->ringing, 1, __ATOMIC_SEQ_CST);
+    }
+    return 0;
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* OTTER_RING_H */
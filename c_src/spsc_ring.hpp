@@ -0,0 +1,147 @@
+#pragma once
+
+#include <atomic>
+#include <vector>
+
+namespace otter
+{
+    /// Lock-free single-producer single-consumer ring buffer
+    ///
+    /// `push` must only be called from one thread at a time, and so must `pop`.
+    /// Callers with more than one producer should serialise `push` themselves.
+    template <typename T>
+    class SPSCRing {
+    public:
+        /// @param capacity rounded up to a power of two
+        explicit SPSCRing(size_t capacity) : head(0), tail(0) {
+            size_t n = 1;
+            while (n < capacity) n <<= 1;
+            buffer.resize(n);
+            mask = n - 1;
+        }
+
+        SPSCRing(const SPSCRing &) = delete;
+        SPSCRing &operator=(const SPSCRing &) = delete;
+
+        bool push(const T &value) {
+            size_t t = tail.load(std::memory_order_relaxed);
+            if (t - head.load(std::memory_order_acquire) > mask) {
+                // full
+                return false;
+            }
+            buffer[t & mask] = value;
+            tail.store(t + 1, std::memory_order_release);
+            return true;
+        }
+
+        bool pop(T &value) {
+            size_t h = head.load(std::memory_order_relaxed);
+            if (h == tail.load(std::memory_order_acquire)) {
+                // empty
+                return false;
+            }
+            value = buffer[h & mask];
+            head.store(h + 1, std::memory_order_release);
+            return true;
+        }
+
+        bool empty() const {
+            return head.load(std::memory_order_acquire) == tail.load(std::memory_order_acquire);
+        }
+
+        size_t capacity() const {
+            return mask + 1;
+        }
+
+    private:
+        std::vector<T> buffer;
+        size_t mask;
+        // head is written by the consumer, tail by the producer
+        // keep them on different cache lines
+        std::atomic<size_t> head;
+        char padding[64 - sizeof(std::atomic<size_t>)];
+        std::atomic<size_t> tail;
+    };
+
+    /// Lock-free multi-producer single-consumer ring buffer
+    ///
+    /// `push` may be called from any number of threads concurrently, `pop` only from one
+    /// thread at a time. Each slot carries a sequence number, see `otter_ring_push`.
+    template <typename T>
+    class MPSCRing {
+    public:
+        /// @param capacity rounded up to a power of two
+        explicit MPSCRing(size_t capacity) : head(0), tail(0) {
+            size_t n = 1;
+            while (n < capacity) n <<= 1;
+            slots = std::vector<Slot>(n);
+            for (size_t i = 0; i < n; ++i) {
+                slots[i].seq.store(i, std::memory_order_relaxed);
+            }
+            mask = n - 1;
+        }
+
+        MPSCRing(const MPSCRing &) = delete;
+        MPSCRing &operator=(const MPSCRing &) = delete;
+
+        bool push(const T &value) {
+            // seq == pos: free, seq == pos + 1: written
+            size_t pos = tail.load(std::memory_order_relaxed);
+            Slot *slot;
+            while (true) {
+                slot = &slots[pos & mask];
+                size_t seq = slot->seq.load(std::memory_order_acquire);
+                intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+                if (diff == 0) {
+                    if (tail.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                        break;
+                    }
+                } else if (diff < 0) {
+                    // full
+                    return false;
+                } else {
+                    pos = tail.load(std::memory_order_relaxed);
+                }
+            }
+            slot->value = value;
+            slot->seq.store(pos + 1, std::memory_order_release);
+            return true;
+        }
+
+        bool pop(T &value) {
+            size_t h = head.load(std::memory_order_relaxed);
+            Slot &slot = slots[h & mask];
+            if (slot.seq.load(std::memory_order_acquire) != h + 1) {
+                // empty, or the producer that reserved this slot has not written it yet
+                return false;
+            }
+            value = slot.value;
+            // free the slot for the push one lap later
+            slot.seq.store(h + mask + 1, std::memory_order_release);
+            head.store(h + 1, std::memory_order_relaxed);
+            return true;
+        }
+
+        bool empty() const {
+            size_t h = head.load(std::memory_order_relaxed);
+            return slots[h & mask].seq.load(std::memory_order_acquire) != h + 1;
+        }
+
+        size_t capacity() const {
+            return mask + 1;
+        }
+
+    private:
+        struct Slot {
+            std::atomic<size_t> seq;
+            T value;
+        };
+
+        std::vector<Slot> slots;
+        size_t mask;
+        // head is only used by the consumer, tail is shared by the producers
+        std::atomic<size_t> head;
+        char padding[64 - sizeof(std::atomic<size_t>)];
+        std::atomic<size_t> tail;
+    };
+}
@@ -0,0 +1,163 @@
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace otter
+{
+    /// Count down from `count`, `wait` returns when it reaches zero
+    class Latch {
+    public:
+        explicit Latch(size_t count) : remaining(count) {}
+
+        void count_down() {
+            std::lock_guard<std::mutex> g(lock);
+            if (remaining > 0 && --remaining == 0) {
+                done.notify_all();
+            }
+        }
+
+        void wait() {
+            std::unique_lock<std::mutex> g(lock);
+            done.wait(g, [this] { return remaining == 0; });
+        }
+
+    private:
+        std::mutex lock;
+        std::condition_variable done;
+        size_t remaining;
+    };
+
+    /// A fixed-size thread pool where each worker owns a deque of tasks
+    ///
+    /// A worker pops tasks from the back of its own deque (LIFO, cache friendly)
+    /// and, when its deque is empty, steals from the front of other workers' deques (FIFO).
+    class WorkStealingPool {
+    public:
+        struct Task {
+            std::function<void()> run;
+            // only workers with index < max_worker may run this task
+            size_t max_worker;
+        };
+
+        explicit WorkStealingPool(size_t num_threads) : stopping(false), generation(0) {
+            if (num_threads == 0) {
+                num_threads = 1;
+            }
+            for (size_t i = 0; i < num_threads; ++i) {
+                workers.emplace_back(new Worker());
+            }
+            for (size_t i = 0; i < num_threads; ++i) {
+                threads.emplace_back([this, i] { this->worker_loop(i); });
+            }
+        }
+
+        ~WorkStealingPool() {
+            {
+                std::lock_guard<std::mutex> g(wake_lock);
+                stopping = true;
+            }
+            wake.notify_all();
+            for (auto &t : threads) {
+                if (t.joinable()) t.join();
+            }
+        }
+
+        WorkStealingPool(const WorkStealingPool &) = delete;
+        WorkStealingPool &operator=(const WorkStealingPool &) = delete;
+
+        size_t size() const {
+            return workers.size();
+        }
+
+        /// Distribute tasks round-robin over the first `max_workers` workers
+        /// @param tasks tasks to run, moved into the pool
+        /// @param max_workers at most this many workers will run these tasks, 0 means all workers
+        void submit(std::vector<std::function<void()>> &tasks, size_t max_workers) {
+            if (max_workers == 0 || max_workers > workers.size()) {
+                max_workers = workers.size();
+            }
+            for (size_t i = 0; i < tasks.size(); ++i) {
+                auto &w = workers[i % max_workers];
+                std::lock_guard<std::mutex> g(w->lock);
+                w->tasks.push_back(Task{std::move(tasks[i]), max_workers});
+            }
+            {
+                std::lock_guard<std::mutex> g(wake_lock);
+                generation++;
+            }
+            wake.notify_all();
+        }
+
+    private:
+        struct Worker {
+            std::mutex lock;
+            std::deque<Task> tasks;
+        };
+
+        bool pop_local(size_t index, Task &task) {
+            auto &w = workers[index];
+            std::lock_guard<std::mutex> g(w->lock);
+            if (w->tasks.empty()) {
+                return false;
+            }
+            task = std::move(w->tasks.back());
+            w->tasks.pop_back();
+            return true;
+        }
+
+        bool steal(size_t thief, Task &task) {
+            size_t n = workers.size();
+            for (size_t k = 1; k < n; ++k) {
+                auto &w = workers[(thief + k) % n];
+                std::lock_guard<std::mutex> g(w->lock);
+                for (auto it = w->tasks.begin(); it != w->tasks.end(); ++it) {
+                    if (thief < it->max_worker) {
+                        task = std::move(*it);
+                        w->tasks.erase(it);
+                        return true;
+                    }
+                }
+            }
+            return false;
+        }
+
+        void worker_loop(size_t index) {
+            while (true) {
+                // read the generation before looking for tasks,
+                // so that a submit after the search always wakes us up
+                size_t seen;
+                {
+                    std::lock_guard<std::mutex> g(wake_lock);
+                    if (stopping) {
+                        return;
+                    }
+                    seen = generation;
+                }
+
+                Task task;
+                if (pop_local(index, task) || steal(index, task)) {
+                    task.run();
+                    continue;
+                }
+
+                std::unique_lock<std::mutex> g(wake_lock);
+                wake.wait(g, [this, seen] { return stopping || generation != seen; });
+            }
+        }
+
+        std::vector<std::unique_ptr<Worker>> workers;
+        std::vector<std::thread> threads;
+
+        std::mutex wake_lock;
+        std::condition_variable wake;
+        bool stopping;
+        // incremented on every submit
+        size_t generation;
+    };
+}
@@ -29,5 +29,5 @@ defmodule CtypesDemo do
   extern tan(:f64, theta :: f64)
 
   # also support functions with variadic arguments
-  extern printf(:u64, fmt :: c_ptr, args :: va_args)
+  extern printf(:u64, fmt :: cstring, args :: va_args)
 end
@@ -43,6 +43,26 @@ defmodule Otter do
 
   deferror dlopen(path, mode)
 
+  @doc """
+  dlopen a shared library from its bytes, without writing it to the filesystem
+
+  The bytes are written into an anonymous file created by `memfd_create`, which is then
+  opened with `dlopen`. Loading the same bytes again returns the same handle.
+  Only supported on Linux.
+
+  - `bytes`: content of the shared library.
+  - `mode`: dlopen mode. See man (3) dlopen for details.
+  """
+  def dlopen_binary(bytes, mode) when is_binary(bytes) and is_atom(mode) do
+    dlopen_binary(bytes, Map.get(@mode_to_int, mode))
+  end
+
+  def dlopen_binary(bytes, mode) when is_binary(bytes) and is_integer(mode) do
+    Otter.Nif.dlopen_binary(bytes, mode)
+  end
+
+  deferror dlopen_binary(bytes, mode)
+
   @doc """
   Call dlclose to release a opened handle
 
@@ -100,7 +120,17 @@ defmodule Otter do
   Invoke a symbol(function) with input arguments
 
   - `symbol`: Function to call
-  - `return_type`: an atom that specifies the function's return type
+  - `return_type`: an atom that specifies the function's return type, or one of these
+    tuples for a function that returns a pointer to an array of basic values, which is
+    returned as a binary (`nil` for `NULL`):
+    - `{:array, type, count}`. The array has `count` elements.
+    - `{:ptr_array, type, index}`. The number of elements is the value of the argument at
+      `index` after the call.
+
+    Both can be followed by a destructor symbol and a boolean, e.g.,
+    `{:ptr_array, :u32, 1, destructor, false}`, if the caller takes ownership of the array.
+    The binary then refers to the array without copying it, and the destructor is called
+    once the binary is garbage collected (on a background thread if the boolean is `true`).
   - `args_with_type`: a list of 2-tuples. An example of a valid `args_with_type` when
      calling cos(3.1415926)
 
@@ -122,6 +152,188 @@ defmodule Otter do
 
   deferror invoke(symbol, return_type, args_with_type)
 
+  @doc """
+  Prepare a function that takes and returns basic types so that it can be called many times
+
+  - `symbol`: Function to call
+  - `return_type`: a basic type or `:void`
+  - `arg_types`: a list of basic types, e.g., `[:u32, :f64]`
+  """
+  def prepare(symbol, return_type, arg_types) when is_reference(symbol) and is_atom(return_type) and is_list(arg_types) do
+    Otter.Nif.prepare(symbol, return_type, arg_types)
+  end
+
+  deferror prepare(symbol, return_type, arg_types)
+
+  @doc """
+  Call a prepared function on every input record in parallel, using a native work-stealing thread pool
+
+  The function should be pure: it is called concurrently from native threads that
+  are not scheduler threads. Unlike `invoke/3`, these calls are not guarded against
+  segmentation faults, so a record that makes the function crash takes down the whole VM.
+
+  - `prepared`: a function prepared by `prepare/3`.
+  - `inputs`: a binary of packed input records. Each record holds the arguments of one call,
+    laid out like the fields of a C struct, i.e., each argument is aligned to its natural alignment
+    and the record is padded to a multiple of the largest alignment. For a function that takes a single
+    argument, this is just a packed array of that type.
+  - `opts`:
+    - `:max_threads`. Use at most this many threads of the pool. Defaults to `0`, all threads.
+    - `:chunk_size`. Number of records per task. Defaults to `0`, a few chunks per thread.
+
+  Returns a binary of packed return values, in the same order as the inputs.
+  For a function prepared with a `:void` return type, the binary is empty.
+
+  ## Example
+  ```elixir
+  prepared = Otter.prepare!(Otter.dlsym!(image, "pass_through_u32"), :u32, [:u32])
+  inputs = for i <- 1..1_000_000, into: <<>>, do: <<i::native-32>>
+  outputs = Otter.parallel_map!(prepared, inputs, max_threads: 8)
+  ```
+  """
+  def parallel_map(prepared, inputs, opts) when is_reference(prepared) and is_binary(inputs) and is_list(opts) do
+    max_threads = Keyword.get(opts, :max_threads, 0)
+    chunk_size = Keyword.get(opts, :chunk_size, 0)
+    Otter.Nif.parallel_map(prepared, inputs, max_threads, chunk_size)
+  end
+
+  deferror parallel_map(prepared, inputs, opts)
+
+  @doc """
+  Set the number of threads in the native thread pool used by `parallel_map/3`
+
+  - `size`: number of threads. `0` means one thread per online CPU, which is the default.
+  """
+  def set_thread_pool_size(size) when is_integer(size) and size >= 0 do
+    Otter.Nif.set_thread_pool_size(size)
+  end
+
+  deferror set_thread_pool_size(size)
+
+  @doc """
+  Get the routing decision and latency statistics of a symbol
+
+  Returns a map with keys
+  - `:route`. `:dirty` if calls to this symbol are rescheduled to dirty schedulers, otherwise `:normal`.
+  - `:p99_ns`. Estimated p99 latency of the last window of calls in nanoseconds.
+  - `:calls`. Number of calls measured.
+  """
+  def routing_info(symbol) when is_reference(symbol) do
+    Otter.Nif.routing_info(symbol)
+  end
+
+  deferror routing_info(symbol)
+
+  @doc """
+  Configure adaptive routing of slow symbols to dirty schedulers
+
+  Routing is disabled until this function is called. Once it is enabled, the time spent in
+  the native function of every call made by `invoke/3` and by functions generated by
+  `extern` is measured per symbol. After every `:window` calls, a symbol whose p99 latency is above
+  `:threshold_us` is rescheduled to a dirty scheduler on later calls, and a symbol whose
+  p99 latency drops below half of the threshold runs on the calling scheduler again.
+
+  - `opts`:
+    - `:enabled`. Defaults to `true`, pass `false` to disable routing again.
+    - `:threshold_us`. Defaults to `1000`.
+    - `:window`. Number of calls per measurement window. Defaults to `256`.
+    - `:dirty`. `:cpu` or `:io`, the kind of dirty scheduler to use. Defaults to `:cpu`.
+  """
+  def set_adaptive_routing(opts) when is_list(opts) do
+    Otter.Nif.set_adaptive_routing(
+      Keyword.get(opts, :enabled, true),
+      Keyword.get(opts, :threshold_us, 1000) * 1000,
+      Keyword.get(opts, :window, 256),
+      Keyword.get(opts, :dirty, :cpu)
+    )
+  end
+
+  deferror set_adaptive_routing(opts)
+
+  @doc """
+  Get statistics of the prepared call interface cache for variadic functions
+
+  Returns a map with keys `:capacity`, `:size`, `:hits` and `:misses`.
+  """
+  def variadic_cif_cache_info do
+    Otter.Nif.variadic_cif_cache_info()
+  end
+
+  deferror variadic_cif_cache_info()
+
+  @doc """
+  Set the maximum number of prepared call interfaces cached for variadic functions
+
+  Prepared call interfaces are keyed by the return type, the fixed argument types and the
+  variadic argument types. The least recently used ones are evicted when the cache is full.
+
+  - `capacity`: a non-negative integer. `0` disables the cache.
+  """
+  def set_variadic_cif_cache_capacity(capacity) when is_integer(capacity) and capacity >= 0 do
+    Otter.Nif.set_variadic_cif_cache_capacity(capacity)
+  end
+
+  deferror set_variadic_cif_cache_capacity(capacity)
+
+  @doc """
+  Map a region of a file into memory
+
+  The returned region can be passed to any `c_ptr` argument, and the C function will
+  receive the address of the region directly, without copying the file into the BEAM heap.
+  The region is unmapped when it is garbage collected, or earlier by `munmap/1`.
+
+  - `path`: path to the file.
+  - `mode`:
+    - `:read`. Read-only.
+    - `:read_write`. Changes are written back to the file.
+    - `:private`. Copy-on-write, changes are not written back to the file.
+  - `offset`: offset in the file, in bytes. It does not need to be aligned to the page size.
+  - `length`: length of the region, in bytes. `0` maps the file from `offset` to the end.
+    The region must be within the file. Files are never grown, not even in `:read_write`
+    mode, so extend the file before mapping past its current end.
+  """
+  def mmap(path, mode, offset, length)
+      when is_binary(path) and mode in [:read, :read_write, :private] and
+             is_integer(offset) and offset >= 0 and is_integer(length) and length >= 0 do
+    Otter.Nif.mmap(path, mode, offset, length)
+  end
+
+  deferror mmap(path, mode, offset, length)
+
+  @doc """
+  Unmap a memory-mapped region before it is garbage collected
+
+  The region cannot be used as an argument afterwards.
+  """
+  def munmap(region) when is_reference(region) do
+    Otter.Nif.munmap(region)
+  end
+
+  deferror munmap(region)
+
+  @doc """
+  Give the kernel a hint about how a memory-mapped region will be accessed
+
+  - `advice`: one of `:normal`, `:sequential`, `:random`, `:willneed` and `:dontneed`.
+  """
+  def madvise(region, advice)
+      when is_reference(region) and advice in [:normal, :sequential, :random, :willneed, :dontneed] do
+    Otter.Nif.madvise(region, advice)
+  end
+
+  deferror madvise(region, advice)
+
+  @doc """
+  Flush changes made to a memory-mapped region back to the file
+
+  - `mode`: `:sync` waits for the write to complete, `:async` only schedules it.
+  """
+  def msync(region, mode) when is_reference(region) and mode in [:sync, :async] do
+    Otter.Nif.msync(region, mode)
+  end
+
+  deferror msync(region, mode)
+
   @doc """
   Return the address of stdin FILE stream
   """
@@ -168,6 +380,315 @@ defmodule Otter do
     name
   end
 
+  @doc """
+  Decode struct instances into Elixir terms in one native pass
+
+  - `struct_type`: the struct declared by `cstruct`, e.g., `s_u8_u16()`.
+  - `data`:
+    - a struct resource returned by a C function. It is decoded into a single term.
+    - a binary holding N packed structs. It is decoded into a list of N terms.
+  - `format`:
+    - `:map`. `%{field_name => value}`.
+    - `:tuple`. Values in field order.
+
+  Scalar fields are decoded to numbers, nd-array fields to flat lists of numbers and
+  `c_ptr` fields to integers.
+  """
+  def decode_struct(%CStruct{} = struct_type, data, format) when is_binary(data) and format in [:map, :tuple] do
+    Otter.Nif.decode_struct_array(transform_type(struct_type), data, format)
+  end
+
+  def decode_struct(%CStruct{} = struct_type, data, format) when is_reference(data) and format in [:map, :tuple] do
+    Otter.Nif.decode_struct(transform_type(struct_type), data, format)
+  end
+
+  deferror decode_struct(struct_type, data, format)
+
+  @doc """
+  Enable or disable memory pooling for instances of a struct type returned by C functions
+
+  When enabled, the memory of a garbage collected instance is kept in a per-scheduler
+  free list and reused for the next instance of the same size.
+
+  - `struct_type`: the struct declared by `cstruct`, e.g., `s_u8_u16()`.
+  - `enabled`: `true` or `false`.
+  """
+  def set_struct_pooling(%CStruct{} = struct_type, enabled) when is_boolean(enabled) do
+    Otter.Nif.set_struct_pooling(transform_type(struct_type), enabled)
+  end
+
+  deferror set_struct_pooling(struct_type, enabled)
+
+  @doc """
+  Get statistics of the struct memory pool
+
+  Returns a map with keys `:capacity`, `:hits` and `:misses`.
+  """
+  def struct_pool_info do
+    Otter.Nif.struct_pool_info()
+  end
+
+  deferror struct_pool_info()
+
+  @doc """
+  Set the maximum number of free blocks of each size kept by each scheduler
+
+  - `capacity`: a non-negative integer. `0` disables reuse.
+  """
+  def set_struct_pool_capacity(capacity) when is_integer(capacity) and capacity >= 0 do
+    Otter.Nif.set_struct_pool_capacity(capacity)
+  end
+
+  deferror set_struct_pool_capacity(capacity)
+
+  @memory_kinds [:struct, :pooled_struct, :struct_type, :symbol, :mmap, :out_buffer, :prepared, :worker, :ring]
+
+  @doc """
+  Get the native memory held by Otter
+
+  Returns a map with keys:
+  - `:kinds`: for each kind of allocation (#{Enum.map_join(@memory_kinds, ", ", &"`#{inspect(&1)}`")}),
+    a map with `:bytes`, `:objects`, `:soft_budget`, `:hard_budget`, `:over_soft_budget`
+    and `:rejected` (number of allocations refused by the hard budget).
+  - `:structs`: bytes and objects of struct instances, by struct id.
+  """
+  def memory_info do
+    Otter.Nif.memory_info()
+  end
+
+  deferror memory_info()
+
+  @doc """
+  Set the memory budgets of a kind of allocation
+
+  Going past the soft budget is only reported by `memory_info/0`. An allocation that would go
+  past the hard budget is refused and the call returns `{:error, :native_memory_budget}`.
+
+  - `kind`: one of #{Enum.map_join(@memory_kinds, ", ", &"`#{inspect(&1)}`")}.
+  - `soft`: bytes, or `:infinity`.
+  - `hard`: bytes, or `:infinity`.
+
+  ## Example
+  ```elixir
+  :ok = Otter.set_memory_budget(:struct, 64 * 1024 * 1024, 256 * 1024 * 1024)
+  ```
+  """
+  def set_memory_budget(kind, soft, hard) when kind in @memory_kinds do
+    Otter.Nif.set_memory_budget(kind, budget_bytes(soft), budget_bytes(hard))
+  end
+
+  deferror set_memory_budget(kind, soft, hard)
+
+  defp budget_bytes(:infinity), do: 0
+  defp budget_bytes(bytes) when is_integer(bytes) and bytes >= 0, do: bytes
+
+  @doc """
+  Get the heap allocations made by the NIF itself in the last `n` invokes
+
+  Only available if the NIF was built with `OTTER_ALLOC_PROFILE=1` (Linux only),
+  otherwise it returns an error.
+
+  ```shell
+  OTTER_ALLOC_PROFILE=1 mix compile --force
+  ```
+
+  Returns a list with one map per call, oldest first. Each map has the `:symbol` address
+  and, for each phase of the call (`:decode`, `:prepare`, `:call`, `:encode`, `:cleanup`),
+  a map with the number of `:mallocs` (and callocs), `:reallocs`, `:frees`, `:news`, `:deletes`
+  and the `:bytes` requested. Allocations made by the called functions, and memory from the
+  VM such as binaries, are not counted.
+
+  ## Example
+  ```elixir
+  42 = Foo.pass_through_u32!(42)
+  {:ok, [%{call: %{mallocs: 0, news: 0}}]} = Otter.alloc_profile(1)
+  ```
+  """
+  def alloc_profile(n) when is_integer(n) and n >= 0 do
+    Otter.Nif.alloc_profile(n)
+  end
+
+  deferror alloc_profile(n)
+
+  @doc """
+  Get a message when a file descriptor is ready
+
+  Use it for fds returned by C functions, e.g., `socket`, `inotify_init` or a library's
+  `get_fd()`, instead of blocking in a `read` call.
+
+  Readiness is reported once, as a message to the calling process:
+  `{:select, watch, :undefined, :ready_input | :ready_output}`. Call `select/2` with `watch`
+  to wait again.
+
+  - `fd_or_watch`: a file descriptor, or a `watch` returned by a previous call.
+  - `mode`: `:read` or `:write`.
+  - `opts`:
+    - `:close`. Close the fd after `deselect/1`. Defaults to `false`, then the fd can be
+      closed by its owner once `deselect/1` returns.
+
+  ## Example
+  ```elixir
+  {:ok, watch} = Otter.select(Foo.get_fd!(), :read)
+
+  receive do
+    {:select, ^watch, _, :ready_input} -> Foo.read_event!()
+  end
+  ```
+  """
+  def select(fd_or_watch, mode, opts \\ [])
+
+  def select(fd, mode, opts) when is_integer(fd) and mode in [:read, :write] and is_list(opts) do
+    with {:ok, watch} <- Otter.Nif.select_fd(fd, Keyword.get(opts, :close, false)) do
+      select(watch, mode, opts)
+    end
+  end
+
+  def select(watch, mode, _opts) when is_reference(watch) and mode in [:read, :write] do
+    with :ok <- Otter.Nif.select(watch, mode) do
+      {:ok, watch}
+    end
+  end
+
+  deferror select(fd_or_watch, mode, opts)
+
+  @doc """
+  Stop watching a file descriptor selected by `select/3`
+  """
+  def deselect(watch) when is_reference(watch) do
+    Otter.Nif.deselect(watch)
+  end
+
+  deferror deselect(watch)
+
+  @doc """
+  Convert a list of numbers into a binary of packed native values
+
+  Every element is checked against the range of `type`. The result can be passed to
+  `c_ptr` arguments or to `parallel_map/3`.
+
+  - `list`: a list of numbers.
+  - `type`: a basic type, e.g., `:u32` or `:f64`.
+
+  ## Example
+  ```elixir
+  {:ok, <<1::native-32, 2::native-32>>} = Otter.pack([1, 2], :u32)
+  ```
+  """
+  def pack(list, type) when is_list(list) and is_atom(type) do
+    Otter.Nif.pack(list, type)
+  end
+
+  deferror pack(list, type)
+
+  @doc """
+  Convert a binary of packed native values into a list of numbers
+
+  This is the reverse of `pack/2`. Returns an error if a `:f32` or `:f64` value is NaN or
+  infinite, because Erlang floats cannot hold them.
+
+  - `binary`: packed values, its size must be a multiple of the size of `type`.
+  - `type`: a basic type, e.g., `:u32` or `:f64`.
+  """
+  def unpack(binary, type) when is_binary(binary) and is_atom(type) do
+    Otter.Nif.unpack(binary, type)
+  end
+
+  deferror unpack(binary, type)
+
+  @doc """
+  Take ownership of a pointer returned by a C function
+
+  The returned reference can be passed to any `c_ptr` argument. When it is garbage collected,
+  or when `release/1` is called, `destructor` is called with the pointer, e.g., `foo_free(ptr)`.
+
+  - `address`: the pointer.
+  - `destructor`: a symbol returned by `dlsym/2`. It takes the pointer as its only argument.
+  - `opts`:
+    - `:background`. Call the destructor on a background thread instead of the scheduler
+      doing the garbage collection. Use it for slow destructors. Defaults to `false`.
+
+  Externs can do this automatically with the return type `{:c_ptr, free: :foo_free}`,
+  where `foo_free` is in the same library. NULL pointers are returned as `0` then.
+
+  ```elixir
+  extern foo_new({:c_ptr, free: :foo_free, background: true}, size :: u64)
+  ```
+  """
+  def own(address, destructor, opts) when is_integer(address) and is_reference(destructor) and is_list(opts) do
+    Otter.Nif.owned_pointer(address, destructor, Keyword.get(opts, :background, false))
+  end
+
+  deferror own(address, destructor, opts)
+
+  @doc """
+  Call the destructor of an owned pointer now
+
+  Calling it more than once is fine, the destructor is only called once.
+  """
+  def release(owned) when is_reference(owned) do
+    Otter.Nif.owned_pointer_release(owned)
+  end
+
+  deferror release(owned)
+
+  @doc """
+  Get the address of an owned pointer, `0` if it has been released
+  """
+  def owned_address(owned) when is_reference(owned) do
+    Otter.Nif.owned_pointer_address(owned)
+  end
+
+  deferror owned_address(owned)
+
+  @doc false
+  # called by functions generated by `extern` with an owned pointer return type
+  def own_result({:ok, {address, out_values}}, image, opts) do
+    with {:ok, owned} <- own_result({:ok, address}, image, opts) do
+      {:ok, {owned, out_values}}
+    end
+  end
+
+  def own_result({:ok, 0}, _image, _opts), do: {:ok, 0}
+
+  def own_result({:ok, address}, image, opts) when is_integer(address) do
+    with {:ok, destructor} <- dlsym(image, opts[:free]) do
+      own(address, destructor, opts)
+    end
+  end
+
+  def own_result(error, _image, _opts), do: error
+
+  @doc false
+  # called by functions generated by `extern`
+  def invoke_signature(symbol, descriptor, args, struct_types) do
+    case Otter.Nif.invoke_signature(symbol, descriptor, args) do
+      {:error, :unregistered_signature} ->
+        with :ok <- Otter.Nif.register_signature(descriptor, struct_types.()) do
+          Otter.Nif.invoke_signature(symbol, descriptor, args)
+        end
+
+      result ->
+        result
+    end
+  end
+
+  @array_element_types [:u8, :u16, :u32, :u64, :s8, :s16, :s32, :s64, :f32, :f64]
+
+  # the element type of an array return type, `u32` or `:u32`
+  defp array_element_type({element_type, _line, context}) when is_atom(context) do
+    array_element_type(element_type)
+  end
+
+  defp array_element_type(element_type) when element_type in @array_element_types do
+    element_type
+  end
+
+  # an array of structs, e.g., `pts :: list_of(point())`
+  defp handle_dash_form_type({:list_of, _line, [{struct_name, _, args}]}, acc)
+       when is_atom(struct_name) and args in [[], nil] do
+    [{:list_of, struct_name} | acc]
+  end
+
   defp handle_dash_form_type({arg_type, _line, []}, acc) do
     [arg_type | acc]
   end
@@ -202,7 +723,19 @@ defmodule Otter do
   `as_type/2` is used for generate typed arguments that pass to
   a variadic function
   """
-  def as_type(value, :c_ptr) when is_binary(value) do
+  def as_type(value, :c_ptr) when is_binary(value) or is_reference(value) do
+    {:ok, {value, %{type: "c_ptr"}}}
+  end
+
+  def as_type(value, :cstring) when is_binary(value) or is_nil(value) do
+    {:ok, {value, %{type: "cstring"}}}
+  end
+
+  def as_type({:out_buffer, _size} = value, :c_ptr) do
+    {:ok, {value, %{type: "c_ptr"}}}
+  end
+
+  def as_type({:out_buffer, _size, _length_from} = value, :c_ptr) do
     {:ok, {value, %{type: "c_ptr"}}}
   end
 
@@ -231,6 +764,40 @@ defmodule Otter do
 
   deferror as_type(value, to_type)
 
+  @doc """
+  Create an output buffer that can be passed to a `c_ptr` argument
+
+  A binary of `size` bytes is allocated and its address is passed to the C function.
+  After the call, the binary is returned as an out value without copying.
+
+  - `size`: size of the buffer in bytes.
+  - `length_from`: how many bytes of the buffer are returned.
+    - `:buffer_size`. The whole buffer.
+    - `:return_value`. The return value of the function, e.g., `read(2)`. Negative values give an empty binary.
+    - `{:arg, index}`. The value of the integer argument at `index` after the call,
+       usually an argument passed by address, e.g., `size_t *written`.
+
+  ## Example
+  ```elixir
+  extern read(:s64, fd :: s32, buf :: c_ptr, count :: u64)
+
+  {n, [data]} = read!(fd, Otter.out_buffer(4096, :return_value), 4096)
+  ```
+  """
+  def out_buffer(size, length_from \\ :buffer_size)
+
+  def out_buffer(size, :buffer_size) when is_integer(size) and size >= 0 do
+    {:out_buffer, size}
+  end
+
+  def out_buffer(size, :return_value) when is_integer(size) and size >= 0 do
+    {:out_buffer, size, :return_value}
+  end
+
+  def out_buffer(size, {:arg, index}) when is_integer(size) and size >= 0 and is_integer(index) and index >= 0 do
+    {:out_buffer, size, {:arg, index}}
+  end
+
   @doc """
   Pass by address and marked as an output variable
   """
@@ -293,6 +860,58 @@ defmodule Otter do
 
   deferror pass_by(arg, by)
 
+  # tags and flags of the signature descriptor, keep in sync with `CallSignature` in otter_nif.cpp
+  @signature_version 1
+  @signature_tags %{
+    void: 0,
+    u8: 1,
+    u16: 2,
+    u32: 3,
+    u64: 4,
+    s8: 5,
+    s16: 6,
+    s32: 7,
+    s64: 8,
+    f32: 9,
+    f64: 10,
+    c_ptr: 11,
+    va_args: 12,
+    cstring: 15
+  }
+  @signature_struct_tag 13
+  @signature_struct_array_tag 14
+  @signature_flags %{addr: 1, out: 2, ref: 4}
+  @signature_count_arg_flag 8
+
+  defp signature_entry({:struct, struct_name}, attributes) do
+    name = Atom.to_string(struct_name)
+    <<@signature_struct_tag, signature_flags(attributes), 0::little-32, byte_size(name), name::binary>>
+  end
+
+  defp signature_entry({:struct_array, struct_name}, attributes) do
+    name = Atom.to_string(struct_name)
+    <<@signature_struct_array_tag, signature_flags(attributes), 0::little-32, byte_size(name), name::binary>>
+  end
+
+  # a pointer to an array returned as a binary, only for return types
+  defp signature_entry({:array, type, count}, []) do
+    <<Map.fetch!(@signature_tags, type), 0, count::little-32>>
+  end
+
+  defp signature_entry({:ptr_array, type, index}, []) do
+    <<Map.fetch!(@signature_tags, type), @signature_count_arg_flag, index::little-32>>
+  end
+
+  defp signature_entry(type, attributes) when is_map_key(@signature_tags, type) do
+    <<Map.fetch!(@signature_tags, type), signature_flags(attributes), 0::little-32>>
+  end
+
+  defp signature_flags(attributes) do
+    attributes
+    |> Enum.map(&Map.get(@signature_flags, &1, 0))
+    |> Enum.reduce(0, &Bitwise.bor/2)
+  end
+
   defmacro extern(fun) do
     {name, args} = Macro.decompose_call(fun)
     [return_type | func_args] = args
@@ -334,20 +953,30 @@ defmodule Otter do
             end
 
           # check if we're dealing with basic types
-          is_basic_type = Enum.member?([:u8, :u16, :u32, :u64, :s8, :s16, :s32, :s64, :c_ptr, :f32, :f64], arg_type)
-          if is_basic_type do
-            {{arg_name, line, nil}, "#{Atom.to_string(arg_type)}", attributes}
-          else
-            if arg_type == :va_args do
-              {{arg_name, line, nil}, "va_args", []}
-            else
-              caller_module = __CALLER__.module
+          is_basic_type = Enum.member?([:u8, :u16, :u32, :u64, :s8, :s16, :s32, :s64, :c_ptr, :cstring, :f32, :f64], arg_type)
+          caller_module = __CALLER__.module
+          cond do
+            is_basic_type ->
+              {{arg_name, line, nil}, "#{Atom.to_string(arg_type)}", attributes, signature_entry(arg_type, attributes), []}
+
+            arg_type == :va_args ->
+              {{arg_name, line, nil}, "va_args", [], signature_entry(:va_args, []), []}
+
+            match?({:list_of, _}, arg_type) ->
+              {:list_of, struct_name} = arg_type
+              struct_tuple =
+                quote do
+                  Kernel.apply(unquote(caller_module), unquote(struct_name), []) |> Otter.transform_type()
+                end
+              array_type = quote do: {:struct_array, unquote(struct_tuple)}
+              {{arg_name, line, nil}, array_type, attributes, signature_entry({:struct_array, struct_name}, attributes), [struct_tuple]}
+
+            true ->
               struct_tuple =
                 quote do
                   Kernel.apply(unquote(caller_module), unquote(arg_type), []) |> Otter.transform_type()
                 end
-              {{arg_name, line, nil}, struct_tuple, attributes}
-            end
+              {{arg_name, line, nil}, struct_tuple, attributes, signature_entry({:struct, arg_type}, attributes), [struct_tuple]}
           end
       end)
 
@@ -364,6 +993,144 @@ defmodule Otter do
       func_arg_types
       |> Enum.map(&elem(&1, 2))
 
+    # a pointer that should be released by a destructor in the same library,
+    #   extern foo_new({:c_ptr, free: :foo_free}, n :: u64)
+    {return_type, owned_opts} =
+      case return_type do
+        {:c_ptr, opts} when is_list(opts) ->
+          {:c_ptr, [free: to_string(Keyword.fetch!(opts, :free)), background: Keyword.get(opts, :background, false)]}
+
+        # a pointer to an array that is copied into a binary
+        #   extern get_matrix(u32-size(16, 16))
+        {:-, _, [element_type, {:size, _, [_ | _] = dims}]} ->
+          true = Enum.all?(dims, &(is_integer(&1) and &1 > 0))
+          {{:array, array_element_type(element_type), Enum.reduce(dims, 1, &*/2)}, nil}
+
+        # the number of elements is the value of an argument after the call
+        #   extern get_values({:ptr_array, :u32, 1}, n :: u64, count :: u64-addr)
+        {:{}, _, [:ptr_array, element_type, index]} when is_integer(index) ->
+          {{:ptr_array, array_element_type(element_type), index}, nil}
+
+        # the binary refers to the array, it is released by a destructor in the same library
+        #   extern new_values({:ptr_array, :u32, 0, free: :free_values}, n :: u64)
+        {:{}, _, [:ptr_array, element_type, index, opts]} when is_integer(index) and is_list(opts) ->
+          {{:ptr_array, array_element_type(element_type), index},
+           [free: to_string(Keyword.fetch!(opts, :free)), background: Keyword.get(opts, :background, false)]}
+
+        _ ->
+          {return_type, nil}
+      end
+
+    is_array_return = match?({kind, _, _} when kind in [:array, :ptr_array], return_type)
+
+    # struct types are not encoded in the descriptor, they are only
+    # evaluated and registered on the first call, see `Otter.invoke_signature/4`
+    {return_entry, return_structs} =
+      case return_type do
+        _array when is_array_return ->
+          {signature_entry(return_type, []), []}
+
+        {struct_name, _, []} when is_atom(struct_name) ->
+          {signature_entry({:struct, struct_name}, []), [return_type]}
+
+        basic_type when is_atom(basic_type) ->
+          {signature_entry(basic_type, []), []}
+      end
+
+    arg_structs =
+      func_arg_types
+      |> Enum.flat_map(&elem(&1, 4))
+
+    # `{return_type, arg_types}` if this extern can have a native stub, see `Otter.Native`
+    native_spec =
+      if owned_opts == nil and is_atom(return_type) do
+        native_arg_types =
+          Enum.map(arg_types, fn
+            arg_type when is_binary(arg_type) -> String.to_atom(arg_type)
+            _struct_type -> nil
+          end)
+
+        Otter.Native.spec(return_type, native_arg_types, types_attributes)
+      end
+
+    struct_types =
+      Enum.map(return_structs, fn struct_type ->
+        quote do
+          unquote(struct_type) |> Otter.transform_type()
+        end
+      end) ++ arg_structs
+
+    # the term form of the return type, for `Otter.invoke/3`
+    return_type_term =
+      cond do
+        is_array_return and owned_opts != nil ->
+          {:ptr_array, element_type, index} = return_type
+
+          quote do
+            {:ptr_array, unquote(element_type), unquote(index),
+             Otter.dlsym!(image, unquote(owned_opts[:free])), unquote(owned_opts[:background])}
+          end
+
+        is_array_return ->
+          Macro.escape(return_type)
+
+        true ->
+          quote do
+            unquote(return_type) |> Otter.transform_type()
+          end
+      end
+
+    args_with_type =
+      quote do
+        type_info =
+          [unquote_splicing(arg_types)]
+          |> Enum.zip(unquote(types_attributes))
+          |> Enum.map(fn {cur_type, cur_attr} ->
+              Enum.reduce(cur_attr, %{type: cur_type}, fn t, acc ->
+                Map.put_new(acc, t, true)
+              end)
+          end)
+
+        Enum.zip([unquote_splicing(func_args)], type_info)
+      end
+
+    descriptor =
+      IO.iodata_to_binary([
+        "OTS",
+        @signature_version,
+        return_entry,
+        length(func_arg_types),
+        Enum.map(func_arg_types, &elem(&1, 3))
+      ])
+
+    # the destructor of an owned array is only known at runtime, it is not part of the descriptor
+    direct_call =
+      if is_array_return and owned_opts != nil do
+        quote do
+          Otter.invoke(symbol, unquote(return_type_term), unquote(args_with_type))
+        end
+      else
+        quote do
+          Otter.invoke_signature(
+            symbol,
+            unquote(descriptor),
+            {unquote_splicing(func_args)},
+            fn -> [unquote_splicing(struct_types)] end
+          )
+        end
+      end
+
+    return_value =
+      if owned_opts && not is_array_return do
+        quote do
+          Otter.own_result(result, image, unquote(owned_opts))
+        end
+      else
+        quote do
+          result
+        end
+      end
+
     quote do
       @load_from Module.get_attribute(
                    __MODULE__,
@@ -375,28 +1142,46 @@ defmodule Otter do
                    :load_mode,
                    Module.get_attribute(__MODULE__, :default_mode)
                  )
+      @worker Module.get_attribute(
+                __MODULE__,
+                :worker,
+                Module.get_attribute(__MODULE__, :default_worker)
+              )
+      @otter_native Otter.Native.register(
+                      __MODULE__,
+                      unquote(:"#{name}"),
+                      unquote(Macro.escape(native_spec)),
+                      @load_from,
+                      @load_mode,
+                      @worker
+                    )
       def unquote(:"#{name}")(unquote_splicing(func_args)) do
         func_name = __ENV__.function |> elem(0) |> Atom.to_string()
-        return_type = unquote(return_type) |> Otter.transform_type()
+        native = @otter_native
 
-        with {:ok, image} <- Otter.dlopen(@load_from, @load_mode),
+        with :otter_fallback <-
+               (if native, do: native.unquote(:"#{name}")(unquote_splicing(func_args)), else: :otter_fallback),
+             {:ok, image} <- Otter.dlopen(@load_from, @load_mode),
              {:ok, symbol} <- Otter.dlsym(image, func_name) do
-          type_info =
-            [unquote_splicing(arg_types)]
-            |> Enum.zip(unquote(types_attributes))
-            |> Enum.map(fn {cur_type, cur_attr} ->
-                Enum.reduce(cur_attr, %{type: cur_type}, fn t, acc ->
-                  Map.put_new(acc, t, true)
-                end)
-            end)
-
-          Otter.invoke(
-            symbol,
-            return_type,
-            Enum.zip([unquote_splicing(func_args)], type_info)
-          )
+          result =
+            case @worker do
+              nil ->
+                unquote(direct_call)
+
+              worker_name ->
+                Otter.Worker.invoke(
+                  Otter.Worker.whereis!(worker_name),
+                  symbol,
+                  unquote(return_type_term),
+                  unquote(args_with_type)
+                )
+            end
+
+          unquote(return_value)
         else
           {:error, reason} -> raise reason
+          # returned by the native stub
+          native_result -> native_result
         end
       end
       deferror(unquote(:"#{name}")(unquote_splicing(func_args)))
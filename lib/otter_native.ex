@@ -0,0 +1,514 @@
+defmodule Otter.Native do
+  @moduledoc """
+  Dedicated NIF stubs generated from `extern` declarations.
+
+  Externs declared while the `@native_stubs` attribute is `true` are compiled into a NIF
+  library of their own. Each extern gets a typed entry point that decodes its arguments
+  directly into C types, calls the C function and encodes the result, without libffi and
+  without parsing type information on every call.
+
+  ```elixir
+  defmodule Foo do
+    import Otter
+
+    @default_from "libfoo.so"
+    @default_mode :RTLD_NOW
+
+    @native_stubs true
+    extern foo_add(:u32, a :: u32, b :: u32)
+    extern foo_name(:cstring, id :: u64)
+  end
+  ```
+
+  The C source is generated when the module is compiled, and built with the compiler in
+  the `CC` environment variable (`cc` by default) in the `otter_native` directory of the
+  Mix build path. Only the library is then copied into the `priv/otter_native` directory
+  of the application so that it is part of releases. The library is loaded together with
+  the module, and opens the
+  libraries of the externs with their `@load_mode` (or `@default_mode`), `:RTLD_NOW` if
+  neither is set.
+
+  Only externs whose return type and argument types are basic types or `cstring`, without
+  `addr`, `out` or `ref` attributes, get a native stub. Other externs and externs routed to
+  a worker are called as usual. If the library cannot be built or loaded, or an argument
+  cannot be decoded by the stub (e.g., a resource passed to a `c_ptr` argument), the call
+  falls back to `Otter.invoke_signature/4`.
+
+  Native stubs run directly on the calling scheduler. Calls made through them are not
+  traced by `Otter.Trace`, not routed to dirty schedulers and a segmentation fault in the
+  C function is not caught.
+  """
+
+  @basic_types [:u8, :u16, :u32, :u64, :s8, :s16, :s32, :s64, :f32, :f64, :c_ptr, :cstring]
+
+  @dlopen_modes [:RTLD_LAZY, :RTLD_NOW, :RTLD_NOLOAD, :RTLD_DEEPBIND, :RTLD_GLOBAL, :RTLD_LOCAL, :RTLD_NODELETE]
+
+  @c_types %{
+    u8: "uint8_t",
+    u16: "uint16_t",
+    u32: "uint32_t",
+    u64: "uint64_t",
+    s8: "int8_t",
+    s16: "int16_t",
+    s32: "int32_t",
+    s64: "int64_t",
+    f32: "float",
+    f64: "double",
+    c_ptr: "void *",
+    cstring: "const char *",
+    void: "void"
+  }
+
+  @doc """
+  Result of loading the native stubs of `module`
+
+  Returns `:ok` if the stubs are loaded, `{:error, reason}` if calls fall back to
+  `Otter.invoke_signature/4`, or `nil` if `module` has no native stubs.
+  """
+  def status(module) when is_atom(module) do
+    :persistent_term.get({__MODULE__, native_module(module)}, nil)
+  end
+
+  @doc false
+  def native_module(module), do: Module.concat(module, OtterNative)
+
+  @doc false
+  # `{return_type, arg_types}` if an extern can have a native stub, otherwise nil
+  def spec(return_type, arg_types, attributes) do
+    if (return_type == :void or return_type in @basic_types) and
+         Enum.all?(arg_types, &(&1 in @basic_types)) and Enum.all?(attributes, &(&1 == [])) do
+      {return_type, arg_types}
+    end
+  end
+
+  @doc false
+  # called when an extern is defined, returns the native module if the extern has a native stub
+  def register(module, name, spec, load_from, load_mode, worker) do
+    if spec != nil and worker == nil and Module.get_attribute(module, :native_stubs, false) == true do
+      unless Module.has_attribute?(module, :otter_native_externs) do
+        Module.register_attribute(module, :otter_native_externs, accumulate: true)
+        Module.put_attribute(module, :before_compile, __MODULE__)
+      end
+
+      Module.put_attribute(module, :otter_native_externs, {name, spec, load_from, load_mode})
+      native_module(module)
+    end
+  end
+
+  defmacro __before_compile__(env) do
+    externs =
+      env.module
+      |> Module.get_attribute(:otter_native_externs)
+      |> Enum.reverse()
+      |> Enum.uniq_by(fn {name, _spec, _load_from, _load_mode} -> name end)
+
+    native_module = native_module(env.module)
+    {app, relative_path, absolute_path} = build(native_module, externs)
+
+    stubs =
+      for {name, {_return_type, arg_types}, _load_from, _load_mode} <- externs do
+        args = Enum.map(1..length(arg_types)//1, &Macro.var(:"_arg#{&1}", __MODULE__))
+
+        quote do
+          def unquote(name)(unquote_splicing(args)), do: :otter_fallback
+        end
+      end
+
+    quote do
+      defmodule unquote(native_module) do
+        @moduledoc false
+        @on_load :__load_nif__
+
+        def __load_nif__ do
+          Otter.Native.load(__MODULE__, unquote(app), unquote(relative_path), unquote(absolute_path))
+        end
+
+        unquote_splicing(stubs)
+      end
+    end
+  end
+
+  @doc false
+  def load(native_module, app, relative_path, absolute_path) do
+    path =
+      with true <- app != nil and relative_path != nil,
+           priv_dir when is_list(priv_dir) <- :code.priv_dir(app),
+           path = Path.join(priv_dir, relative_path),
+           true <- File.exists?(path <> so_extension()) do
+        path
+      else
+        _ -> absolute_path
+      end
+
+    status =
+      if path do
+        case :erlang.load_nif(String.to_charlist(path), 0) do
+          :ok -> :ok
+          {:error, {_reason, text}} -> {:error, to_string(text)}
+        end
+      else
+        {:error, "native stubs were not built"}
+      end
+
+    :persistent_term.put({__MODULE__, native_module}, status)
+    # stubs that are not replaced by the NIF fall back to the generic path
+    :ok
+  end
+
+  # generate and compile the C source,
+  # returns the application, the path relative to its priv directory and the absolute path
+  defp build(native_module, externs) do
+    {app, build_dir, priv_dir} = output_location()
+    name = native_module |> Atom.to_string() |> String.replace_prefix("Elixir.", "")
+    base = Path.join(build_dir, name)
+    source = generate(native_module, externs)
+
+    with :ok <- File.mkdir_p(build_dir),
+         :ok <- compile_if_changed(base, source),
+         :ok <- copy_to_priv(base <> so_extension(), priv_dir, name) do
+      relative_path = if priv_dir, do: Path.join("otter_native", name)
+      {app, relative_path, base}
+    else
+      {:error, reason} ->
+        IO.warn("cannot build native stubs for #{inspect(native_module)}, calls fall back to Otter.invoke: #{reason}", [])
+        {nil, nil, nil}
+    end
+  end
+
+  # `{app, build_dir, priv_dir}`, the priv directory of the application is usually
+  # a symlink to the priv directory of the project, so only the library goes there
+  defp output_location do
+    if Code.ensure_loaded?(Mix.Project) and Mix.Project.get() != nil and Mix.Project.config()[:app] != nil do
+      app = Mix.Project.config()[:app]
+      build_dir = Path.join([Mix.Project.build_path(), "otter_native", Atom.to_string(app)])
+      {app, build_dir, Path.join([Mix.Project.app_path(), "priv", "otter_native"])}
+    else
+      {nil, Path.join(System.tmp_dir!(), "otter_native"), nil}
+    end
+  end
+
+  defp copy_to_priv(_so_file, nil, _name), do: :ok
+
+  defp copy_to_priv(so_file, priv_dir, name) do
+    dest = Path.join(priv_dir, name <> so_extension())
+
+    if File.read(dest) == File.read(so_file) do
+      :ok
+    else
+      # the library may be loaded, so it is replaced instead of being overwritten in place
+      tmp = dest <> ".tmp"
+
+      with :ok <- File.mkdir_p(priv_dir),
+           :ok <- File.cp(so_file, tmp) do
+        File.rename(tmp, dest)
+      end
+    end
+  end
+
+  defp compile_if_changed(base, source) do
+    c_file = base <> ".c"
+    so_file = base <> so_extension()
+
+    if File.read(c_file) == {:ok, source} and File.exists?(so_file) do
+      :ok
+    else
+      File.write!(c_file, source)
+      compile(c_file, so_file)
+    end
+  end
+
+  defp compile(c_file, so_file) do
+    cc = System.get_env("CC", "cc")
+
+    case System.find_executable(cc) do
+      nil ->
+        {:error, "cannot find C compiler #{cc}"}
+
+      cc_path ->
+        erts_include = Path.join([:code.root_dir(), "erts-#{:erlang.system_info(:version)}", "include"])
+
+        os_flags =
+          case :os.type() do
+            {:unix, :darwin} -> ["-undefined", "dynamic_lookup", "-flat_namespace"]
+            {:unix, _} -> ["-ldl"]
+            _ -> []
+          end
+
+        args = ["-O2", "-fPIC", "-shared", "-I", erts_include, c_file, "-o", so_file] ++ os_flags
+
+        case System.cmd(cc_path, args, stderr_to_stdout: true) do
+          {_, 0} -> :ok
+          {output, _} -> {:error, output}
+        end
+    end
+  end
+
+  defp so_extension, do: ".so"
+
+  @doc false
+  # C source of the NIF library, one entry point per extern
+  def generate(native_module, externs) do
+    # a library opened with different modes is opened once per mode
+    libraries =
+      externs
+      |> Enum.map(fn {_name, _spec, load_from, load_mode} -> {library_path(load_from), dlopen_mode(load_mode)} end)
+      |> Enum.uniq()
+
+    functions =
+      externs
+      |> Enum.with_index()
+      |> Enum.map(fn {{_name, spec, _load_from, _load_mode}, index} -> generate_function(spec, index) end)
+
+    nif_funcs =
+      externs
+      |> Enum.with_index()
+      |> Enum.map(fn {{name, {_return_type, arg_types}, _load_from, _load_mode}, index} ->
+        ~s|    {"#{name}", #{length(arg_types)}, otter_nif_#{index}, 0},\n|
+      end)
+
+    load_libraries =
+      libraries
+      |> Enum.with_index()
+      |> Enum.map(fn {{path, mode}, index} ->
+        c_path = if path, do: c_string_literal(path), else: "NULL"
+
+        """
+            libraries[#{index}] = dlopen(#{c_path}, #{mode});
+            if (!libraries[#{index}]) return 1;
+        """
+      end)
+
+    load_symbols =
+      externs
+      |> Enum.with_index()
+      |> Enum.map(fn {{name, _spec, load_from, load_mode}, index} ->
+        library = Enum.find_index(libraries, &(&1 == {library_path(load_from), dlopen_mode(load_mode)}))
+
+        """
+            *(void **)&otter_fn_#{index} = dlsym(libraries[#{library}], #{c_string_literal(Atom.to_string(name))});
+            if (!otter_fn_#{index}) return 1;
+        """
+      end)
+
+    """
+    // generated by Otter.Native, do not edit
+    #define _POSIX_C_SOURCE 200809L
+    #include <dlfcn.h>
+    #include <stdint.h>
+    #include <string.h>
+    #include <erl_nif.h>
+
+    static ERL_NIF_TERM atom_ok, atom_nil, atom_null, atom_fallback;
+    static void *libraries[#{max(length(libraries), 1)}];
+
+    static int otter_get_int(ErlNifEnv *env, ERL_NIF_TERM term, int64_t *value) {
+        ErlNifSInt64 s64;
+        if (!enif_get_int64(env, term, &s64)) return 0;
+        *value = (int64_t)s64;
+        return 1;
+    }
+
+    static int otter_get_uint(ErlNifEnv *env, ERL_NIF_TERM term, uint64_t *value) {
+        ErlNifUInt64 u64;
+        ErlNifSInt64 s64;
+        if (enif_get_uint64(env, term, &u64)) {
+            *value = (uint64_t)u64;
+            return 1;
+        } else if (enif_get_int64(env, term, &s64)) {
+            *value = (uint64_t)s64;
+            return 1;
+        }
+        return 0;
+    }
+
+    static int otter_get_double(ErlNifEnv *env, ERL_NIF_TERM term, double *value) {
+        ErlNifUInt64 u64;
+        ErlNifSInt64 s64;
+        if (enif_get_double(env, term, value)) {
+            return 1;
+        } else if (enif_get_uint64(env, term, &u64)) {
+            *value = (double)u64;
+            return 1;
+        } else if (enif_get_int64(env, term, &s64)) {
+            *value = (double)s64;
+            return 1;
+        }
+        return 0;
+    }
+
+    static int otter_is_null(ErlNifEnv *env, ERL_NIF_TERM term) {
+        (void)env;
+        return enif_is_identical(term, atom_nil) || enif_is_identical(term, atom_null);
+    }
+
+    // integers are addresses, binaries are passed by their data
+    static int otter_get_ptr(ErlNifEnv *env, ERL_NIF_TERM term, void **value) {
+        ErlNifBinary binary;
+        ErlNifUInt64 u64;
+        if (enif_get_uint64(env, term, &u64)) {
+            *value = (void *)(uintptr_t)u64;
+            return 1;
+        } else if (enif_inspect_binary(env, term, &binary)) {
+            *value = binary.data;
+            return 1;
+        } else if (otter_is_null(env, term)) {
+            *value = NULL;
+            return 1;
+        }
+        return 0;
+    }
+
+    // binaries that do not end with NUL are copied, `*copy` is set if the caller should free it
+    static int otter_get_cstring(ErlNifEnv *env, ERL_NIF_TERM term, const char **value, char **copy) {
+        ErlNifBinary binary;
+        *copy = NULL;
+        if (enif_inspect_binary(env, term, &binary)) {
+            if (binary.size > 0 && binary.data[binary.size - 1] == '\\0') {
+                *value = (const char *)binary.data;
+                return 1;
+            }
+            *copy = (char *)enif_alloc(binary.size + 1);
+            if (*copy == NULL) return 0;
+            memcpy(*copy, binary.data, binary.size);
+            (*copy)[binary.size] = '\\0';
+            *value = *copy;
+            return 1;
+        } else if (otter_is_null(env, term)) {
+            *value = NULL;
+            return 1;
+        }
+        return 0;
+    }
+
+    static ERL_NIF_TERM otter_make_cstring(ErlNifEnv *env, const char *str) {
+        ERL_NIF_TERM term;
+        size_t length;
+        unsigned char *data;
+        if (str == NULL) return atom_nil;
+        length = strnlen(str, (size_t)1 << 30);
+        data = enif_make_new_binary(env, length, &term);
+        if (data == NULL) return enif_raise_exception(env, enif_make_atom(env, "enomem"));
+        memcpy(data, str, length);
+        return term;
+    }
+
+    #{Enum.join(functions, "\n")}
+    static int load(ErlNifEnv *env, void **priv_data, ERL_NIF_TERM load_info) {
+        (void)priv_data;
+        (void)load_info;
+        atom_ok = enif_make_atom(env, "ok");
+        atom_nil = enif_make_atom(env, "nil");
+        atom_null = enif_make_atom(env, "NULL");
+        atom_fallback = enif_make_atom(env, "otter_fallback");
+    #{Enum.join(load_libraries)}#{Enum.join(load_symbols)}    return 0;
+    }
+
+    static ErlNifFunc nif_functions[] = {
+    #{Enum.join(nif_funcs)}};
+
+    ERL_NIF_INIT(#{Atom.to_string(native_module)}, nif_functions, load, NULL, NULL, NULL)
+    """
+  end
+
+  defp generate_function({return_type, arg_types}, index) do
+    c_return = Map.fetch!(@c_types, return_type)
+    c_args = if arg_types == [], do: "void", else: Enum.map_join(arg_types, ", ", &Map.fetch!(@c_types, &1))
+
+    decls =
+      arg_types
+      |> Enum.with_index()
+      |> Enum.map(fn
+        {:cstring, i} -> "    const char *a#{i};\n    char *copy#{i} = NULL;\n"
+        {type, i} -> "    #{Map.fetch!(@c_types, type)} a#{i};\n"
+      end)
+
+    decode =
+      arg_types
+      |> Enum.with_index()
+      |> Enum.map(fn {type, i} -> decode_arg(type, i) end)
+
+    frees =
+      arg_types
+      |> Enum.with_index()
+      |> Enum.filter(fn {type, _i} -> type == :cstring end)
+      |> Enum.map(fn {_type, i} -> "    if (copy#{i}) enif_free(copy#{i});\n" end)
+
+    # jumped to when an argument cannot be decoded
+    done_label = if arg_types == [], do: "", else: "done:\n"
+
+    call = "otter_fn_#{index}(#{arg_types |> Enum.with_index() |> Enum.map_join(", ", fn {_, i} -> "a#{i}" end)})"
+
+    {call_and_encode, result_decl} =
+      case return_type do
+        :void ->
+          {"    #{call};\n    result = enif_make_tuple2(env, atom_ok, atom_ok);\n", ""}
+
+        _ ->
+          {"    ret = #{call};\n    result = enif_make_tuple2(env, atom_ok, #{encode_return(return_type, "ret")});\n",
+           "    #{c_return} ret;\n"}
+      end
+
+    """
+    static #{c_return} (*otter_fn_#{index})(#{c_args});
+
+    static ERL_NIF_TERM otter_nif_#{index}(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[]) {
+        ERL_NIF_TERM result = atom_fallback;
+        int64_t s64;
+        uint64_t u64;
+        double f64;
+    #{decls}#{result_decl}    (void)argc;
+        (void)argv;
+        (void)s64;
+        (void)u64;
+        (void)f64;
+    #{decode}#{call_and_encode}#{done_label}#{frees}    return result;
+    }
+    """
+  end
+
+  defp decode_arg(type, i) when type in [:s8, :s16, :s32, :s64] do
+    "    if (!otter_get_int(env, argv[#{i}], &s64)) goto done;\n    a#{i} = (#{Map.fetch!(@c_types, type)})s64;\n"
+  end
+
+  defp decode_arg(type, i) when type in [:u8, :u16, :u32, :u64] do
+    "    if (!otter_get_uint(env, argv[#{i}], &u64)) goto done;\n    a#{i} = (#{Map.fetch!(@c_types, type)})u64;\n"
+  end
+
+  defp decode_arg(type, i) when type in [:f32, :f64] do
+    "    if (!otter_get_double(env, argv[#{i}], &f64)) goto done;\n    a#{i} = (#{Map.fetch!(@c_types, type)})f64;\n"
+  end
+
+  defp decode_arg(:c_ptr, i) do
+    "    if (!otter_get_ptr(env, argv[#{i}], &a#{i})) goto done;\n"
+  end
+
+  defp decode_arg(:cstring, i) do
+    "    if (!otter_get_cstring(env, argv[#{i}], &a#{i}, &copy#{i})) goto done;\n"
+  end
+
+  defp encode_return(type, var) when type in [:u8, :u16, :u32], do: "enif_make_uint(env, #{var})"
+  defp encode_return(type, var) when type in [:s8, :s16, :s32], do: "enif_make_int(env, #{var})"
+  defp encode_return(:u64, var), do: "enif_make_uint64(env, #{var})"
+  defp encode_return(:s64, var), do: "enif_make_int64(env, #{var})"
+  defp encode_return(type, var) when type in [:f32, :f64], do: "enif_make_double(env, #{var})"
+  defp encode_return(:c_ptr, var), do: "enif_make_uint64(env, (uint64_t)(uintptr_t)#{var})"
+  defp encode_return(:cstring, var), do: "otter_make_cstring(env, #{var})"
+
+  defp library_path(load_from) when load_from in [nil, :RTLD_SELF, "RTLD_SELF"], do: nil
+  # passed to dlopen as it is, same as `Otter.dlopen/2`
+  defp library_path(load_from) when is_binary(load_from), do: load_from
+
+  # the flag passed to dlopen in C, `Otter.dlopen/2` takes the same modes
+  defp dlopen_mode(nil), do: "RTLD_NOW"
+  defp dlopen_mode(mode) when mode in @dlopen_modes, do: Atom.to_string(mode)
+  defp dlopen_mode(mode) when is_integer(mode) and mode >= 0, do: Integer.to_string(mode)
+
+  defp c_string_literal(string) do
+    escaped =
+      string
+      |> String.replace("\\", "\\\\")
+      |> String.replace("\"", "\\\"")
+
+    "\"" <> escaped <> "\""
+  end
+end
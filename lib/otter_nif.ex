@@ -13,6 +13,7 @@ defmodule Otter.Nif do
   end
 
   def dlopen(_path, _mode), do: :erlang.nif_error(:not_loaded)
+  def dlopen_binary(_bytes, _mode), do: :erlang.nif_error(:not_loaded)
   def dlclose(_handle), do: :erlang.nif_error(:not_loaded)
   def dlsym(_image, _func_name), do: :erlang.nif_error(:not_loaded)
 
@@ -23,4 +24,48 @@ defmodule Otter.Nif do
   def stdout(), do: :erlang.nif_error(:not_loaded)
   def stderr(), do: :erlang.nif_error(:not_loaded)
   def invoke(_symbol, _return_type, _args_with_type), do: :erlang.nif_error(:not_loaded)
+  def mmap(_path, _mode, _offset, _length), do: :erlang.nif_error(:not_loaded)
+  def munmap(_region), do: :erlang.nif_error(:not_loaded)
+  def madvise(_region, _advice), do: :erlang.nif_error(:not_loaded)
+  def msync(_region, _mode), do: :erlang.nif_error(:not_loaded)
+  def pointer_new(_source, _type, _count), do: :erlang.nif_error(:not_loaded)
+  def pointer_read(_pointer, _type, _offset, _count, _format), do: :erlang.nif_error(:not_loaded)
+  def pointer_write(_pointer, _offset, _binary), do: :erlang.nif_error(:not_loaded)
+  def pointer_address(_pointer), do: :erlang.nif_error(:not_loaded)
+  def invoke_signature(_symbol, _descriptor, _args), do: :erlang.nif_error(:not_loaded)
+  def register_signature(_descriptor, _struct_types), do: :erlang.nif_error(:not_loaded)
+  def pack(_list, _type), do: :erlang.nif_error(:not_loaded)
+  def unpack(_binary, _type), do: :erlang.nif_error(:not_loaded)
+  def owned_pointer(_address, _destructor, _background), do: :erlang.nif_error(:not_loaded)
+  def owned_pointer_release(_owned), do: :erlang.nif_error(:not_loaded)
+  def owned_pointer_address(_owned), do: :erlang.nif_error(:not_loaded)
+  def struct_pool_info(), do: :erlang.nif_error(:not_loaded)
+  def set_struct_pool_capacity(_capacity), do: :erlang.nif_error(:not_loaded)
+  def set_struct_pooling(_struct_type, _enabled), do: :erlang.nif_error(:not_loaded)
+  def select_fd(_fd, _close_on_stop), do: :erlang.nif_error(:not_loaded)
+  def select(_watch, _mode), do: :erlang.nif_error(:not_loaded)
+  def deselect(_watch), do: :erlang.nif_error(:not_loaded)
+  def memory_info(), do: :erlang.nif_error(:not_loaded)
+  def ring_new(_record_size, _capacity, _mode), do: :erlang.nif_error(:not_loaded)
+  def ring_arm(_ring, _ref), do: :erlang.nif_error(:not_loaded)
+  def ring_disarm(_ring), do: :erlang.nif_error(:not_loaded)
+  def ring_drain(_ring, _max_records), do: :erlang.nif_error(:not_loaded)
+  def ring_close(_ring), do: :erlang.nif_error(:not_loaded)
+  def set_memory_budget(_kind, _soft, _hard), do: :erlang.nif_error(:not_loaded)
+  def alloc_profile(_n), do: :erlang.nif_error(:not_loaded)
+  def routing_info(_symbol), do: :erlang.nif_error(:not_loaded)
+  def set_adaptive_routing(_enabled, _threshold_ns, _window, _dirty), do: :erlang.nif_error(:not_loaded)
+  def set_tracing(_enabled), do: :erlang.nif_error(:not_loaded)
+  def drain_trace(_format), do: :erlang.nif_error(:not_loaded)
+  def worker_start(_cpu, _queue_size), do: :erlang.nif_error(:not_loaded)
+  def worker_invoke(_worker, _symbol, _return_type, _args_with_type), do: :erlang.nif_error(:not_loaded)
+  def worker_invoke_async(_worker, _symbol, _return_type, _args_with_type), do: :erlang.nif_error(:not_loaded)
+  def worker_stop(_worker), do: :erlang.nif_error(:not_loaded)
+  def prepare(_symbol, _return_type, _arg_types), do: :erlang.nif_error(:not_loaded)
+  def parallel_map(_prepared, _inputs, _max_threads, _chunk_size), do: :erlang.nif_error(:not_loaded)
+  def set_thread_pool_size(_size), do: :erlang.nif_error(:not_loaded)
+  def decode_struct(_struct_type, _resource, _format), do: :erlang.nif_error(:not_loaded)
+  def decode_struct_array(_struct_type, _binary, _format), do: :erlang.nif_error(:not_loaded)
+  def variadic_cif_cache_info(), do: :erlang.nif_error(:not_loaded)
+  def set_variadic_cif_cache_capacity(_capacity), do: :erlang.nif_error(:not_loaded)
 end
@@ -0,0 +1,72 @@
+defmodule Otter.Pointer do
+  @moduledoc """
+  Typed views of native memory.
+
+  A pointer view has an element type and a count, and every read and write is
+  checked against this extent. Reading through a view copies the memory into a
+  binary (or a list) in one go, which is much cheaper than calling a C function
+  for each element.
+
+  A pointer view can be passed to any `c_ptr` argument.
+  """
+
+  import Otter.Errorize
+
+  @doc """
+  Create a pointer view
+
+  - `source`:
+    - an address, for example, the return value of a function whose return type is `:c_ptr`.
+    - a memory-mapped region returned by `Otter.mmap/4`. The region stays mapped
+      as long as the view is alive unless it is unmapped explicitly.
+  - `type`: element type, a basic type like `:u32`.
+  - `count`: number of elements that can be accessed. For memory-mapped regions, `0` covers
+    the whole region.
+  """
+  def new(source, type, count)
+      when (is_integer(source) or is_reference(source)) and is_atom(type) and
+             is_integer(count) and count >= 0 do
+    Otter.Nif.pointer_new(source, type, count)
+  end
+
+  deferror new(source, type, count)
+
+  @doc """
+  Read `count` elements of `type` starting at `offset`
+
+  `offset` and `count` are in elements of `type`, which does not need to be the same as
+  the element type of the view.
+
+  - `format`:
+    - `:binary`. The raw bytes.
+    - `:list`. A list of numbers.
+  """
+  def read(pointer, type, offset, count, format)
+      when is_reference(pointer) and is_atom(type) and is_integer(offset) and offset >= 0 and
+             is_integer(count) and count >= 0 and format in [:binary, :list] do
+    Otter.Nif.pointer_read(pointer, type, offset, count, format)
+  end
+
+  deferror read(pointer, type, offset, count, format)
+
+  @doc """
+  Write `binary` to the memory starting at `offset`
+
+  `offset` is in elements of the view's element type.
+  """
+  def write(pointer, offset, binary)
+      when is_reference(pointer) and is_integer(offset) and offset >= 0 and is_binary(binary) do
+    Otter.Nif.pointer_write(pointer, offset, binary)
+  end
+
+  deferror write(pointer, offset, binary)
+
+  @doc """
+  Get the address that the pointer view points to
+  """
+  def address(pointer) when is_reference(pointer) do
+    Otter.Nif.pointer_address(pointer)
+  end
+
+  deferror address(pointer)
+end
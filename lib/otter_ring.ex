@@ -0,0 +1,120 @@
+defmodule Otter.Ring do
+  @moduledoc """
+  Lock-free ring buffers shared with producer threads in C code.
+
+  Some libraries produce data on their own threads. Instead of polling them with repeated
+  calls, pass a ring to the library as a `c_ptr`. The library pushes fixed-size records
+  with `otter_ring_push` from `c_src/otter_ring.h`. When the consumer is waiting, a push
+  rings an eventfd doorbell, which wakes the consumer through `enif_select`. The consumer
+  then drains all available records into one binary.
+
+  ```c
+  #include "otter_ring.h"
+
+  void start_capture(struct otter_ring *ring) {
+      // on the capture thread
+      struct sample s = ...;
+      otter_ring_push(ring, &s, sizeof(s));
+  }
+  ```
+
+  ```elixir
+  {:ok, ring} = Otter.Ring.new(16, 4096, :mpsc)
+  Foo.start_capture!(ring)
+  {:ok, records} = Otter.Ring.await(ring, :infinity)
+  ```
+
+  C code must stop pushing before the ring is closed or garbage collected. Only supported
+  on Linux.
+  """
+
+  import Otter.Errorize
+
+  @doc """
+  Create a ring
+
+  - `record_size`: size of each record in bytes.
+  - `capacity`: number of records the ring can hold, rounded up to a power of two.
+  - `mode`:
+    - `:spsc`. Only one producer thread pushes at a time.
+    - `:mpsc`. Any number of producer threads push concurrently.
+  """
+  def new(record_size, capacity, mode \\ :mpsc)
+      when is_integer(record_size) and record_size > 0 and is_integer(capacity) and capacity > 0 and
+             mode in [:spsc, :mpsc] do
+    Otter.Nif.ring_new(record_size, capacity, mode)
+  end
+
+  deferror new(record_size, capacity, mode)
+
+  @doc """
+  Take up to `max_records` records from the ring without waiting
+
+  Returns `{:ok, records}`, where `records` is a binary of zero or more records. Drains that
+  copy more than 64 KiB run on a dirty CPU scheduler.
+  """
+  def drain(ring, max_records \\ 0xFFFFFFFF) when is_reference(ring) and is_integer(max_records) and max_records >= 0 do
+    Otter.Nif.ring_drain(ring, max_records)
+  end
+
+  deferror drain(ring, max_records)
+
+  @doc """
+  Wait until the ring has records, then take up to `max_records` of them
+
+  Returns `{:ok, records}`, or `{:error, :timeout}` if no record arrived within `timeout`.
+  """
+  def await(ring, timeout, max_records \\ 0xFFFFFFFF) when is_reference(ring) do
+    case drain(ring, max_records) do
+      {:ok, <<>>} -> wait_and_drain(ring, timeout, max_records)
+      ret -> ret
+    end
+  end
+
+  deferror await(ring, timeout, max_records)
+
+  defp wait_and_drain(ring, timeout, max_records) do
+    ref = make_ref()
+
+    case Otter.Nif.ring_arm(ring, ref) do
+      {:ok, :ready} ->
+        drain(ring, max_records)
+
+      :ok ->
+        receive do
+          {:select, ^ring, ^ref, :ready_input} ->
+            case drain(ring, max_records) do
+              # woken up by a record that was already drained
+              {:ok, <<>>} -> wait_and_drain(ring, timeout, max_records)
+              ret -> ret
+            end
+        after
+          timeout ->
+            # stop watching the doorbell, only a message that is already on its way can still arrive
+            Otter.Nif.ring_disarm(ring)
+
+            receive do
+              {:select, ^ring, ^ref, :ready_input} -> :ok
+            after
+              0 -> :ok
+            end
+
+            {:error, :timeout}
+        end
+
+      error ->
+        error
+    end
+  end
+
+  @doc """
+  Close the doorbell of the ring
+
+  The memory of the ring is freed when it is garbage collected.
+  """
+  def close(ring) when is_reference(ring) do
+    Otter.Nif.ring_close(ring)
+  end
+
+  deferror close(ring)
+end
@@ -0,0 +1,58 @@
+defmodule Otter.Trace do
+  @moduledoc """
+  Record the timing of native calls across schedulers.
+
+  When tracing is started, every call made by `Otter.invoke/3` and by functions generated
+  by `extern` is recorded with its symbol, thread, start and end timestamps
+  (`CLOCK_MONOTONIC_RAW`), number of arguments and outcome. Each thread keeps up to 4096
+  events until they are drained, and events beyond that are dropped.
+
+  ```elixir
+  :ok = Otter.Trace.start()
+  # ... make some calls ...
+  {json, _dropped} = Otter.Trace.drain!(:chrome)
+  File.write!("otter_trace.json", json)
+  ```
+
+  The JSON file can be opened in `chrome://tracing` or Perfetto.
+  """
+
+  import Otter.Errorize
+
+  @doc """
+  Start recording native calls
+  """
+  def start do
+    Otter.Nif.set_tracing(true)
+  end
+
+  deferror start()
+
+  @doc """
+  Stop recording native calls
+
+  Events recorded so far are kept until they are drained.
+  """
+  def stop do
+    Otter.Nif.set_tracing(false)
+  end
+
+  deferror stop()
+
+  @doc """
+  Take all recorded events
+
+  Returns `{:ok, {data, dropped}}`, where `dropped` is the number of events dropped since
+  the last drain.
+
+  - `format`:
+    - `:chrome`. `data` is a JSON document in the Chrome trace event format.
+    - `:binary`. `data` is a sequence of 32-byte events in native byte order,
+      `<<symbol::64, start_ns::64, end_ns::64, thread::32, argc::16, ok::8, _::8>>`.
+  """
+  def drain(format) when format in [:chrome, :binary] do
+    Otter.Nif.drain_trace(format)
+  end
+
+  deferror drain(format)
+end
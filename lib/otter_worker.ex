@@ -0,0 +1,102 @@
+defmodule Otter.Worker do
+  @moduledoc """
+  Thread-affine native workers.
+
+  Some libraries keep thread-local state, or require all calls to be made on the thread
+  that initialised them. A worker owns one native thread, and every call sent to the
+  worker runs on that thread.
+
+  Externs can be routed to a named worker by setting the `@worker` (or the module level
+  `@default_worker`) attribute before them.
+
+  ```elixir
+  defmodule Foo do
+    import Otter
+
+    @default_from "libfoo.so"
+    @default_mode :RTLD_NOW
+
+    @worker :foo
+    extern foo_init(:s32)
+    extern foo_draw(:s32, n :: u32)
+  end
+
+  {:ok, _worker} = Otter.Worker.start(name: :foo)
+  Foo.foo_init!()
+  ```
+  """
+
+  import Otter.Errorize
+
+  @doc """
+  Start a worker thread
+
+  - `opts`:
+    - `:name`. Register the worker under this name, see `whereis/1`.
+    - `:cpu`. Pin the worker thread to this CPU. Only supported on Linux.
+    - `:queue_size`. Maximum number of pending requests. Defaults to `1024`.
+
+  The thread is stopped when the worker is garbage collected or by `stop/1`.
+  """
+  def start(opts \\ []) when is_list(opts) do
+    cpu = Keyword.get(opts, :cpu, -1)
+    queue_size = Keyword.get(opts, :queue_size, 1024)
+
+    with {:ok, worker} <- Otter.Nif.worker_start(cpu, queue_size) do
+      case Keyword.get(opts, :name) do
+        nil -> :ok
+        name -> :persistent_term.put({__MODULE__, name}, worker)
+      end
+
+      {:ok, worker}
+    end
+  end
+
+  deferror start(opts)
+
+  @doc """
+  Find a worker registered by `start/1`
+  """
+  def whereis(name) do
+    case :persistent_term.get({__MODULE__, name}, nil) do
+      nil -> {:error, "no worker named #{inspect(name)}"}
+      worker -> {:ok, worker}
+    end
+  end
+
+  deferror whereis(name)
+
+  @doc """
+  Invoke a symbol on the worker thread and wait for the result
+
+  The arguments and the return value are the same as `Otter.invoke/3`.
+  """
+  def invoke(worker, symbol, return_type, args_with_type) when is_reference(worker) do
+    Otter.Nif.worker_invoke(worker, symbol, return_type, args_with_type)
+  end
+
+  deferror invoke(worker, symbol, return_type, args_with_type)
+
+  @doc """
+  Invoke a symbol on the worker thread without waiting
+
+  Returns `{:ok, ref}`, and the result will be sent to the calling process as `{ref, result}`,
+  where `result` is what `Otter.invoke/3` would return.
+  """
+  def invoke_async(worker, symbol, return_type, args_with_type) when is_reference(worker) do
+    Otter.Nif.worker_invoke_async(worker, symbol, return_type, args_with_type)
+  end
+
+  deferror invoke_async(worker, symbol, return_type, args_with_type)
+
+  @doc """
+  Stop the worker thread
+
+  Requests that are still queued will fail.
+  """
+  def stop(worker) when is_reference(worker) do
+    Otter.Nif.worker_stop(worker)
+  end
+
+  deferror stop(worker)
+end
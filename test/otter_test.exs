@@ -1,3 +1,17 @@
+defmodule OtterTest.NativeStubs do
+  import Otter, except: [{:&, 1}]
+
+  @default_from Path.join([__DIR__, "test.so"])
+  @default_mode :RTLD_NOW
+
+  @native_stubs true
+  extern add_two_32(:u32, a :: u32, b :: u32)
+  extern pass_through_f64(:f64, val :: f64)
+  extern pass_through_c_ptr(:u64, ptr :: c_ptr)
+  extern pass_through_cstring(:cstring, str :: cstring)
+  extern cstring_length(:s64, str :: cstring)
+end
+
 defmodule OtterTest do
   use ExUnit.Case
   doctest Otter
@@ -15,6 +29,8 @@ defmodule OtterTest do
   cstruct(s_u8_u16(u8 :: u8, u16 :: u16))
   extern create_s_u8_u16(s_u8_u16())
   extern receive_s_u8_u16(:u32, s_u8_u16)
+  extern sum_s_u8_u16_array(:u64, arr :: list_of(s_u8_u16), n :: u64)
+  extern double_s_u8_u16_array(:void, arr :: list_of(s_u8_u16)-out, n :: u64)
 
   # struct s_uints {
   #     uint8_t u8;
@@ -52,6 +68,9 @@ defmodule OtterTest do
   extern create_matrix16x16(matrix16x16())
   extern receive_matrix16x16(:u32, matrix16x16())
 
+  # only decoded from binaries
+  cstruct(s_f64(f64 :: f64))
+
   # test basic data types
   extern pass_through_u8(:u8, val :: u8)
   extern pass_through_u16(:u16, val :: u16)
@@ -64,6 +83,8 @@ defmodule OtterTest do
   extern pass_through_f32(:f32, val :: f32)
   extern pass_through_f64(:f64, val :: f64)
   extern pass_through_c_ptr(:u64, ptr :: c_ptr)
+  extern pass_through_cstring(:cstring, str :: cstring)
+  extern cstring_length(:s64, str :: cstring)
 
   extern multiply_in_test(:u64, a :: u32, b :: u32)
   extern divide_in_test(:u64, a :: u32, b :: u32)
@@ -78,6 +99,31 @@ defmodule OtterTest do
 
   extern variadic_func_pass_by_values(:u64, n :: u32, array :: va_args)
 
+  extern sum_bytes(:u64, data :: c_ptr, n :: u64)
+  extern get_u32_array(:c_ptr)
+  extern fill_bytes(:s64, buf :: c_ptr, n :: u64, val :: u8)
+  extern fill_bytes_with_length(:u32, buf :: c_ptr, n :: u64, val :: u8, written :: u64-addr-out)
+
+  extern owned_new({:c_ptr, free: :owned_free}, value :: u64)
+  extern owned_new_raw(:c_ptr, value :: u64)
+  extern owned_get(:u64, ptr :: c_ptr)
+  extern owned_freed_count(:u64)
+  extern get_matrix_16x16(u32-size(16, 16))
+  extern sequence_view({:ptr_array, :u32, 1}, n :: u64, count :: u64-addr)
+  extern sequence_new({:ptr_array, :u32, 0, free: :sequence_free}, n :: u64)
+  extern sequence_freed_count(:u64)
+  extern sleep_us(:void, us :: u32)
+  extern ring_produce_async(:void, ring :: c_ptr, count :: u32, threads :: u32)
+  extern ring_produce_join(:void)
+
+  extern pipe(:s32, fds :: c_ptr)
+  extern write(:s64, fd :: s32, buf :: c_ptr, n :: u64)
+  extern close(:s32, fd :: s32)
+
+  @worker :otter_test_worker
+  extern increase_thread_local_counter(:u64)
+  @worker nil
+
   extern fopen(:u64, path :: c_ptr, mode :: c_ptr)
   extern fclose(:u32, stream :: c_ptr)
   extern fscanf(:u64, stream :: c_ptr, fmt :: c_ptr, args :: va_args)
@@ -113,6 +159,41 @@ defmodule OtterTest do
     assert 1 == receive_complex!(t)
   end
 
+  test "decode struct" do
+    t = create_s_uints!()
+    %{u8: ?b, u16: 65535, u32: 0xdeadbeef, u64: 0xfeedfacedeadbeef} = Otter.decode_struct!(s_uints(), t, :map)
+    {?b, 65535, 0xdeadbeef, 0xfeedfacedeadbeef} = Otter.decode_struct!(s_uints(), t, :tuple)
+
+    %{c1: ?c, c2: ?d, c3: 'efg', foo: 32768} = Otter.decode_struct!(complex(), create_complex!(), :map)
+
+    # struct s_u8_u16 is 4 bytes: u8, 1 byte of padding and u16
+    packed = <<1, 0, 2::little-16, 3, 0, 4::little-16>>
+    [{1, 2}, {3, 4}] = Otter.decode_struct!(s_u8_u16(), packed, :tuple)
+    {:error, _} = Otter.decode_struct(s_u8_u16(), <<1, 2, 3>>, :tuple)
+
+    # erlang floats cannot be NaN or infinity
+    [%{f64: 1.5}] = Otter.decode_struct!(s_f64(), <<1.5::native-float-64>>, :map)
+    {:error, _} = Otter.decode_struct(s_f64(), <<0x7FF8000000000000::native-64>>, :map)
+    {:error, _} = Otter.decode_struct(s_f64(), <<0x7FF0000000000000::native-64>>, :tuple)
+  end
+
+  test "array of structs" do
+    t = create_s_u8_u16!()
+    assert 3 * (?a + 43008) == sum_s_u8_u16_array!([t, t, t], 3)
+
+    # packed binary, u8 at offset 0 and u16 at offset 2
+    packed = <<1, 0, 2::native-16, 3, 0, 4::native-16>>
+    assert 10 == sum_s_u8_u16_array!(packed, 2)
+    # large arrays are gathered in the per-scheduler arena
+    assert 20_000 * (?a + 43008) == sum_s_u8_u16_array!(List.duplicate(t, 20_000), 20_000)
+    {:error, _} = sum_s_u8_u16_array(<<1, 2, 3>>, 1)
+    {:error, _} = sum_s_u8_u16_array([t, 1], 2)
+
+    {:ok, [doubled]} = double_s_u8_u16_array!(packed, 2)
+    [%{u8: 2, u16: 4}, %{u8: 6, u16: 8}] = Otter.decode_struct!(s_u8_u16(), doubled, :map)
+    {:ok, [<<>>]} = double_s_u8_u16_array!([], 0)
+  end
+
   test "nd-array" do
     t = create_matrix16x16!()
     assert 32640 == receive_matrix16x16!(t)
@@ -133,6 +214,20 @@ defmodule OtterTest do
     0xdeadbeef = pass_through_c_ptr!(0xdeadbeef)
   end
 
+  test "cstring" do
+    "hello" = pass_through_cstring!("hello")
+    "hello" = pass_through_cstring!("hello\0")
+    "" = pass_through_cstring!("")
+    nil = pass_through_cstring!(nil)
+    5 = cstring_length!("hello")
+    3 = cstring_length!("abc\0def")
+    -1 = cstring_length!(nil)
+
+    # larger than the inline scratch buffer
+    long = String.duplicate("x", 1000)
+    ^long = pass_through_cstring!(long)
+  end
+
   test "dlopen, dlclose, symbol_to_address and address_to_symbol" do
     {:ok, image} = Otter.dlopen(@default_from, :RTLD_NOW)
     {:ok, add_two_32} = Otter.dlsym(image, "add_two_32")
@@ -140,10 +235,51 @@ defmodule OtterTest do
     {:ok, _add_two_32_sym} = Otter.address_to_symbol(add_two_32_addr)
   end
 
+  test "native stubs" do
+    alias OtterTest.NativeStubs
+    :ok = Otter.Native.status(NativeStubs)
+    nil = Otter.Native.status(OtterTest)
+
+    3 = NativeStubs.add_two_32!(1, 2)
+    -123.456 = NativeStubs.pass_through_f64!(-123.456)
+    2.0 = NativeStubs.pass_through_f64!(2)
+    0xdeadbeef = NativeStubs.pass_through_c_ptr!(0xdeadbeef)
+    "hello" = NativeStubs.pass_through_cstring!("hello")
+    "hello" = NativeStubs.pass_through_cstring!("hello\0")
+    nil = NativeStubs.pass_through_cstring!(nil)
+    5 = NativeStubs.cstring_length!("hello")
+    -1 = NativeStubs.cstring_length!(nil)
+
+    # resources cannot be decoded by the stub, the call falls back to the generic path
+    {:ok, image} = Otter.dlopen(@default_from, :RTLD_NOW)
+    symbol = Otter.dlsym!(image, "add_two_32")
+    address = Otter.symbol_to_address!(symbol)
+    ^address = NativeStubs.pass_through_c_ptr!(symbol)
+
+    # libraries are opened with the load mode of the extern
+    source = Otter.Native.generate(Foo, [{:foo, {:u32, [:u32]}, "libfoo.so", :RTLD_LAZY}])
+    assert source =~ ~s|dlopen("libfoo.so", RTLD_LAZY)|
+    source = Otter.Native.generate(Foo, [{:foo, {:u32, [:u32]}, nil, nil}])
+    assert source =~ ~s|dlopen(NULL, RTLD_NOW)|
+  end
+
   test "dlopen self" do
     {:ok, _image} = Otter.dlopen(nil, :RTLD_NOW)
   end
 
+  test "dlopen from a binary" do
+    bytes = File.read!(@default_from)
+    {:ok, image} = Otter.dlopen_binary(bytes, :RTLD_NOW)
+    # same content, same handle
+    {:ok, ^image} = Otter.dlopen_binary(bytes, :RTLD_NOW)
+
+    {:ok, add} = Otter.dlsym(image, "add_in_test")
+    {:ok, 42} = Otter.invoke(add, :u64, [{40, %{type: "u32"}}, {2, %{type: "u32"}}])
+
+    {:error, _} = Otter.dlopen_binary("not a shared object", :RTLD_NOW)
+    :ok = Otter.dlclose(image)
+  end
+
   test "pass function pointer by symbol/address" do
     {:ok, image} = Otter.dlopen(@default_from, :RTLD_NOW)
     multiply =
@@ -201,6 +337,385 @@ defmodule OtterTest do
     ^sum = variadic_func_pass_by_values!(n, val)
   end
 
+  test "variadic function/prepared cif cache" do
+    val = Enum.map([1, 2, 3], &Otter.as_type!(&1, :u32))
+    6 = variadic_func_pass_by_values!(3, val)
+    %{hits: hits} = Otter.variadic_cif_cache_info!()
+    6 = variadic_func_pass_by_values!(3, val)
+    %{hits: new_hits, size: size} = Otter.variadic_cif_cache_info!()
+    assert new_hits > hits
+    assert size > 0
+
+    # a capacity of 0 also disables the per-thread fronts
+    :ok = Otter.set_variadic_cif_cache_capacity!(0)
+    6 = variadic_func_pass_by_values!(3, val)
+    6 = variadic_func_pass_by_values!(3, val)
+    %{hits: ^new_hits, size: 0} = Otter.variadic_cif_cache_info!()
+    :ok = Otter.set_variadic_cif_cache_capacity!(64)
+  end
+
+  test "mmap region as c_ptr" do
+    test_file_path = Path.join([__DIR__, "test_mmap.bin"])
+    data = :binary.copy(<<1, 2, 3, 4>>, 4096)
+    :ok = File.write!(test_file_path, data)
+
+    region = Otter.mmap!(test_file_path, :read, 0, 0)
+    :ok = Otter.madvise!(region, :sequential)
+    assert 10 * 4096 == sum_bytes!(region, byte_size(data))
+
+    # offset does not need to be page-aligned
+    region_at_offset = Otter.mmap!(test_file_path, :read, 4097, 3)
+    assert 2 + 3 + 4 == sum_bytes!(region_at_offset, 3)
+
+    # the region must be within the file
+    {:error, _} = Otter.mmap(test_file_path, :read, 0, 10 * byte_size(data))
+    {:error, _} = Otter.mmap(test_file_path, :read, 4097, byte_size(data))
+    {:error, _} = Otter.mmap(test_file_path, :read_write, 1, 0xFFFFFFFFFFFFFFFF)
+    _ = Otter.mmap!(test_file_path, :read, byte_size(data) - 1, 1)
+
+    :ok = Otter.munmap!(region)
+    {:error, _} = Otter.munmap(region)
+    {:error, _} = sum_bytes(region, byte_size(data))
+    File.rm_rf!(test_file_path)
+  end
+
+  test "out buffer" do
+    {8, [<<42, 42, 42, 42, 42, 42, 42, 42>>]} = fill_bytes!(Otter.out_buffer(16, :return_value), 16, 42)
+    {8, [buffer]} = fill_bytes!(Otter.out_buffer(16), 16, 42)
+    assert 16 == byte_size(buffer)
+    {0, [<<1, 1, 1, 1>>, 4]} = fill_bytes_with_length!(Otter.out_buffer(8, {:arg, 3}), 8, 1, 0)
+  end
+
+  test "pointer view" do
+    ptr = Otter.Pointer.new!(get_u32_array!(), :u32, 8)
+    [0, 1, 2, 3] = Otter.Pointer.read!(ptr, :u32, 0, 4, :list)
+    <<4::native-32, 5::native-32>> = Otter.Pointer.read!(ptr, :u32, 4, 2, :binary)
+    {:error, "out of bounds"} = Otter.Pointer.read(ptr, :u32, 6, 3, :list)
+    # offset and count are in elements of the type being read
+    [_, _, _, _] = Otter.Pointer.read!(ptr, :u64, 0, 4, :list)
+    {:error, "out of bounds"} = Otter.Pointer.read(ptr, :u64, 0, 5, :list)
+
+    :ok = Otter.Pointer.write!(ptr, 7, <<42::native-32>>)
+    [42] = Otter.Pointer.read!(ptr, :u32, 7, 1, :list)
+    {:error, "out of bounds"} = Otter.Pointer.write(ptr, 7, <<1::native-32, 2::native-32>>)
+    :ok = Otter.Pointer.write!(ptr, 7, <<7::native-32>>)
+
+    # can be passed as a c_ptr, the sum of the bytes in [0, 1, 2, 3]
+    assert 6 == sum_bytes!(ptr, 4 * 4)
+  end
+
+  test "parallel map" do
+    {:ok, image} = Otter.dlopen(@default_from, :RTLD_NOW)
+    prepared = Otter.prepare!(Otter.dlsym!(image, "add_two_32"), :u32, [:u32, :u32])
+
+    n = 10_000
+    inputs = for i <- 1..n, into: <<>>, do: <<i::native-32, i::native-32>>
+    expected = for i <- 1..n, into: <<>>, do: <<2 * i::native-32>>
+    ^expected = Otter.parallel_map!(prepared, inputs, [])
+    ^expected = Otter.parallel_map!(prepared, inputs, max_threads: 2, chunk_size: 7)
+    <<>> = Otter.parallel_map!(prepared, <<>>, [])
+    {:error, _} = Otter.parallel_map(prepared, <<1, 2, 3>>, [])
+
+    prepared = Otter.prepare!(Otter.dlsym!(image, "pass_through_u8"), :u8, [:u8])
+    <<1, 2, 3>> = Otter.parallel_map!(prepared, <<1, 2, 3>>, [])
+
+    prepared = Otter.prepare!(Otter.dlsym!(image, "sleep_us"), :void, [:u32])
+    <<>> = Otter.parallel_map!(prepared, <<0::native-32, 0::native-32, 0::native-32>>, [])
+  end
+
+  test "trace" do
+    {:ok, _} = Otter.Trace.drain(:binary)
+    :ok = Otter.Trace.start!()
+    7 = add_two_32!(3, 4)
+    :ok = Otter.Trace.stop!()
+    7 = add_two_32!(3, 4)
+
+    {json, 0} = Otter.Trace.drain!(:chrome)
+    assert json =~ ~s("name":"add_two_32")
+    assert json =~ ~s("args":{"argc":2,"ok":true})
+    {<<>>, 0} = Otter.Trace.drain!(:binary)
+
+    :ok = Otter.Trace.start!()
+    7 = add_two_32!(3, 4)
+    :ok = Otter.Trace.stop!()
+    {<<_symbol::native-64, start_ns::native-64, end_ns::native-64, _thread::native-32, 2::native-16, 1, 0>>, 0} =
+      Otter.Trace.drain!(:binary)
+    assert end_ns >= start_ns
+  end
+
+  test "adaptive routing" do
+    # disabled by default
+    {:ok, image} = Otter.dlopen(@default_from, :RTLD_NOW)
+    symbol = Otter.dlsym!(image, "sleep_us")
+    sleep_us!(0)
+    %{calls: 0} = Otter.routing_info!(symbol)
+
+    :ok = Otter.set_adaptive_routing!(enabled: true, threshold_us: 1000, window: 8)
+
+    for _ <- 1..8, do: sleep_us!(2000)
+    %{route: :dirty, calls: calls} = Otter.routing_info!(symbol)
+    assert calls >= 8
+
+    for _ <- 1..8, do: sleep_us!(0)
+    %{route: :normal} = Otter.routing_info!(symbol)
+
+    :ok = Otter.set_adaptive_routing!(enabled: false)
+  end
+
+  test "owned pointer" do
+    freed = owned_freed_count!()
+    owned = owned_new!(42)
+    assert is_reference(owned)
+    42 = owned_get!(owned)
+    assert Otter.owned_address!(owned) != 0
+
+    :ok = Otter.release!(owned)
+    :ok = Otter.release!(owned)
+    assert freed + 1 == owned_freed_count!()
+    0 = Otter.owned_address!(owned)
+    {:error, _} = owned_get(owned)
+
+    # released when garbage collected
+    {pid, ref} = spawn_monitor(fn -> 7 = owned_get!(owned_new!(7)) end)
+    assert_receive {:DOWN, ^ref, :process, ^pid, :normal}
+    wait_until(fn -> freed + 2 == owned_freed_count!() end)
+
+    # on the background thread
+    {:ok, image} = Otter.dlopen(@default_from, :RTLD_NOW)
+    owned_free = Otter.dlsym!(image, "owned_free")
+    {pid, ref} = spawn_monitor(fn -> Otter.own!(owned_new_raw!(8), owned_free, background: true) end)
+    assert_receive {:DOWN, ^ref, :process, ^pid, :normal}
+    wait_until(fn -> freed + 3 == owned_freed_count!() end)
+  end
+
+  test "array return types" do
+    matrix = get_matrix_16x16!()
+    assert byte_size(matrix) == 16 * 16 * 4
+    assert Enum.to_list(0..255) == Otter.unpack!(matrix, :u32)
+
+    assert [0, 1, 2, 3, 4] == Otter.unpack!(sequence_view!(5, 0), :u32)
+    assert 64 * 4 == byte_size(sequence_view!(100, 0))
+    nil = sequence_view!(0, 0)
+
+    # zero-copy, freed with the binary
+    freed = sequence_freed_count!()
+    {pid, ref} = spawn_monitor(fn -> [0, 1, 2] = Otter.unpack!(sequence_new!(3), :u32) end)
+    assert_receive {:DOWN, ^ref, :process, ^pid, :normal}
+    wait_until(fn -> freed + 1 == sequence_freed_count!() end)
+    <<>> = sequence_new!(0)
+  end
+
+  test "allocation profile" do
+    case Otter.alloc_profile(1) do
+      {:error, _} ->
+        # only available with OTTER_ALLOC_PROFILE=1
+        :ok
+
+      {:ok, _} ->
+        42 = pass_through_u32!(42)
+        {:ok, [calls]} = Otter.alloc_profile(1)
+        assert %{mallocs: 0, reallocs: 0, news: 0} = calls.call
+        assert %{mallocs: 0, reallocs: 0, news: 0} = calls.encode
+        assert Map.has_key?(calls, :decode)
+        assert is_integer(calls.symbol)
+
+        [0, 1] = Otter.unpack!(sequence_view!(2, 0), :u32)
+        {:ok, [_, _]} = Otter.alloc_profile(2)
+    end
+  end
+
+  defp wait_until(fun, retries \\ 100) do
+    cond do
+      fun.() ->
+        :ok
+
+      retries > 0 ->
+        Process.sleep(10)
+        wait_until(fun, retries - 1)
+
+      true ->
+        flunk("condition was not met in time")
+    end
+  end
+
+  test "pack and unpack" do
+    <<1::native-32, 2::native-32, 3::native-32>> = Otter.pack!([1, 2, 3], :u32)
+    <<-1::native-signed-16>> = Otter.pack!([-1], :s16)
+    <<1.5::native-float-64, 2.0::native-float-64>> = Otter.pack!([1.5, 2], :f64)
+    <<>> = Otter.pack!([], :u8)
+    {:error, _} = Otter.pack([256], :u8)
+    {:error, _} = Otter.pack([-1], :u64)
+    {:error, _} = Otter.pack([:a], :u32)
+
+    list = Enum.to_list(-100_000..100_000)
+    ^list = list |> Otter.pack!(:s32) |> Otter.unpack!(:s32)
+    [1.5, 2.0] = [1.5, 2] |> Otter.pack!(:f32) |> Otter.unpack!(:f32)
+    [0xFFFFFFFFFFFFFFFF] = Otter.unpack!(<<-1::native-64>>, :u64)
+    {:error, _} = Otter.unpack(<<1, 2, 3>>, :u16)
+    {:error, _} = Otter.unpack(<<0x7FC00000::native-32>>, :f32)
+    {:error, _} = Otter.unpack(<<1.0::native-float-64, 0xFFF0000000000000::native-64>>, :f64)
+
+    # packed values can be passed to c_ptr arguments
+    assert 6 == sum_bytes!(Otter.pack!([1, 2, 3], :u8), 3)
+  end
+
+  test "struct pool" do
+    :ok = Otter.set_struct_pooling!(s_u8_u16(), true)
+    %{hits: hits, misses: misses} = Otter.struct_pool_info!()
+
+    for _ <- 1..100 do
+      t = create_s_u8_u16!()
+      assert 1 == receive_s_u8_u16!(t)
+      %{u8: ?a, u16: 43008} = Otter.decode_struct!(s_u8_u16(), t, :map)
+    end
+
+    :erlang.garbage_collect()
+    t = create_s_u8_u16!()
+    assert 1 == receive_s_u8_u16!(t)
+    %{hits: new_hits, misses: new_misses} = Otter.struct_pool_info!()
+    assert new_hits + new_misses == hits + misses + 101
+
+    :ok = Otter.set_struct_pooling!(s_u8_u16(), false)
+  end
+
+  test "select" do
+    {0, [<<r::native-32, w::native-32>>]} = pipe!(Otter.out_buffer(8))
+
+    {:ok, watch} = Otter.select(r, :read)
+    refute_receive {:select, ^watch, _, _}, 10
+    1 = write!(w, "x", 1)
+    assert_receive {:select, ^watch, :undefined, :ready_input}
+
+    # readiness is reported once per select
+    {:ok, ^watch} = Otter.select(watch, :read)
+    assert_receive {:select, ^watch, :undefined, :ready_input}
+
+    # Otter closes `w` after deselect
+    {:ok, w_watch} = Otter.select(w, :write, close: true)
+    assert_receive {:select, ^w_watch, :undefined, :ready_output}
+
+    :ok = Otter.deselect(watch)
+    :ok = Otter.deselect(w_watch)
+    {:error, _} = Otter.select(watch, :read)
+    0 = close!(r)
+  end
+
+  test "shared ring" do
+    {:ok, ring} = Otter.Ring.new(4, 64, :mpsc)
+    {:ok, <<>>} = Otter.Ring.drain(ring)
+    {:error, :timeout} = Otter.Ring.await(ring, 10)
+
+    # more records than the ring can hold, producers wait for the consumer
+    ring_produce_async!(ring, 1000, 4)
+    records = receive_records(ring, 1000, [])
+    ring_produce_join!()
+    assert Enum.sort(records) == Enum.to_list(0..999)
+
+    # a timed out await no longer watches the doorbell
+    {:error, :timeout} = Otter.Ring.await(ring, 10)
+    ring_produce_async!(ring, 1, 1)
+    ring_produce_join!()
+    refute_receive {:select, ^ring, _, _}, 50
+    {:ok, <<0::native-32>>} = Otter.Ring.drain(ring)
+
+    :ok = Otter.Ring.close!(ring)
+    {:error, _} = Otter.Ring.drain(ring)
+
+    # large drains run on a dirty scheduler
+    {:ok, ring} = Otter.Ring.new(4, 32768, :spsc)
+    ring_produce_async!(ring, 20000, 1)
+    ring_produce_join!()
+    {:ok, binary} = Otter.Ring.drain(ring)
+    assert byte_size(binary) == 20000 * 4
+    :ok = Otter.Ring.close!(ring)
+  end
+
+  defp receive_records(_ring, 0, acc), do: acc
+
+  defp receive_records(ring, remaining, acc) do
+    {:ok, binary} = Otter.Ring.await(ring, 5000)
+    records = for <<value::native-32 <- binary>>, do: value
+    receive_records(ring, remaining - length(records), records ++ acc)
+  end
+
+  test "native memory budget" do
+    t = create_matrix16x16!()
+    %{kinds: %{struct: %{bytes: bytes, objects: objects}}, structs: %{matrix16x16: matrix}} = Otter.memory_info!()
+    assert bytes >= 16 * 16 * 4 and objects >= 1
+    assert matrix.bytes >= 16 * 16 * 4
+
+    :ok = Otter.set_memory_budget!(:struct, 16, 64)
+    {:error, :native_memory_budget} = create_matrix16x16()
+    %{kinds: %{struct: %{rejected: rejected, over_soft_budget: true}}} = Otter.memory_info!()
+    assert rejected >= 1
+
+    :ok = Otter.set_memory_budget!(:struct, :infinity, :infinity)
+    assert 32640 == receive_matrix16x16!(create_matrix16x16!())
+    assert 32640 == receive_matrix16x16!(t)
+  end
+
+  test "signature descriptor" do
+    {:ok, image} = Otter.dlopen(@default_from, :RTLD_NOW)
+    add_two_32 = Otter.dlsym!(image, "add_two_32")
+
+    # u32 add_two_32(u32, u32)
+    u32 = <<3, 0, 0::little-32>>
+    descriptor = <<"OTS", 1>> <> u32 <> <<2>> <> u32 <> u32
+    {:ok, 7} = Otter.Nif.invoke_signature(add_two_32, descriptor, {3, 4})
+    {:error, _} = Otter.Nif.invoke_signature(add_two_32, descriptor, {3})
+    {:error, _} = Otter.Nif.invoke_signature(add_two_32, binary_part(descriptor, 0, 10), {3, 4})
+
+    # struct types are registered on the first call
+    create = Otter.dlsym!(image, "create_s_u8_u16")
+    descriptor = <<"OTS", 1, 13, 0, 0::little-32, 8, "s_u8_u16", 0>>
+    {:error, :unregistered_signature} = Otter.Nif.invoke_signature(create, descriptor, {})
+    {:error, _} = Otter.Nif.register_signature(descriptor, [])
+    :ok = Otter.Nif.register_signature(descriptor, [Otter.transform_type(s_u8_u16())])
+    {:ok, struct} = Otter.Nif.invoke_signature(create, descriptor, {})
+    assert is_reference(struct)
+  end
+
+  test "worker" do
+    {:ok, image} = Otter.dlopen(@default_from, :RTLD_NOW)
+    add_two_32 = Otter.dlsym!(image, "add_two_32")
+    args = [{3, %{type: :u32}}, {4, %{type: :u32}}]
+
+    worker = Otter.Worker.start!(name: :otter_test_worker, queue_size: 4)
+    {:ok, ^worker} = Otter.Worker.whereis(:otter_test_worker)
+    {:error, _} = Otter.Worker.whereis(:no_such_worker)
+
+    7 = Otter.Worker.invoke!(worker, add_two_32, :u32, args)
+    ref = Otter.Worker.invoke_async!(worker, add_two_32, :u32, args)
+    assert_receive {^ref, {:ok, 7}}
+
+    # thread local state is kept on the worker thread
+    1 = increase_thread_local_counter!()
+    2 = increase_thread_local_counter!()
+
+    :ok = Otter.Worker.stop!(worker)
+    {:error, _} = Otter.Worker.invoke(worker, add_two_32, :u32, args)
+  end
+
+  test "worker dropped while an async request is pending" do
+    {:ok, image} = Otter.dlopen(@default_from, :RTLD_NOW)
+    sleep_us = Otter.dlsym!(image, "sleep_us")
+
+    # the pending request holds the last reference to the worker
+    {pid, ref} =
+      spawn_monitor(fn ->
+        worker = Otter.Worker.start!()
+        Otter.Worker.invoke_async!(worker, sleep_us, :void, [{20_000, %{type: :u32}}])
+      end)
+
+    assert_receive {:DOWN, ^ref, :process, ^pid, :normal}
+    :erlang.garbage_collect()
+    Process.sleep(100)
+
+    worker = Otter.Worker.start!()
+    :ok = Otter.Worker.invoke!(worker, sleep_us, :void, [{0, %{type: :u32}}])
+    :ok = Otter.Worker.stop!(worker)
+  end
+
   test "fprintf" do
     # remove output file if exists
     test_file_path = Path.join([__DIR__, "test_fprintf.txt"])
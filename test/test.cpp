@@ -1,5 +1,11 @@
+#include <atomic>
 #include <iostream>
 #include <cstdarg>
+#include <thread>
+#include <vector>
+#include <unistd.h>
+
+#include "../c_src/otter_ring.h"
 
 using namespace std;
 
@@ -42,6 +48,21 @@ uint32_t receive_s_u8_u16(struct s_u8_u16 t) {
     return (t.u8 == 'a' && t.u16 == (42 << 10));
 }
 
+uint64_t sum_s_u8_u16_array(const struct s_u8_u16 *arr, uint64_t n) {
+    uint64_t sum = 0;
+    for (uint64_t i = 0; i < n; i++) {
+        sum += arr[i].u8 + arr[i].u16;
+    }
+    return sum;
+}
+
+void double_s_u8_u16_array(struct s_u8_u16 *arr, uint64_t n) {
+    for (uint64_t i = 0; i < n; i++) {
+        arr[i].u8 *= 2;
+        arr[i].u16 *= 2;
+    }
+}
+
 struct s_uints create_s_uints() {
     struct s_uints t;
     t.u8 = 'b';
@@ -155,6 +176,14 @@ uint64_t pass_through_c_ptr(void *ptr) {
     ptr;
 }
 
+const char *pass_through_cstring(const char *str) {
+    return str;
+}
+
+int64_t cstring_length(const char *str) {
+    return str ? (int64_t)strlen(str) : -1;
+}
+
 uint64_t multiply_in_test(uint32_t a, uint32_t b) {
     return a * b;
 }
@@ -197,6 +226,132 @@ uint32_t pass_by_addr_read_write(uint32_t *val_addr) {
     }
 }
 
+uint64_t sum_bytes(const uint8_t *data, uint64_t n) {
+    uint64_t sum = 0;
+    for (uint64_t i = 0; i < n; i++) {
+        sum += data[i];
+    }
+    return sum;
+}
+
+int64_t fill_bytes(uint8_t *buf, uint64_t n, uint8_t val) {
+    if (buf == nullptr) return -1;
+    // only fill the first half
+    uint64_t filled = n / 2;
+    for (uint64_t i = 0; i < filled; i++) {
+        buf[i] = val;
+    }
+    return (int64_t)filled;
+}
+
+uint32_t fill_bytes_with_length(uint8_t *buf, uint64_t n, uint8_t val, uint64_t *written) {
+    *written = (uint64_t)fill_bytes(buf, n, val);
+    return 0;
+}
+
+static uint32_t u32_array_in_test[8] = {0, 1, 2, 3, 4, 5, 6, 7};
+
+uint32_t *get_u32_array() {
+    return u32_array_in_test;
+}
+
+void sleep_us(uint32_t us) {
+    usleep(us);
+}
+
+static std::atomic<uint64_t> owned_freed(0);
+
+uint64_t * owned_new(uint64_t value) {
+    uint64_t *p = (uint64_t *)malloc(sizeof(uint64_t));
+    *p = value;
+    return p;
+}
+
+uint64_t * owned_new_raw(uint64_t value) {
+    return owned_new(value);
+}
+
+uint64_t owned_get(uint64_t *p) {
+    return *p;
+}
+
+void owned_free(uint64_t *p) {
+    free(p);
+    owned_freed++;
+}
+
+uint64_t owned_freed_count() {
+    return owned_freed.load();
+}
+
+static uint32_t matrix_16x16[16][16];
+
+uint32_t * get_matrix_16x16() {
+    for (uint32_t i = 0; i < 16; ++i) {
+        for (uint32_t j = 0; j < 16; ++j) {
+            matrix_16x16[i][j] = i * 16 + j;
+        }
+    }
+    return &matrix_16x16[0][0];
+}
+
+static uint32_t sequence_buffer[64];
+
+uint32_t * sequence_view(uint64_t n, uint64_t *count) {
+    *count = n < 64 ? n : 64;
+    for (uint64_t i = 0; i < *count; ++i) {
+        sequence_buffer[i] = (uint32_t)i;
+    }
+    return n == 0 ? nullptr : sequence_buffer;
+}
+
+static std::atomic<uint64_t> sequence_freed(0);
+
+uint32_t * sequence_new(uint64_t n) {
+    uint32_t *p = (uint32_t *)malloc(sizeof(uint32_t) * (n + 1));
+    for (uint64_t i = 0; i < n; ++i) {
+        p[i] = (uint32_t)i;
+    }
+    return p;
+}
+
+void sequence_free(uint32_t *p) {
+    free(p);
+    sequence_freed++;
+}
+
+uint64_t sequence_freed_count() {
+    return sequence_freed.load();
+}
+
+static thread_local uint64_t thread_local_counter = 0;
+
+uint64_t increase_thread_local_counter() {
+    return ++thread_local_counter;
+}
+
+static vector<thread> ring_producers;
+
+// push `count` u32 records (0 to count - 1) to `ring` from `threads` threads
+void ring_produce_async(struct otter_ring *ring, uint32_t count, uint32_t threads) {
+    for (uint32_t t = 0; t < threads; t++) {
+        ring_producers.emplace_back([ring, count, threads, t]() {
+            for (uint32_t i = t; i < count; i += threads) {
+                while (otter_ring_push(ring, &i, sizeof(i)) != 0) {
+                    this_thread::yield();
+                }
+            }
+        });
+    }
+}
+
+void ring_produce_join() {
+    for (auto &t : ring_producers) {
+        t.join();
+    }
+    ring_producers.clear();
+}
+
 uint64_t variadic_func_pass_by_values(uint32_t n, ...) {
     uint64_t sum = 0;
     va_list ptr;